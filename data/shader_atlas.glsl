@@ -3,40 +3,83 @@ flat basic.vs flat.fs
 texture basic.vs texture.fs
 multi_pass basic.vs multi_pass.fs
 single_pass basic.vs single_pass.fs
+@flat basic.vs flat.fs SKINNING
+@texture basic.vs texture.fs SKINNING
+@multi_pass basic.vs multi_pass.fs BINDLESS,SKINNING
+@single_pass basic.vs single_pass.fs BINDLESS,MULTIDRAW,SKINNING
 skybox basic.vs skybox.fs
 depth quad.vs depth.fs
+probe_prefilter quad.vs probe_prefilter.fs
 multi basic.vs multi.fs
 
 \basic.vs
 
 #version 330 core
 
+#ifdef MULTIDRAW
+#extension GL_ARB_shader_storage_buffer_object : require
+#endif
+
 in vec3 a_vertex;
 in vec3 a_normal;
 in vec2 a_coord;
+in vec2 a_coord1;
 in vec4 a_color;
 
 uniform vec3 u_camera_pos;
 
+#ifdef MULTIDRAW
+//every draw of the indirect buffer (see Renderer::renderMultiDraw), the base instance of the draw is its id
+struct sDraw {
+	mat4 model;
+	ivec4 info; //x: material index
+};
+layout(std430, binding = 1) readonly buffer Draws {
+	sDraw u_draws[];
+};
+in int a_draw_id;
+flat out int v_material_index;
+#define u_model u_draws[a_draw_id].model
+#else
 uniform mat4 u_model;
+#endif
 uniform mat4 u_viewprojection;
 
+#ifdef SKINNING
+#define MAX_BONES 128
+in vec4 a_bones;
+in vec4 a_weights;
+//final matrices of the bones of the mesh (see Renderer::uploadSkinning)
+layout(std140) uniform BonesBlock {
+	mat4 u_bones[MAX_BONES];
+};
+#endif
+
 //this will store the color for the pixel shader
 out vec3 v_position;
 out vec3 v_world_position;
 out vec3 v_normal;
 out vec2 v_uv;
+out vec2 v_uv1;
 out vec4 v_color;
 
 uniform float u_time;
 
 void main()
 {	
+	vec3 vertex = a_vertex;
+	vec3 normal = a_normal;
+#ifdef SKINNING
+	mat4 skin = u_bones[int(a_bones.x)] * a_weights.x + u_bones[int(a_bones.y)] * a_weights.y + u_bones[int(a_bones.z)] * a_weights.z + u_bones[int(a_bones.w)] * a_weights.w;
+	vertex = (skin * vec4(vertex, 1.0)).xyz;
+	normal = (skin * vec4(normal, 0.0)).xyz;
+#endif
+
 	//calcule the normal in camera space (the NormalMatrix is like ViewMatrix but without traslation)
-	v_normal = (u_model * vec4( a_normal, 0.0) ).xyz;
+	v_normal = (u_model * vec4( normal, 0.0) ).xyz;
 	
 	//calcule the vertex in object space
-	v_position = a_vertex;
+	v_position = vertex;
 	v_world_position = (u_model * vec4( v_position, 1.0) ).xyz;
 	
 	//store the color in the varying var to use it from the pixel shader
@@ -44,6 +87,11 @@ void main()
 
 	//store the texture coordinates
 	v_uv = a_coord;
+	v_uv1 = a_coord1;
+
+#ifdef MULTIDRAW
+	v_material_index = u_draws[a_draw_id].info.x;
+#endif
 
 	//calcule the position of the vertex using the matrices
 	gl_Position = u_viewprojection * vec4( v_world_position, 1.0 );
@@ -111,6 +159,11 @@ void main()
 
 #version 330 core
 
+#ifdef BINDLESS
+#extension GL_ARB_bindless_texture : require
+#extension GL_ARB_shader_storage_buffer_object : require
+#endif
+
 in vec3 v_position;
 in vec3 v_world_position;
 in vec3 v_normal;
@@ -118,33 +171,32 @@ in vec2 v_uv;
 in vec4 v_color;
 
 //material properties
-uniform vec4 u_color;
-uniform vec3 u_emissive_factor;
-uniform sampler2D u_emissive_texture;
-uniform sampler2D u_albedo_texture;
-uniform sampler2D u_metalic_roughness_texture;
+#ifdef BINDLESS
+#include "materials_buffer"
+#else
+#include "material_block"
+#endif
 
 //global properties
 uniform float u_time;
-uniform float u_alpha_cutoff;
-uniform vec3 u_camera_position;
-
-//lights
-uniform vec3 u_ambient_light;
-uniform vec4 u_light_info; // (light_type, near_distance, far_distance, xxx);
-uniform vec3 u_light_position;
-uniform vec3 u_light_front;
-uniform vec3 u_light_color;
-uniform vec2 u_light_cone; // ( cos(min_angle), cos(max_angle) s)
-uniform bool u_show_specular;  // bool (1 to show specular ligth, 0 otherwise)
-
-//normalmap
-uniform sampler2D u_normalmap;
-
-//shadowmap
-uniform mat4 u_shadow_viewproj;
+#include "frame_block"
+#include "irradiance"
+#include "reflection"
+
+//light of this pass, with its shadowmap
+layout(std140) uniform LightBlock {
+	vec4 u_light_info; // (light_type, near_distance, far_distance, xxx);
+	vec3 u_light_position;
+	vec3 u_light_front;
+	vec3 u_light_color;
+	vec2 u_light_cone; // ( cos(min_angle), cos(max_angle) s)
+	mat4 u_shadow_viewproj;
+	vec2 u_shadow_params;  // bool (1 if it has shadowmap, 0 otherwise), bias
+};
 uniform sampler2D u_shadowmap;
-uniform vec2 u_shadow_params;  // bool (1 if it has shadowmap, 0 otherwise), bias
+uniform float u_base_pass; //1 in the first pass, 0 in the additive ones (no ambient or emissive)
+in vec2 v_uv1;
+uniform sampler2D u_lightmap; //baked ambient occlusion in the second uvs (see LightmapBaker), white if it has none
 
 #define NOLIGHT 0
 #define POINT_LIGHT 1
@@ -214,6 +266,7 @@ mat3 cotangent_frame(vec3 N, vec3 p, vec2 uv)
 vec3 perturbNormal(vec3 N, vec3 WP, vec2 uv, vec3 normal_pixel)
 {
 	normal_pixel = normal_pixel * 255./127. - 128./127.;
+	normal_pixel.z = sqrt(max(0.0, 1.0 - dot(normal_pixel.xy, normal_pixel.xy))); //BC5 normalmaps only store XY
 	mat3 TBN = cotangent_frame(N, WP, uv);
 	return normalize(TBN * normal_pixel);
 }
@@ -300,12 +353,14 @@ void main()
 	}
 
 	
-	light += u_ambient_light * occlussion_factor;
+	light += computeIrradiance(v_world_position, N) * occlussion_factor * texture(u_lightmap, v_uv1).x * u_base_pass;
 
 
 	
 	vec3 color = albedo.xyz * light;
-	color += u_emissive_factor * texture(u_emissive_texture, v_uv).xyz;
+	if (u_show_specular)
+		color += computeReflection(N, normalize(u_camera_position - v_world_position), albedo.xyz, metalness, roughness) * occlussion_factor * u_base_pass;
+	color += u_emissive_factor * texture(u_emissive_texture, v_uv).xyz * u_base_pass;
 	FragColor = vec4( color, albedo.a );
 }
 
@@ -313,6 +368,11 @@ void main()
 
 #version 330 core
 
+#ifdef BINDLESS
+#extension GL_ARB_bindless_texture : require
+#extension GL_ARB_shader_storage_buffer_object : require
+#endif
+
 in vec3 v_position;
 in vec3 v_world_position;
 in vec3 v_normal;
@@ -320,30 +380,33 @@ in vec2 v_uv;
 in vec4 v_color;
 
 //material properties
-uniform vec4 u_color;
-uniform vec3 u_emissive_factor;
-uniform sampler2D u_emissive_texture;
-uniform sampler2D u_albedo_texture;
-uniform sampler2D u_metalic_roughness_texture;
+#ifdef BINDLESS
+#include "materials_buffer"
+#else
+#include "material_block"
+#endif
 
 //global properties
 uniform float u_time;
-uniform float u_alpha_cutoff;
-uniform vec3 u_camera_position;
+#include "frame_block"
+#include "irradiance"
+#include "reflection"
 
 //lights
 const int MAX_LIGHTS = 4;
-uniform vec3 u_ambient_light;
-uniform vec3 u_light_info[MAX_LIGHTS]; // (light_type, near_distance, far_distance);
-uniform vec3 u_light_position[MAX_LIGHTS];
-uniform vec3 u_light_front[MAX_LIGHTS];
-uniform vec3 u_light_color[MAX_LIGHTS];
-uniform vec2 u_light_cone[MAX_LIGHTS]; // ( cos(min_angle), cos(max_angle) s)
-uniform int u_num_lights;
-uniform bool u_show_specular;  // bool (1 to show specular ligth, 0 otherwise)
-
-//normalmap
-uniform sampler2D u_normalmap;
+layout(std140) uniform LightsBlock {
+	vec3 u_light_info[MAX_LIGHTS]; // (light_type, near_distance, far_distance);
+	vec3 u_light_position[MAX_LIGHTS];
+	vec3 u_light_front[MAX_LIGHTS];
+	vec3 u_light_color[MAX_LIGHTS];
+	vec2 u_light_cone[MAX_LIGHTS]; // ( cos(min_angle), cos(max_angle) s)
+	int u_num_lights;
+};
+
+#ifndef MULTIDRAW
+in vec2 v_uv1;
+uniform sampler2D u_lightmap; //baked ambient occlusion in the second uvs (see LightmapBaker), white if it has none
+#endif
 
 #define NOLIGHT 0
 #define POINT_LIGHT 1
@@ -377,6 +440,7 @@ mat3 cotangent_frame(vec3 N, vec3 p, vec2 uv)
 vec3 perturbNormal(vec3 N, vec3 WP, vec2 uv, vec3 normal_pixel)
 {
 	normal_pixel = normal_pixel * 255./127. - 128./127.;
+	normal_pixel.z = sqrt(max(0.0, 1.0 - dot(normal_pixel.xy, normal_pixel.xy))); //BC5 normalmaps only store XY
 	mat3 TBN = cotangent_frame(N, WP, uv);
 	return normalize(TBN * normal_pixel);
 }
@@ -402,7 +466,10 @@ void main()
 	float shininess = roughness;
 
 	vec3 light = vec3(0.0);
-	light += u_ambient_light * occlussion_factor;
+#ifndef MULTIDRAW
+	occlussion_factor *= texture(u_lightmap, v_uv1).x; //meshes with lightmap are never in the indirect draws
+#endif
+	light += computeIrradiance(v_world_position, N) * occlussion_factor;
 
 	for( int i = 0; i < MAX_LIGHTS; ++i )
 	{
@@ -460,10 +527,106 @@ void main()
 	}
 	
 	vec3 color = albedo.xyz * light;
+	if (u_show_specular)
+		color += computeReflection(N, normalize(u_camera_position - v_world_position), albedo.xyz, metalness, roughness) * occlussion_factor;
 	color += u_emissive_factor * texture(u_emissive_texture, v_uv).xyz;
 	FragColor = vec4( color, albedo.a );
 }
 
+\frame_block
+
+//per frame data (see Renderer::uploadFrameBlocks)
+layout(std140) uniform FrameBlock {
+	vec3 u_camera_position;
+	bool u_show_specular;  // bool (1 to show specular ligth, 0 otherwise)
+	vec3 u_ambient_light;
+	mat4 u_irradiance_matrix; //from world to [0..1] in the irradiance volume
+	vec4 u_irradiance_dims; //probes per axis, w is 0 if there is no volume
+};
+
+\irradiance
+
+//baked irradiance volume (see IrradianceEntity), the constant ambient light if the scene has none
+uniform sampler3D u_irradiance_texture; //the 9 coefficients one after the other in z
+
+vec3 computeIrradiance(vec3 position, vec3 N)
+{
+	if (u_irradiance_dims.w == 0.0)
+		return u_ambient_light;
+
+	//centers of the first and last texels, the slices of the coefficients never blend
+	vec3 uvw = clamp((u_irradiance_matrix * vec4(position, 1.0)).xyz, 0.0, 1.0);
+	vec3 coord = (uvw * (u_irradiance_dims.xyz - 1.0) + 0.5) / vec3(u_irradiance_dims.xy, u_irradiance_dims.z * 9.0);
+	vec3 c[9];
+	for (int i = 0; i < 9; ++i)
+		c[i] = texture(u_irradiance_texture, coord + vec3(0.0, 0.0, float(i) / 9.0)).xyz;
+
+	//same basis as computeSH in sphericalharmonics.cpp
+	vec3 irradiance = c[0] + c[1] * N.y + c[2] * N.z + c[3] * N.x;
+	irradiance += c[4] * N.x * N.y + c[5] * N.y * N.z + c[6] * (3.0 * N.z * N.z - 1.0);
+	irradiance += c[7] * N.x * N.z + c[8] * (N.x * N.x - N.y * N.y);
+	return max(irradiance, vec3(0.0));
+}
+
+\reflection
+
+//prefiltered cubemap of the reflection probe of the object (see ReflectionProbeEntity) or the skybox, a mip per roughness
+uniform samplerCube u_reflection_texture;
+uniform float u_reflection_max_lod; //negative if there is no cubemap
+
+vec3 computeReflection(vec3 N, vec3 V, vec3 albedo, float metalness, float roughness)
+{
+	if (u_reflection_max_lod < 0.0)
+		return vec3(0.0);
+
+	vec3 R = reflect(-V, N);
+	vec3 F0 = mix(vec3(0.04), albedo, metalness);
+	float NdotV = clamp(dot(N, V), 0.0, 1.0);
+	vec3 F = F0 + (max(vec3(1.0 - roughness), F0) - F0) * pow(1.0 - NdotV, 5.0); //schlick with roughness
+	return textureLod(u_reflection_texture, R, roughness * u_reflection_max_lod).xyz * F;
+}
+
+\material_block
+
+//properties uploaded once per material (see Renderer::updateMaterialBlock), the draw binds its range
+layout(std140) uniform MaterialBlock {
+	vec4 u_color;
+	vec3 u_emissive_factor;
+	float u_alpha_cutoff;
+};
+uniform sampler2D u_albedo_texture;
+uniform sampler2D u_emissive_texture;
+uniform sampler2D u_metalic_roughness_texture;
+uniform sampler2D u_normalmap;
+
+\materials_buffer
+
+//materials of the frame (see Renderer::uploadMaterialsBuffer), the draw only sets its index
+struct sMaterial {
+	vec4 color;
+	vec4 emissive_factor; //w is the alpha cutoff
+	uvec2 textures[4]; //bindless handles: albedo, emissive, metallic_roughness, normalmap
+};
+
+layout(std430, binding = 0) readonly buffer Materials {
+	sMaterial u_materials[];
+};
+
+#ifdef MULTIDRAW
+flat in int v_material_index; //from the draw
+#define u_material_index v_material_index
+#else
+uniform int u_material_index;
+#endif
+
+#define u_color u_materials[u_material_index].color
+#define u_emissive_factor u_materials[u_material_index].emissive_factor.xyz
+#define u_alpha_cutoff u_materials[u_material_index].emissive_factor.w
+#define u_albedo_texture sampler2D(u_materials[u_material_index].textures[0])
+#define u_emissive_texture sampler2D(u_materials[u_material_index].textures[1])
+#define u_metalic_roughness_texture sampler2D(u_materials[u_material_index].textures[2])
+#define u_normalmap sampler2D(u_materials[u_material_index].textures[3])
+
 \skybox.fs
 
 #version 330 core
@@ -537,6 +700,89 @@ void main()
 }
 
 
+\probe_prefilter.fs
+
+#version 330 core
+
+//one face of one mip of a reflection probe (see Renderer::prefilterReflectionProbe)
+in vec2 v_uv;
+
+uniform samplerCube u_texture; //the capture, with its mipmaps
+uniform int u_face;
+uniform float u_roughness;
+uniform float u_texel_solid_angle; //of the first mip of the capture
+uniform float u_max_lod;
+uniform int u_num_samples;
+
+out vec4 FragColor;
+
+const float PI = 3.14159265359;
+
+//direction of the texel, the faces as in cubemapFaceNormals (the GL cubemap convention)
+vec3 faceDirection(int face, vec2 uv)
+{
+	float u = uv.x * 2.0 - 1.0;
+	float v = uv.y * 2.0 - 1.0;
+	if (face == 0) return normalize(vec3(1.0, -v, -u));
+	if (face == 1) return normalize(vec3(-1.0, -v, u));
+	if (face == 2) return normalize(vec3(u, 1.0, v));
+	if (face == 3) return normalize(vec3(u, -1.0, -v));
+	if (face == 4) return normalize(vec3(u, -v, 1.0));
+	return normalize(vec3(-u, -v, -1.0));
+}
+
+float radicalInverse(uint bits)
+{
+	bits = (bits << 16u) | (bits >> 16u);
+	bits = ((bits & 0x55555555u) << 1u) | ((bits & 0xAAAAAAAAu) >> 1u);
+	bits = ((bits & 0x33333333u) << 2u) | ((bits & 0xCCCCCCCCu) >> 2u);
+	bits = ((bits & 0x0F0F0F0Fu) << 4u) | ((bits & 0xF0F0F0F0u) >> 4u);
+	bits = ((bits & 0x00FF00FFu) << 8u) | ((bits & 0xFF00FF00u) >> 8u);
+	return float(bits) * 2.3283064365386963e-10;
+}
+
+void main()
+{
+	vec3 N = faceDirection(u_face, v_uv);
+	if (u_roughness == 0.0)
+	{
+		FragColor = vec4(textureLod(u_texture, N, 0.0).xyz, 1.0);
+		return;
+	}
+
+	//GGX importance sampling with the view in the normal direction. Every sample reads the mip
+	//that covers its solid angle (filtered importance sampling), so few samples are enough
+	float a = u_roughness * u_roughness;
+	float a2 = a * a;
+	vec3 up = abs(N.z) < 0.999 ? vec3(0.0, 0.0, 1.0) : vec3(1.0, 0.0, 0.0);
+	vec3 T = normalize(cross(up, N));
+	vec3 B = cross(N, T);
+
+	vec3 color = vec3(0.0);
+	float total_weight = 0.0;
+	for (int i = 0; i < u_num_samples; ++i)
+	{
+		float phi = 2.0 * PI * float(i) / float(u_num_samples);
+		float xi = radicalInverse(uint(i));
+		float cos_theta = sqrt((1.0 - xi) / (1.0 + (a2 - 1.0) * xi));
+		float sin_theta = sqrt(1.0 - cos_theta * cos_theta);
+		vec3 H = T * (sin_theta * cos(phi)) + B * (sin_theta * sin(phi)) + N * cos_theta;
+		vec3 L = H * (2.0 * dot(N, H)) - N;
+		float NdotL = dot(N, L);
+		if (NdotL <= 0.0)
+			continue;
+
+		float d = cos_theta * cos_theta * (a2 - 1.0) + 1.0;
+		float pdf = a2 / (PI * d * d) * 0.25; //D * NdotH / (4 * VdotH), with V = N
+		float sample_solid_angle = 1.0 / (float(u_num_samples) * pdf + 0.0001);
+		float lod = clamp(0.5 * log2(sample_solid_angle / u_texel_solid_angle) + 1.0, 0.0, u_max_lod);
+		color += textureLod(u_texture, L, lod).xyz * NdotL;
+		total_weight += NdotL;
+	}
+	FragColor = vec4(color / total_weight, 1.0);
+}
+
+
 \instanced.vs
 
 #version 330 core
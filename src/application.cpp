@@ -6,6 +6,8 @@
 
 #include "editor.h"
 #include "pipeline/light.h"
+#include "pipeline/irradiance.h"
+#include "pipeline/reflectionprobe.h"
 
 std::vector<vec3> debug_points; //useful
 
@@ -22,6 +24,8 @@ Application::Application()
 	REGISTER_ENTITY_TYPE(SCN::PrefabEntity);
 	//add here your own entities
 	REGISTER_ENTITY_TYPE(SCN::LightEntity);
+	REGISTER_ENTITY_TYPE(SCN::IrradianceEntity);
+	REGISTER_ENTITY_TYPE(SCN::ReflectionProbeEntity);
 	//...
 
 	// Create camera
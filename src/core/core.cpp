@@ -6,6 +6,9 @@
 
 #include "../gfx/gfx.h" //check errors
 #include "../gfx/texture.h" //??
+#include "../gfx/shader.h"
+#include "../gfx/pbo.h"
+#include "../gfx/texturestreamer.h"
 #include "../utils/utils.h" //cleanPath
 
 #ifdef WIN32
@@ -260,8 +263,16 @@ void CORE::mainLoop(CORE::Window* window, BaseApplication* app)
 		//update app logic
 		app->update(elapsed_time);
 
-		//execute a task in the main task manager (blocking)
-		TaskManager::foreground.fetchTask();
+		//execute tasks in the main task manager till the frame budget is spent (blocking)
+		TaskManager::foreground.fetchTasks(TaskManager::foreground.max_ms_per_frame);
+		GFX::updateUploadStats(elapsed_time);
+
+		//release the upload memory the GPU has finished copying
+		if (GFX::PBORing::instance)
+			GFX::PBORing::instance->update();
+
+		//reload or evict texture mips according to what was rendered
+		GFX::TextureStreamer::update();
 
 		//check errors in opengl only when working in debug
 #ifdef _DEBUG
@@ -274,6 +285,12 @@ void CORE::mainLoop(CORE::Window* window, BaseApplication* app)
 
 void CORE::destroy()
 {
+	//the workers must be joined before the static managers are destroyed
+	TaskManager::background.stopThreads();
+
+	//with the programs compiled on demand during the session (ubershader permutations)
+	GFX::Shader::SaveBinaryCache();
+
 	// Cleanup
 #ifndef SKIP_IMGUI
 	ImGui_ImplOpenGL3_Shutdown();
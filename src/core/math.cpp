@@ -155,6 +155,7 @@ template<typename T> void Vector3<T>::parseFromText(const char* text, const char
 };
 
 template void Vector3<float>::parseFromText(const char* text, const char separator);
+template float Vector3<float>::length() const;
 
 //*********************************
 const Matrix44 Matrix44::IDENTITY;
@@ -0,0 +1,63 @@
+#pragma once
+
+//four floats processed at once, with SSE when available (always in x64) or plain loops otherwise.
+//comparisons return masks (all bits set in the lanes where they are true) for select and getMask
+
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define SIMD_SSE
+#endif
+
+struct simd4 {
+#ifdef SIMD_SSE
+	__m128 v;
+	simd4() {}
+	simd4(__m128 v) : v(v) {}
+	simd4(float f) : v(_mm_set1_ps(f)) {}
+	simd4(float x, float y, float z, float w) : v(_mm_setr_ps(x, y, z, w)) {}
+	static simd4 load(const float* p) { return _mm_loadu_ps(p); }
+	void store(float* p) const { _mm_storeu_ps(p, v); }
+	int getMask() const { return _mm_movemask_ps(v); } //one bit per lane
+	friend simd4 operator + (simd4 a, simd4 b) { return _mm_add_ps(a.v, b.v); }
+	friend simd4 operator - (simd4 a, simd4 b) { return _mm_sub_ps(a.v, b.v); }
+	friend simd4 operator * (simd4 a, simd4 b) { return _mm_mul_ps(a.v, b.v); }
+	friend simd4 operator / (simd4 a, simd4 b) { return _mm_div_ps(a.v, b.v); }
+	friend simd4 operator < (simd4 a, simd4 b) { return _mm_cmplt_ps(a.v, b.v); }
+	friend simd4 operator <= (simd4 a, simd4 b) { return _mm_cmple_ps(a.v, b.v); }
+	friend simd4 operator & (simd4 a, simd4 b) { return _mm_and_ps(a.v, b.v); }
+	friend simd4 operator | (simd4 a, simd4 b) { return _mm_or_ps(a.v, b.v); }
+	friend simd4 select(simd4 mask, simd4 a, simd4 b) { return _mm_or_ps(_mm_and_ps(mask.v, a.v), _mm_andnot_ps(mask.v, b.v)); } //a where the mask is set
+	friend simd4 sqrt(simd4 a) { return _mm_sqrt_ps(a.v); }
+	friend simd4 min(simd4 a, simd4 b) { return _mm_min_ps(a.v, b.v); }
+	friend simd4 max(simd4 a, simd4 b) { return _mm_max_ps(a.v, b.v); }
+	friend simd4 flipSign(simd4 a, simd4 b) { return _mm_xor_ps(a.v, _mm_and_ps(b.v, _mm_set1_ps(-0.0f))); } //-a where b is negative
+#else
+	float v[4];
+	simd4() {}
+	simd4(float f) { v[0] = v[1] = v[2] = v[3] = f; }
+	simd4(float x, float y, float z, float w) { v[0] = x; v[1] = y; v[2] = z; v[3] = w; }
+	static simd4 load(const float* p) { simd4 r; memcpy(r.v, p, sizeof(r.v)); return r; }
+	void store(float* p) const { memcpy(p, v, sizeof(v)); }
+	int getMask() const { int m = 0; for (int i = 0; i < 4; ++i) m |= (bits(v[i]) >> 31) << i; return m; }
+	friend simd4 operator + (simd4 a, simd4 b) { for (int i = 0; i < 4; ++i) a.v[i] += b.v[i]; return a; }
+	friend simd4 operator - (simd4 a, simd4 b) { for (int i = 0; i < 4; ++i) a.v[i] -= b.v[i]; return a; }
+	friend simd4 operator * (simd4 a, simd4 b) { for (int i = 0; i < 4; ++i) a.v[i] *= b.v[i]; return a; }
+	friend simd4 operator / (simd4 a, simd4 b) { for (int i = 0; i < 4; ++i) a.v[i] /= b.v[i]; return a; }
+	friend simd4 operator < (simd4 a, simd4 b) { for (int i = 0; i < 4; ++i) a.v[i] = fromBits(a.v[i] < b.v[i] ? ~0u : 0u); return a; }
+	friend simd4 operator <= (simd4 a, simd4 b) { for (int i = 0; i < 4; ++i) a.v[i] = fromBits(a.v[i] <= b.v[i] ? ~0u : 0u); return a; }
+	friend simd4 operator & (simd4 a, simd4 b) { for (int i = 0; i < 4; ++i) a.v[i] = fromBits(bits(a.v[i]) & bits(b.v[i])); return a; }
+	friend simd4 operator | (simd4 a, simd4 b) { for (int i = 0; i < 4; ++i) a.v[i] = fromBits(bits(a.v[i]) | bits(b.v[i])); return a; }
+	friend simd4 select(simd4 mask, simd4 a, simd4 b) { for (int i = 0; i < 4; ++i) if (!bits(mask.v[i])) a.v[i] = b.v[i]; return a; }
+	friend simd4 sqrt(simd4 a) { for (int i = 0; i < 4; ++i) a.v[i] = sqrtf(a.v[i]); return a; }
+	friend simd4 min(simd4 a, simd4 b) { for (int i = 0; i < 4; ++i) a.v[i] = std::min(a.v[i], b.v[i]); return a; }
+	friend simd4 max(simd4 a, simd4 b) { for (int i = 0; i < 4; ++i) a.v[i] = std::max(a.v[i], b.v[i]); return a; }
+	friend simd4 flipSign(simd4 a, simd4 b) { for (int i = 0; i < 4; ++i) if (b.v[i] < 0.0f) a.v[i] = -a.v[i]; return a; }
+	static unsigned int bits(float f) { unsigned int u; memcpy(&u, &f, 4); return u; }
+	static float fromBits(unsigned int u) { float f; memcpy(&f, &u, 4); return f; }
+#endif
+	float operator[](int i) const { float f[4]; store(f); return f[i]; }
+};
@@ -2,78 +2,302 @@
 #include <iostream>       // std::cout
 #include <thread>         // std::thread
 #include <chrono>		  //ms
+#include <memory>
+#include <algorithm>
 #include <cassert>
 
 TaskManager TaskManager::foreground;
 TaskManager TaskManager::background;
 
+//to know if we are inside a worker, so tasks added from it go to its own queue
+thread_local TaskManager* current_manager = NULL;
+thread_local int current_worker = 0;
+
 TaskManager::TaskManager()
 {
 	must_loop = false;
-	_thread = NULL;
+	num_queued = 0;
+	next_worker = 0;
+	max_ms_per_frame = 4.0;
+	last_fetch_count = 0;
+	last_fetch_ms = 0.0;
+	workers.push_back(new Worker()); //external queue
 }
 
-void TaskManager::loop()
+void TaskManager::workerLoop(int index)
 {
-	using namespace std::chrono_literals;
-	std::cout << "Starting Task Manager ..." << std::endl;
+	current_manager = this;
+	current_worker = index;
 
 	while (must_loop)
 	{
-		if (pending_tasks.empty())
+		Task* task = pop(index);
+		if (task)
 		{
-			std::this_thread::sleep_for(10ms);
+			execute(task);
 			continue;
 		}
 
-		fetchTask();
+		//nothing to do, sleep till somebody adds a task
+		std::unique_lock<std::mutex> lock(sleep_mutex);
+		wake_condition.wait(lock, [this] { return num_queued > 0 || !must_loop; });
 	}
+}
 
-	std::cout << "Ending Task Manager" << std::endl;
+//own queue from the back (LIFO), other queues from the front (FIFO), higher priorities first
+Task* TaskManager::pop(int index)
+{
+	int num = (int)workers.size();
+	for (int p = 0; p < NUM_TASK_PRIORITIES; ++p)
+	{
+		{
+			Worker* worker = workers[index];
+			const std::lock_guard<std::mutex> lock(worker->mutex);
+			std::deque<Task*>& queue = worker->queues[p];
+			if (!queue.empty())
+			{
+				Task* task = queue.back();
+				queue.pop_back();
+				num_queued--;
+				return task;
+			}
+		}
+
+		//steal
+		for (int i = 1; i < num; ++i)
+		{
+			Worker* worker = workers[(index + i) % num];
+			const std::lock_guard<std::mutex> lock(worker->mutex);
+			std::deque<Task*>& queue = worker->queues[p];
+			if (queue.empty())
+				continue;
+			Task* task = queue.front();
+			queue.pop_front();
+			num_queued--;
+			return task;
+		}
+	}
+	return NULL;
 }
 
-void TaskManager::fetchTask()
+void TaskManager::push(Task* task)
 {
-	Task* task = NULL;
-	try
+	int index = 0;
+	if (current_manager == this)
+		index = current_worker;
+	else if (workers.size() > 1)
+		index = 1 + (next_worker++ % (int)(workers.size() - 1));
+
 	{
-		//lock
-		const std::lock_guard<std::mutex> lock(tasks_mutex);
-		if (pending_tasks.empty())
-			return;
-		task = pending_tasks.front();
-		pending_tasks.pop_front();
-		//unlock after finishing scope
+		Worker* worker = workers[index];
+		const std::lock_guard<std::mutex> lock(worker->mutex);
+		worker->queues[task->priority].push_back(task);
 	}
-	catch (std::logic_error&) {
-		std::cout << "[exception caught]\n";
+
+	num_queued++;
+	{ const std::lock_guard<std::mutex> lock(sleep_mutex); } //avoids missing the wake up of a worker going to sleep
+	wake_condition.notify_one();
+}
+
+void TaskManager::execute(Task* task)
+{
+	task->onExecute();
+
+	//schedule the tasks waiting for this one
+	for (size_t i = 0; i < task->continuations.size(); ++i)
+	{
+		Task* next = task->continuations[i];
+		if (--next->pending == 0)
+			next->manager->push(next);
 	}
+	delete task;
+}
 
-	if (task)
+bool TaskManager::fetchTask()
+{
+	Task* task = pop(current_manager == this ? current_worker : 0);
+	if (!task)
+		return false;
+	execute(task);
+	return true;
+}
+
+//moves the tasks of the external queue to the heaps, so getImportance is called once per task
+//and frame and the lock is not held while ranking
+void TaskManager::rankExternalTasks()
+{
+	Worker* worker = workers[0];
+	std::deque<Task*> queues[NUM_TASK_PRIORITIES];
 	{
-		task->onExecute();
-		delete task;
-		task = NULL;
+		const std::lock_guard<std::mutex> lock(worker->mutex);
+		for (int p = 0; p < NUM_TASK_PRIORITIES; ++p)
+			queues[p].swap(worker->queues[p]);
+	}
+
+	for (int p = 0; p < NUM_TASK_PRIORITIES; ++p)
+	{
+		std::vector<sRankedTask>& heap = ranked[p];
+		for (Task* task : queues[p])
+		{
+			heap.push_back({ task->getImportance(), task });
+			std::push_heap(heap.begin(), heap.end());
+		}
 	}
 }
 
-void thread_loop_func(TaskManager* manager)
+//only from the external queue (after rankExternalTasks)
+Task* TaskManager::popMostImportant()
 {
-	manager->loop();
-	//join?
+	for (int p = 0; p < NUM_TASK_PRIORITIES; ++p)
+	{
+		std::vector<sRankedTask>& heap = ranked[p];
+		if (heap.empty())
+			continue;
+		std::pop_heap(heap.begin(), heap.end());
+		Task* task = heap.back().task;
+		heap.pop_back();
+		num_queued--;
+		return task;
+	}
+	return NULL;
 }
 
-void TaskManager::startThread()
+int TaskManager::fetchTasks(double max_ms)
 {
-	assert(!_thread && "TaskManager already in a thread");
+	assert(workers.size() == 1 && "fetchTasks is for managers without threads");
+	using namespace std::chrono;
+	auto start = high_resolution_clock::now();
+	double elapsed = 0.0;
+	int count = 0;
+
+	do
+	{
+		rankExternalTasks(); //also the ones added by the last task
+		Task* task = popMostImportant();
+		if (!task)
+			break;
+		execute(task);
+		count++;
+		elapsed = duration<double, std::milli>(high_resolution_clock::now() - start).count();
+	} while (elapsed < max_ms);
+
+	//what was not executed goes back to the queue, its importance could change till next frame
+	{
+		Worker* worker = workers[0];
+		const std::lock_guard<std::mutex> lock(worker->mutex);
+		for (int p = 0; p < NUM_TASK_PRIORITIES; ++p)
+		{
+			for (const sRankedTask& ranked_task : ranked[p])
+				worker->queues[p].push_back(ranked_task.task);
+			ranked[p].clear();
+		}
+	}
+
+	last_fetch_count = count;
+	last_fetch_ms = elapsed;
+	return count;
+}
+
+void thread_loop_func(TaskManager* manager, int index)
+{
+	manager->workerLoop(index);
+}
+
+void TaskManager::startThread(int num_threads)
+{
+	assert(workers.size() == 1 && "TaskManager already has threads");
+	if (num_threads <= 0)
+		num_threads = std::max(1, (int)std::thread::hardware_concurrency() - 1);
+
+	std::cout << "Starting Task Manager with " << num_threads << " threads ..." << std::endl;
 	must_loop = true;
-	_thread = new std::thread(thread_loop_func, this);
+	for (int i = 0; i < num_threads; ++i)
+		workers.push_back(new Worker());
+	for (int i = 1; i <= num_threads; ++i)
+		workers[i]->thread = new std::thread(thread_loop_func, this, i);
+}
+
+void TaskManager::stopThreads()
+{
+	{
+		const std::lock_guard<std::mutex> lock(sleep_mutex);
+		must_loop = false;
+	}
+	wake_condition.notify_all();
+
+	for (size_t i = 1; i < workers.size(); ++i)
+	{
+		Worker* worker = workers[i];
+		worker->thread->join();
+		delete worker->thread;
+
+		//move what was left to the external queue
+		for (int p = 0; p < NUM_TASK_PRIORITIES; ++p)
+			for (Task* task : worker->queues[p])
+				workers[0]->queues[p].push_back(task);
+		delete worker;
+	}
+	workers.resize(1);
+	std::cout << "Ending Task Manager" << std::endl;
 }
 
 void TaskManager::addTask(Task* task)
 {
-	//block pending_tasks
-	const std::lock_guard<std::mutex> lock(tasks_mutex);
-	pending_tasks.push_back(task);
-	//release pending_tasks automatically
-}
\ No newline at end of file
+	//it will be queued when its dependencies finish
+	task->manager = this;
+	if (--task->pending == 0)
+		push(task);
+}
+
+Task* TaskManager::addTask(std::function<void()> func, eTaskPriority priority)
+{
+	Task* task = new Task(func, priority);
+	addTask(task);
+	return task;
+}
+
+void TaskManager::parallelFor(size_t count, const std::function<void(size_t start, size_t end)>& func, size_t min_batch)
+{
+	if (!count)
+		return;
+
+	int num_threads = getNumThreads();
+	size_t batch = std::max(min_batch, count / ((num_threads + 1) * 4) + 1);
+	size_t num_batches = (count + batch - 1) / batch;
+
+	//no threads or not worth it
+	if (num_threads == 0 || num_batches == 1)
+	{
+		func(0, count);
+		return;
+	}
+
+	//shared by all helpers, some of them could start after we return
+	struct sParallelFor {
+		std::atomic<size_t> next;
+		std::atomic<size_t> done;
+	};
+	std::shared_ptr<sParallelFor> state = std::make_shared<sParallelFor>();
+	state->next = 0;
+	state->done = 0;
+
+	const std::function<void(size_t, size_t)>* f = &func;
+	auto work = [state, f, count, batch, num_batches]() {
+		size_t i;
+		while ((i = state->next++) < num_batches)
+		{
+			(*f)(i * batch, std::min(count, (i + 1) * batch));
+			state->done++;
+		}
+	};
+
+	//func is only accessed while batches are pending, so it is safe to keep a pointer
+	int num_helpers = (int)std::min(num_batches - 1, (size_t)num_threads);
+	for (int i = 0; i < num_helpers; ++i)
+		addTask(work, HIGH);
+
+	//this thread helps too
+	work();
+	while (state->done < num_batches)
+		std::this_thread::yield();
+}
@@ -1,34 +1,103 @@
 #pragma once
 
 #include <vector>
-#include <list>
+#include <deque>
 #include <mutex>
+#include <condition_variable>
+#include <atomic>
 #include <thread>         // std::thread
 #include <functional>
 
+class TaskManager;
+
+enum eTaskPriority {
+	HIGH,
+	NORMAL,
+	LOW,
+	NUM_TASK_PRIORITIES
+};
+
 //any task executed in BG should inherit from this one
 class Task {
 public:
 	std::function<void()> callback;
-	Task() { callback = NULL; };
-	Task(std::function<void()> func) { callback = func; };
+	eTaskPriority priority;
+
+	Task() { callback = NULL; priority = NORMAL; pending = 1; manager = NULL; };
+	Task(std::function<void()> func, eTaskPriority priority = NORMAL) { callback = func; this->priority = priority; pending = 1; manager = NULL; };
 	virtual ~Task() {};
 	virtual void onExecute() { if (callback) callback(); }
+	virtual float getImportance() { return 0.0f; } //fetchTasks runs first the most important ones of the same priority
+
+	//the task will be added to the queue once this one has finished (and the rest of its dependencies)
+	//must be called before adding this task to a manager, as it is deleted after being executed
+	void then(Task* task) { task->pending++; continuations.push_back(task); }
+
+	//used by the TaskManager
+	std::atomic<int> pending; //1 (not added yet) + unfinished dependencies
+	std::vector<Task*> continuations;
+	TaskManager* manager;
 };
 
+//Work stealing pool: every worker has its own queues (one per priority), pops from its own
+//and steals from the others when empty. Workers sleep when there is nothing to do.
+//Tasks added from outside the workers go to the external queue, which is the only one
+//when there are no threads (like in the foreground manager, executed with fetchTask)
 class TaskManager {
 public:
-	std::list<Task*> pending_tasks;
-	std::mutex tasks_mutex;  // protects pending_tasks
-	bool must_loop;
-	std::thread* _thread;
+	struct Worker {
+		std::deque<Task*> queues[NUM_TASK_PRIORITIES];
+		std::mutex mutex; //protects queues
+		std::thread* thread;
+		Worker() { thread = NULL; }
+	};
+
+	std::vector<Worker*> workers; //0 is the external queue, it has no thread
+	std::atomic<int> num_queued;
+	std::atomic<int> next_worker; //round robin for external tasks
+	std::mutex sleep_mutex;
+	std::condition_variable wake_condition;
+	std::atomic<bool> must_loop; //read by the workers without lock
 
 	static TaskManager foreground;
 	static TaskManager background;
 
 	TaskManager();
+
 	void addTask(Task* task);
-	void fetchTask();
-	void loop();
-	void startThread();
-};
\ No newline at end of file
+	Task* addTask(std::function<void()> func, eTaskPriority priority = NORMAL);
+	bool fetchTask(); //executes one pending task in the calling thread, returns false if empty
+
+	//for managers without threads (like foreground): executes tasks till max_ms is spent (at least one)
+	//by priority and importance. Tasks added meanwhile are also executed.
+	int fetchTasks(double max_ms);
+	double max_ms_per_frame; //budget used by the main loop
+	int last_fetch_count; //stats of the last fetchTasks
+	double last_fetch_ms;
+	int getNumPending() { return num_queued; }
+	int getNumThreads() { return (int)workers.size() - 1; }
+
+	void startThread(int num_threads = 0); //0 means hardware concurrency - 1
+	void stopThreads();
+
+	//splits the range in batches and executes them in the workers (and the calling thread)
+	//returns once all have finished
+	void parallelFor(size_t count, const std::function<void(size_t start, size_t end)>& func, size_t min_batch = 1);
+
+private:
+	void workerLoop(int index);
+	void push(Task* task);
+	Task* pop(int index);
+
+	//fetchTasks moves the external queue here, importance is computed once per task and frame
+	struct sRankedTask {
+		float importance;
+		Task* task;
+		bool operator<(const sRankedTask& other) const { return importance < other.importance; }
+	};
+	std::vector<sRankedTask> ranked[NUM_TASK_PRIORITIES]; //max heaps
+	void rankExternalTasks();
+	Task* popMostImportant();
+	void execute(Task* task);
+	friend void thread_loop_func(TaskManager* manager, int index);
+};
@@ -1,6 +1,11 @@
 
 #include "litengine.h"
 #include "editor.h"
+#include "utils/benchmark.h"
+#include "gfx/texturestreamer.h"
+#include "pipeline/lightmapbaker.h"
+#include "pipeline/irradiance.h"
+#include "pipeline/reflectionprobe.h"
 
 long mouse_press_time = 0;
 
@@ -207,6 +212,29 @@ void SceneEditor::render(Camera* camera)
 
 	if (ImGui::BeginTabItem("Stats"))
 	{
+		ImGui::Text("Tasks: %d pending, %d threads", TaskManager::background.getNumPending(), TaskManager::background.getNumThreads());
+		ImGui::Text("%s", GFX::getUploadStats().c_str());
+		if (GFX::PBORing* ring = GFX::PBORing::instance)
+			ImGui::Text("PBO ring: %d/%d MB used, %d allocations failed", (int)(ring->used / (1024 * 1024)), (int)(ring->size / (1024 * 1024)), (int)ring->failed_allocations);
+		else
+			ImGui::Text("PBO ring: not supported");
+		ImGui::Text("%s", GFX::Texture::getLoadStats().c_str());
+		int max_decoding_mb = (int)(GFX::Texture::max_decoding_bytes / (1024 * 1024));
+		if (ImGui::SliderInt("Max decoding (MB)", &max_decoding_mb, 16, 1024))
+			GFX::Texture::max_decoding_bytes = (size_t)max_decoding_mb * 1024 * 1024;
+		float budget = (float)TaskManager::foreground.max_ms_per_frame;
+		if (ImGui::SliderFloat("Upload budget (ms)", &budget, 0.0f, 16.0f))
+			TaskManager::foreground.max_ms_per_frame = budget;
+
+		//results are shown in the console
+		if (ImGui::TreeNode("Benchmarks"))
+		{
+			for (auto& benchmark : getBenchmarks())
+				if (ImGui::Button(benchmark.name))
+					runBenchmark(benchmark.name);
+			ImGui::TreePop();
+		}
+		ImGui::EndTabItem();
 	}
 
 
@@ -232,6 +260,8 @@ void SceneEditor::render(Camera* camera)
 		{
 		case SCN::eEntityType::PREFAB: inspectEntity((SCN::PrefabEntity*)ent); break;
 		case SCN::eEntityType::LIGHT: inspectEntity((SCN::LightEntity*)ent); break;
+		case SCN::eEntityType::IRRADIANCE_VOLUME: inspectEntity((SCN::IrradianceEntity*)ent); break;
+		case SCN::eEntityType::REFLECTION_PROBE: inspectEntity((SCN::ReflectionProbeEntity*)ent); break;
 		case SCN::eEntityType::NONE: inspectEntity((SCN::UnknownEntity*)ent); break;
 		default: inspectEntity(ent); break;
 		}
@@ -241,6 +271,18 @@ void SceneEditor::render(Camera* camera)
 		ImGui::ColorEdit3("BG color", scene->background_color.v);
 		ImGui::ColorEdit3("Ambient Light", scene->ambient_light.v);
 
+		//baked in the main thread, the rays use the workers. Save the scene to keep them
+		if (ImGui::TreeNode("Lightmaps"))
+		{
+			ImGui::SliderInt("Resolution", &SCN::LightmapBaker::resolution, 32, 2048);
+			ImGui::SliderInt("Samples", &SCN::LightmapBaker::num_samples, 1, 1024);
+			ImGui::DragFloat("Max distance", &SCN::LightmapBaker::max_distance, 1.0f, 0.0f, 100000.0f);
+			ImGui::DragFloat("Bias", &SCN::LightmapBaker::bias, 0.01f, 0.0f, 100.0f);
+			if (ImGui::Button("Bake lightmaps"))
+				SCN::LightmapBaker::bake(scene);
+			ImGui::TreePop();
+		}
+
 		if (UI::Filename("Skybox", scene->skybox_filename, scene->base_folder))
 			renderer->setupScene(camera);
 
@@ -294,6 +336,14 @@ void SceneEditor::renderTexturesPanel()
 	if (ImGui::Begin("Textures", nullptr, flags))// Create a window
 	{
 		ImGui::Checkbox("Big", &show_big);
+		ImGui::SameLine();
+		ImGui::Checkbox("Streaming", &GFX::TextureStreamer::enabled);
+		int budget_mb = (int)(GFX::TextureStreamer::budget / (1024 * 1024));
+		ImGui::SameLine();
+		ImGui::SetNextItemWidth(200);
+		if (ImGui::SliderInt("VRAM budget (MB)", &budget_mb, 16, 4096))
+			GFX::TextureStreamer::budget = (size_t)budget_mb * 1024 * 1024;
+		ImGui::Text("%s", GFX::TextureStreamer::getStats().c_str());
 		for (auto it : GFX::Texture::sTextures)
 		{
 			GFX::Texture* tex = it.second;
@@ -307,6 +357,9 @@ void SceneEditor::renderTexturesPanel()
 			if (ImGui::IsItemClicked(0))
 				selected_texture = selected_texture == tex->index ? -1 : tex->index;
 			ImGui::Text("%dx%d %s", (int)tex->width, (int)tex->height, tex->filename.c_str());
+			if (tex->source_width)
+				ImGui::Text("lod %d (wanted %d) of %dx%d, %.2f MB, used %d frames ago%s", tex->lod, tex->wanted_lod, tex->source_width, tex->source_height,
+					tex->getVRAMBytes() / (1024.0 * 1024.0), (int)(GFX::TextureStreamer::frame - tex->last_used_frame), tex->streaming ? ", loading" : "");
 		}
 	}
 	ImGui::End();
@@ -374,6 +427,45 @@ void SceneEditor::inspectEntity(SCN::LightEntity* entity)
 #endif
 }
 
+void SceneEditor::inspectEntity(SCN::IrradianceEntity* entity)
+{
+#ifndef SKIP_IMGUI
+	this->inspectEntity((SCN::BaseEntity*)entity);
+
+	ImGui::DragFloat3("size", entity->size.v, 1.0f, 0.0f, 100000.0f);
+	if (ImGui::DragInt3("dims", entity->dims, 0.1f, 1, 64))
+		entity->probes.clear(); //they no longer match, bake again
+	ImGui::SliderInt("samples", &SCN::IrradianceEntity::num_samples, 16, 4096);
+	ImGui::Text("probes: %d %s", entity->getNumProbes(), entity->probes.size() ? "" : "(not baked)");
+	if (ImGui::Button("Bake"))
+	{
+		entity->bake();
+		entity->save();
+	}
+#endif
+}
+void SceneEditor::inspectEntity(SCN::ReflectionProbeEntity* entity)
+{
+#ifndef SKIP_IMGUI
+	this->inspectEntity((SCN::BaseEntity*)entity);
+
+	ImGui::DragFloat3("size", entity->size.v, 1.0f, 0.0f, 100000.0f);
+	int resolution = 0; //from 32 to 512
+	while ((32 << resolution) < entity->resolution && resolution < 4)
+		resolution++;
+	if (ImGui::Combo("resolution", &resolution, "32\0" "64\0" "128\0" "256\0" "512\0"))
+		entity->resolution = 32 << resolution; //the signature changes, it is captured again
+	if (!entity->getTexture())
+		ImGui::Text("(not captured)");
+	else
+		ImGui::Text("%s %s", entity->filename.c_str(), entity->isSaved() ? "" : "(not saved)");
+	if (ImGui::Button("Capture"))
+		entity->signature = 0; //the renderer captures it once the scene is still
+	ImGui::SameLine();
+	if (ImGui::Button("Save"))
+		entity->save();
+#endif
+}
 
 void SceneEditor::inspectEntity( SCN::UnknownEntity* entity )
 {
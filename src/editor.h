@@ -10,6 +10,8 @@ namespace SCN {
 
 	class PrefabEntity;
 	class LightEntity;
+	class IrradianceEntity;
+	class ReflectionProbeEntity;
 };
 
 class SceneEditor
@@ -32,6 +34,8 @@ public:
 	void inspectEntity(SCN::BaseEntity* entity);
 	void inspectEntity(SCN::PrefabEntity* entity);
 	void inspectEntity(SCN::LightEntity* entity);
+	void inspectEntity(SCN::IrradianceEntity* entity);
+	void inspectEntity(SCN::ReflectionProbeEntity* entity);
 	void inspectEntity(SCN::UnknownEntity* entity);
 
 	void renderInList(SCN::BaseEntity* entity);
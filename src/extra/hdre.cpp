@@ -3,6 +3,7 @@
 #include <cmath>
 #include <cassert>
 #include <algorithm>
+#include <cstring>
 
 #include "../utils/utils.h"
 #include "hdre.h"
@@ -254,4 +255,44 @@ HDRE* HDRE::Get(const char* filename)
 
 	s_loaded_hdres[filename] = hdre;
 	return hdre;
-}
\ No newline at end of file
+}
+
+bool HDRE::Save(const char* filename, int width, int num_channels, float* faces[N_LEVELS][N_FACES])
+{
+	assert(filename && width >= (1 << (N_LEVELS - 1)));
+
+	sHDREHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.signature, "HDRE", 4);
+	header.version = 3.0f; //every level is half the previous one
+	header.width = width;
+	header.height = width;
+	header.numChannels = num_channels;
+	header.bitsPerChannel = 32;
+	header.headerSize = sizeof(sHDREHeader);
+	header.type = 3; //Float32Array
+
+	int data_size = 0;
+	for (int i = 0; i < N_LEVELS; i++)
+	{
+		int w = width >> i;
+		for (int j = 0; j < N_FACES; j++)
+			for (int k = 0; k < w * w * num_channels; k++)
+				header.maxLuminance = std::max(header.maxLuminance, faces[i][j][k]);
+		data_size += w * w * num_channels * N_FACES;
+	}
+	header.maxFileSize = (float)(sizeof(sHDREHeader) + data_size * sizeof(float));
+
+	FILE* f = fopen(filename, "wb");
+	if (f == nullptr)
+		return false;
+	fwrite(&header, sizeof(sHDREHeader), 1, f);
+	for (int i = 0; i < N_LEVELS; i++)
+	{
+		int w = width >> i;
+		for (int j = 0; j < N_FACES; j++)
+			fwrite(faces[i][j], sizeof(float) * w * w * num_channels, 1, f);
+	}
+	fclose(f);
+	return true;
+}
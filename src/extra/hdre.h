@@ -97,4 +97,6 @@ public:
 	//sHDRELevel getLevel(int level = 0);
 
 	static HDRE* Get(const char* filename);
+	//writes a float cubemap with its N_LEVELS mips (version 3, each level is half the previous one)
+	static bool Save(const char* filename, int width, int num_channels, float* faces[N_LEVELS][N_FACES]);
 };
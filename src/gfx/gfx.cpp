@@ -11,6 +11,12 @@ namespace GFX {
 	long gpu_frame_microseconds = 0;
 	long gpu_frame_microseconds_history[GPU_FRAME_HISTORY_SIZE];
 
+	size_t uploaded_bytes_frame = 0;
+	size_t uploaded_bytes_second = 0;
+	double upload_time = 0.0;
+	double upload_bandwidth = 0.0; //MB per second
+	size_t uploaded_bytes_total = 0;
+
 	void startGPULabel(const char* text)
 	{
 		glPushDebugGroup(GL_DEBUG_SOURCE_THIRD_PARTY, 1, -1, text);
@@ -43,6 +49,32 @@ namespace GFX {
 		return str;
 	}
 
+	void addUploadedBytes(size_t bytes)
+	{
+		uploaded_bytes_frame += bytes;
+		uploaded_bytes_total += bytes;
+	}
+
+	//called once per frame
+	void updateUploadStats(double elapsed_seconds)
+	{
+		uploaded_bytes_second += uploaded_bytes_frame;
+		uploaded_bytes_frame = 0;
+		upload_time += elapsed_seconds;
+		if (upload_time < 1.0)
+			return;
+		upload_bandwidth = (uploaded_bytes_second / (1024.0 * 1024.0)) / upload_time;
+		uploaded_bytes_second = 0;
+		upload_time = 0.0;
+	}
+
+	std::string getUploadStats()
+	{
+		return "Uploads: " + std::to_string(TaskManager::foreground.getNumPending()) + " queued, " +
+			std::to_string(TaskManager::foreground.last_fetch_count) + " tasks in " + std::to_string(TaskManager::foreground.last_fetch_ms) + "ms, " +
+			std::to_string(upload_bandwidth) + " MB/s (" + std::to_string(uploaded_bytes_total / (1024 * 1024)) + " MB total)";
+	}
+
 	bool checkGLErrors()
 	{
 #ifndef _DEBUG
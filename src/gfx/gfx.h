@@ -21,6 +21,11 @@ namespace GFX {
 	void endGPULabel();
 
 	std::string getGPUStats();
+
+	//bytes sent to the GPU by the async loaders, to show the upload bandwidth
+	void addUploadedBytes(size_t bytes);
+	void updateUploadStats(double elapsed_seconds);
+	std::string getUploadStats();
 	void drawGrid();
 	bool drawText(float x, float y, std::string text, Vector4f c, float scale);
 	bool drawText3D(Vector3f pos, std::string text, Vector4f c, float scale);
@@ -12,9 +12,10 @@
 #include <sys/stat.h>
 
 #include "../pipeline/camera.h" //??
+#include "../pipeline/animationsystem.h" //skin bindings
 #include "texture.h"
 //#include "animation.h"
-#include "../extra/coldet/coldet.h"
+#include "meshbvh.h"
 
 //#include "engine/application.h"
 
@@ -23,6 +24,7 @@ namespace GFX {
 bool Mesh::use_binary = false;			//checks if there is .wbin, it there is one tries to read it instead of the other file
 bool Mesh::auto_upload_to_vram = true;	//uploads the mesh to the GPU VRAM to speed up rendering
 bool Mesh::interleave_meshes = true;	//places the geometry in an interleaved array
+bool Mesh::use_vertex_arrays = true;	//one VAO per mesh instead of setting the attributes in every draw
 
 std::map<std::string, Mesh*> Mesh::sMeshesLoaded;
 long Mesh::num_meshes_rendered = 0;
@@ -39,19 +41,28 @@ Mesh::Mesh()
 	index = s_last_index++;
 	radius = 0;
 	vertices_vbo_id = uvs_vbo_id = uvs1_vbo_id = normals_vbo_id = colors_vbo_id = interleaved_vbo_id = indices_vbo_id = bones_vbo_id = weights_vbo_id = 0;
-	collision_model = NULL;
+	vao_id = 0;
+	in_arena = false;
+	bvh = NULL;
 
 	clear();
 }
 
 Mesh::~Mesh()
 {
+	if (bones_info.size())
+		AnimationSystem::removeBindings(this, NULL);
 	clear();
 }
 
 
 void Mesh::clear()
 {
+	releaseVertexArray();
+	if (in_arena)
+		MeshArena::instance->remove(arena_range);
+	in_arena = false;
+
 	//Free VBOs
 	#ifdef USE_OPENGL_EXT
 		if (vertices_vbo_id)
@@ -108,8 +119,9 @@ void Mesh::clear()
 	weights.clear();
 	m_uvs1.clear();
 
-	if (collision_model)
-		delete (CollisionModel3D*)collision_model;
+	if (bvh)
+		delete bvh;
+	bvh = NULL;
 }
 
 int vertex_location = -1;
@@ -272,6 +284,16 @@ void Mesh::render(unsigned int primitive, int submesh_id, int num_instances)
 	}
 	assert((interleaved.size() || vertices.size()) && "No vertices in this mesh");
 
+	//all the streams are already bound in the VAO (instancing sets its own attributes in the default one)
+	if (in_arena || (use_vertex_arrays && !num_instances && (vao_id || createVertexArray())))
+	{
+		glBindVertexArray(in_arena ? MeshArena::instance->vao_id : vao_id);
+		drawCall(primitive, submesh_id, num_instances);
+		glBindVertexArray(0); //the rest of the framework expects the default one
+		checkGLErrors();
+		return;
+	}
+
 	//bind buffers to attribute locations
 	enableBuffers(shader);
 	checkGLErrors();
@@ -303,23 +325,38 @@ void Mesh::drawCall(unsigned int primitive, int submesh_id, int num_instances)
 		size = submesh.start + submesh.length;
 	}
 
+	bool in_vao = use_vertex_arrays && vao_id && !num_instances; //the VAO has the index buffer bound
+
 	//DRAW
-	if (m_indices.size())
+	if (in_arena)
+	{
+		//indices are always there (sequential if the mesh had none), start is in triangles
+		size_t first = arena_range.first_index + start * 3;
+		if (num_instances > 0)
+			glDrawElementsInstancedBaseVertex(primitive, size, GL_UNSIGNED_INT, (void*)(first * sizeof(uint32)), num_instances, (GLint)arena_range.first_vertex);
+		else
+			glDrawElementsBaseVertex(primitive, size, GL_UNSIGNED_INT, (void*)(first * sizeof(uint32)), (GLint)arena_range.first_vertex);
+	}
+	else if (m_indices.size())
 	{
 		if (num_instances > 0)
 		{
 			assert(indices_vbo_id && "indices must be uploaded to the GPU");
-			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indices_vbo_id);
+			if (!in_vao)
+				glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indices_vbo_id);
 			#ifdef OPENGL_ES3
 				glDrawElementsInstanced(primitive, size, GL_UNSIGNED_INT, (void*)(start + sizeof(Vector3u)), num_instances);
             #else
 				assert(0 && "not supported in OpenGL ES2");
             #endif
-			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+			if (!in_vao)
+				glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 		}
 		else
 		{
-			if (indices_vbo_id)
+			if (in_vao)
+				glDrawElements(primitive, size, GL_UNSIGNED_INT, (void*)(start * sizeof(Vector3u)));
+			else if (indices_vbo_id)
 			{
 				/*if (size != 90)*/ {
 					glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indices_vbo_id);
@@ -363,6 +400,91 @@ void Mesh::disableBuffers(Shader* shader)
 	checkGLErrors();
 }
 
+bool Mesh::createVertexArray()
+{
+	//only if everything is in VRAM, client arrays cannot be stored in a VAO
+	if (!interleaved_vbo_id && !vertices_vbo_id)
+		return false;
+	if ((m_indices.size() && !indices_vbo_id) || (!interleaved_vbo_id && ((normals.size() && !normals_vbo_id) || (uvs.size() && !uvs_vbo_id))) ||
+		(m_uvs1.size() && !uvs1_vbo_id) || (colors.size() && !colors_vbo_id) || (bones.size() && !bones_vbo_id) || (weights.size() && !weights_vbo_id))
+		return false;
+
+	glGenVertexArrays(1, &vao_id);
+	glBindVertexArray(vao_id);
+
+	if (interleaved_vbo_id)
+	{
+		int spacing = sizeof(tInterleaved);
+		glBindBuffer(GL_ARRAY_BUFFER, interleaved_vbo_id);
+		glEnableVertexAttribArray(A_VERTEX);
+		glVertexAttribPointer(A_VERTEX, 3, GL_FLOAT, GL_FALSE, spacing, (void*)0);
+		glEnableVertexAttribArray(A_NORMAL);
+		glVertexAttribPointer(A_NORMAL, 3, GL_FLOAT, GL_FALSE, spacing, (void*)sizeof(Vector3f));
+		glEnableVertexAttribArray(A_COORD);
+		glVertexAttribPointer(A_COORD, 2, GL_FLOAT, GL_FALSE, spacing, (void*)(sizeof(Vector3f) * 2));
+	}
+	else
+	{
+		glBindBuffer(GL_ARRAY_BUFFER, vertices_vbo_id);
+		glEnableVertexAttribArray(A_VERTEX);
+		glVertexAttribPointer(A_VERTEX, 3, GL_FLOAT, GL_FALSE, 0, (void*)0);
+		if (normals_vbo_id)
+		{
+			glBindBuffer(GL_ARRAY_BUFFER, normals_vbo_id);
+			glEnableVertexAttribArray(A_NORMAL);
+			glVertexAttribPointer(A_NORMAL, 3, GL_FLOAT, GL_FALSE, 0, (void*)0);
+		}
+		if (uvs_vbo_id)
+		{
+			glBindBuffer(GL_ARRAY_BUFFER, uvs_vbo_id);
+			glEnableVertexAttribArray(A_COORD);
+			glVertexAttribPointer(A_COORD, 2, GL_FLOAT, GL_FALSE, 0, (void*)0);
+		}
+	}
+
+	if (uvs1_vbo_id)
+	{
+		glBindBuffer(GL_ARRAY_BUFFER, uvs1_vbo_id);
+		glEnableVertexAttribArray(A_COORD1);
+		glVertexAttribPointer(A_COORD1, 2, GL_FLOAT, GL_FALSE, 0, (void*)0);
+	}
+	if (colors_vbo_id)
+	{
+		glBindBuffer(GL_ARRAY_BUFFER, colors_vbo_id);
+		glEnableVertexAttribArray(A_COLOR);
+		glVertexAttribPointer(A_COLOR, 4, GL_FLOAT, GL_FALSE, 0, (void*)0);
+	}
+	if (bones_vbo_id)
+	{
+		glBindBuffer(GL_ARRAY_BUFFER, bones_vbo_id);
+		glEnableVertexAttribArray(A_BONES);
+		glVertexAttribPointer(A_BONES, 4, GL_UNSIGNED_BYTE, GL_FALSE, 0, (void*)0);
+	}
+	if (weights_vbo_id)
+	{
+		glBindBuffer(GL_ARRAY_BUFFER, weights_vbo_id);
+		glEnableVertexAttribArray(A_WEIGHTS);
+		glVertexAttribPointer(A_WEIGHTS, 4, GL_FLOAT, GL_FALSE, 0, (void*)0);
+	}
+
+	//the index buffer is part of the VAO state
+	if (indices_vbo_id)
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indices_vbo_id);
+
+	glBindVertexArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	checkGLErrors();
+	return true;
+}
+
+void Mesh::releaseVertexArray()
+{
+	if (vao_id)
+		glDeleteVertexArrays(1, &vao_id);
+	vao_id = 0;
+}
+
 GLuint instances_buffer_id = 0;
 
 //should be faster but in some system it is slower
@@ -507,6 +629,12 @@ void Mesh::renderAnimated( unsigned int primitive, Skeleton* skeleton )
 void Mesh::uploadToVRAM()
 {
 	assert(vertices.size() || interleaved.size());
+	releaseVertexArray(); //the streams may change
+	if (in_arena)
+		MeshArena::instance->remove(arena_range);
+	in_arena = false;
+	if (uploadToArena())
+		return;
 
 	if (glGenBuffersARB == nullptr)
 	{
@@ -598,136 +726,92 @@ void Mesh::uploadToVRAM()
 	//clear buffers to save memory
 }
 
-bool Mesh::createCollisionModel(bool is_static)
+bool Mesh::uploadToArena()
 {
-	if (collision_model)
-		return true;
-
-	double time = getTime();
-	std::cout << "Creating collision model for: " << this->name << " (" << (interleaved.size() ? interleaved.size() : vertices.size()) / 3 << ") ...";
-
-	CollisionModel3D* collision_model = newCollisionModel3D(is_static);
+	//only the streams of the arena
+	if (!interleaved.size() || m_uvs1.size() || colors.size() || bones.size() || weights.size())
+		return false;
+	MeshArena* arena = MeshArena::init();
+	if (!arena)
+		return false;
 
-	if (m_indices.size()) //indexed
+	std::vector<unsigned int> sequential;
+	if (!m_indices.size())
 	{
-		collision_model->setTriangleNumber((int)m_indices.size() / 3);
-
-		if (interleaved.size())
-			for (unsigned int i = 0; i < m_indices.size(); i+=3)
-			{
-				auto v1 = interleaved[m_indices[i+0]];
-				auto v2 = interleaved[m_indices[i+1]];
-				auto v3 = interleaved[m_indices[i+2]];
-				collision_model->addTriangle(v1.vertex.v, v2.vertex.v, v3.vertex.v);
-			}
-		else
-		for (unsigned int i = 0; i < m_indices.size(); i+=3)
-		{
-			auto v1 = vertices[m_indices[i+0]];
-			auto v2 = vertices[m_indices[i+1]];
-			auto v3 = vertices[m_indices[i+2]];
-			collision_model->addTriangle(v1.v, v2.v, v3.v);
-		}
+		sequential.resize(interleaved.size());
+		for (size_t i = 0; i < sequential.size(); ++i)
+			sequential[i] = (unsigned int)i;
 	}
-	else if (interleaved.size()) //is interleaved
-	{
-		collision_model->setTriangleNumber(interleaved.size() / 3);
-		for (unsigned int i = 0; i < interleaved.size(); i+=3)
-		{
-			auto v1 = interleaved[i];
-			auto v2 = interleaved[i+1];
-			auto v3 = interleaved[i+2];
-			collision_model->addTriangle(v1.vertex.v, v2.vertex.v, v3.vertex.v);
-		}
-	}
-	else if (vertices.size()) //non interleaved
-	{
-		collision_model->setTriangleNumber((int)vertices.size() / 3);
-		for (unsigned int i = 0; i < (int)vertices.size(); i+=3)
-		{
-			auto v1 = vertices[i];
-			auto v2 = vertices[i + 1];
-			auto v3 = vertices[i + 2];
-			collision_model->addTriangle(v1.v, v2.v, v3.v);
-		}
-	}
-	else
+	const std::vector<unsigned int>& indices = m_indices.size() ? m_indices : sequential;
+	if (!arena->add(&interleaved[0], interleaved.size(), &indices[0], indices.size(), arena_range))
+		return false; //full, it will have its own buffers
+	in_arena = true;
+	checkGLErrors();
+	return true;
+}
+
+bool Mesh::createBVH()
+{
+	if (bvh)
+		return true;
+	if (!vertices.size() && !interleaved.size())
 	{
-		assert(0 && "mesh without vertices, cannot create collision model");
-		std::cout << "[ERROR]" << std::endl;
+		assert(0 && "mesh without vertices, cannot create BVH");
 		return false;
 	}
-	collision_model->finalize();
-	this->collision_model = collision_model;
-
-	std::cout << "[OK] Time: " << (getTime() - time) * 0.001 << "sec" << std::endl;
 
+	bvh = new MeshBVH();
+	bvh->build(this);
 	return true;
 }
 
 //help: model is the transform of the mesh, ray origin and direction, a Vector3 where to store the collision if found, a Vector3 where to store the normal if there was a collision, max ray distance in case the ray should go to infintiy, and in_object_space to get the collision point in object space or world space
 bool Mesh::testRayCollision(Matrix44 model, Vector3f start, Vector3f front, Vector3f& collision, Vector3f& normal, float max_ray_dist, bool in_object_space )
 {
-	if (!this->collision_model)
+	if (in_object_space)
 	{
-		//test first against bounding before creating collision model
-		BoundingBox aabb = transformBoundingBox(model, box);
-		if (!RayBoundingBoxCollision(aabb, start, front, collision))
-			return false;
-
-		if (!createCollisionModel())
-			return false;
+		Matrix44 inv = model;
+		inv.inverse();
+		start = inv * start;
+		front = inv.rotateVector(front); //not normalized so the distances are the same
+		model.setIdentity();
 	}
 
-	CollisionModel3D* collision_model = (CollisionModel3D*)this->collision_model;
-	assert(collision_model && "CollisionModel3D must be created before using it, call createCollisionModel");
-
-	collision_model->setTransform( model.m );
-	if (collision_model->rayCollision( start.v , front.v, true,0.0, max_ray_dist) == false)
+	sMeshHit hit;
+	if (!testRay(model, start, front, hit, max_ray_dist))
 		return false;
-
-	collision_model->getCollisionPoint( collision.v, in_object_space);
-
-	float t1[9],t2[9];
-	collision_model->getCollidingTriangles(t1,t2, in_object_space);
-
-	Vector3f v1;
-	Vector3f v2;
-	v1=Vector3f(t1[3]-t1[0],t1[4]-t1[1],t1[5]-t1[2]);
-	v2=Vector3f(t1[6]-t1[0],t1[7]-t1[1],t1[8]-t1[2]);
-	v1.normalize();
-	v2.normalize();
-	normal = v1.cross(v2);
-
+	collision = hit.position;
+	normal = hit.normal;
 	return true;
 }
 
-bool Mesh::testSphereCollision(Matrix44 model, Vector3f center, float radius, Vector3f& collision, Vector3f& normal)
+bool Mesh::testRay(const Matrix44& model, const Vector3f& origin, const Vector3f& direction, sMeshHit& hit, float max_ray_dist, bool any_hit)
 {
-	if (!this->collision_model)
-		if (!createCollisionModel())
+	if (!bvh)
+	{
+		//test first against bounding before creating the BVH
+		Vector3f collision;
+		BoundingBox aabb = transformBoundingBox(model, box);
+		if (!RayBoundingBoxCollision(aabb, origin, direction, collision))
 			return false;
 
-	CollisionModel3D* collision_model = (CollisionModel3D*)this->collision_model;
-	assert(collision_model && "CollisionModel3D must be created before using it, call createCollisionModel");
-
-	collision_model->setTransform(model.m);
-	if (collision_model->sphereCollision(center.v, radius) == false)
-		return false;
-
-	collision_model->getCollisionPoint(collision.v, false);
+		if (!createBVH())
+			return false;
+	}
 
-	float t1[9], t2[9];
-	collision_model->getCollidingTriangles(t1, t2, false);
+	return bvh->testRay(model, origin, direction, max_ray_dist, hit, any_hit);
+}
 
-	Vector3f v1;
-	Vector3f v2;
-	v1 = Vector3f(t1[3] - t1[0], t1[4] - t1[1], t1[5] - t1[2]);
-	v2 = Vector3f(t1[6] - t1[0], t1[7] - t1[1], t1[8] - t1[2]);
-	v1.normalize();
-	v2.normalize();
-	normal = v1.cross(v2);
+bool Mesh::testSphereCollision(Matrix44 model, Vector3f center, float radius, Vector3f& collision, Vector3f& normal)
+{
+	if (!bvh && !createBVH())
+		return false;
 
+	sMeshHit hit;
+	if (!bvh->testSphere(model, center, radius, hit))
+		return false;
+	collision = hit.position;
+	normal = hit.normal;
 	return true;
 }
 
@@ -769,7 +853,9 @@ typedef struct
 	int num_submeshes;
 	Matrix44 bind_matrix;
 	char streams[8]; //Vertex/Interlaved|Normal|Uvs|Color|Indices|Bones|Weights|Extra|Uvs1
-	char extra[32]; //unused
+	int num_bvh_nodes; //the BVH goes after the submeshes
+	int num_bvh_packets;
+	char extra[24]; //unused
 } sMeshInfo;
 
 bool Mesh::readBin(const char* filename)
@@ -887,7 +973,13 @@ bool Mesh::readBin(const char* filename)
 	memcpy(&submeshes[0], pos, sizeof(sSubmeshInfo) * info.num_submeshes);
 	pos += sizeof(sSubmeshInfo) * info.num_submeshes;
 
-	createCollisionModel();
+	if (info.num_bvh_nodes)
+	{
+		bvh = new MeshBVH();
+		pos = bvh->readBin(pos, info.num_bvh_nodes, info.num_bvh_packets);
+	}
+	else
+		createBVH();
 	return true;
 }
 
@@ -921,6 +1013,9 @@ bool Mesh::writeBin(const char* filename)
 	info.num_bones = bones_info.size();
 	info.bind_matrix = bind_matrix;
 	info.num_submeshes = submeshes.size();
+	createBVH();
+	info.num_bvh_nodes = (int)bvh->nodes.size();
+	info.num_bvh_packets = (int)bvh->packets.size();
 
 	info.streams[0] = interleaved.size() ? 'I' : 'V';
 	info.streams[1] = normals.size() ? 'N' : ' ';
@@ -962,6 +1057,7 @@ bool Mesh::writeBin(const char* filename)
 		fwrite((void*)&m_uvs1[0], m_uvs1.size() * sizeof(Vector2f), 1, f);
 
 	fwrite((void*)&submeshes[0], submeshes.size() * sizeof(sSubmeshInfo), 1, f);
+	bvh->writeBin(f);
 
 	fclose(f);
 	return true;
@@ -1744,6 +1840,8 @@ Mesh* Mesh::Get(const char* filename, bool skip_load)
 		m->interleaveBuffers();
 	}
 
+	m->createBVH();
+
 	//and upload them to VRAM
 	if (auto_upload_to_vram)
 	{
@@ -1751,7 +1849,10 @@ Mesh* Mesh::Get(const char* filename, bool skip_load)
 		m->uploadToVRAM();
 	}
 
-	std::cout << "[OK]  Faces: " << m->vertices.size() / 3 << " Time: " << (getTime() - time) * 0.001 << "sec" << std::endl;
+	std::cout << "[OK]  Faces: " << m->vertices.size() / 3;
+	if (m->bvh)
+		std::cout << " BVH: " << m->bvh->nodes.size() << " nodes " << m->bvh->packets.size() << " packets";
+	std::cout << " Time: " << (getTime() - time) * 0.001 << "sec" << std::endl;
 	if (use_binary)
 	{
 		std::cout << "\t\t Writing .BIN ... ";
@@ -3,6 +3,7 @@
 
 #include <vector>
 #include "../core/math.h"
+#include "mesharena.h"
 
 #include <map>
 #include <string>
@@ -16,9 +17,11 @@ namespace GFX {
 
 	class Shader; //for binding
 	class Skeleton; //for skinned meshes
+	class MeshBVH; //for collisions
+	struct sMeshHit;
 
 	//version from 11/5/2020
-#define MESH_BIN_VERSION 11 //this is used to regenerate bins if the format changes
+#define MESH_BIN_VERSION 12 //this is used to regenerate bins if the format changes
 
 	struct sSubmeshInfo
 	{
@@ -35,6 +38,7 @@ namespace GFX {
 		static bool use_binary; //always load the binary version of a mesh when possible
 		static bool interleave_meshes; //loaded meshes will me automatically interleaved
 		static bool auto_upload_to_vram; //loaded meshes will be stored in the VRAM
+		static bool use_vertex_arrays; //meshes in VRAM keep their streams in a VAO, a draw is only binding it
 		static long num_meshes_rendered;
 		static long num_triangles_rendered;
 		static uint32 s_last_index;
@@ -82,6 +86,9 @@ namespace GFX {
 		unsigned int bones_vbo_id;
 		unsigned int weights_vbo_id;
 		unsigned int uvs1_vbo_id;
+		unsigned int vao_id; //created in the first render, uses the fixed attribute locations (GFX::eAttribute)
+		bool in_arena; //uploaded to the MeshArena instead of its own VBOs
+		sArenaRange arena_range;
 
 		Mesh();
 		~Mesh();
@@ -97,6 +104,9 @@ namespace GFX {
 		void enableBuffers(Shader* shader);
 		void drawCall(unsigned int primitive, int submesh_id = -1, int num_instances = 0);
 		void disableBuffers(Shader* shader);
+		bool createVertexArray(); //false if some stream is not in VRAM
+		bool uploadToArena(); //false if it cannot be in the arena
+		void releaseVertexArray();
 
 		bool readBin(const char* filename);
 		bool writeBin(const char* filename);
@@ -105,8 +115,9 @@ namespace GFX {
 		unsigned int getNumVertices() { return (unsigned int)interleaved.size() ? (unsigned int)interleaved.size() : (unsigned int)vertices.size(); }
 
 		//collision testing
-		void* collision_model;
-		bool createCollisionModel(bool is_static = false); //is_static sets if the inv matrix should be computed after setTransform (true) or before rayCollision (false)
+		MeshBVH* bvh; //built when loading, stored in the binary files, it is read only so it can be queried from many threads
+		bool createBVH();
+		bool testRay(const Matrix44& model, const Vector3f& origin, const Vector3f& direction, sMeshHit& hit, float max_ray_dist = 3.4e+38F, bool any_hit = false);
 		//help: model is the transform of the mesh, ray origin and direction, a Vector3 where to store the collision if found, a Vector3 where to store the normal if there was a collision, max ray distance in case the ray should go to infintiy, and in_object_space to get the collision point in object space or world space
 		bool testRayCollision(Matrix44 model, Vector3f ray_origin, Vector3f ray_direction, Vector3f& collision, Vector3f& normal, float max_ray_dist = 3.4e+38F, bool in_object_space = false);
 		bool testSphereCollision(Matrix44 model, Vector3f center, float radius, Vector3f& collision, Vector3f& normal);
@@ -0,0 +1,238 @@
+#include "mesharena.h"
+
+#include <iostream>
+#include <cassert>
+#include <vector>
+
+#include "mesh.h"
+#include "shader.h" //eAttribute
+#include "../utils/utils.h"
+
+namespace GFX {
+
+	MeshArena* MeshArena::instance = NULL;
+	bool MeshArena::enabled = true;
+	size_t MeshArena::default_vertices = 256 * 1024; //8MB
+	size_t MeshArena::default_indices = 1024 * 1024; //4MB
+
+	void RangeAllocator::init(size_t capacity)
+	{
+		this->capacity = capacity;
+		used = 0;
+		free_ranges.clear();
+		free_ranges[0] = capacity;
+	}
+
+	void RangeAllocator::grow(size_t new_capacity)
+	{
+		assert(new_capacity > capacity);
+		size_t old_capacity = capacity;
+		capacity = new_capacity;
+		used += new_capacity - old_capacity; //release discounts it
+		release(old_capacity, new_capacity - old_capacity);
+	}
+
+	bool RangeAllocator::allocate(size_t count, size_t& offset)
+	{
+		assert(count);
+		for (auto it = free_ranges.begin(); it != free_ranges.end(); ++it)
+		{
+			if (it->second < count)
+				continue;
+			offset = it->first;
+			size_t remaining = it->second - count;
+			free_ranges.erase(it);
+			if (remaining)
+				free_ranges[offset + count] = remaining;
+			used += count;
+			return true;
+		}
+		return false;
+	}
+
+	void RangeAllocator::release(size_t offset, size_t count)
+	{
+		auto next = free_ranges.lower_bound(offset);
+		assert((next == free_ranges.end() || next->first >= offset + count) && "range already released");
+
+		//merge with the previous and the next
+		if (next != free_ranges.begin())
+		{
+			auto prev = std::prev(next);
+			if (prev->first + prev->second == offset)
+			{
+				offset = prev->first;
+				count += prev->second;
+				free_ranges.erase(prev);
+			}
+		}
+		if (next != free_ranges.end() && next->first == offset + count)
+		{
+			count += next->second;
+			free_ranges.erase(next);
+		}
+		free_ranges[offset] = count;
+		used -= std::min(used, count);
+	}
+
+	MeshArena::MeshArena()
+	{
+		vertices_vbo_id = indices_vbo_id = draw_ids_vbo_id = vao_id = 0;
+		num_meshes = 0;
+	}
+
+	MeshArena::~MeshArena()
+	{
+		if (vao_id)
+			glDeleteVertexArrays(1, &vao_id);
+		GLuint buffers[3] = { vertices_vbo_id, indices_vbo_id, draw_ids_vbo_id };
+		for (GLuint id : buffers)
+			if (id)
+				glDeleteBuffers(1, &id);
+	}
+
+	MeshArena* MeshArena::init()
+	{
+		static bool initialized = false;
+		if (initialized || !enabled)
+			return instance;
+		initialized = true;
+
+		if (!SDL_GL_ExtensionSupported("GL_ARB_draw_elements_base_vertex") || !SDL_GL_ExtensionSupported("GL_ARB_instanced_arrays"))
+		{
+			std::cout << " * Mesh arena not supported (GL_ARB_draw_elements_base_vertex), meshes will use their own buffers" << std::endl;
+			return NULL;
+		}
+
+		MeshArena* arena = new MeshArena();
+		if (!arena->create(default_vertices, default_indices))
+		{
+			delete arena;
+			return NULL;
+		}
+		instance = arena;
+		return instance;
+	}
+
+	//copies the content of a buffer to a new bigger one, the old one is deleted
+	static GLuint resizeBuffer(GLuint id, size_t old_bytes, size_t new_bytes)
+	{
+		GLuint new_id = 0;
+		glGenBuffers(1, &new_id);
+		glBindBuffer(GL_COPY_WRITE_BUFFER, new_id);
+		glBufferData(GL_COPY_WRITE_BUFFER, new_bytes, NULL, GL_STATIC_DRAW);
+		if (id)
+		{
+			glBindBuffer(GL_COPY_READ_BUFFER, id);
+			glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, old_bytes);
+			glBindBuffer(GL_COPY_READ_BUFFER, 0);
+			glDeleteBuffers(1, &id);
+		}
+		glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+		return new_id;
+	}
+
+	bool MeshArena::create(size_t max_vertices, size_t max_indices)
+	{
+		assert(!vao_id && "mesh arena already created");
+		std::vector<int> draw_ids(MAX_ARENA_DRAW_IDS);
+		for (int i = 0; i < MAX_ARENA_DRAW_IDS; ++i)
+			draw_ids[i] = i;
+		glGenBuffers(1, &draw_ids_vbo_id);
+		glBindBuffer(GL_ARRAY_BUFFER, draw_ids_vbo_id);
+		glBufferData(GL_ARRAY_BUFFER, draw_ids.size() * sizeof(int), &draw_ids[0], GL_STATIC_DRAW);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		glGenVertexArrays(1, &vao_id);
+
+		if (!grow(max_vertices, max_indices))
+			return false;
+		std::cout << " + Mesh arena created: " << TermColor::YELLOW << ((vertices.capacity * sizeof(Mesh::tInterleaved) + indices.capacity * sizeof(uint32)) / (1024 * 1024)) << "MB" << TermColor::DEFAULT << std::endl;
+		return true;
+	}
+
+	bool MeshArena::grow(size_t min_vertices, size_t min_indices)
+	{
+		size_t max_vertices = min_vertices > vertices.capacity ? std::max(min_vertices, vertices.capacity * 2) : vertices.capacity;
+		size_t max_indices = min_indices > indices.capacity ? std::max(min_indices, indices.capacity * 2) : indices.capacity;
+		int spacing = sizeof(Mesh::tInterleaved);
+		if (max_vertices != vertices.capacity)
+			vertices_vbo_id = resizeBuffer(vertices_vbo_id, vertices.capacity * spacing, max_vertices * spacing);
+		if (max_indices != indices.capacity)
+			indices_vbo_id = resizeBuffer(indices_vbo_id, indices.capacity * sizeof(uint32), max_indices * sizeof(uint32));
+
+		//the VAO keeps the buffers it was set up with
+		glBindVertexArray(vao_id);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indices_vbo_id);
+		glBindBuffer(GL_ARRAY_BUFFER, vertices_vbo_id);
+		glEnableVertexAttribArray(A_VERTEX);
+		glVertexAttribPointer(A_VERTEX, 3, GL_FLOAT, GL_FALSE, spacing, (void*)0);
+		glEnableVertexAttribArray(A_NORMAL);
+		glVertexAttribPointer(A_NORMAL, 3, GL_FLOAT, GL_FALSE, spacing, (void*)sizeof(Vector3f));
+		glEnableVertexAttribArray(A_COORD);
+		glVertexAttribPointer(A_COORD, 2, GL_FLOAT, GL_FALSE, spacing, (void*)(sizeof(Vector3f) * 2));
+
+		glBindBuffer(GL_ARRAY_BUFFER, draw_ids_vbo_id);
+		glEnableVertexAttribArray(A_DRAW_ID);
+		glVertexAttribIPointer(A_DRAW_ID, 1, GL_INT, 0, (void*)0);
+		glVertexAttribDivisor(A_DRAW_ID, 1);
+
+		glBindVertexArray(0);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+
+		if (glGetError() != GL_NO_ERROR)
+		{
+			std::cout << "[ERROR] Mesh arena could not be allocated" << std::endl;
+			return false;
+		}
+
+		if (vertices.capacity)
+			std::cout << " + Mesh arena grown: " << TermColor::YELLOW << ((max_vertices * spacing + max_indices * sizeof(uint32)) / (1024 * 1024)) << "MB" << TermColor::DEFAULT << std::endl;
+		if (!vertices.capacity)
+			vertices.init(max_vertices);
+		else if (max_vertices != vertices.capacity)
+			vertices.grow(max_vertices);
+		if (!indices.capacity)
+			indices.init(max_indices);
+		else if (max_indices != indices.capacity)
+			indices.grow(max_indices);
+		return true;
+	}
+
+	bool MeshArena::add(const void* vertices_data, size_t num_vertices, const uint32* indices_data, size_t num_indices, sArenaRange& range)
+	{
+		//full (or fragmented), grows with a free range at the end big enough for the mesh
+		if (!vertices.allocate(num_vertices, range.first_vertex))
+		{
+			if (!grow(vertices.capacity + num_vertices, 0) || !vertices.allocate(num_vertices, range.first_vertex))
+				return false;
+		}
+		if (!indices.allocate(num_indices, range.first_index))
+		{
+			if (!grow(0, indices.capacity + num_indices) || !indices.allocate(num_indices, range.first_index))
+			{
+				vertices.release(range.first_vertex, num_vertices);
+				return false;
+			}
+		}
+		range.num_vertices = num_vertices;
+		range.num_indices = num_indices;
+
+		glBindBuffer(GL_ARRAY_BUFFER, vertices_vbo_id);
+		glBufferSubData(GL_ARRAY_BUFFER, range.first_vertex * sizeof(Mesh::tInterleaved), num_vertices * sizeof(Mesh::tInterleaved), vertices_data);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		//not as GL_ELEMENT_ARRAY_BUFFER, that binding is state of the current VAO
+		glBindBuffer(GL_COPY_WRITE_BUFFER, indices_vbo_id);
+		glBufferSubData(GL_COPY_WRITE_BUFFER, range.first_index * sizeof(uint32), num_indices * sizeof(uint32), indices_data);
+		glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+		num_meshes++;
+		return true;
+	}
+
+	void MeshArena::remove(const sArenaRange& range)
+	{
+		vertices.release(range.first_vertex, range.num_vertices);
+		indices.release(range.first_index, range.num_indices);
+		num_meshes--;
+	}
+};
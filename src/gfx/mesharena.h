@@ -0,0 +1,68 @@
+#pragma once
+
+#include "../core/includes.h"
+#include "../core/math.h"
+#include <map>
+
+namespace GFX {
+
+	//first fit allocator of ranges (in elements, not bytes), contiguous free ranges are merged
+	class RangeAllocator
+	{
+	public:
+		size_t capacity;
+		size_t used;
+
+		RangeAllocator() { capacity = used = 0; }
+		void init(size_t capacity);
+		void grow(size_t new_capacity); //the new elements are added at the end as free
+		bool allocate(size_t count, size_t& offset); //false if there is no free range big enough
+		void release(size_t offset, size_t count);
+
+	private:
+		std::map<size_t, size_t> free_ranges; //offset -> count
+	};
+
+	//where a mesh is in the arena
+	struct sArenaRange {
+		size_t first_vertex;
+		size_t num_vertices;
+		size_t first_index;
+		size_t num_indices;
+	};
+
+	//Shared vertex (interleaved, as Mesh::tInterleaved) and index buffers for all the meshes in VRAM,
+	//so every mesh is drawn with the same VAO and buffers (draws only change the ranges) and the
+	//renderer can submit many meshes with one glMultiDrawElementsIndirect.
+	//Meshes with other streams (second uvs, colors, bones) keep their own VBOs.
+	class MeshArena
+	{
+	public:
+		static MeshArena* instance; //NULL if not supported or disabled
+		static bool enabled;
+		static size_t default_vertices; //initial size, the buffers grow when a mesh does not fit
+		static size_t default_indices;
+
+		GLuint vertices_vbo_id;
+		GLuint indices_vbo_id;
+		GLuint draw_ids_vbo_id; //0,1,2... as an instanced attribute, the base instance of a draw selects its id
+		GLuint vao_id;
+		RangeAllocator vertices;
+		RangeAllocator indices;
+		int num_meshes;
+
+		MeshArena();
+		~MeshArena();
+
+		//must be called from the main thread
+		static MeshArena* init();
+		bool create(size_t max_vertices, size_t max_indices);
+		bool grow(size_t min_vertices, size_t min_indices); //reallocates the buffers smaller than asked (at least doubled) keeping the content
+
+		//vertices are tInterleaved, returns false if they do not fit
+		bool add(const void* vertices_data, size_t num_vertices, const uint32* indices_data, size_t num_indices, sArenaRange& range);
+		void remove(const sArenaRange& range);
+	};
+
+	#define MAX_ARENA_DRAW_IDS 65536
+};
@@ -0,0 +1,447 @@
+#include "meshbvh.h"
+
+#include <cassert>
+#include <algorithm>
+
+#include "mesh.h"
+#include "../core/simd.h"
+
+namespace GFX {
+
+	int MeshBVH::max_leaf_triangles = 16;
+
+	#define BVH_BINS 12
+	#define BVH_STACK_SIZE 64
+	#define BVH_MAX_DEPTH (BVH_STACK_SIZE - 2) //a traversal stack never holds more than one node per level plus two children
+	#define BVH_MEDIAN_DEPTH (BVH_MAX_DEPTH - 24) //from here the splits are by the middle, 2^24 leaves fit till the max depth
+
+	struct sBuildTriangle {
+		Vector3f min;
+		Vector3f max;
+		Vector3f center;
+		int id;
+	};
+
+	static void getTriangle(const Mesh* mesh, int index, Vector3f* v)
+	{
+		for (int i = 0; i < 3; ++i)
+		{
+			unsigned int vertex = mesh->m_indices.size() ? mesh->m_indices[index * 3 + i] : index * 3 + i;
+			v[i] = mesh->interleaved.size() ? mesh->interleaved[vertex].vertex : mesh->vertices[vertex];
+		}
+	}
+
+	static float getArea(const Vector3f& min, const Vector3f& max)
+	{
+		Vector3f size = max - min;
+		return size.x * size.y + size.y * size.z + size.z * size.x;
+	}
+
+	static void growBounds(Vector3f& min, Vector3f& max, const Vector3f& p_min, const Vector3f& p_max)
+	{
+		min.set(std::min(min.x, p_min.x), std::min(min.y, p_min.y), std::min(min.z, p_min.z));
+		max.set(std::max(max.x, p_max.x), std::max(max.y, p_max.y), std::max(max.z, p_max.z));
+	}
+
+	//closest point of the triangle abc to p as barycentric coordinates of b and c (Ericson, Real-Time Collision Detection 5.1.5)
+	static void closestPointInTriangle(const Vector3f& p, const Vector3f& a, const Vector3f& b, const Vector3f& c, float& u, float& v)
+	{
+		Vector3f ab = b - a, ac = c - a, ap = p - a;
+		float d1 = dot(ab, ap), d2 = dot(ac, ap);
+		if (d1 <= 0.0f && d2 <= 0.0f) { u = 0.0f; v = 0.0f; return; }
+		Vector3f bp = p - b;
+		float d3 = dot(ab, bp), d4 = dot(ac, bp);
+		if (d3 >= 0.0f && d4 <= d3) { u = 1.0f; v = 0.0f; return; }
+		float vc = d1 * d4 - d3 * d2;
+		if (vc <= 0.0f && d1 >= 0.0f && d3 <= 0.0f) { u = d1 / (d1 - d3); v = 0.0f; return; }
+		Vector3f cp = p - c;
+		float d5 = dot(ab, cp), d6 = dot(ac, cp);
+		if (d6 >= 0.0f && d5 <= d6) { u = 0.0f; v = 1.0f; return; }
+		float vb = d5 * d2 - d1 * d6;
+		if (vb <= 0.0f && d2 >= 0.0f && d6 <= 0.0f) { u = 0.0f; v = d2 / (d2 - d6); return; }
+		float va = d3 * d6 - d5 * d4;
+		if (va <= 0.0f && (d4 - d3) >= 0.0f && (d5 - d6) >= 0.0f)
+		{
+			float w = (d4 - d3) / ((d4 - d3) + (d5 - d6));
+			u = 1.0f - w;
+			v = w;
+			return;
+		}
+		float denom = 1.0f / (va + vb + vc);
+		u = vb * denom;
+		v = vc * denom;
+	}
+
+	//the packet triangle in the space of the model
+	static void getPacketTriangle(const MeshBVH::sTrianglePacket& packet, int lane, const Matrix44& model, Vector3f* v)
+	{
+		Vector3f v0(packet.v0[0][lane], packet.v0[1][lane], packet.v0[2][lane]);
+		v[0] = model * v0;
+		v[1] = model * (v0 + Vector3f(packet.e1[0][lane], packet.e1[1][lane], packet.e1[2][lane]));
+		v[2] = model * (v0 + Vector3f(packet.e2[0][lane], packet.e2[1][lane], packet.e2[2][lane]));
+	}
+
+	static void fillHit(const MeshBVH::sTrianglePacket& packet, int lane, const Matrix44& model, float u, float v, sMeshHit& hit)
+	{
+		Vector3f t[3];
+		getPacketTriangle(packet, lane, model, t);
+		hit.triangle = packet.ids[lane];
+		hit.u = u;
+		hit.v = v;
+		hit.position = t[0] + (t[1] - t[0]) * u + (t[2] - t[0]) * v;
+		hit.normal = (t[1] - t[0]).cross(t[2] - t[0]);
+		hit.normal.normalize();
+	}
+
+	void MeshBVH::build(const Mesh* mesh)
+	{
+		nodes.clear();
+		packets.clear();
+
+		int num_triangles = (int)(mesh->m_indices.size() ? mesh->m_indices.size() : (mesh->interleaved.size() ? mesh->interleaved.size() : mesh->vertices.size())) / 3;
+		if (!num_triangles)
+			return;
+
+		std::vector<sBuildTriangle> triangles(num_triangles);
+		for (int i = 0; i < num_triangles; ++i)
+		{
+			Vector3f v[3];
+			getTriangle(mesh, i, v);
+			sBuildTriangle& t = triangles[i];
+			t.min = t.max = v[0];
+			growBounds(t.min, t.max, v[1], v[1]);
+			growBounds(t.min, t.max, v[2], v[2]);
+			t.center = (t.min + t.max) * 0.5f;
+			t.id = i;
+		}
+
+		//nodes are split from the root, children are created in pairs
+		struct sRange { int node; int begin; int end; int depth; };
+		std::vector<sRange> pending;
+		nodes.resize(1);
+		pending.push_back({ 0, 0, num_triangles, 0 });
+		std::vector<int> leaf_triangles(num_triangles);
+		while (pending.size())
+		{
+			sRange range = pending.back();
+			pending.pop_back();
+			int count = range.end - range.begin;
+
+			Vector3f min(3.4e+38F, 3.4e+38F, 3.4e+38F), max(-3.4e+38F, -3.4e+38F, -3.4e+38F);
+			Vector3f center_min = min, center_max = max;
+			for (int i = range.begin; i < range.end; ++i)
+			{
+				growBounds(min, max, triangles[i].min, triangles[i].max);
+				growBounds(center_min, center_max, triangles[i].center, triangles[i].center);
+			}
+			nodes[range.node].min = min;
+			nodes[range.node].max = max;
+
+			//best split of the binned centers in the three axis
+			int best_axis = -1, best_bin = 0;
+			float best_cost = (float)count; //cost of the leaf, traversal is considered free
+			if (count > 4 && range.depth < BVH_MEDIAN_DEPTH) //an unbalanced chain of splits must not get too deep
+				for (int axis = 0; axis < 3; ++axis)
+				{
+					float extent = center_max.v[axis] - center_min.v[axis];
+					if (extent <= 0.0f)
+						continue;
+					Vector3f bin_min[BVH_BINS], bin_max[BVH_BINS];
+					int bin_count[BVH_BINS] = { 0 };
+					for (int b = 0; b < BVH_BINS; ++b)
+					{
+						bin_min[b].set(3.4e+38F, 3.4e+38F, 3.4e+38F);
+						bin_max[b].set(-3.4e+38F, -3.4e+38F, -3.4e+38F);
+					}
+					float scale = BVH_BINS / extent;
+					for (int i = range.begin; i < range.end; ++i)
+					{
+						int b = std::min(BVH_BINS - 1, (int)((triangles[i].center.v[axis] - center_min.v[axis]) * scale));
+						bin_count[b]++;
+						growBounds(bin_min[b], bin_max[b], triangles[i].min, triangles[i].max);
+					}
+
+					//sweep from the right storing the cost of every right side, then from the left
+					float right_cost[BVH_BINS];
+					Vector3f rmin = bin_min[BVH_BINS - 1], rmax = bin_max[BVH_BINS - 1];
+					int rcount = 0;
+					for (int b = BVH_BINS - 1; b > 0; --b)
+					{
+						growBounds(rmin, rmax, bin_min[b], bin_max[b]);
+						rcount += bin_count[b];
+						right_cost[b] = rcount ? getArea(rmin, rmax) * rcount : 0.0f;
+					}
+					Vector3f lmin = bin_min[0], lmax = bin_max[0];
+					int lcount = 0;
+					float inv_area = 1.0f / std::max(getArea(min, max), 1e-20f);
+					for (int b = 0; b < BVH_BINS - 1; ++b)
+					{
+						growBounds(lmin, lmax, bin_min[b], bin_max[b]);
+						lcount += bin_count[b];
+						if (!lcount || lcount == count)
+							continue;
+						float cost = 0.5f + (getArea(lmin, lmax) * lcount + right_cost[b + 1]) * inv_area;
+						if (cost < best_cost)
+						{
+							best_cost = cost;
+							best_axis = axis;
+							best_bin = b;
+						}
+					}
+				}
+
+			//split, by the middle if there is no good split and it is too big for a leaf
+			int middle = -1;
+			if (best_axis != -1)
+			{
+				float extent = center_max.v[best_axis] - center_min.v[best_axis];
+				float scale = BVH_BINS / extent;
+				sBuildTriangle* split = std::partition(&triangles[range.begin], &triangles[0] + range.end, [&](const sBuildTriangle& t) {
+					return std::min(BVH_BINS - 1, (int)((t.center.v[best_axis] - center_min.v[best_axis]) * scale)) <= best_bin;
+				});
+				middle = (int)(split - &triangles[0]);
+			}
+			else if (count > max_leaf_triangles && range.depth < BVH_MAX_DEPTH)
+				middle = range.begin + count / 2;
+
+			if (middle == -1)
+			{
+				//leaf, packets of four
+				sNode& node = nodes[range.node];
+				node.first = (uint32)packets.size();
+				node.count = (uint32)(count + 3) / 4;
+				for (int i = range.begin; i < range.end; i += 4)
+				{
+					sTrianglePacket packet;
+					memset(&packet, 0, sizeof(packet));
+					for (int lane = 0; lane < 4; ++lane)
+					{
+						packet.ids[lane] = -1;
+						if (i + lane >= range.end)
+							continue;
+						Vector3f v[3];
+						getTriangle(mesh, triangles[i + lane].id, v);
+						for (int c = 0; c < 3; ++c)
+						{
+							packet.v0[c][lane] = v[0].v[c];
+							packet.e1[c][lane] = v[1].v[c] - v[0].v[c];
+							packet.e2[c][lane] = v[2].v[c] - v[0].v[c];
+						}
+						packet.ids[lane] = triangles[i + lane].id;
+					}
+					packets.push_back(packet);
+				}
+				continue;
+			}
+
+			int first = (int)nodes.size();
+			nodes.resize(first + 2);
+			nodes[range.node].first = first;
+			nodes[range.node].count = 0;
+			pending.push_back({ first, range.begin, middle, range.depth + 1 });
+			pending.push_back({ first + 1, middle, range.end, range.depth + 1 });
+		}
+	}
+
+	size_t MeshBVH::getBytes() const
+	{
+		return nodes.size() * sizeof(sNode) + packets.size() * sizeof(sTrianglePacket);
+	}
+
+	//slabs of the three axis at once, returns the entry distance
+	static inline bool rayBox(const MeshBVH::sNode& node, const simd4& origin, const simd4& inv_dir, float max_dist, float& t_near)
+	{
+		const simd4 xyz = simd4(0.0f) < simd4(1.0f, 1.0f, 1.0f, 0.0f); //fourth lane is not a coordinate
+		simd4 t0 = (select(xyz, simd4::load(node.min.v), origin) - origin) * inv_dir;
+		simd4 t1 = (select(xyz, simd4::load(node.max.v), origin) - origin) * inv_dir;
+		float lo[4], hi[4];
+		min(t0, t1).store(lo); //the fourth lane is 0, the start of the ray
+		select(xyz, max(t0, t1), simd4(max_dist)).store(hi);
+		t_near = std::max(std::max(lo[0], lo[1]), std::max(lo[2], lo[3]));
+		float t_far = std::min(std::min(hi[0], hi[1]), std::min(hi[2], hi[3]));
+		return t_near <= t_far;
+	}
+
+	bool MeshBVH::testRay(const Matrix44& model, const Vector3f& world_origin, const Vector3f& world_direction, float max_dist, sMeshHit& hit, bool any_hit) const
+	{
+		if (nodes.empty())
+			return false;
+		Matrix44 inv = model;
+		inv.inverse();
+		return testRay(model, inv, world_origin, world_direction, max_dist, hit, any_hit);
+	}
+
+	bool MeshBVH::testRay(const Matrix44& model, const Matrix44& inv_model, const Vector3f& world_origin, const Vector3f& world_direction, float max_dist, sMeshHit& hit, bool any_hit) const
+	{
+		if (nodes.empty())
+			return false;
+
+		//the ray in object space, distances are the same in both
+		Vector3f o = inv_model * world_origin;
+		Vector3f d = inv_model.rotateVector(world_direction);
+		simd4 origin(o.x, o.y, o.z, 0.0f);
+		simd4 inv_dir(1.0f / d.x, 1.0f / d.y, 1.0f / d.z, 1.0f);
+		simd4 ox(o.x), oy(o.y), oz(o.z), dx(d.x), dy(d.y), dz(d.z);
+		simd4 zero(0.0f), one(1.0f), epsilon(1e-16f);
+
+		float best = max_dist;
+		const sTrianglePacket* best_packet = NULL;
+		int best_lane = 0;
+		float best_u = 0.0f, best_v = 0.0f;
+
+		int stack[BVH_STACK_SIZE];
+		int stack_size = 0;
+		float t_near;
+		if (!rayBox(nodes[0], origin, inv_dir, best, t_near))
+			return false;
+		stack[stack_size++] = 0;
+		while (stack_size)
+		{
+			const sNode& node = nodes[stack[--stack_size]];
+			if (node.count)
+			{
+				for (uint32 i = 0; i < node.count; ++i)
+				{
+					//Moller-Trumbore of four triangles
+					const sTrianglePacket& packet = packets[node.first + i];
+					simd4 e1x = simd4::load(packet.e1[0]), e1y = simd4::load(packet.e1[1]), e1z = simd4::load(packet.e1[2]);
+					simd4 e2x = simd4::load(packet.e2[0]), e2y = simd4::load(packet.e2[1]), e2z = simd4::load(packet.e2[2]);
+					simd4 px = dy * e2z - dz * e2y, py = dz * e2x - dx * e2z, pz = dx * e2y - dy * e2x;
+					simd4 det = e1x * px + e1y * py + e1z * pz;
+					simd4 inv_det = one / det;
+					simd4 sx = ox - simd4::load(packet.v0[0]), sy = oy - simd4::load(packet.v0[1]), sz = oz - simd4::load(packet.v0[2]);
+					simd4 u = (sx * px + sy * py + sz * pz) * inv_det;
+					simd4 qx = sy * e1z - sz * e1y, qy = sz * e1x - sx * e1z, qz = sx * e1y - sy * e1x;
+					simd4 v = (dx * qx + dy * qy + dz * qz) * inv_det;
+					simd4 t = (e2x * qx + e2y * qy + e2z * qz) * inv_det;
+					simd4 valid = (epsilon < det * det) & (zero <= u) & (zero <= v) & ((u + v) <= one) & (zero < t) & (t < simd4(best));
+					int mask = valid.getMask();
+					if (!mask)
+						continue;
+					for (int lane = 0; lane < 4; ++lane)
+						if ((mask & (1 << lane)) && t[lane] < best)
+						{
+							best = t[lane];
+							best_packet = &packet;
+							best_lane = lane;
+							best_u = u[lane];
+							best_v = v[lane];
+						}
+					if (any_hit)
+						break;
+				}
+				if (any_hit && best_packet)
+					break;
+				continue;
+			}
+
+			//nearest child first
+			float t_a, t_b;
+			bool hit_a = rayBox(nodes[node.first], origin, inv_dir, best, t_a);
+			bool hit_b = rayBox(nodes[node.first + 1], origin, inv_dir, best, t_b);
+			assert(stack_size + 2 <= BVH_STACK_SIZE);
+			if (hit_a && hit_b)
+			{
+				stack[stack_size++] = t_a < t_b ? node.first + 1 : node.first;
+				stack[stack_size++] = t_a < t_b ? node.first : node.first + 1;
+			}
+			else if (hit_a)
+				stack[stack_size++] = node.first;
+			else if (hit_b)
+				stack[stack_size++] = node.first + 1;
+		}
+
+		if (!best_packet)
+			return false;
+		fillHit(*best_packet, best_lane, model, best_u, best_v, hit);
+		hit.distance = best;
+		hit.position = world_origin + world_direction * best; //more precise than interpolating the triangle
+		return true;
+	}
+
+	bool MeshBVH::getClosestPoint(const Matrix44& model, const Vector3f& point, sMeshHit& hit, float max_dist) const
+	{
+		if (nodes.empty())
+			return false;
+
+		//boxes are tested in object space, a distance there is at least min_scale times that distance in world space
+		Matrix44 inv = model;
+		inv.inverse();
+		Vector3f p = inv * point;
+		float min_scale = std::min(std::min(model.rotateVector(Vector3f(1, 0, 0)).length(), model.rotateVector(Vector3f(0, 1, 0)).length()), model.rotateVector(Vector3f(0, 0, 1)).length());
+		auto boxDistance = [&](const sNode& node) {
+			Vector3f delta(std::max(std::max(node.min.x - p.x, p.x - node.max.x), 0.0f),
+				std::max(std::max(node.min.y - p.y, p.y - node.max.y), 0.0f),
+				std::max(std::max(node.min.z - p.z, p.z - node.max.z), 0.0f));
+			return delta.length() * min_scale;
+		};
+
+		float best = max_dist;
+		bool found = false;
+		int stack[BVH_STACK_SIZE];
+		int stack_size = 0;
+		stack[stack_size++] = 0;
+		while (stack_size)
+		{
+			const sNode& node = nodes[stack[--stack_size]];
+			if (boxDistance(node) > best)
+				continue;
+			if (node.count)
+			{
+				for (uint32 i = 0; i < node.count; ++i)
+				{
+					const sTrianglePacket& packet = packets[node.first + i];
+					for (int lane = 0; lane < 4 && packet.ids[lane] != -1; ++lane)
+					{
+						Vector3f t[3];
+						float u, v;
+						getPacketTriangle(packet, lane, model, t);
+						closestPointInTriangle(point, t[0], t[1], t[2], u, v);
+						float dist = (t[0] + (t[1] - t[0]) * u + (t[2] - t[0]) * v).distance(point);
+						if (dist > best)
+							continue;
+						best = dist;
+						found = true;
+						fillHit(packet, lane, model, u, v, hit);
+						hit.distance = dist;
+					}
+				}
+				continue;
+			}
+
+			//nearest child last so it is visited first
+			assert(stack_size + 2 <= BVH_STACK_SIZE);
+			bool a_first = boxDistance(nodes[node.first]) < boxDistance(nodes[node.first + 1]);
+			stack[stack_size++] = a_first ? node.first + 1 : node.first;
+			stack[stack_size++] = a_first ? node.first : node.first + 1;
+		}
+		return found;
+	}
+
+	bool MeshBVH::testSphere(const Matrix44& model, const Vector3f& center, float radius, sMeshHit& hit) const
+	{
+		return getClosestPoint(model, center, hit, radius);
+	}
+
+	void MeshBVH::writeBin(FILE* f) const
+	{
+		if (nodes.size())
+			fwrite(&nodes[0], sizeof(sNode) * nodes.size(), 1, f);
+		if (packets.size())
+			fwrite(&packets[0], sizeof(sTrianglePacket) * packets.size(), 1, f);
+	}
+
+	char* MeshBVH::readBin(char* pos, int num_nodes, int num_packets)
+	{
+		nodes.resize(num_nodes);
+		packets.resize(num_packets);
+		if (num_nodes)
+			memcpy(&nodes[0], pos, sizeof(sNode) * num_nodes);
+		pos += sizeof(sNode) * num_nodes;
+		if (num_packets)
+			memcpy(&packets[0], pos, sizeof(sTrianglePacket) * num_packets);
+		pos += sizeof(sTrianglePacket) * num_packets;
+		return pos;
+	}
+
+};
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <vector>
+#include <cstdio>
+#include "../core/math.h"
+
+//Bounding volume hierarchy of the triangles of a mesh, built with the surface area heuristic.
+//Leaves store their triangles in packets of four (vertex and edges per component) so a ray is tested against
+//four triangles at once with SIMD. It is never modified by the queries, they take the transform of the mesh
+//as a parameter so any number of threads can query the same mesh.
+
+namespace GFX {
+
+	class Mesh;
+
+	//result of a query, in world space
+	struct sMeshHit {
+		float distance; //rays: in units of the ray direction
+		Vector3f position;
+		Vector3f normal; //of the triangle, normalized
+		int triangle; //index of the triangle in the mesh
+		float u, v; //barycentric coordinates of the second and third vertex of the triangle
+	};
+
+	class MeshBVH {
+	public:
+		struct sNode {
+			Vector3f min;
+			uint32 first; //first child (the second is next to it) or first packet in leaves
+			Vector3f max;
+			uint32 count; //packets of a leaf, 0 for inner nodes
+		};
+
+		//unused triangles have id -1 and zero edges
+		struct sTrianglePacket {
+			float v0[3][4];
+			float e1[3][4];
+			float e2[3][4];
+			int32 ids[4];
+		};
+
+		std::vector<sNode> nodes; //first one is the root
+		std::vector<sTrianglePacket> packets;
+
+		static int max_leaf_triangles; //leaves always split above this
+
+		void build(const Mesh* mesh);
+		bool isEmpty() const { return nodes.empty(); }
+		size_t getBytes() const;
+
+		//closest hit of the ray from origin along direction up to max_dist (in units of direction), any_hit stops at the first one found
+		bool testRay(const Matrix44& model, const Vector3f& origin, const Vector3f& direction, float max_dist, sMeshHit& hit, bool any_hit = false) const;
+		//same with the inverse of the model precomputed, for many rays against the same instance
+		bool testRay(const Matrix44& model, const Matrix44& inv_model, const Vector3f& origin, const Vector3f& direction, float max_dist, sMeshHit& hit, bool any_hit = false) const;
+		//point of the mesh closest to the center if it is inside the sphere
+		bool testSphere(const Matrix44& model, const Vector3f& center, float radius, sMeshHit& hit) const;
+		//point of the mesh closest to a point, max_dist limits the search
+		bool getClosestPoint(const Matrix44& model, const Vector3f& point, sMeshHit& hit, float max_dist = 3.4e+38F) const;
+
+		//stored after the streams in the binary files
+		void writeBin(FILE* f) const;
+		char* readBin(char* pos, int num_nodes, int num_packets); //returns the position after it
+	};
+
+};
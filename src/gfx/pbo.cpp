@@ -0,0 +1,235 @@
+#include "pbo.h"
+
+#include <iostream>
+#include <cassert>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+
+#include "texture.h" //isPowerOfTwo, downsampleImage
+#include "../utils/utils.h"
+
+namespace GFX {
+
+	PBORing* PBORing::instance = NULL;
+	size_t PBORing::default_size = 64 * 1024 * 1024;
+
+	//offsets must be aligned to be used by glTexImage
+	#define PBO_ALIGNMENT 256
+
+	PBORing::PBORing()
+	{
+		buffer_id = 0;
+		size = 0;
+		mapped = NULL;
+		used = 0;
+		failed_allocations = 0;
+		head = 0;
+	}
+
+	PBORing::~PBORing()
+	{
+		for (auto& region : regions)
+			if (region.fence)
+				glDeleteSync(region.fence);
+		if (buffer_id)
+		{
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer_id);
+			glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+			glDeleteBuffers(1, &buffer_id);
+		}
+	}
+
+	PBORing* PBORing::init()
+	{
+		static bool initialized = false;
+		if (initialized)
+			return instance;
+		initialized = true;
+
+		if (!SDL_GL_ExtensionSupported("GL_ARB_buffer_storage"))
+		{
+			std::cout << " * PBO ring not supported (GL_ARB_buffer_storage), textures will be uploaded from RAM" << std::endl;
+			return NULL;
+		}
+
+		PBORing* ring = new PBORing();
+		if (!ring->create(default_size))
+		{
+			delete ring;
+			return NULL;
+		}
+		instance = ring;
+		return instance;
+	}
+
+	bool PBORing::create(size_t size)
+	{
+		assert(!buffer_id && "PBO ring already created");
+		GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		glGenBuffers(1, &buffer_id);
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer_id);
+		glBufferStorage(GL_PIXEL_UNPACK_BUFFER, size, NULL, flags);
+		mapped = (uint8*)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, flags);
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		if (!mapped)
+		{
+			std::cout << "[ERROR] PBO ring could not be mapped" << std::endl;
+			glDeleteBuffers(1, &buffer_id);
+			buffer_id = 0;
+			return false;
+		}
+		this->size = size;
+		std::cout << " + PBO ring created: " << TermColor::YELLOW << (size / (1024 * 1024)) << "MB" << TermColor::DEFAULT << std::endl;
+		return true;
+	}
+
+	uint8* PBORing::allocate(size_t bytes, size_t& offset)
+	{
+		bytes = (bytes + PBO_ALIGNMENT - 1) & ~(size_t)(PBO_ALIGNMENT - 1);
+		const std::lock_guard<std::mutex> lock(mutex);
+
+		if (regions.empty())
+			head = 0;
+
+		//free space is [head,size) + [0,tail) or [head,tail) once it wrapped
+		size_t tail = regions.empty() ? 0 : regions.front().offset;
+		bool full = !regions.empty() && head == tail;
+		size_t start = size; //invalid
+		if (!full)
+		{
+			if (head >= tail)
+			{
+				if (head + bytes <= size)
+					start = head;
+				else if (bytes < tail) //wrap
+					start = 0;
+			}
+			else if (head + bytes < tail)
+				start = head;
+		}
+
+		if (start == size)
+		{
+			failed_allocations++;
+			return NULL;
+		}
+
+		sRegion region;
+		region.offset = start;
+		region.size = bytes;
+		region.fence = NULL;
+		region.done = false;
+		regions.push_back(region);
+		head = start + bytes;
+		if (head == size)
+			head = 0;
+		used += bytes;
+		offset = start;
+		return mapped + start;
+	}
+
+	PBORing::sRegion* PBORing::findRegion(size_t offset)
+	{
+		for (auto& region : regions)
+			if (region.offset == offset && !region.done)
+				return &region;
+		return NULL;
+	}
+
+	void PBORing::cancel(size_t offset)
+	{
+		const std::lock_guard<std::mutex> lock(mutex);
+		sRegion* region = findRegion(offset);
+		assert(region && "PBO region not found");
+		if (region)
+			region->done = true;
+	}
+
+	void PBORing::submit(size_t offset)
+	{
+		const std::lock_guard<std::mutex> lock(mutex);
+		sRegion* region = findRegion(offset);
+		assert(region && "PBO region not found");
+		if (!region)
+			return;
+		region->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		region->done = true;
+	}
+
+	void PBORing::update()
+	{
+		const std::lock_guard<std::mutex> lock(mutex);
+		while (!regions.empty())
+		{
+			sRegion& region = regions.front();
+			if (!region.done)
+				break;
+			if (region.fence)
+			{
+				//do not wait, just check
+				GLenum result = glClientWaitSync(region.fence, 0, 0);
+				if (result != GL_ALREADY_SIGNALED && result != GL_CONDITION_SATISFIED)
+					break;
+				glDeleteSync(region.fence);
+			}
+			used -= region.size;
+			regions.pop_front();
+		}
+	}
+
+	bool writeImageToPBO(const uint8* data, int width, int height, int num_channels, bool mipmaps, sPBOUpload& upload)
+	{
+		PBORing* ring = PBORing::instance;
+		if (!ring)
+			return false;
+
+		mipmaps = mipmaps && isPowerOfTwo(width) && isPowerOfTwo(height);
+
+		//compute size of all levels
+		upload.width = width;
+		upload.height = height;
+		upload.num_channels = num_channels;
+		upload.num_levels = 0;
+		size_t total = 0;
+		int w = width, h = height;
+		while (upload.num_levels < MAX_PBO_UPLOAD_LEVELS)
+		{
+			upload.level_offsets[upload.num_levels++] = total;
+			total += w * h * num_channels;
+			total = (total + 3) & ~(size_t)3; //default rows are 4 bytes aligned, keep levels aligned too
+			if (!mipmaps || (w == 1 && h == 1))
+				break;
+			w = std::max(1, w >> 1);
+			h = std::max(1, h >> 1);
+		}
+
+		uint8* dst = ring->allocate(total, upload.offset);
+		if (!dst)
+			return false;
+		upload.size = total;
+
+		//the mapped memory is write combined, reading from it is slow so mipmaps are built from the previous level in the source
+		memcpy(dst, data, width * height * num_channels);
+		if (upload.num_levels > 1)
+		{
+			std::vector<uint8> levels(upload.level_offsets[upload.num_levels - 1] - upload.level_offsets[1] + num_channels);
+			const uint8* src = data;
+			w = width; h = height;
+			for (int i = 1; i < upload.num_levels; ++i)
+			{
+				uint8* level = &levels[upload.level_offsets[i] - upload.level_offsets[1]];
+				downsampleImage(src, w, h, num_channels, level);
+				w = std::max(1, w >> 1);
+				h = std::max(1, h >> 1);
+				memcpy(dst + upload.level_offsets[i], level, w * h * num_channels);
+				src = level;
+			}
+		}
+
+		for (int i = 0; i < upload.num_levels; ++i)
+			upload.level_offsets[i] += upload.offset;
+		return true;
+	}
+};
@@ -0,0 +1,69 @@
+#pragma once
+
+#include "../core/includes.h"
+#include "../core/math.h"
+#include <deque>
+#include <mutex>
+#include <atomic>
+
+namespace GFX {
+
+	#define MAX_PBO_UPLOAD_LEVELS 16
+
+	//info about an image written in the ring, ready to be copied to a texture
+	struct sPBOUpload {
+		size_t offset; //start of the allocation in the ring
+		size_t size;
+		int width;
+		int height;
+		int num_channels;
+		int num_levels; //mipmaps included
+		size_t level_offsets[MAX_PBO_UPLOAD_LEVELS]; //in the ring
+	};
+
+	//Ring of memory in a GL_PIXEL_UNPACK_BUFFER persistently mapped, so background threads can write
+	//pixels directly in upload memory and the main thread only issues the buffer to texture copy.
+	//Allocations are released in order once the fence of its copy has been signaled.
+	class PBORing
+	{
+	public:
+		static PBORing* instance; //NULL if not supported (no GL_ARB_buffer_storage)
+		static size_t default_size;
+
+		GLuint buffer_id;
+		size_t size;
+		uint8* mapped;
+
+		//stats
+		std::atomic<size_t> used;
+		std::atomic<size_t> failed_allocations;
+
+		PBORing();
+		~PBORing();
+
+		//must be called from the main thread
+		static PBORing* init();
+		bool create(size_t size);
+		void submit(size_t offset); //the copy of that allocation has been issued
+		void update(); //releases the regions the GPU has finished with
+
+		//thread safe, returns NULL if there is no room (use RAM instead)
+		uint8* allocate(size_t size, size_t& offset);
+		void cancel(size_t offset); //allocation not used
+
+	private:
+		struct sRegion {
+			size_t offset;
+			size_t size;
+			GLsync fence;
+			bool done; //submitted or canceled
+		};
+		std::deque<sRegion> regions; //by allocation order
+		size_t head;
+		std::mutex mutex;
+		sRegion* findRegion(size_t offset);
+	};
+
+	//writes the image (and its mipmaps if num_levels > 1) in the ring, returns false if it doesnt fit
+	bool writeImageToPBO(const uint8* data, int width, int height, int num_channels, bool mipmaps, sPBOUpload& upload);
+};
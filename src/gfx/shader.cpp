@@ -65,13 +65,113 @@ bool Shader::s_ready = false;
 Shader* Shader::current = NULL;
 std::vector<char> Shader::lines_with_error;
 
+const char* uniform_names[NUM_UNIFORMS] = {
+	"u_model",
+	"u_viewprojection",
+	"u_camera_position",
+	"u_camera_nearfar",
+	"u_time",
+	"u_color",
+	"u_texture",
+	"u_alpha_cutoff",
+	"u_albedo_texture",
+	"u_emissive_texture",
+	"u_metalic_roughness_texture",
+	"u_normalmap",
+	"u_shadowmap",
+	"u_material_index",
+	"u_base_pass",
+	"u_bones",
+	"u_lightmap",
+	"u_irradiance_texture",
+	"u_reflection_texture",
+	"u_reflection_max_lod"
+};
+
+const char* uniform_block_names[NUM_UNIFORM_BLOCKS] = {
+	NULL,
+	"FrameBlock",
+	"LightBlock",
+	"LightsBlock",
+	"MaterialBlock",
+	"BonesBlock"
+};
+
+const char* attribute_names[NUM_ATTRIBUTES] = {
+	"a_vertex",
+	"a_normal",
+	"a_coord",
+	"a_coord1",
+	"a_color",
+	"a_bones",
+	"a_weights",
+	"a_draw_id"
+};
+
+bool Shader::use_binary_cache = true;
+
+//program binary cache
+#define SHADER_CACHE_VERSION 1
+
+struct sProgramBinary {
+	GLenum format;
+	std::vector<uint8> data;
+	bool used; //only the used ones are saved again
+};
+static std::map<uint64, sProgramBinary> s_program_binaries;
+static std::string s_binary_cache_filename;
+static bool s_binary_cache_dirty = false;
+
+#ifndef GL_COMPLETION_STATUS_KHR
+	#define GL_COMPLETION_STATUS_KHR 0x91B1
+#endif
+static bool s_parallel_compile = false;
+
+//FNV-1a
+static uint64 hashString(const std::string& str, uint64 hash = 14695981039346656037ULL)
+{
+	for (unsigned char c : str)
+		hash = (hash ^ c) * 1099511628211ULL;
+	return hash;
+}
+
+static uint64 getDriverHash()
+{
+	std::string driver;
+	GLenum names[] = { GL_VENDOR, GL_RENDERER, GL_VERSION };
+	for (GLenum name : names)
+	{
+		const char* str = (const char*)glGetString(name);
+		driver += str ? str : "";
+	}
+	return hashString(driver);
+}
+
+static bool isProgramBinarySupported()
+{
+	static int supported = -1;
+	if (supported == -1)
+	{
+		GLint num_formats = 0;
+		if (SDL_GL_ExtensionSupported("GL_ARB_get_program_binary"))
+			glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &num_formats);
+		supported = num_formats > 0;
+	}
+	return supported == 1;
+}
+
 Shader::Shader()
 {
 	if(!Shader::s_ready)
 		Shader::init();
 	program = vs = fs = cs = 0;
 	compiled = false;
+	compiling = false;
 	from_atlas = false;
+	from_binary = false;
+	source_hash = 0;
+	for (int i = 0; i < NUM_UNIFORMS; ++i)
+		uniform_locations[i] = -1;
 
 }
 
@@ -203,48 +303,240 @@ bool Shader::compileFromMemory(const std::string& vsm, const std::string& psm)
 		exit(0);
 	}
 
+	return beginCompile(vsm, psm) && endCompile();
+}
+
+bool Shader::beginCompile(const std::string& vsm, const std::string& psm)
+{
 	if (program != 0)
 		glDeleteProgram(program);
 	program = glCreateProgram();
 	assert (glGetError() == GL_NO_ERROR);
-
-	if (!createVertexShaderObject(vsm))
+	compiled = false;
+	compiling = true;
+	pending_vs = vsm;
+	pending_fs = psm;
+	source_hash = hashString(psm, hashString(vsm));
+
+	//same sources already linked by this driver
+	from_binary = false;
+	if (use_binary_cache && isProgramBinarySupported())
 	{
-		printf("Vertex shader compilation failed\n");
-		return false;
+		auto it = s_program_binaries.find(source_hash);
+		if (it != s_program_binaries.end())
+		{
+			glProgramBinary(program, it->second.format, &it->second.data[0], (GLsizei)it->second.data.size());
+			it->second.used = true;
+			from_binary = true;
+			return true;
+		}
 	}
 
-	if (!createFragmentShaderObject(psm))
+	//the status is checked in endCompile, so the driver does not have to finish now
+	if (!createShaderObject(GL_VERTEX_SHADER, vs, vsm, false) || !createShaderObject(GL_FRAGMENT_SHADER, fs, psm, false))
 	{
-		printf("Fragment shader compilation failed\n");
+		compiling = false;
 		return false;
 	}
 
+	//fixed locations for the mesh streams (see eAttribute)
+	for (int i = 0; i < NUM_ATTRIBUTES; ++i)
+		glBindAttribLocation(program, i, attribute_names[i]);
+
+	if (use_binary_cache && isProgramBinarySupported())
+		glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+
 	glLinkProgram(program);
 	assert (glGetError() == GL_NO_ERROR);
+	return true;
+}
+
+bool Shader::isCompileDone()
+{
+	if (!compiling || !s_parallel_compile)
+		return true;
+	GLint done = 0;
+	glGetProgramiv(program, GL_COMPLETION_STATUS_KHR, &done);
+	return done != 0;
+}
+
+bool Shader::endCompile()
+{
+	if (!compiling)
+		return compiled;
+	compiling = false;
 
 	GLint linked=0;
-    
 	glGetProgramiv(program,GL_LINK_STATUS,&linked);
 	assert(glGetError() == GL_NO_ERROR);
 
+	//the binary is not valid anymore (driver updated), compile the sources
+	if (!linked && from_binary)
+	{
+		s_program_binaries.erase(source_hash);
+		s_binary_cache_dirty = true;
+		use_binary_cache = false;
+		bool result = beginCompile(pending_vs, pending_fs) && endCompile();
+		use_binary_cache = true;
+		return result;
+	}
+
 	if (!linked)
 	{
-		saveProgramInfoLog(program);
+		if (!checkShaderObject(vs, pending_vs))
+			printf("Vertex shader compilation failed\n");
+		else if (!checkShaderObject(fs, pending_fs))
+			printf("Fragment shader compilation failed\n");
+		else
+			saveProgramInfoLog(program);
 		release();
 		return false;
 	}
 
+	//store it for the next time
+	if (!from_binary && use_binary_cache && isProgramBinarySupported())
+	{
+		GLint size = 0;
+		glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &size);
+		if (size > 0)
+		{
+			sProgramBinary& binary = s_program_binaries[source_hash];
+			binary.data.resize(size);
+			glGetProgramBinary(program, size, NULL, &binary.format, &binary.data[0]);
+			binary.used = true;
+			s_binary_cache_dirty = true;
+		}
+	}
+
 #ifdef _DEBUG
 	validate();
 #endif
 
 	compiled = true;
 	locations.clear(); //regenerate table
+	resolveUniformLocations();
+	pending_vs.clear();
+	pending_fs.clear();
 
 	return true;
 }
 
+bool Shader::LoadBinaryCache(const char* filename)
+{
+	s_binary_cache_filename = filename;
+	std::vector<unsigned char> buffer;
+	if (!use_binary_cache || !isProgramBinarySupported() || !readFileBin(filename, buffer))
+		return false;
+
+	//header: "SBIN", version, driver hash, number of programs
+	const size_t header_size = 4 + sizeof(int) + sizeof(uint64) + sizeof(int);
+	if (buffer.size() < header_size || memcmp(&buffer[0], "SBIN", 4) != 0)
+		return false;
+	uint8* pos = &buffer[4];
+	int version = *(int*)pos; pos += sizeof(int);
+	uint64 driver = *(uint64*)pos; pos += sizeof(uint64);
+	int num = *(int*)pos; pos += sizeof(int);
+	if (version != SHADER_CACHE_VERSION || driver != getDriverHash())
+	{
+		std::cout << " * Shader binary cache discarded (driver or version changed)" << std::endl;
+		return false;
+	}
+
+	//every program: hash, format, size, data
+	uint8* end = &buffer[0] + buffer.size();
+	for (int i = 0; i < num; ++i)
+	{
+		if (pos + sizeof(uint64) + sizeof(GLenum) + sizeof(int) > end)
+			break;
+		uint64 hash = *(uint64*)pos; pos += sizeof(uint64);
+		sProgramBinary& binary = s_program_binaries[hash];
+		binary.format = *(GLenum*)pos; pos += sizeof(GLenum);
+		int size = *(int*)pos; pos += sizeof(int);
+		if (size <= 0 || pos + size > end)
+		{
+			s_program_binaries.erase(hash);
+			break;
+		}
+		binary.data.assign(pos, pos + size);
+		binary.used = false;
+		pos += size;
+	}
+	std::cout << " + Shader binary cache: " << TermColor::YELLOW << s_program_binaries.size() << TermColor::DEFAULT << " programs" << std::endl;
+	return true;
+}
+
+bool Shader::SaveBinaryCache()
+{
+	if (!s_binary_cache_dirty || s_binary_cache_filename.empty())
+		return false;
+	FILE* f = fopen(s_binary_cache_filename.c_str(), "wb");
+	if (!f)
+	{
+		std::cout << "[ERROR] cannot write shader binary cache: " << s_binary_cache_filename << std::endl;
+		return false;
+	}
+
+	//the ones not used in this session are from old versions of the shaders
+	int version = SHADER_CACHE_VERSION;
+	uint64 driver = getDriverHash();
+	int num = 0;
+	for (auto& it : s_program_binaries)
+		num += it.second.used ? 1 : 0;
+	fwrite("SBIN", 1, 4, f);
+	fwrite(&version, sizeof(int), 1, f);
+	fwrite(&driver, sizeof(uint64), 1, f);
+	fwrite(&num, sizeof(int), 1, f);
+	for (auto& it : s_program_binaries)
+	{
+		if (!it.second.used)
+			continue;
+		int size = (int)it.second.data.size();
+		fwrite(&it.first, sizeof(uint64), 1, f);
+		fwrite(&it.second.format, sizeof(GLenum), 1, f);
+		fwrite(&size, sizeof(int), 1, f);
+		fwrite(&it.second.data[0], 1, size, f);
+	}
+	fclose(f);
+	s_binary_cache_dirty = false;
+	return true;
+}
+
+void Shader::EnableParallelCompile()
+{
+	static bool initialized = false;
+	if (initialized)
+		return;
+	initialized = true;
+
+	typedef void (APIENTRY *MaxShaderCompilerThreads_func)(GLuint count);
+	MaxShaderCompilerThreads_func maxShaderCompilerThreads = NULL;
+	if (SDL_GL_ExtensionSupported("GL_KHR_parallel_shader_compile"))
+		maxShaderCompilerThreads = (MaxShaderCompilerThreads_func)SDL_GL_GetProcAddress("glMaxShaderCompilerThreadsKHR");
+	else if (SDL_GL_ExtensionSupported("GL_ARB_parallel_shader_compile"))
+		maxShaderCompilerThreads = (MaxShaderCompilerThreads_func)SDL_GL_GetProcAddress("glMaxShaderCompilerThreadsARB");
+	if (!maxShaderCompilerThreads)
+		return;
+	maxShaderCompilerThreads(0xFFFFFFFF); //as many as the driver wants
+	s_parallel_compile = true;
+	std::cout << " + Parallel shader compilation enabled" << std::endl;
+}
+
+void Shader::resolveUniformLocations()
+{
+	for (int i = 0; i < NUM_UNIFORMS; ++i)
+		uniform_locations[i] = program ? glGetUniformLocation(program, uniform_names[i]) : -1;
+
+	//block bindings are state of the program, a recompiled shader needs them again
+	if (!program)
+		return;
+	for (int i = B_FRAME; i < NUM_UNIFORM_BLOCKS; ++i)
+	{
+		GLuint index = glGetUniformBlockIndex(program, uniform_block_names[i]);
+		if (index != GL_INVALID_INDEX)
+			glUniformBlockBinding(program, index, i);
+	}
+}
+
 bool Shader::validate()
 {
 	glValidateProgram(program);
@@ -280,7 +572,7 @@ bool Shader::createComputeShaderObject(const std::string& shader)
 }
 
 
-bool Shader::createShaderObject(unsigned int type, GLuint& handle, const std::string& code)
+bool Shader::createShaderObject(unsigned int type, GLuint& handle, const std::string& code, bool check)
 {
 	if (handle != 0)
 		glDeleteShader(handle);
@@ -298,6 +590,17 @@ bool Shader::createShaderObject(unsigned int type, GLuint& handle, const std::st
 	glCompileShader(handle);
 	assert( glGetError() == GL_NO_ERROR );
 
+	if (check && !checkShaderObject(handle, fullcode))
+		return false;
+
+	glAttachShader(program,handle);
+	assert( glGetError() == GL_NO_ERROR );
+
+	return true;
+}
+
+bool Shader::checkShaderObject(GLuint handle, const std::string& fullcode)
+{
 	GLint compile=0;
 	glGetShaderiv(handle,GL_COMPILE_STATUS,&compile);
 	assert( glGetError() == GL_NO_ERROR );
@@ -321,9 +624,6 @@ bool Shader::createShaderObject(unsigned int type, GLuint& handle, const std::st
 		return false;
 	}
 
-	glAttachShader(program,handle);
-	assert( glGetError() == GL_NO_ERROR );
-
 	return true;
 }
 
@@ -359,6 +659,7 @@ void Shader::release()
 	}
 
 	locations.clear();
+	resolveUniformLocations();
 
 	compiled = false;
 }
@@ -522,6 +823,15 @@ void Shader::setTexture(const char* varname, Texture* tex, int slot)
 	glActiveTexture(GL_TEXTURE0 + slot);
 }
 
+void Shader::setUniform(eUniform u, Texture* tex, int slot)
+{
+	assert(current == this);
+	glActiveTexture(GL_TEXTURE0 + slot);
+	glBindTexture(tex->texture_type, tex->texture_id);
+	if (uniform_locations[u] != -1)
+		glUniform1i(uniform_locations[u], slot);
+}
+
 /*
 void Shader::setTexture(const char* varname, unsigned int tex)
 {
@@ -928,6 +1238,9 @@ bool Shader::LoadAtlas(const char* filename, const char* base_path_cstr)
 
 	//separate subfiles
 	s_shader_atlas_filename = filename;
+	if (s_binary_cache_filename.empty())
+		LoadBinaryCache((s_shader_atlas_filename + ".cache").c_str());
+	EnableParallelCompile();
 	std::vector<std::string> lines = tokenize(content, "\n");
 	std::string subfile_name = "";
 	std::string subfile_content = "";
@@ -957,8 +1270,9 @@ bool Shader::LoadAtlas(const char* filename, const char* base_path_cstr)
 		s_shader_files[it.first] = subfile_content;
 	}
 
-	//compile shaders
+	//compile shaders, all are started before waiting for any
 	std::string shaders = s_shader_files[""];
+	std::vector<std::pair<std::string, Shader*>> pending;
 
 	lines = tokenize(shaders, "\n");
 	for (size_t i = 0; i < lines.size(); ++i)
@@ -998,7 +1312,7 @@ bool Shader::LoadAtlas(const char* filename, const char* base_path_cstr)
 				return false;
 			}
 
-			Shader* shader = CompileShader(name.c_str(), vs_code.c_str(), fs_code.c_str(), macros.c_str());
+			Shader* shader = BeginCompileShader(name.c_str(), vs_code.c_str(), fs_code.c_str(), macros.c_str());
 			if (!shader)
 			{
 				std::cout << TermColor::RED << "[ERROR]" << TermColor::DEFAULT << " Problem compiling shaders in atlas, canceling compilation." << std::endl;
@@ -1007,8 +1321,20 @@ bool Shader::LoadAtlas(const char* filename, const char* base_path_cstr)
 			shader->vs_filename = vs_filename;
 			shader->fs_filename = fs_filename;
 			shader->from_atlas = true;
-			std::cout << " + Shader from atlas: " << TermColor::CYAN << name << TermColor::DEFAULT << std::endl;
+			pending.push_back(std::make_pair(name, shader));
+		}
+	}
+
+	for (auto& it : pending)
+	{
+		Shader* shader = it.second;
+		if (!shader->endCompile())
+		{
+			std::cout << " * Compilation error in shader at atlas: " << it.first << std::endl;
+			std::cout << TermColor::RED << "[ERROR]" << TermColor::DEFAULT << " Problem compiling shaders in atlas, canceling compilation." << std::endl;
+			return false;
 		}
+		std::cout << " + Shader from atlas: " << TermColor::CYAN << it.first << TermColor::DEFAULT << (shader->from_binary ? " (binary)" : "") << std::endl;
 	}
 
 	return true;
@@ -1070,6 +1396,21 @@ std::string Shader::ExpandIncludes(std::string name, std::string content, std::m
 }
 
 Shader* Shader::CompileShader(const char* name, const char* vs_code, const char* fs_code, const char* macros = nullptr)
+{
+	Shader* shader = BeginCompileShader(name, vs_code, fs_code, macros);
+	if (!shader)
+		return nullptr;
+	if (!shader->endCompile())
+	{
+		s_Shaders.erase(name);
+		delete shader;
+		std::cout << " * Compilation error in shader at atlas: " << name << std::endl;
+		return nullptr; //stop here
+	}
+	return shader;
+}
+
+Shader* Shader::BeginCompileShader(const char* name, const char* vs_code, const char* fs_code, const char* macros)
 {
 	//expand macros
 	std::string macros_str = "";
@@ -1107,8 +1448,9 @@ Shader* Shader::CompileShader(const char* name, const char* vs_code, const char*
 	else
 		shader = it2->second;
 
-	if (!shader->compileFromMemory(vs.c_str(), fs.c_str()))
+	if (!shader->beginCompile(vs, fs))
 	{
+		s_Shaders.erase(name);
 		delete shader;
 		std::cout << " * Compilation error in shader at atlas: " << name << std::endl;
 		return nullptr; //stop here
@@ -1143,6 +1485,17 @@ Shader* Shader::UberShader::get(uint64 macros)
 	if (it != compiled_shaders.end())
 		return it->second;
 
+	Shader* shader = beginCompile(macros);
+	if (!shader)
+		return nullptr;
+	return endCompile(macros, shader); //the binary is stored when the app ends, writing the cache now would stall the frame
+}
+
+Shader* Shader::UberShader::beginCompile(uint64 macros)
+{
+	if (compiled_shaders.find(macros) != compiled_shaders.end())
+		return nullptr;
+
 	std::string fullname = name + "[" + std::to_string(macros) + "]";
 
 	std::string vs_code;
@@ -1165,17 +1518,70 @@ Shader* Shader::UberShader::get(uint64 macros)
 		macros_str = macros_str.substr(0, macros_str.size() - 1); //remove last comma
 	}
 
-	Shader* shader = Shader::CompileShader(fullname.c_str(), vs_code.c_str(), fs_code.c_str(), macros_str.c_str() );
+	Shader* shader = Shader::BeginCompileShader(fullname.c_str(), vs_code.c_str(), fs_code.c_str(), macros_str.c_str() );
 	if (!shader)
 		return nullptr;
-	compiled_shaders[macros] = shader;
 	shader->vs_filename = this->vs_name;
 	shader->fs_filename = this->fs_name;
 	shader->from_atlas = true;
-	std::cout << " + Shader from Ubershader: " << TermColor::CYAN << fullname << TermColor::DEFAULT << std::endl;
 	return shader;
 }
 
+Shader* Shader::UberShader::endCompile(uint64 macros, Shader* shader)
+{
+	std::string fullname = name + "[" + std::to_string(macros) + "]";
+	if (!shader->endCompile())
+	{
+		s_Shaders.erase(fullname);
+		delete shader;
+		std::cout << " * Compilation error in shader at atlas: " << fullname << std::endl;
+		return nullptr;
+	}
+	compiled_shaders[macros] = shader;
+	std::cout << " + Shader from Ubershader: " << TermColor::CYAN << fullname << TermColor::DEFAULT << (shader->from_binary ? " (binary)" : "") << std::endl;
+	return shader;
+}
+
+int Shader::WarmUp(const std::vector<sPermutation>& permutations)
+{
+	EnableParallelCompile();
+
+	//start all of them
+	struct sPending { UberShader* ubershader; uint64 macros; Shader* shader; };
+	std::vector<sPending> pending;
+	for (const sPermutation& permutation : permutations)
+	{
+		UberShader* ubershader = GetUberShader(permutation.ubershader);
+		if (!ubershader)
+		{
+			std::cout << "[ERROR] Ubershader not found: " << permutation.ubershader << std::endl;
+			continue;
+		}
+		Shader* shader = ubershader->beginCompile(permutation.macros);
+		if (shader)
+			pending.push_back({ ubershader, permutation.macros, shader });
+	}
+
+	//finish them in the order the driver completes them
+	int num_compiled = 0;
+	while (pending.size())
+	{
+		size_t index = 0;
+		for (size_t i = 0; i < pending.size(); ++i)
+			if (pending[i].shader->isCompileDone())
+			{
+				index = i;
+				break;
+			}
+		sPending& it = pending[index];
+		if (it.ubershader->endCompile(it.macros, it.shader))
+			num_compiled++;
+		pending.erase(pending.begin() + index);
+	}
+
+	return num_compiled;
+}
+
 void Shader::UberShader::clear()
 {
 	compiled_shaders.clear();
@@ -1255,6 +1661,14 @@ void BufferObject::updateFromPointer(const void* data, int size)
 	glBindBuffer(type, 0);
 }
 
+void BufferObject::updateRange(int offset, const void* data, int size)
+{
+	assert(offset >= 0 && (size_t)(offset + size) <= this->size);
+	glBindBuffer(type, id);
+	glBufferSubData(type, offset, size, data);
+	glBindBuffer(type, 0);
+}
+
 void BufferObject::bind(Shader* shader, int index, int start, int length)
 {
 	assert(size);
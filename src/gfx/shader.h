@@ -25,6 +25,59 @@ namespace GFX {
 	class Texture;
 	class UBO;
 
+	//uniforms set in every draw, their locations are resolved once when the program is linked
+	//so setting them is just an index in a table (use setUniform(U_MODEL, ...) instead of setUniform("u_model", ...))
+	enum eUniform {
+		U_MODEL,
+		U_VIEWPROJECTION,
+		U_CAMERA_POSITION,
+		U_CAMERA_NEARFAR,
+		U_TIME,
+		U_COLOR,
+		U_TEXTURE,
+		U_ALPHA_CUTOFF,
+		U_ALBEDO_TEXTURE,
+		U_EMISSIVE_TEXTURE,
+		U_METALIC_ROUGHNESS_TEXTURE,
+		U_NORMALMAP,
+		U_SHADOWMAP,
+		U_MATERIAL_INDEX,
+		U_BASE_PASS,
+		U_BONES,
+		U_LIGHTMAP,
+		U_IRRADIANCE_TEXTURE,
+		U_REFLECTION_TEXTURE,
+		U_REFLECTION_MAX_LOD,
+		NUM_UNIFORMS
+	};
+	extern const char* uniform_names[NUM_UNIFORMS]; //the name in the shaders of every eUniform
+
+	//uniform blocks have the same binding point in all the shaders, set when the program is linked
+	enum eUniformBlock {
+		B_FRAME = 1, //0 is not used
+		B_LIGHT,
+		B_LIGHTS,
+		B_MATERIAL,
+		B_BONES,
+		NUM_UNIFORM_BLOCKS
+	};
+	extern const char* uniform_block_names[NUM_UNIFORM_BLOCKS]; //the name in the shaders of every eUniformBlock
+
+	//vertex attributes have the same location in all the shaders (bound before linking),
+	//so a mesh can keep its streams in a VAO that works with any shader
+	enum eAttribute {
+		A_VERTEX,
+		A_NORMAL,
+		A_COORD,
+		A_COORD1,
+		A_COLOR,
+		A_BONES,
+		A_WEIGHTS,
+		A_DRAW_ID, //index of the draw in multi draw indirect (instanced attribute, see MeshArena)
+		NUM_ATTRIBUTES
+	};
+	extern const char* attribute_names[NUM_ATTRIBUTES];
+
 	class Shader
 	{
 		int last_slot;
@@ -45,6 +98,11 @@ namespace GFX {
 
 		//internal functions
 		bool compileFromMemory(const std::string& vsm, const std::string& psm);
+
+		//the compilation in two steps, so the driver can compile many programs at the same time (KHR_parallel_shader_compile)
+		bool beginCompile(const std::string& vsm, const std::string& psm);
+		bool isCompileDone(); //does not block
+		bool endCompile(); //waits till it is done, false if it failed
 		void release();
 		void enable();
 		void disable();
@@ -69,6 +127,18 @@ namespace GFX {
 		//for textures you must specify an slot (a number from 0 to 16) where this texture is stored in the shader
 		void setUniform(const char* varname, Texture* texture, int slot) { assert(current == this); setTexture(varname, texture, slot); }
 
+		//same using the precomputed locations, -1 if the shader does not use it
+		GLint getLocation(eUniform u) const { return uniform_locations[u]; }
+		void setUniform(eUniform u, bool input) { assert(current == this); if (uniform_locations[u] != -1) glUniform1i(uniform_locations[u], input); }
+		void setUniform(eUniform u, int input) { assert(current == this); if (uniform_locations[u] != -1) glUniform1i(uniform_locations[u], input); }
+		void setUniform(eUniform u, float input) { assert(current == this); if (uniform_locations[u] != -1) glUniform1f(uniform_locations[u], input); }
+		void setUniform(eUniform u, const Vector2f& input) { assert(current == this); if (uniform_locations[u] != -1) glUniform2f(uniform_locations[u], input.x, input.y); }
+		void setUniform(eUniform u, const Vector3f& input) { assert(current == this); if (uniform_locations[u] != -1) glUniform3f(uniform_locations[u], input.x, input.y, input.z); }
+		void setUniform(eUniform u, const Vector4f& input) { assert(current == this); if (uniform_locations[u] != -1) glUniform4f(uniform_locations[u], input.x, input.y, input.z, input.w); }
+		void setUniform(eUniform u, const Matrix44& input) { assert(current == this); if (uniform_locations[u] != -1) glUniformMatrix4fv(uniform_locations[u], 1, GL_FALSE, input.m); }
+		void setUniform(eUniform u, std::vector<Matrix44>& m_vector) { assert(current == this && m_vector.size()); if (uniform_locations[u] != -1) glUniformMatrix4fv(uniform_locations[u], (GLsizei)m_vector.size(), GL_FALSE, (GLfloat*)&m_vector[0]); }
+		void setUniform(eUniform u, Texture* texture, int slot);
+
 
 		void setInt(const char* varname, const int& input) { setUniform1(varname, input); }
 		void setFloat(const char* varname, const float& input) { setUniform1(varname, input); }
@@ -121,7 +191,12 @@ namespace GFX {
 		std::string fs_filename;
 		std::string macros;
 		bool compiled;
+		bool compiling; //between beginCompile and endCompile
 		bool from_atlas;
+		bool from_binary; //loaded from the binary cache
+		uint64 source_hash; //key in the binary cache
+		std::string pending_vs; //sources while compiling, to show the errors
+		std::string pending_fs;
 
 		GLuint vs;
 		GLuint fs;
@@ -135,7 +210,8 @@ namespace GFX {
 		bool createVertexShaderObject(const std::string& shader);
 		bool createFragmentShaderObject(const std::string& shader);
 		bool createComputeShaderObject(const std::string& shader); //not used yet
-		bool createShaderObject(unsigned int type, GLuint& handle, const std::string& shader);
+		bool createShaderObject(unsigned int type, GLuint& handle, const std::string& shader, bool check = true);
+		bool checkShaderObject(GLuint handle, const std::string& code); //prints the errors
 		void saveShaderInfoLog(GLuint obj);
 		void saveProgramInfoLog(GLuint obj);
 
@@ -148,6 +224,8 @@ namespace GFX {
 		typedef std::map<const char*, int, ltstr> loctable;
 		GLint getLocation(const char* varname, bool is_block = false);
 		loctable locations;
+		GLint uniform_locations[NUM_UNIFORMS]; //of the eUniform, filled after linking
+		void resolveUniformLocations();
 
 		//Shader Atlas stuff ************************
 		//to know more about the file format, it is based in this https://github.com/jagenjo/rendeer.js/tree/master/guides#the-shaders but with tiny differences
@@ -157,6 +235,14 @@ namespace GFX {
 
 		//compiles and stores shader, if exist it will recompile it!
 		static Shader* CompileShader(const char* name, const char* vs_code, const char* fs_code, const char* macros);
+		static Shader* BeginCompileShader(const char* name, const char* vs_code, const char* fs_code, const char* macros); //call endCompile after
+
+		//binary cache of the linked programs (glGetProgramBinary), in a file next to the atlas
+		//entries are keyed by the hash of the sources (macros included), the file is discarded if the driver changes
+		static bool use_binary_cache;
+		static bool LoadBinaryCache(const char* filename);
+		static bool SaveBinaryCache(); //only if there are new programs, called when the app ends
+		static void EnableParallelCompile(); //KHR_parallel_shader_compile, if supported
 		static std::string ExpandIncludes(std::string name, std::string content, std::map<std::string, std::string>& subfiles, const std::string& base_path);
 		static bool LoadAtlas(const char* filename, const char* base_path = nullptr);
 		static bool GetShaderFile(const char* filename, std::string& content);
@@ -176,12 +262,18 @@ namespace GFX {
 					macros_index[ macros[i] ] = i;
 			}
 			Shader* get(uint64 macros);
+			Shader* beginCompile(uint64 macros); //NULL if it is already compiled or fails
+			Shader* endCompile(uint64 macros, Shader* shader);
 			void clear();
 			int getMacroIndex(const char* name) { auto it = macros_index.find(name); return it == macros_index.end() ? -1 : it->second; }
 		};
 		static std::map<std::string, UberShader*> s_ubershaders;
 		static UberShader* GetUberShader(const char* name);
 
+		//compiles in parallel the permutations that will be used, so they do not stall the frame that needs them
+		struct sPermutation { const char* ubershader; uint64 macros; };
+		static int WarmUp(const std::vector<sPermutation>& permutations); //returns how many were compiled
+
 		static Shader* getDefaultShader(std::string name);
 	};
 
@@ -202,6 +294,7 @@ namespace GFX {
 		template <typename T>
 		void update(const T& obj) { updateFromPointer(&obj, sizeof(T)); }
 		void updateFromPointer(const void* data, int size);
+		void updateRange(int offset, const void* data, int size); //only part of it, must be allocated
 		//the global index behaves similar to slots in textures, you bind a UBO to an index, and a block to the same index
 		void bind(Shader* shader, int global_index, int start = 0, int length = -1);
 	};
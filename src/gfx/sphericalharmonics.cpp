@@ -1,5 +1,11 @@
 #include "sphericalharmonics.h"
 
+#include <map>
+#include <mutex>
+
+#include "../core/simd.h"
+#include "../core/task.h"
+
 //system axis
 Vector3f cubemapFaceNormals[6][3] = {
     {{0, 0, -1} ,{0, -1, 0},{1, 0, 0} },  // posx
@@ -13,8 +19,8 @@ Vector3f cubemapFaceNormals[6][3] = {
 };
 
 const int sh_length = 9;
-std::vector< std::vector<Vector3f> > cubeMapVecs;
-int cubeMapVecs_size = 0;
+std::map<int, SHTable*> cubemap_tables; //by face size, never freed
+std::mutex cubemap_tables_mutex;
 
 float areaElement(float x, float y) {
     return atan2(x * y, sqrtf(x * x + y * y + 1.0f));
@@ -40,86 +46,183 @@ float texelSolidAngle(float aU, float aV, float width, float height) {
     return angle;
 }
 
+void SHTable::resize(int num_groups, int group_size)
+{
+    num_samples = num_groups * group_size;
+    stride = (group_size + 3) & ~3;
+    count = num_groups * stride;
+    x.assign(count, 0.0f);
+    y.assign(count, 0.0f);
+    z.assign(count, 0.0f);
+    solid_angle.assign(count, 0.0f);
+    for (int k = 0; k < sh_length; ++k)
+        weights[k].assign(count, 0.0f);
+    weight_accum = 0.0f;
+}
+
+void SHTable::setSample(int index, const Vector3f& d, float weight)
+{
+    x[index] = d.x;
+    y[index] = d.y;
+    z[index] = d.z;
+    solid_angle[index] = weight;
+
+    // forsyths weights
+    float weight1 = weight * 4 / 17;
+    float weight2 = weight * 8 / 17;
+    float weight3 = weight * 15 / 17;
+    float weight4 = weight * 5 / 68;
+    float weight5 = weight * 15 / 68;
+
+    weights[0][index] = weight1;
+    weights[1][index] = weight2 * d.y;
+    weights[2][index] = weight2 * d.z;
+    weights[3][index] = weight2 * d.x;
+
+    weights[4][index] = weight3 * d.x * d.y;
+    weights[5][index] = weight3 * d.y * d.z;
+    weights[6][index] = weight4 * (3.0f * d.z * d.z - 1.0f);
+
+    weights[7][index] = weight3 * d.x * d.z;
+    weights[8][index] = weight5 * (d.x * d.x - d.y * d.y);
+
+    weight_accum += weight * 3.0f;
+}
+
+void SHTable::create(const Vector3f* directions, float weight, int num_samples)
+{
+    resize(1, num_samples);
+    for (int i = 0; i < num_samples; ++i)
+        setSample(i, directions[i], weight);
+}
+
+const SHTable& SHTable::getCubemap(int size)
+{
+    const std::lock_guard<std::mutex> lock(cubemap_tables_mutex);
+    SHTable*& table = cubemap_tables[size];
+    if (table)
+        return *table;
+
+    table = new SHTable();
+    table->resize(6, size * size);
+    for (int index = 0; index < 6; ++index)
+        for (int v = 0; v < size; v++)
+            for (int u = 0; u < size; u++)
+            {
+                float fU = (2.0f * u / (size - 1.0f)) - 1.0f;
+                float fV = (2.0f * v / (size - 1.0f)) - 1.0f;
+
+                Vector3f vecX = cubemapFaceNormals[index][0] * fU;
+                Vector3f vecY = cubemapFaceNormals[index][1] * fV;
+                Vector3f vecZ = cubemapFaceNormals[index][2];
+
+                Vector3f res = normalize(vecX + vecY + vecZ);
+                table->setSample(index * table->stride + v * size + u, res, texelSolidAngle(u, v, size, size));
+            }
+    return *table;
+}
+
+//adds the radiance (in SoA) of the samples [start..end) of the table, four at once. end - start must be a multiple of 4
+static void accumulateSH(const SHTable& table, const float* r, const float* g, const float* b, int start, int end, SphericalHarmonics& sh)
+{
+    simd4 acc[sh_length][3];
+    for (int k = 0; k < sh_length; ++k)
+        acc[k][0] = acc[k][1] = acc[k][2] = simd4(0.0f);
+
+    for (int i = start; i < end; i += 4)
+    {
+        simd4 red = simd4::load(r + i - start);
+        simd4 green = simd4::load(g + i - start);
+        simd4 blue = simd4::load(b + i - start);
+        for (int k = 0; k < sh_length; ++k)
+        {
+            simd4 w = simd4::load(&table.weights[k][i]);
+            acc[k][0] = acc[k][0] + red * w;
+            acc[k][1] = acc[k][1] + green * w;
+            acc[k][2] = acc[k][2] + blue * w;
+        }
+    }
+
+    for (int k = 0; k < sh_length; ++k)
+        for (int c = 0; c < 3; ++c)
+            sh.coeffs[k].v[c] += acc[k][c][0] + acc[k][c][1] + acc[k][c][2] + acc[k][c][3];
+}
+
 // give me a cubemap, its size and number of channels
 // and i'll give you spherical harmonics
 SphericalHarmonics computeSH( FloatImage images[], bool degamma ) {
 	assert(images[0].width == images[0].height && images[0].width != 0 && "Image is not square");
     int size = images[0].width;
-    int channels = 3;
-    SphericalHarmonics sh;
-
-    // generate cube map vectors
-    if (cubeMapVecs_size != size)
-    {
-        cubeMapVecs_size = size;
-        cubeMapVecs.clear();
-        for (int index = 0; index < 6; ++index)
+    const SHTable& table = SHTable::getCubemap(size);
+
+    // generate spherical harmonics, a face per job
+    SphericalHarmonics faces_sh[6];
+    TaskManager::background.parallelFor(6, [&](size_t start, size_t end) {
+        std::vector<float> rgb(table.stride * 3, 0.0f); //padding texels stay black
+        float* r = &rgb[0];
+        float* g = r + table.stride;
+        float* b = g + table.stride;
+        for (size_t index = start; index < end; ++index)
         {
-            std::vector<Vector3f> faceVecs;
-            for (int v = 0; v < size; v++) {
-                for (int u = 0; u < size; u++)
+            FloatImage& face = images[index];
+            const float* pixel = face.data;
+            int channels = face.num_channels;
+            for (int i = 0; i < size * size; ++i, pixel += channels)
+            {
+                if (degamma)
                 {
-                    float fU = (2.0f * u / (size - 1.0f)) - 1.0f;
-                    float fV = (2.0f * v / (size - 1.0f)) - 1.0f;
-
-                    Vector3f vecX = cubemapFaceNormals[index][0] * fU;
-                    Vector3f vecY = cubemapFaceNormals[index][1] * fV;
-                    Vector3f vecZ = cubemapFaceNormals[index][2];
-
-                    Vector3f res = normalize(vecX + vecY + vecZ);
-                    faceVecs.push_back(res);
+                    r[i] = powf(pixel[0], 2.2f);
+                    g[i] = powf(pixel[1], 2.2f);
+                    b[i] = powf(pixel[2], 2.2f);
+                }
+                else
+                {
+                    r[i] = pixel[0];
+                    g[i] = pixel[1];
+                    b[i] = pixel[2];
                 }
             }
-            cubeMapVecs.push_back(faceVecs);
+            int face_start = (int)index * table.stride;
+            accumulateSH(table, r, g, b, face_start, face_start + table.stride, faces_sh[index]);
         }
-    }
-
-    // generate spherical harmonics
-    float weightAccum = 0;
+    });
 
+    //added in order, the result does not depend on the threads
+    SphericalHarmonics sh;
     for (int index = 0; index < 6; ++index)
-    {
-        FloatImage& face = images[index];
-        float* pixels = face.data;
-        bool gammaCorrect = degamma;
-        for (int y = 0; y < size; y++) {
-            for (int x = 0; x < size; x++) {
-                Vector3f texelVect = cubeMapVecs[index][y * size + x];
-                float weight = texelSolidAngle(x, y, size, size);
-                    // forsyths weights
-                float weight1 = weight * 4 / 17;
-                float weight2 = weight * 8 / 17;
-                float weight3 = weight * 15 / 17;
-                float weight4 = weight * 5 / 68;
-                float weight5 = weight * 15 / 68;
-
-                float dx = texelVect[0];
-                float dy = texelVect[1];
-                float dz = texelVect[2];
-
-                Vector3f value = face.getPixel(x,y).xyz();
-                if (gammaCorrect)
-                    value = Vector3f(pow(value.x, 2.2), pow(value.y, 2.2), pow(value.z, 2.2));
-                    
-                sh.coeffs[0] += value * weight1;
-                sh.coeffs[1] += value * weight2 * dy;
-                sh.coeffs[2] += value * weight2 * dz;
-                sh.coeffs[3] += value * weight2 * dx;
-
-                sh.coeffs[4] += value * weight3 * dx * dy;
-                sh.coeffs[5] += value * weight3 * dy * dz;
-                sh.coeffs[6] += value * weight4 * (3.0f * dz * dz - 1.0f);
-
-                sh.coeffs[7] += value * weight3 * dx * dz;
-                sh.coeffs[8] += value * weight5 * (dx * dx - dy * dy);
-
-                weightAccum += weight * 3.0f;
-            }
-        }
-    };
+        for (int i = 0; i < sh_length; i++)
+            sh.coeffs[i] += faces_sh[index].coeffs[i];
 
     SphericalHarmonics linear_sh;
     for (int i = 0; i < sh_length; i++)
-        linear_sh.coeffs[i] = sh.coeffs[i] * (float)(4 * PI / weightAccum);
+        linear_sh.coeffs[i] = sh.coeffs[i] * (float)(4 * PI / table.weight_accum);
     return linear_sh;
 }
+
+SphericalHarmonics computeSH(const SHTable& table, const Vector3f* values)
+{
+    assert(table.stride == table.count && "only tables of one group");
+    std::vector<float> rgb(table.count * 3, 0.0f);
+    float* r = &rgb[0];
+    float* g = r + table.count;
+    float* b = g + table.count;
+    for (int i = 0; i < table.num_samples; ++i)
+    {
+        r[i] = values[i].x;
+        g[i] = values[i].y;
+        b[i] = values[i].z;
+    }
+
+    SphericalHarmonics sh;
+    accumulateSH(table, r, g, b, 0, table.count, sh);
+    for (int i = 0; i < sh_length; i++)
+        sh.coeffs[i] = sh.coeffs[i] * (float)(4 * PI / table.weight_accum);
+    return sh;
+}
+
+SphericalHarmonics computeSH(const Vector3f* directions, const Vector3f* values, int count)
+{
+    SHTable table;
+    table.create(directions, (float)(4 * PI / count), count);
+    return computeSH(table, values);
+}
@@ -9,4 +9,24 @@ struct SphericalHarmonics {
 	Vector3f coeffs[9];
 };
 
-SphericalHarmonics computeSH( FloatImage images[], bool degamma = false);
+//sample directions with their solid angles and the nine weights of every sample (basis * solid angle), precomputed once and reused by every projection.
+//In SoA, the groups (the faces of a cubemap) padded to a multiple of 4 with zero weights
+struct SHTable {
+	int num_samples; //without padding
+	int count; //with padding
+	int stride; //samples of every group
+	std::vector<float> x, y, z, solid_angle;
+	std::vector<float> weights[9];
+	float weight_accum; //of all the samples, to normalize
+
+	void create(const Vector3f* directions, float weight, int num_samples); //one group with the same solid angle for all the samples
+	void resize(int num_groups, int group_size);
+	void setSample(int index, const Vector3f& d, float weight);
+
+	static const SHTable& getCubemap(int size); //built the first time a face size is used
+};
+
+SphericalHarmonics computeSH( FloatImage images[], bool degamma = false); //the faces in parallel
+//from radiance samples in directions evenly distributed over the sphere (probes baked with rays), same weights as the cubemap version
+SphericalHarmonics computeSH(const Vector3f* directions, const Vector3f* values, int count);
+SphericalHarmonics computeSH(const SHTable& table, const Vector3f* values); //a value per sample of a table from create
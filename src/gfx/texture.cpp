@@ -3,17 +3,34 @@
 #include <iostream> //to output
 #include <cmath>
 #include <cassert>
+#include <algorithm>
+#include <deque>
 
 #include "texture.h"
 #include "fbo.h"
 #include "mesh.h"
 #include "shader.h"
+#include "texturestreamer.h"
 
 #include "../utils/utils.h"
-#include "../extra/picopng.h"
 #include "../extra/jpgd.h"
 #define DDSKTX_IMPLEMENT
 #include "../extra/dds-ktx.h"
+
+//stb_image allocates with new[] so the decoded pixels can be used as Image::data without copying them
+static void* stbiMalloc(size_t size) { return new unsigned char[size]; }
+static void stbiFree(void* p) { delete[] (unsigned char*)p; }
+static void* stbiRealloc(void* p, size_t old_size, size_t new_size)
+{
+	unsigned char* data = new unsigned char[new_size];
+	if (p)
+		memcpy(data, p, old_size < new_size ? old_size : new_size);
+	stbiFree(p);
+	return data;
+}
+#define STBI_MALLOC(size) stbiMalloc(size)
+#define STBI_FREE(p) stbiFree(p)
+#define STBI_REALLOC_SIZED(p, old_size, new_size) stbiRealloc(p, old_size, new_size)
 #define STB_IMAGE_IMPLEMENTATION
 #include "../extra/stb_image.h"
 
@@ -57,8 +74,42 @@ namespace GFX
 
 	int Texture::default_mag_filter = GL_LINEAR;
 	int Texture::default_min_filter = GL_LINEAR_MIPMAP_LINEAR;
+	bool Texture::use_compressed = true;
 	FBO* Texture::global_fbo = NULL;
 
+	//images of 1 and 2 channels are grayscale (and alpha)
+	static unsigned int formatFromChannels(int num_channels)
+	{
+		static const unsigned int formats[] = { GL_RED, GL_RG, GL_RGB, GL_RGBA };
+		assert(num_channels >= 1 && num_channels <= 4);
+		return formats[num_channels - 1];
+	}
+
+	//so shaders read grayscale images as rgb, the texture must be bound
+	static void setGrayscaleSwizzle(unsigned int texture_type, int num_channels)
+	{
+		if (num_channels > 2)
+			return;
+		GLint swizzle[] = { GL_RED, GL_RED, GL_RED, num_channels == 2 ? GL_GREEN : GL_ONE };
+		glTexParameteriv(texture_type, GL_TEXTURE_SWIZZLE_RGBA, swizzle);
+	}
+
+	//bindless functions are loaded at runtime, not all the drivers have them
+	typedef GLuint64(APIENTRY* getTextureHandle_func)(GLuint texture);
+	typedef void (APIENTRY* makeTextureHandle_func)(GLuint64 handle);
+	static getTextureHandle_func getTextureHandle = NULL;
+	static makeTextureHandle_func makeTextureHandleResident = NULL;
+	static makeTextureHandle_func makeTextureHandleNonResident = NULL;
+
+	//levels of a full mipmap chain
+	static int getNumMips(int width, int height)
+	{
+		int levels = 1;
+		while ((width >> levels) || (height >> levels))
+			levels++;
+		return levels;
+	}
+
 	Texture::Texture()
 	{
 		width = 0;
@@ -70,6 +121,7 @@ namespace GFX
 		type = 0;
 		texture_type = GL_TEXTURE_2D;
 		loading = false;
+		screen_importance = 0.0f;
 		index = s_last_index++;
 		sTextures.insert(std::pair<unsigned int, Texture*>(index, this));
 		near_far.set(0.1f, 1000.0f);
@@ -78,6 +130,7 @@ namespace GFX
 	Texture::Texture(unsigned int width, unsigned int height, unsigned int format, unsigned int type, bool mipmaps, Uint8* data, unsigned int internal_format)
 	{
 		loading = false;
+		screen_importance = 0.0f;
 		texture_id = 0;
 		index = s_last_index++;
 		sTextures.insert(std::pair<unsigned int, Texture*>(index, this));
@@ -88,11 +141,12 @@ namespace GFX
 	Texture::Texture(::Image* img)
 	{
 		loading = false;
+		screen_importance = 0.0f;
 		texture_id = 0;
 		index = s_last_index++;
 		sTextures.insert(std::pair<unsigned int, Texture*>(index,this));
 		near_far.set(0.1f, 1000.0f);
-		create(img->width, img->height, img->num_channels == 3 ? GL_RGB : GL_RGBA, GL_UNSIGNED_BYTE, true, img->data);
+		upload(img);
 	}
 
 	Texture::~Texture()
@@ -105,6 +159,7 @@ namespace GFX
 
 	void Texture::clear()
 	{
+		releaseBindlessHandle();
 		if (texture_id)
 		{
 			glBindTexture(this->texture_type, 0);
@@ -113,7 +168,7 @@ namespace GFX
 			if (texture_type != GL_TEXTURE_EXTERNAL_OES)
 				glDeleteTextures(1, &texture_id);
 
-			if (!loading) //when loading the texture of 1x1 is replaced with the new one
+			if (!loading && !streaming) //when loading the texture is replaced with the new one
 				stdlog("Destroy texture: " + filename);
 			texture_id = 0;
 		}
@@ -164,6 +219,7 @@ namespace GFX
 		this->internal_format = internal_format;
 		this->type = type;
 		this->mipmaps = mipmaps && isPowerOfTwo(width) && isPowerOfTwo(height) && format != GL_DEPTH_COMPONENT;
+		this->num_levels = this->mipmaps ? getNumMips(width, height) : 1;
 
 		//Delete previous texture and ensure that previous bounded texture_id is not of another texture type
 		if (this->texture_id != 0)
@@ -178,7 +234,6 @@ namespace GFX
 		upload(format, type, mipmaps, data, internal_format);
 	}
 
-	/*
 	void Texture::create3D(unsigned int width, unsigned int height, unsigned int depth, unsigned int format, unsigned int type, bool mipmaps, Uint8* data, unsigned int internal_format)
 	{
 		assert(width && height && depth && "texture must have a size");
@@ -204,7 +259,6 @@ namespace GFX
 
 		upload3D(format, type, mipmaps, data, internal_format);
 	}
-	*/
 
 	void Texture::createCubemap(unsigned int width, unsigned int height, Uint8** data, unsigned int format, unsigned int type, bool mipmaps, unsigned int internal_format)
 	{
@@ -218,6 +272,7 @@ namespace GFX
 		this->type = type;
 		this->texture_type = GL_TEXTURE_CUBE_MAP;
 		this->mipmaps = mipmaps && isPowerOfTwo(width) && isPowerOfTwo(height) && format != GL_DEPTH_COMPONENT;
+		this->num_levels = this->mipmaps ? getNumMips(width, height) : 1;
 
 		this->wrapS = GL_CLAMP_TO_EDGE;
 		this->wrapT = GL_CLAMP_TO_EDGE;
@@ -246,6 +301,15 @@ namespace GFX
 			return texture;
 
 		texture = new Texture();
+
+		//use the block compressed version if it has been baked (see compressGLTFTextures)
+		std::string compressed = getCompressedFilename(filename);
+		if (compressed.size() && texture->loadKTX(compressed.c_str()))
+		{
+			texture->setName(filename);
+			return texture;
+		}
+
 		if (!texture->load(filename, mipmaps, wrap))
 		{
 			std::cout << "" << std::endl;
@@ -257,6 +321,26 @@ namespace GFX
 	}
 
 	Texture* Texture::GetAsync(const char* filename, bool mipmaps, bool wrap)
+	{
+		return GetAsync(filename, std::shared_ptr<sTextureBatch>());
+	}
+
+	std::vector<Texture*> Texture::GetAsyncBatch(const std::vector<std::string>& filenames)
+	{
+		std::shared_ptr<sTextureBatch> batch = std::make_shared<sTextureBatch>();
+		batch->start_time = getHighResTime();
+		batch->pending = 1; //till all are queued
+		batch->decoded_bytes = 0;
+
+		std::vector<Texture*> textures(filenames.size());
+		for (size_t i = 0; i < filenames.size(); ++i)
+			textures[i] = GetAsync(filenames[i].c_str(), batch);
+
+		batch->finishItem(NULL, 0.0, 0);
+		return textures;
+	}
+
+	Texture* Texture::GetAsync(const char* filename, std::shared_ptr<sTextureBatch> batch)
 	{
 		//disable loading textures in thread
 		//return Get(filename, mipmaps, wrap);
@@ -275,8 +359,14 @@ namespace GFX
 		temp->setName(filename);
 		temp->loading = true;
 
+		//the ring has to be created in the main thread
+		PBORing::init();
+
 		//add action to BG Thread 
 		LoadTextureTask* task = new LoadTextureTask(filename);
+		task->batch = batch;
+		if (batch)
+			batch->pending++;
 		TaskManager::background.addTask(task);
 
 		return temp;
@@ -294,6 +384,13 @@ namespace GFX
 			setName(filename);
 			return true;
 		}
+		if (ext == "ktx" || ext == "dds")
+		{
+			if (!loadKTX(filename))
+				return false;
+			setName(filename);
+			return true;
+		}
 
 		//image based textures
 		::Image* image = new ::Image();
@@ -318,9 +415,10 @@ namespace GFX
 
 		//upload to VRAM
 		// We have to synchronously upload for now because Image class is not ref-counted
-		create(image->width, image->height, (image->num_channels == 3 ? GL_RGB : GL_RGBA), type, mipmaps, image->data, 0);
+		create(image->width, image->height, formatFromChannels(image->num_channels), type, mipmaps, image->data, 0);
 
 		glBindTexture(this->texture_type, texture_id);	//we activate this id to tell opengl we are going to use this texture
+		setGrayscaleSwizzle(this->texture_type, image->num_channels);
 		glTexParameteri(this->texture_type, GL_TEXTURE_WRAP_S, (this->mipmaps && wrap) ? GL_REPEAT : GL_CLAMP_TO_EDGE);
 		glTexParameteri(this->texture_type, GL_TEXTURE_WRAP_T, (this->mipmaps && wrap) ? GL_REPEAT : GL_CLAMP_TO_EDGE);
 		//glTexParameteri(this->texture_type, GL_TEXTURE_WRAP_S, GL_REPEAT);
@@ -330,9 +428,56 @@ namespace GFX
 		glBindTexture(GL_TEXTURE_2D, 0);
 	}
 
+	void Texture::loadFromPBO(const GFX::sPBOUpload& upload, bool wrap)
+	{
+		PBORing* ring = PBORing::instance;
+		assert(ring && "no PBO ring");
+		if (texture_id != 0)
+			clear();
+		this->width = (float)upload.width;
+		this->height = (float)upload.height;
+		this->depth = 0;
+		this->format = formatFromChannels(upload.num_channels);
+		this->internal_format = 0;
+		this->type = GL_UNSIGNED_BYTE;
+		this->mipmaps = upload.num_levels > 1;
+		this->num_levels = upload.num_levels;
+		this->texture_type = GL_TEXTURE_2D;
+		glGenTextures(1, &texture_id);
+
+		//offsets are relative to the bound unpack buffer
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, ring->buffer_id);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+		glBindTexture(GL_TEXTURE_2D, texture_id);
+		int w = upload.width, h = upload.height;
+		for (int i = 0; i < upload.num_levels; ++i)
+		{
+			glTexImage2D(GL_TEXTURE_2D, i, format, w, h, 0, format, GL_UNSIGNED_BYTE, (void*)upload.level_offsets[i]);
+			w = std::max(1, w >> 1);
+			h = std::max(1, h >> 1);
+		}
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+		setGrayscaleSwizzle(GL_TEXTURE_2D, upload.num_channels);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, upload.num_levels - 1);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, Texture::default_mag_filter);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, this->mipmaps ? Texture::default_min_filter : GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, (this->mipmaps && wrap) ? GL_REPEAT : GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, (this->mipmaps && wrap) ? GL_REPEAT : GL_CLAMP_TO_EDGE);
+		glBindTexture(GL_TEXTURE_2D, 0);
+
+		//the region can be reused once the GPU has done the copy
+		ring->submit(upload.offset);
+		assert(checkGLErrors() && "Error uploading texture from PBO");
+	}
+
 	void Texture::upload(::Image* img)
 	{
-		create(img->width, img->height, img->num_channels == 3 ? GL_RGB : GL_RGBA, GL_UNSIGNED_BYTE, true, img->data);
+		create(img->width, img->height, formatFromChannels(img->num_channels), GL_UNSIGNED_BYTE, true, img->data);
+		glBindTexture(this->texture_type, texture_id);
+		setGrayscaleSwizzle(this->texture_type, img->num_channels);
+		glBindTexture(this->texture_type, 0);
 	}
 
 	void Texture::upload(FloatImage* img)
@@ -358,7 +503,9 @@ namespace GFX
 				internal_format = format == GL_RGB ? GL_RGB16F : GL_RGBA16F;
 		}
 
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 1); //rows are not padded (RGB or grayscale images)
 		glTexImage2D(this->texture_type, 0, internal_format == 0 ? format : internal_format, width, height, 0, format, type, data);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
 
 		glTexParameteri(this->texture_type, GL_TEXTURE_MAG_FILTER, Texture::default_mag_filter);	//set the min filter
 		glTexParameteri(this->texture_type, GL_TEXTURE_MIN_FILTER, this->mipmaps ? Texture::default_min_filter : GL_LINEAR);   //set the mag filter
@@ -373,14 +520,13 @@ namespace GFX
 		assert(checkGLErrors() && "Error uploading texture");
 	}
 
-	/*
 	void Texture::upload3D(unsigned int format, unsigned int type, bool mipmaps, Uint8* data, unsigned int internal_format) {
 		assert(texture_id && "Must create texture before uploading data.");
 		assert(texture_type == GL_TEXTURE_3D && "Texture type does not match.");
 
 		glBindTexture(this->texture_type, texture_id);	//we activate this id to tell opengl we are going to use this texture
 
-		glTexImage3D(this->texture_type, 0, internal_format == 0 ? format : internal_format, width, height, depth, 0, format, type, data);
+		glTexImage3D(this->texture_type, 0, internal_format == 0 ? format : internal_format, (GLsizei)width, (GLsizei)height, (GLsizei)depth, 0, format, type, data);
 
 		glTexParameteri(this->texture_type, GL_TEXTURE_MAG_FILTER, Texture::default_mag_filter);	//set the min filter
 		glTexParameteri(this->texture_type, GL_TEXTURE_MIN_FILTER, this->mipmaps ? Texture::default_min_filter : GL_LINEAR);   //set the mag filter
@@ -394,7 +540,6 @@ namespace GFX
 		glBindTexture(this->texture_type, 0);
 		assert(checkGLErrors() && "Error uploading texture");
 	}
-	*/
 
 	void Texture::uploadCubemap(unsigned int format, unsigned int t, bool mips, Uint8** data, unsigned int intFormat, int level) {
 
@@ -470,8 +615,9 @@ namespace GFX
 
 		texture_type = GL_TEXTURE_2D_ARRAY;
 		type = GL_UNSIGNED_BYTE;
-		int dataFormat = (image.num_channels == 3 ? GL_RGB : GL_RGBA);
-		format = (image.num_channels == 3 ? GL_RGB8 : GL_RGBA8);
+		static const int sized_formats[] = { GL_R8, GL_RG8, GL_RGB8, GL_RGBA8 };
+		int dataFormat = formatFromChannels(image.num_channels);
+		format = sized_formats[image.num_channels - 1];
 		this->width = (float)width;
 		this->height = (float)height;
 		int bytes_per_pixel = image.num_channels;
@@ -503,8 +649,11 @@ namespace GFX
 		if (texture_id == 0)
 			glGenTextures(1, &texture_id); //we need to create an unique ID for the texture
 		glBindTexture(this->texture_type, texture_id);	//we activate this id to tell opengl we are going to use this texture
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
 		glTexImage3D(this->texture_type, 0, format, width, height, num_textures, 0, dataFormat, type, data);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
 		assert(glGetError() == GL_NO_ERROR);
+		setGrayscaleSwizzle(this->texture_type, image.num_channels);
 
 		glTexParameteri(this->texture_type, GL_TEXTURE_MAG_FILTER, Texture::default_mag_filter);	//set the min filter
 		glTexParameteri(this->texture_type, GL_TEXTURE_MIN_FILTER, this->mipmaps ? Texture::default_min_filter : GL_LINEAR); //set the mag filter
@@ -530,40 +679,114 @@ namespace GFX
 		return loadKTX(buffer);
 	}
 
-	bool Texture::loadKTX(std::vector<unsigned char>& buffer)
+	bool Texture::loadKTX(std::vector<unsigned char>& buffer, int first_level)
 	{
-		std::vector<unsigned char> out_image;
-
 		ddsktx_texture_info tc = { 0 };
-		if (!ddsktx_parse(&tc, &buffer[0], buffer.size(), NULL))
+		ddsktx_error error;
+		if (buffer.empty() || !ddsktx_parse(&tc, &buffer[0], (int)buffer.size(), &error))
+		{
+			std::cout << "[ERROR] KTX/DDS not valid: " << (buffer.empty() ? "empty" : error.msg) << std::endl;
 			return false;
+		}
 
-		this->texture_type = GL_TEXTURE_2D;
-		if (tc.flags & DDSKTX_TEXTURE_FLAG_CUBEMAP)
-			this->texture_type = GL_TEXTURE_CUBE_MAP;
-		else if (tc.flags & DDSKTX_TEXTURE_FLAG_VOLUME)
-			this->texture_type = GL_TEXTURE_3D;
+		if (tc.flags & DDSKTX_TEXTURE_FLAG_VOLUME)
+		{
+			std::cout << "[ERROR] KTX/DDS volume textures not supported" << std::endl;
+			return false;
+		}
 
-		if (texture_id == 0)
-			glGenTextures(1, &texture_id); //we need to create an unique ID for the texture
+		//format to upload and how it is stored in VRAM
+		bool has_alpha = (tc.flags & DDSKTX_TEXTURE_FLAG_ALPHA) != 0;
+		unsigned int format = 0;
+		unsigned int internal_format = 0;
+		switch (tc.format)
+		{
+		case DDSKTX_FORMAT_BC1: format = has_alpha ? GL_RGBA : GL_RGB; internal_format = has_alpha ? GL_COMPRESSED_RGBA_S3TC_DXT1_EXT : GL_COMPRESSED_RGB_S3TC_DXT1_EXT; break;
+		case DDSKTX_FORMAT_BC2: format = GL_RGBA; internal_format = GL_COMPRESSED_RGBA_S3TC_DXT3_EXT; break;
+		case DDSKTX_FORMAT_BC3: format = GL_RGBA; internal_format = GL_COMPRESSED_RGBA_S3TC_DXT5_EXT; break;
+		case DDSKTX_FORMAT_BC4: format = GL_RED; internal_format = GL_COMPRESSED_RED_RGTC1; break;
+		case DDSKTX_FORMAT_BC5: format = GL_RG; internal_format = GL_COMPRESSED_RG_RGTC2; break;
+		case DDSKTX_FORMAT_BC6H: format = GL_RGB; internal_format = GL_COMPRESSED_RGB_BPTC_UNSIGNED_FLOAT; break;
+		case DDSKTX_FORMAT_BC7: format = GL_RGBA; internal_format = GL_COMPRESSED_RGBA_BPTC_UNORM; break;
+		case DDSKTX_FORMAT_R8: format = GL_RED; internal_format = GL_R8; break;
+		case DDSKTX_FORMAT_RG8: format = GL_RG; internal_format = GL_RG8; break;
+		case DDSKTX_FORMAT_RGB8: format = GL_RGB; internal_format = GL_RGB8; break;
+		case DDSKTX_FORMAT_RGBA8: format = GL_RGBA; internal_format = GL_RGBA8; break;
+		case DDSKTX_FORMAT_BGRA8: format = GL_BGRA; internal_format = GL_RGBA8; break;
+		default:
+			std::cout << "[ERROR] KTX/DDS format not supported: " << ddsktx_format_str(tc.format) << std::endl;
+			return false;
+		}
+		bool compressed = ddsktx_format_compressed(tc.format);
+		bool cubemap = (tc.flags & DDSKTX_TEXTURE_FLAG_CUBEMAP) != 0;
+		first_level = cubemap ? 0 : std::min(std::max(first_level, 0), tc.num_mips - 1);
+
+		//Delete previous texture, it could be of another type
+		if (this->texture_id != 0)
+			clear();
+
+		this->width = (float)std::max(1, tc.width >> first_level);
+		this->height = (float)std::max(1, tc.height >> first_level);
+		this->depth = 0;
+		this->format = format;
+		this->internal_format = internal_format;
+		this->type = GL_UNSIGNED_BYTE;
+		this->num_levels = tc.num_mips - first_level;
+		this->mipmaps = num_levels > 1;
+		this->texture_type = cubemap ? GL_TEXTURE_CUBE_MAP : GL_TEXTURE_2D;
+
+		glGenTextures(1, &texture_id); //we need to create an unique ID for the texture
 		glBindTexture(this->texture_type, texture_id);	//we activate this id to tell opengl we are going to use this texture
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
 
-		for (int mip = 0; mip < tc.num_mips; mip++) {
-			ddsktx_sub_data sub_data;
-			ddsktx_get_sub(&tc, &sub_data, &buffer[0], buffer.size(), 0, 0, mip);
-			// Fill/Set texture sub resource data (mips in this case)
-			/*
-			if (ddsktx_format_compressed(tc.format))
-				//glCompressedTexImage2D(this->texture_type,mip,
-			else
-				glTexImage2D(this->texture_type, mip, internal_format == 0 ? format : internal_format, width, height, 0, format, type, data);
-				//glTexImage2D(..);
-			*/
+		int num_faces = texture_type == GL_TEXTURE_CUBE_MAP ? 6 : 1;
+		for (int face = 0; face < num_faces; ++face)
+		{
+			unsigned int target = texture_type == GL_TEXTURE_CUBE_MAP ? GL_TEXTURE_CUBE_MAP_POSITIVE_X + face : GL_TEXTURE_2D;
+			for (int mip = first_level; mip < tc.num_mips; mip++)
+			{
+				ddsktx_sub_data sub_data;
+				ddsktx_get_sub(&tc, &sub_data, &buffer[0], (int)buffer.size(), 0, face, mip);
+				if (compressed)
+					glCompressedTexImage2D(target, mip - first_level, internal_format, sub_data.width, sub_data.height, 0, sub_data.size_bytes, sub_data.buff);
+				else
+					glTexImage2D(target, mip - first_level, internal_format, sub_data.width, sub_data.height, 0, format, GL_UNSIGNED_BYTE, sub_data.buff);
+			}
 		}
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
 
+		//single channel textures are grayscale
+		if (format == GL_RED)
+		{
+			GLint swizzle[] = { GL_RED, GL_RED, GL_RED, GL_ONE };
+			glTexParameteriv(this->texture_type, GL_TEXTURE_SWIZZLE_RGBA, swizzle);
+		}
+
+		glTexParameteri(this->texture_type, GL_TEXTURE_MAX_LEVEL, num_levels - 1);
+		glTexParameteri(this->texture_type, GL_TEXTURE_MAG_FILTER, Texture::default_mag_filter);
+		glTexParameteri(this->texture_type, GL_TEXTURE_MIN_FILTER, this->mipmaps ? Texture::default_min_filter : GL_LINEAR);
+		glTexParameteri(this->texture_type, GL_TEXTURE_WRAP_S, (this->mipmaps && num_faces == 1) ? GL_REPEAT : GL_CLAMP_TO_EDGE);
+		glTexParameteri(this->texture_type, GL_TEXTURE_WRAP_T, (this->mipmaps && num_faces == 1) ? GL_REPEAT : GL_CLAMP_TO_EDGE);
+		glBindTexture(this->texture_type, 0);
+
+		assert(checkGLErrors() && "Error uploading KTX/DDS");
 		return true;
 	}
 
+	std::string Texture::getCompressedFilename(const char* filename)
+	{
+		std::string str = filename;
+		std::string ext = toLowerCase(getExtension(str));
+		if (!use_compressed || ext.empty() || ext == "dds" || ext == "ktx" || ext == "hdre")
+			return "";
+		std::string base = str.substr(0, str.size() - ext.size());
+		if (fileExists(base + "dds"))
+			return base + "dds";
+		if (fileExists(base + "ktx"))
+			return base + "ktx";
+		return "";
+	}
+
 
 	void Texture::bind()
 	{
@@ -606,6 +829,130 @@ namespace GFX
 		glTexParameteri(this->texture_type, GL_TEXTURE_MIN_FILTER, Texture::default_min_filter);
 		glGenerateMipmap(this->texture_type);
 #endif
+		num_levels = getNumMips((int)width, (int)height);
+	}
+
+	size_t Texture::getVRAMBytes()
+	{
+		//bits per pixel
+		int bpp = 0;
+		switch (internal_format)
+		{
+		case GL_COMPRESSED_RGB_S3TC_DXT1_EXT: case GL_COMPRESSED_RGBA_S3TC_DXT1_EXT: case GL_COMPRESSED_RED_RGTC1: bpp = 4; break;
+		case GL_COMPRESSED_RGBA_S3TC_DXT3_EXT: case GL_COMPRESSED_RGBA_S3TC_DXT5_EXT: case GL_COMPRESSED_RG_RGTC2:
+		case GL_COMPRESSED_RGB_BPTC_UNSIGNED_FLOAT: case GL_COMPRESSED_RGBA_BPTC_UNORM: bpp = 8; break;
+		default:
+		{
+			int channels = 4;
+			if (format == GL_RED || format == GL_DEPTH_COMPONENT) channels = 1;
+			else if (format == GL_RG) channels = 2;
+			else if (format == GL_RGB) channels = 3;
+			int size = 1;
+			if (type == GL_HALF_FLOAT) size = 2;
+			else if (type == GL_FLOAT || type == GL_UNSIGNED_INT) size = 4;
+			bpp = channels * size * 8;
+		}
+		}
+
+		size_t pixels = 0;
+		int w = (int)width, h = (int)height;
+		for (int i = 0; i < num_levels; ++i)
+		{
+			pixels += (size_t)w * h;
+			w = std::max(1, w >> 1);
+			h = std::max(1, h >> 1);
+		}
+		int layers = texture_type == GL_TEXTURE_CUBE_MAP ? 6 : std::max(1, (int)depth);
+		return pixels * layers * bpp / 8;
+	}
+
+	bool Texture::isBindlessSupported()
+	{
+		static int supported = -1;
+		if (supported != -1)
+			return supported == 1;
+
+		supported = 0;
+		if (!SDL_GL_ExtensionSupported("GL_ARB_bindless_texture") || !SDL_GL_ExtensionSupported("GL_ARB_shader_storage_buffer_object"))
+			return false;
+		getTextureHandle = (getTextureHandle_func)SDL_GL_GetProcAddress("glGetTextureHandleARB");
+		makeTextureHandleResident = (makeTextureHandle_func)SDL_GL_GetProcAddress("glMakeTextureHandleResidentARB");
+		makeTextureHandleNonResident = (makeTextureHandle_func)SDL_GL_GetProcAddress("glMakeTextureHandleNonResidentARB");
+		if (getTextureHandle && makeTextureHandleResident && makeTextureHandleNonResident)
+			supported = 1;
+		return supported == 1;
+	}
+
+	uint64_t Texture::getBindlessHandle()
+	{
+		assert(getTextureHandle && "call isBindlessSupported first");
+		if (!bindless_handle && texture_id)
+		{
+			bindless_handle = getTextureHandle(texture_id);
+			makeTextureHandleResident(bindless_handle);
+		}
+		return bindless_handle;
+	}
+
+	void Texture::releaseBindlessHandle()
+	{
+		if (!bindless_handle)
+			return;
+		makeTextureHandleNonResident(bindless_handle);
+		bindless_handle = 0;
+	}
+
+	bool Texture::dropLevels(int count)
+	{
+		if (texture_type != GL_TEXTURE_2D || count <= 0 || count >= num_levels)
+			return false;
+
+		//immutable storage of the same format, so the levels can be copied as they are
+		unsigned int storage_format = internal_format;
+		if (!storage_format)
+		{
+			if (type != GL_UNSIGNED_BYTE)
+				return false;
+			static const unsigned int sized[] = { GL_R8, GL_RG8, GL_RGB8, GL_RGBA8 };
+			storage_format = format == GL_RED ? sized[0] : (format == GL_RG ? sized[1] : (format == GL_RGB ? sized[2] : sized[3]));
+		}
+
+		int levels = num_levels - count;
+		int w = std::max(1, (int)width >> count);
+		int h = std::max(1, (int)height >> count);
+		GLuint new_id = 0;
+		glGenTextures(1, &new_id);
+		glBindTexture(GL_TEXTURE_2D, new_id);
+		glTexStorage2D(GL_TEXTURE_2D, levels, storage_format, w, h);
+		for (int i = 0; i < levels; ++i)
+			glCopyImageSubData(texture_id, GL_TEXTURE_2D, i + count, 0, 0, 0, new_id, GL_TEXTURE_2D, i, 0, 0, 0, std::max(1, w >> i), std::max(1, h >> i), 1);
+
+		//same sampling than the old one
+		GLint params[4];
+		glBindTexture(GL_TEXTURE_2D, texture_id);
+		glGetTexParameteriv(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_RGBA, params);
+		GLint wrap_s, wrap_t, min_filter, mag_filter;
+		glGetTexParameteriv(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, &wrap_s);
+		glGetTexParameteriv(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, &wrap_t);
+		glGetTexParameteriv(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, &min_filter);
+		glGetTexParameteriv(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, &mag_filter);
+		glBindTexture(GL_TEXTURE_2D, new_id);
+		glTexParameteriv(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_RGBA, params);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, wrap_s);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, wrap_t);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, min_filter);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, mag_filter);
+		glBindTexture(GL_TEXTURE_2D, 0);
+
+		releaseBindlessHandle();
+		glDeleteTextures(1, &texture_id);
+		texture_id = new_id;
+		this->width = (float)w;
+		this->height = (float)h;
+		num_levels = levels;
+		lod += count;
+		assert(checkGLErrors() && "Error dropping texture levels");
+		return true;
 	}
 
 
@@ -854,25 +1201,12 @@ bool Image::loadPNG(const char* filename, bool flip_y)
 	std::vector<unsigned char> buffer;
 	if (!readFileBin(filename, buffer))
 		return false;
-	return loadPNG(buffer);
+	return loadPNG(buffer, flip_y);
 }
 
 bool Image::loadPNG(std::vector<unsigned char>& buffer, bool flip_y)
 {
-    std::vector<unsigned char> out_image;
-
-	if (decodePNG(out_image, width, height, buffer.empty() ? 0 : &buffer[0], (unsigned long)buffer.size(), true) != 0)
-		return false;
-
-	data = new Uint8[out_image.size()];
-	memcpy(data, &out_image[0], out_image.size());
-	num_channels = 4;
-
-	//flip pixels in Y
-	if (flip_y)
-		flipY();
-
-	return true;
+	return loadSTB(buffer, flip_y);
 }
 
 bool Image::loadJPG(const char* filename, bool flip_y)
@@ -880,36 +1214,33 @@ bool Image::loadJPG(const char* filename, bool flip_y)
 	std::vector<unsigned char> buffer;
 	if (!readFileBin(filename, buffer))
 		return false;
-	return loadJPG(buffer);
+	return loadJPG(buffer, flip_y);
 }
 
 bool Image::loadJPG(std::vector<unsigned char>& buffer, bool flip_y)
 {
-	std::vector<unsigned char> out_image;
+	return loadSTB(buffer, flip_y);
+}
 
-	int width;
-	int height;
-	int actual_comps;
-	int channels;
+bool Image::loadSTB(std::vector<unsigned char>& buffer, bool flip_y)
+{
+	if (buffer.empty())
+		return false;
 
-	//stb_image
-	unsigned char* image_data = stbi_load_from_memory( (stbi_uc*) &buffer[0], (unsigned long)buffer.size(), &width, &height, &channels, STBI_rgb);
-	if (!image_data)
+	//stb flips in place while decoding, before returning the pixels
+	int width, height, channels;
+	stbi_set_flip_vertically_on_load_thread(flip_y);
+	unsigned char* pixels = stbi_load_from_memory((stbi_uc*)&buffer[0], (int)buffer.size(), &width, &height, &channels, 0);
+	stbi_set_flip_vertically_on_load_thread(false);
+	if (!pixels)
 		return false;
+
+	//allocated with new[] (see stbiMalloc), so we keep it
+	clear();
+	data = pixels;
 	this->width = (unsigned int)width;
 	this->height = (unsigned int)height;
-	this->num_channels = 3;// (unsigned int)channels;
-
-	//clone
-	data = new unsigned char[width * height * this->num_channels];
-	memcpy(data, image_data, width * height * this->num_channels);
-
-	stbi_image_free(image_data);
-
-	//flip pixels in Y
-	if (flip_y)
-		flipY();
-
+	this->num_channels = (unsigned int)channels;
 	return true;
 }
 
@@ -972,6 +1303,8 @@ void tImage<T>::flipY()
 	delete[] temp_row;
 }
 
+template void tImage<uint8>::flipY();
+
 struct tImageHeader {
 	int width;
 	int height;
@@ -1051,6 +1384,27 @@ bool isPowerOfTwo( int n )
 	return (n & (n - 1)) == 0;
 }
 
+void downsampleImage(const uint8* src, int width, int height, int num_channels, uint8* dst)
+{
+	int w = std::max(1, width >> 1);
+	int h = std::max(1, height >> 1);
+	int stride = width * num_channels;
+	for (int y = 0; y < h; ++y)
+	{
+		//odd sizes ignore the last row/column
+		const uint8* row0 = src + (y * 2) * stride;
+		const uint8* row1 = height > 1 ? row0 + stride : row0;
+		for (int x = 0; x < w; ++x)
+		{
+			const uint8* p0 = row0 + (x * 2) * num_channels;
+			const uint8* p1 = row1 + (x * 2) * num_channels;
+			int next = width > 1 ? num_channels : 0;
+			for (int c = 0; c < num_channels; ++c)
+				*dst++ = (p0[c] + p0[c + next] + p1[c] + p1[c + next] + 2) >> 2;
+		}
+	}
+}
+
 GFX::Texture* CubemapFromHDRE(const char* filename, GFX::Texture* output)
 {
 	HDRE* hdre = HDRE::Get(filename);
@@ -1081,24 +1435,210 @@ GFX::Texture* CubemapFromHDRE(const char* filename, GFX::Texture* output)
 
 //*********************
 
+size_t GFX::Texture::max_decoding_bytes = 256 * 1024 * 1024;
+
+//images decoded and not uploaded yet, and the loads waiting for them
+struct sDecodeQueue {
+	std::mutex mutex;
+	size_t inflight_bytes = 0;
+	size_t peak_bytes = 0;
+	std::deque<LoadTextureTask*> waiting;
+
+	//stats
+	int num_decoded = 0;
+	double decode_ms = 0.0;
+	size_t decoded_bytes = 0;
+} decode_queue;
+
+//returns false if there is no room, then a copy of the task is queued till some bytes are released
+static bool reserveDecodeBytes(LoadTextureTask* task, size_t bytes)
+{
+	const std::lock_guard<std::mutex> lock(decode_queue.mutex);
+	//one image is always allowed, even if it is bigger than the max
+	if (decode_queue.inflight_bytes && decode_queue.inflight_bytes + bytes > GFX::Texture::max_decoding_bytes)
+	{
+		LoadTextureTask* copy = new LoadTextureTask(task->filename.c_str());
+		copy->lod = task->lod;
+		copy->batch = task->batch;
+		copy->reserved = true;
+		copy->reserved_bytes = bytes;
+		decode_queue.waiting.push_back(copy);
+		return false;
+	}
+	decode_queue.inflight_bytes += bytes;
+	decode_queue.peak_bytes = std::max(decode_queue.peak_bytes, decode_queue.inflight_bytes);
+	return true;
+}
+
+static void releaseDecodeBytes(size_t bytes)
+{
+	std::vector<LoadTextureTask*> ready;
+	{
+		const std::lock_guard<std::mutex> lock(decode_queue.mutex);
+		decode_queue.inflight_bytes -= bytes;
+		while (!decode_queue.waiting.empty())
+		{
+			LoadTextureTask* task = decode_queue.waiting.front();
+			if (decode_queue.inflight_bytes && decode_queue.inflight_bytes + task->reserved_bytes > GFX::Texture::max_decoding_bytes)
+				break;
+			decode_queue.inflight_bytes += task->reserved_bytes;
+			decode_queue.waiting.pop_front();
+			ready.push_back(task);
+		}
+		decode_queue.peak_bytes = std::max(decode_queue.peak_bytes, decode_queue.inflight_bytes);
+	}
+	for (LoadTextureTask* task : ready)
+		TaskManager::background.addTask(task);
+}
+
+std::string GFX::Texture::getLoadStats()
+{
+	const std::lock_guard<std::mutex> lock(decode_queue.mutex);
+	char str[256];
+	double mb = 1.0 / (1024 * 1024);
+	snprintf(str, sizeof(str), "Textures decoded: %d, avg %.1f ms, %.1f MB/s per thread. In flight %.1f MB (peak %.1f, max %.1f), %d waiting",
+		decode_queue.num_decoded, decode_queue.num_decoded ? decode_queue.decode_ms / decode_queue.num_decoded : 0.0,
+		decode_queue.decode_ms > 0.0 ? decode_queue.decoded_bytes * mb / (decode_queue.decode_ms * 0.001) : 0.0,
+		decode_queue.inflight_bytes * mb, decode_queue.peak_bytes * mb, max_decoding_bytes * mb, (int)decode_queue.waiting.size());
+	return str;
+}
+
+void sTextureBatch::finishItem(const char* filename, double ms, size_t bytes)
+{
+	if (filename)
+	{
+		const std::lock_guard<std::mutex> lock(mutex);
+		times.push_back(std::make_pair(std::string(filename), ms));
+		decoded_bytes += bytes;
+	}
+	if (--pending > 0 || times.empty())
+		return;
+
+	//the last one, the rest have finished
+	double elapsed = getHighResTime() - start_time;
+	std::sort(times.begin(), times.end(), [](const std::pair<std::string, double>& a, const std::pair<std::string, double>& b) { return a.second > b.second; });
+	std::cout << " + Texture batch: " << TermColor::YELLOW << times.size() << TermColor::DEFAULT << " decoded in " << (int)elapsed << "ms, "
+		<< (decoded_bytes / (1024.0 * 1024.0)) / (elapsed * 0.001) << " MB/s" << std::endl;
+	for (auto& time : times)
+		std::cout << "\t" << (int)time.second << "ms " << time.first << std::endl;
+}
+
+//keeps only the level of the mip chain we want to upload
+static void skipImageLevels(Image* image, int count)
+{
+	Image level;
+	for (int i = 0; i < count; ++i)
+	{
+		level.resize(std::max(1u, image->width >> 1), std::max(1u, image->height >> 1), image->num_channels);
+		downsampleImage(image->data, image->width, image->height, image->num_channels, level.data);
+		std::swap(image->data, level.data);
+		std::swap(image->width, level.width);
+		std::swap(image->height, level.height);
+	}
+}
+
 LoadTextureTask::LoadTextureTask(const char* str)
 {
 	filename = str;
+	lod = -1;
 	image = NULL;
+	reserved = false;
+	reserved_bytes = 0;
 }
 
 void LoadTextureTask::onExecute()
 {
+	double start = getHighResTime();
+
+	//block compressed version, it is small and has its mipmaps so it goes as it is
+	std::string compressed = GFX::Texture::getCompressedFilename(filename.c_str());
+	if (compressed.size())
+	{
+		std::vector<unsigned char>* buffer = new std::vector<unsigned char>();
+		if (readFileBin(compressed, *buffer))
+		{
+			if (batch)
+				batch->finishItem(compressed.c_str(), getHighResTime() - start, buffer->size());
+			UploadTextureTask* upload_task = new UploadTextureTask(filename.c_str(), buffer);
+
+			//the file has all the levels, loadKTX skips the ones we do not want
+			ddsktx_texture_info tc = { 0 };
+			if (!buffer->empty() && ddsktx_parse(&tc, &(*buffer)[0], (int)buffer->size(), NULL) &&
+				!(tc.flags & DDSKTX_TEXTURE_FLAG_CUBEMAP) && tc.num_mips > 1)
+			{
+				int first = lod >= 0 ? lod : GFX::TextureStreamer::getFirstLod(tc.width, tc.height);
+				upload_task->lod = std::min(first, tc.num_mips - 1);
+				upload_task->source_width = tc.width;
+				upload_task->source_height = tc.height;
+			}
+			TaskManager::foreground.addTask(upload_task);
+			return;
+		}
+		delete buffer;
+	}
+
+	//wait if there are too many images decoded waiting to be uploaded (we only read the header to know the size)
+	if (!reserved)
+	{
+		int width, height, channels;
+		size_t bytes = stbi_info(filename.c_str(), &width, &height, &channels) ? (size_t)width * height * channels : 0;
+		if (!reserveDecodeBytes(this, bytes))
+			return;
+		reserved = true;
+		reserved_bytes = bytes;
+	}
+
+	start = getHighResTime();
 	image = new Image();
-	if (!image->load(filename.c_str()))
+	bool loaded = image->load(filename.c_str());
+	double ms = getHighResTime() - start;
+	size_t bytes = loaded ? image->width * image->height * image->num_channels : 0;
+	{
+		const std::lock_guard<std::mutex> lock(decode_queue.mutex);
+		decode_queue.num_decoded++;
+		decode_queue.decode_ms += ms;
+		decode_queue.decoded_bytes += bytes;
+	}
+	if (batch)
+		batch->finishItem(filename.c_str(), ms, bytes);
+
+	if (!loaded)
 	{
 		delete image;
 		image = NULL;
+		releaseDecodeBytes(reserved_bytes);
 		return;
 	}
 
-	//image loaded, ready to go back to main thread
-	UploadTextureTask* upload_task = new UploadTextureTask(filename.c_str(), image);
+	//only images with a mip chain can be streamed
+	int source_width = 0, source_height = 0, skipped = 0;
+	if (isPowerOfTwo(image->width) && isPowerOfTwo(image->height))
+	{
+		source_width = image->width;
+		source_height = image->height;
+		skipped = lod >= 0 ? lod : GFX::TextureStreamer::getFirstLod(image->width, image->height);
+		skipImageLevels(image, skipped);
+	}
+
+	//write it straight in upload memory, with its mipmaps, so the main thread only has to copy it
+	GFX::sPBOUpload staging;
+	UploadTextureTask* upload_task = NULL;
+	if (GFX::writeImageToPBO(image->data, image->width, image->height, image->num_channels, true, staging))
+	{
+		delete image;
+		image = NULL;
+		releaseDecodeBytes(reserved_bytes);
+		upload_task = new UploadTextureTask(filename.c_str(), staging);
+	}
+	else
+	{
+		//image loaded, ready to go back to main thread
+		upload_task = new UploadTextureTask(filename.c_str(), image);
+		upload_task->reserved_bytes = reserved_bytes;
+	}
+	upload_task->lod = skipped;
+	upload_task->source_width = source_width;
+	upload_task->source_height = source_height;
 	TaskManager::foreground.addTask(upload_task);
 }
 
@@ -1106,18 +1646,46 @@ UploadTextureTask::UploadTextureTask(const char* filename, Image* image)
 {
 	this->filename = filename;
 	this->image = image;
+	this->compressed = NULL;
+	this->reserved_bytes = 0;
+	this->lod = 0;
+	this->source_width = this->source_height = 0;
 	assert(image && "image cannot be null");
 }
 
+UploadTextureTask::UploadTextureTask(const char* filename, const GFX::sPBOUpload& staging)
+{
+	this->filename = filename;
+	this->image = NULL;
+	this->compressed = NULL;
+	this->reserved_bytes = 0;
+	this->staging = staging;
+	this->lod = 0;
+	this->source_width = this->source_height = 0;
+}
+
+UploadTextureTask::UploadTextureTask(const char* filename, std::vector<unsigned char>* compressed)
+{
+	this->filename = filename;
+	this->image = NULL;
+	this->compressed = compressed;
+	this->reserved_bytes = 0;
+	this->lod = 0;
+	this->source_width = this->source_height = 0;
+}
+
+float UploadTextureTask::getImportance()
+{
+	//called from the main thread, so we can access the manager
+	auto it = GFX::Texture::sTexturesLoaded.find(filename);
+	if (it == GFX::Texture::sTexturesLoaded.end())
+		return 0.0f;
+	return it->second->screen_importance;
+}
+
 void UploadTextureTask::onExecute()
 {
 	GFX::Texture* texture = NULL;
-	if (!image)
-	{
-		std::cerr << "Image is null: " << filename << std::endl;
-		return;
-	}
-	assert(image && "image cant be null");
 
 	//in case somehow it got loaded while I was loading it in the background
 	auto it = GFX::Texture::sTexturesLoaded.find(filename);
@@ -1128,17 +1696,44 @@ void UploadTextureTask::onExecute()
 		if (!texture)
 			texture = new Texture();
 		*/
-		delete image;
+		if (image)
+		{
+			delete image;
+			releaseDecodeBytes(reserved_bytes);
+		}
+		else if (compressed)
+			delete compressed;
+		else
+			GFX::PBORing::instance->cancel(staging.offset);
 		std::cout << "Warning: image loaded in background not found foreground thread" << std::endl;
 		return;
 	}
 
 	texture = it->second;
 
-	//upload to GPU
-	texture->loadFromImage(image);
+	//upload to GPU (create clears the texture, which unregisters it)
+	if (compressed)
+	{
+		texture->loadKTX(*compressed, lod);
+		GFX::addUploadedBytes(compressed->size());
+		delete compressed;
+	}
+	else if (!image)
+	{
+		texture->loadFromPBO(staging);
+		GFX::addUploadedBytes(staging.size);
+	}
+	else
+	{
+		texture->loadFromImage(image);
+		GFX::addUploadedBytes(image->width * image->height * image->num_channels);
+		delete image;
+		releaseDecodeBytes(reserved_bytes);
+	}
+	texture->setName(filename.c_str());
 	texture->loading = false;
-
-	//delete image
-	delete image;
+	texture->streaming = false;
+	texture->lod = lod;
+	texture->source_width = source_width;
+	texture->source_height = source_height;
 }
@@ -7,9 +7,11 @@
 #include "../core/includes.h"
 #include "../core/math.h"
 #include "../core/task.h"
+#include "pbo.h"
 #include <map>
 #include <set>
 #include <string>
+#include <memory>
 #include <cassert>
 
 //forward declaration
@@ -18,6 +20,7 @@ namespace GFX {
 	class FBO;
 	class Texture;
 };
+struct sTextureBatch;
 
 #ifndef OPENGL_ES3
 #define GL_RGBA32F 0x8814
@@ -56,11 +59,14 @@ public:
 	Color getPixel(int x, int y) {
 		assert(x >= 0 && x < (int)width && y >= 0 && y < (int)height && "reading of memory");
 		int pos = y*width* num_channels + x* num_channels;
-		return Color(data[pos], data[pos + 1], data[pos + 2], num_channels == 4 ? 255 : data[pos + 3]);
+		if (num_channels < 3) //grayscale (and alpha)
+			return Color(data[pos], data[pos], data[pos], num_channels == 2 ? data[pos + 1] : 255);
+		return Color(data[pos], data[pos + 1], data[pos + 2], num_channels == 4 ? data[pos + 3] : 255);
 	};
 	void setPixel(int x, int y, Color v) {
 		assert(x >= 0 && x < (int)width && y >= 0 && y < (int)height && "writing of memory");
 		int pos = y*width*num_channels + x* num_channels;
+		if (num_channels < 3) { data[pos] = v.x; if (num_channels == 2) data[pos + 1] = v.w; return; }
 		data[pos] = v.x; data[pos + 1] = v.y; data[pos + 2] = v.z; if (num_channels == 4) data[pos + 3] = v.w;
 	};
 
@@ -73,10 +79,12 @@ public:
 	bool load(const char* filename);
 
 	bool loadTGA(const char* filename);
-	bool loadPNG(const char* filename, bool flip_y = true);
+	//PNG and JPG keep the channels of the file (1 to 4), decoded straight into data
+	bool loadPNG(const char* filename, bool flip_y = false);
 	bool loadPNG(std::vector<unsigned char>& buffer, bool flip_y = false);
 	bool loadJPG(const char* filename, bool flip_y = false);
 	bool loadJPG(std::vector<unsigned char>& buffer, bool flip_y = false);
+	bool loadSTB(std::vector<unsigned char>& buffer, bool flip_y = false);
 	bool saveTGA(const char* filename, bool flip_y = false);
 };
 
@@ -112,6 +120,7 @@ namespace GFX {
 		static int default_mag_filter;
 		static int default_min_filter;
 		static FBO* global_fbo;
+		static bool use_compressed; //Get and GetAsync use the .dds/.ktx next to the image if it exists
 
 		//a general struct to store all the information about a TGA file
 
@@ -126,9 +135,20 @@ namespace GFX {
 		float depth;	//Optional for 3dTexture or 2dTexture array
 		std::string filename;
 		bool loading;
+		float screen_importance; //while loading, biggest size on screen it had, to upload first the important ones
 		vec2 near_far; //used for depth textures
 		unsigned int index;
 
+		//streaming (see TextureStreamer), source_width is 0 if the texture is not streamed
+		int source_width = 0;
+		int source_height = 0;
+		int lod = 0; //levels of the source that are not resident (0 is full resolution)
+		int wanted_lod = 0; //smallest lod requested in last_used_frame
+		long last_used_frame = -1;
+		bool streaming = false; //a load with another lod is in progress
+		int num_levels = 1; //mipmaps included
+		uint64_t bindless_handle = 0; //0 till getBindlessHandle is called
+
 		unsigned int format; //GL_RGB, GL_RGBA, GL_DEPTH_COMPONENT
 		unsigned int type; //GL_UNSIGNED_INT, GL_FLOAT
 		unsigned int internal_format;
@@ -152,18 +172,19 @@ namespace GFX {
 		void clear();
 
 		void create(unsigned int width, unsigned int height, unsigned int format = GL_RGB, unsigned int type = GL_UNSIGNED_BYTE, bool mipmaps = true, Uint8* data = NULL, unsigned int internal_format = 0);
-		//void create3D(unsigned int width, unsigned int height, unsigned int depth, unsigned int format = GL_RED, unsigned int type = GL_UNSIGNED_BYTE, bool mipmaps = true, Uint8* data = NULL, unsigned int internal_format = 0);
+		void create3D(unsigned int width, unsigned int height, unsigned int depth, unsigned int format = GL_RED, unsigned int type = GL_UNSIGNED_BYTE, bool mipmaps = true, Uint8* data = NULL, unsigned int internal_format = 0);
 		void createCubemap(unsigned int width, unsigned int height, Uint8** data = NULL, unsigned int format = GL_RGBA, unsigned int type = GL_UNSIGNED_BYTE, bool mipmaps = true, unsigned int internal_format = 0);
 
 		void upload(::Image* img);
 		void upload(::FloatImage* img);
 		void upload(unsigned int format = GL_RGB, unsigned int type = GL_UNSIGNED_BYTE, bool mipmaps = true, const Uint8* data = NULL, unsigned int internal_format = 0);
-		//void upload3D(unsigned int format = GL_RED, unsigned int type = GL_UNSIGNED_BYTE, bool mipmaps = true, Uint8* data = NULL, unsigned int internal_format = 0);
+		void upload3D(unsigned int format = GL_RED, unsigned int type = GL_UNSIGNED_BYTE, bool mipmaps = true, Uint8* data = NULL, unsigned int internal_format = 0);
 		void uploadCubemap(unsigned int format = GL_RGB, unsigned int type = GL_UNSIGNED_BYTE, bool mipmaps = true, Uint8** data = NULL, unsigned int internal_format = 0, int level = 0);
 		void uploadAsArray(unsigned int texture_size, bool mipmaps = true);
 
-		bool loadKTX(const char* filename);
-		bool loadKTX(std::vector<unsigned char>& buffer);
+		bool loadKTX(const char* filename); //also DDS, BC1-7 with all their mipmaps
+		bool loadKTX(std::vector<unsigned char>& buffer, int first_level = 0); //first_level skips the biggest mips
+		static std::string getCompressedFilename(const char* filename); //empty if there is no compressed version
 
 		void bind();
 		void unbind();
@@ -177,10 +198,16 @@ namespace GFX {
 		//load without using the manager
 		bool load(const char* filename, bool mipmaps = true, bool wrap = true, unsigned int type = GL_UNSIGNED_BYTE);
 		void loadFromImage(::Image* image, bool mipmaps = true, bool wrap = true, unsigned int type = GL_UNSIGNED_BYTE);
+		void loadFromPBO(const GFX::sPBOUpload& upload, bool wrap = true); //pixels (and mipmaps) already in the PBO ring
 
 		//load using the manager (caching loaded ones to avoid reloading them)
 		static Texture* Get(const char* filename, bool mipmaps = true, bool wrap = true);
 		static Texture* GetAsync(const char* filename, bool mipmaps = true, bool wrap = true);
+		static Texture* GetAsync(const char* filename, std::shared_ptr<sTextureBatch> batch);
+		//like GetAsync but reports the decoding time of the whole batch once all are decoded
+		static std::vector<Texture*> GetAsyncBatch(const std::vector<std::string>& filenames);
+		static size_t max_decoding_bytes; //RAM of the images decoded but not uploaded yet, loads wait if reached
+		static std::string getLoadStats();
 		static Texture* Find(const char* filename);
 		void setName(const char* name) {
 			filename = name;
@@ -188,6 +215,13 @@ namespace GFX {
 		}
 
 		void generateMipmaps();
+		size_t getVRAMBytes(); //approximated, mipmaps included
+
+		//bindless (GL_ARB_bindless_texture), shaders can sample the texture from a handle stored in a buffer
+		static bool isBindlessSupported(); //also needs SSBOs, loads the functions the first time
+		uint64_t getBindlessHandle(); //makes it resident, sampling params cannot change after this
+		void releaseBindlessHandle();
+		bool dropLevels(int count); //removes the biggest mips copying the rest to a smaller texture in the GPU
 
 		//show the texture on the current viewport
 		void toViewport(Shader* shader = NULL);
@@ -205,15 +239,36 @@ GFX::Texture* CubemapFromHDRE(const char* filename, GFX::Texture* output = nullp
 
 
 bool isPowerOfTwo(int n);
+//box filter 2x2 to build mipmaps on the CPU, dst must have room for max(1,width/2) * max(1,height/2) pixels
+void downsampleImage(const uint8* src, int width, int height, int num_channels, uint8* dst);
 
 //When loading textures asyncrhonously, first we load them from the hard drive in a background thread
 //afterwards we pass the data to the main thread as bg threads cannot access opengl, and main thread
 //uploads to GPU. While loading a fake 1x1 texture is created
+//If there is a PBO ring the bg thread writes the pixels (and mipmaps) directly in it, so the main thread only
+//has to issue the copy to the texture
+//Images are decoded in all the workers, but only till Texture::max_decoding_bytes are waiting to be uploaded,
+//the rest wait in a queue till some memory is released
+
+//textures requested together (like the ones of a prefab)
+struct sTextureBatch {
+	double start_time;
+	std::atomic<int> pending;
+	std::mutex mutex;
+	std::vector<std::pair<std::string, double>> times; //decode ms of every texture
+	size_t decoded_bytes;
+
+	void finishItem(const char* filename, double ms, size_t bytes); //the last one prints the report
+};
 
 class LoadTextureTask : public Task {
 public:
 	std::string filename;
+	int lod; //levels of the source to skip, -1 for the first load (see TextureStreamer::getFirstLod)
 	Image* image;
+	std::shared_ptr<sTextureBatch> batch; //can be null
+	bool reserved; //reserved_bytes already counted as in flight
+	size_t reserved_bytes;
 
 	LoadTextureTask(const char* filename);
 	void onExecute();
@@ -223,9 +278,18 @@ class UploadTextureTask : public Task {
 public:
 	std::string filename;
 	Image* image;
+	std::vector<unsigned char>* compressed; //KTX/DDS file
+	size_t reserved_bytes; //released once the image is uploaded
+	GFX::sPBOUpload staging; //used if image and compressed are NULL
+	int lod; //skipped levels of the source (already skipped in image and staging)
+	int source_width; //0 if it cannot be streamed
+	int source_height;
 
 	UploadTextureTask(const char* filename, Image* image);
+	UploadTextureTask(const char* filename, const GFX::sPBOUpload& staging);
+	UploadTextureTask(const char* filename, std::vector<unsigned char>* compressed);
 	void onExecute();
+	float getImportance();
 };
 
 #endif
\ No newline at end of file
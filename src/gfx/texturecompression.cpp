@@ -0,0 +1,265 @@
+#include "texturecompression.h"
+
+#include <iostream>
+#include <cstring>
+#include <algorithm>
+#include <cstdint>
+
+#include "texture.h"
+
+namespace GFX {
+
+	static uint16 packRGB565(int r, int g, int b)
+	{
+		return (uint16)(((r * 31 + 127) / 255) << 11 | ((g * 63 + 127) / 255) << 5 | ((b * 31 + 127) / 255));
+	}
+
+	static void unpackRGB565(uint16 c, int* rgb)
+	{
+		int r = (c >> 11) & 31, g = (c >> 5) & 63, b = c & 31;
+		rgb[0] = (r << 3) | (r >> 2);
+		rgb[1] = (g << 2) | (g >> 4);
+		rgb[2] = (b << 3) | (b >> 2);
+	}
+
+	void compressBC1Block(const uint8* rgba, uint8* output)
+	{
+		//bounding box of the colors
+		int min[3] = { 255,255,255 }, max[3] = { 0,0,0 };
+		int mean[3] = { 0,0,0 };
+		for (int i = 0; i < 16; ++i)
+			for (int c = 0; c < 3; ++c)
+			{
+				int v = rgba[i * 4 + c];
+				min[c] = std::min(min[c], v);
+				max[c] = std::max(max[c], v);
+				mean[c] += v;
+			}
+
+		//use the diagonal of the box that follows the colors (sign of the covariance against green)
+		int cov_rg = 0, cov_bg = 0;
+		for (int i = 0; i < 16; ++i)
+		{
+			int g = rgba[i * 4 + 1] * 16 - mean[1];
+			cov_rg += (rgba[i * 4] * 16 - mean[0]) * g;
+			cov_bg += (rgba[i * 4 + 2] * 16 - mean[2]) * g;
+		}
+		if (cov_rg < 0) std::swap(min[0], max[0]);
+		if (cov_bg < 0) std::swap(min[2], max[2]);
+
+		//inset the box a little, endpoints are rarely the extremes
+		for (int c = 0; c < 3; ++c)
+		{
+			int inset = (max[c] - min[c]) / 16;
+			max[c] -= inset;
+			min[c] += inset;
+		}
+
+		uint16 c0 = packRGB565(max[0], max[1], max[2]);
+		uint16 c1 = packRGB565(min[0], min[1], min[2]);
+		if (c0 < c1) //c0 > c1 means 4 colors mode
+			std::swap(c0, c1);
+
+		uint32 indices = 0;
+		if (c0 != c1)
+		{
+			int palette[4][3];
+			unpackRGB565(c0, palette[0]);
+			unpackRGB565(c1, palette[1]);
+			for (int c = 0; c < 3; ++c)
+			{
+				palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+				palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+			}
+
+			for (int i = 0; i < 16; ++i)
+			{
+				int best = 0, best_dist = 0x7FFFFFFF;
+				for (int j = 0; j < 4; ++j)
+				{
+					int dr = rgba[i * 4] - palette[j][0], dg = rgba[i * 4 + 1] - palette[j][1], db = rgba[i * 4 + 2] - palette[j][2];
+					int dist = dr * dr + dg * dg + db * db;
+					if (dist < best_dist)
+					{
+						best_dist = dist;
+						best = j;
+					}
+				}
+				indices |= best << (i * 2);
+			}
+		}
+
+		output[0] = c0 & 0xFF; output[1] = c0 >> 8;
+		output[2] = c1 & 0xFF; output[3] = c1 >> 8;
+		memcpy(output + 4, &indices, 4); //little endian
+	}
+
+	void compressBC4Block(const uint8* rgba, int channel, uint8* output)
+	{
+		int min = 255, max = 0;
+		for (int i = 0; i < 16; ++i)
+		{
+			int v = rgba[i * 4 + channel];
+			min = std::min(min, v);
+			max = std::max(max, v);
+		}
+
+		//a0 > a1 means 8 values mode
+		output[0] = (uint8)max;
+		output[1] = (uint8)min;
+		uint64_t indices = 0; //48 bits used
+		if (max != min)
+		{
+			int palette[8];
+			palette[0] = max;
+			palette[1] = min;
+			for (int j = 1; j < 7; ++j)
+				palette[j + 1] = ((7 - j) * max + j * min) / 7;
+
+			for (int i = 0; i < 16; ++i)
+			{
+				int v = rgba[i * 4 + channel];
+				int best = 0, best_dist = 256;
+				for (int j = 0; j < 8; ++j)
+				{
+					int dist = abs(v - palette[j]);
+					if (dist < best_dist)
+					{
+						best_dist = dist;
+						best = j;
+					}
+				}
+				indices |= (uint64_t)best << (i * 3);
+			}
+		}
+		for (int i = 0; i < 6; ++i)
+			output[2 + i] = (uint8)(indices >> (i * 8));
+	}
+
+	//reads a 4x4 block as RGBA, clamping at the borders
+	static void readBlock(const Image* image, int bx, int by, uint8* rgba)
+	{
+		int nc = image->num_channels;
+		for (int y = 0; y < 4; ++y)
+			for (int x = 0; x < 4; ++x)
+			{
+				int px = std::min(bx + x, (int)image->width - 1);
+				int py = std::min(by + y, (int)image->height - 1);
+				const uint8* src = image->data + (py * image->width + px) * nc;
+				uint8* dst = rgba + (y * 4 + x) * 4;
+				if (nc >= 3)
+				{
+					dst[0] = src[0]; dst[1] = src[1]; dst[2] = src[2];
+					dst[3] = nc == 4 ? src[3] : 255;
+				}
+				else //luminance (and alpha)
+				{
+					dst[0] = dst[1] = dst[2] = src[0];
+					dst[3] = nc == 2 ? src[1] : 255;
+				}
+			}
+	}
+
+	void compressImageBC(const Image* image, eBCFormat format, std::vector<uint8>& output)
+	{
+		int blocks_x = (image->width + 3) / 4;
+		int blocks_y = (image->height + 3) / 4;
+		int block_size = format == BC1 ? 8 : 16;
+		output.resize(blocks_x * blocks_y * block_size);
+
+		uint8 rgba[16 * 4];
+		uint8* dst = &output[0];
+		for (int by = 0; by < blocks_y; ++by)
+			for (int bx = 0; bx < blocks_x; ++bx)
+			{
+				readBlock(image, bx * 4, by * 4, rgba);
+				switch (format)
+				{
+				case BC1: compressBC1Block(rgba, dst); break;
+				case BC3: compressBC4Block(rgba, 3, dst); compressBC1Block(rgba, dst + 8); break;
+				case BC5: compressBC4Block(rgba, 0, dst); compressBC4Block(rgba, 1, dst + 8); break;
+				}
+				dst += block_size;
+			}
+	}
+
+	//DDS header as in the spec (after the "DDS " magic)
+	struct sDDSHeader {
+		uint32 size;
+		uint32 flags;
+		uint32 height;
+		uint32 width;
+		uint32 pitch_or_linear_size;
+		uint32 depth;
+		uint32 mip_count;
+		uint32 reserved1[11];
+		//pixel format
+		uint32 pf_size;
+		uint32 pf_flags;
+		uint32 pf_fourcc;
+		uint32 pf_bit_count;
+		uint32 pf_masks[4];
+		uint32 caps1;
+		uint32 caps2;
+		uint32 caps3;
+		uint32 caps4;
+		uint32 reserved2;
+	};
+
+	bool saveDDS(const char* filename, const Image* image, eBCFormat format, bool mipmaps)
+	{
+		mipmaps = mipmaps && isPowerOfTwo(image->width) && isPowerOfTwo(image->height);
+
+		//levels
+		std::vector<std::vector<uint8>> levels;
+		levels.resize(1);
+		compressImageBC(image, format, levels[0]);
+		if (mipmaps)
+		{
+			Image current, next;
+			const Image* src = image;
+			int w = image->width, h = image->height;
+			while (w > 1 || h > 1)
+			{
+				next.resize(std::max(1, w >> 1), std::max(1, h >> 1), image->num_channels);
+				downsampleImage(src->data, w, h, image->num_channels, next.data);
+				std::swap(current.data, next.data);
+				std::swap(current.width, next.width);
+				std::swap(current.height, next.height);
+				current.num_channels = image->num_channels;
+				src = &current;
+				w = current.width;
+				h = current.height;
+				levels.resize(levels.size() + 1);
+				compressImageBC(&current, format, levels.back());
+			}
+		}
+
+		sDDSHeader header;
+		memset(&header, 0, sizeof(header));
+		header.size = 124;
+		header.flags = 0x1 | 0x2 | 0x4 | 0x1000 | 0x80000 | (mipmaps ? 0x20000 : 0); //caps, height, width, pixelformat, linearsize, mipmapcount
+		header.height = image->height;
+		header.width = image->width;
+		header.pitch_or_linear_size = (uint32)levels[0].size();
+		header.mip_count = (uint32)levels.size();
+		header.pf_size = 32;
+		header.pf_flags = 0x4; //fourcc
+		const char* fourcc = format == BC1 ? "DXT1" : (format == BC3 ? "DXT5" : "ATI2");
+		memcpy(&header.pf_fourcc, fourcc, 4);
+		header.caps1 = 0x1000 | (mipmaps ? 0x400008 : 0); //texture, mipmap and complex
+
+		FILE* f = fopen(filename, "wb");
+		if (!f)
+		{
+			std::cout << "[ERROR] cannot write DDS: " << filename << std::endl;
+			return false;
+		}
+		fwrite("DDS ", 1, 4, f);
+		fwrite(&header, sizeof(header), 1, f);
+		for (auto& level : levels)
+			fwrite(&level[0], 1, level.size(), f);
+		fclose(f);
+		return true;
+	}
+};
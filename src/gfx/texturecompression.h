@@ -0,0 +1,28 @@
+#pragma once
+
+#include "../core/math.h"
+#include <vector>
+
+class Image;
+
+//Simple block compression encoders, used offline to convert the textures of the prefabs to DDS
+//They are fast range fit encoders (not the best quality), good enough for albedo, roughness and normalmaps
+
+namespace GFX {
+
+	enum eBCFormat {
+		BC1, //RGB, 4 bits per pixel
+		BC3, //RGBA, 8 bits per pixel
+		BC5  //RG (normalmaps), 8 bits per pixel
+	};
+
+	//rgba is 16 pixels of 4 bytes (a 4x4 block in rows)
+	void compressBC1Block(const uint8* rgba, uint8* output); //8 bytes
+	void compressBC4Block(const uint8* rgba, int channel, uint8* output); //8 bytes, only one channel of the block
+
+	//compresses the whole image (one level), any size (borders are clamped)
+	void compressImageBC(const Image* image, eBCFormat format, std::vector<uint8>& output);
+
+	//writes all levels (if mipmaps and power of two) in a DDS file that Texture::loadKTX can read
+	bool saveDDS(const char* filename, const Image* image, eBCFormat format, bool mipmaps = true);
+};
@@ -0,0 +1,181 @@
+#include "texturestreamer.h"
+
+#include <vector>
+#include <algorithm>
+
+#include "texture.h"
+#include "../core/includes.h"
+#include "../core/task.h"
+
+namespace GFX {
+
+	bool TextureStreamer::enabled = true;
+	size_t TextureStreamer::budget = 512 * 1024 * 1024;
+	int TextureStreamer::first_load_size = 128;
+	int TextureStreamer::max_loads = 4;
+	long TextureStreamer::frame = 0;
+
+	size_t TextureStreamer::resident_bytes = 0;
+	size_t TextureStreamer::streamed_bytes = 0;
+	int TextureStreamer::num_streamed = 0;
+	int TextureStreamer::num_loads = 0;
+	int TextureStreamer::total_loads = 0;
+	int TextureStreamer::total_evictions = 0;
+	size_t TextureStreamer::evicted_bytes = 0;
+
+	//bytes of the texture with count more levels (negative to remove them), mipmaps make every level 4 times the next one
+	static size_t getBytesWithLevels(size_t bytes, int count)
+	{
+		return count >= 0 ? bytes << (2 * count) : bytes >> (2 * -count);
+	}
+
+	int TextureStreamer::getFirstLod(int width, int height)
+	{
+		if (!enabled)
+			return 0;
+		int lod = 0;
+		while ((std::max(width, height) >> lod) > first_load_size && ((width >> (lod + 1)) || (height >> (lod + 1))))
+			lod++;
+		return lod;
+	}
+
+	void TextureStreamer::request(Texture* texture, float screen_pixels)
+	{
+		if (!texture->source_width || texture->loading)
+			return;
+
+		//smallest mip that still has a texel per pixel
+		int size = std::max(texture->source_width, texture->source_height);
+		int lod = 0;
+		while ((size >> (lod + 1)) && (size >> (lod + 1)) >= screen_pixels)
+			lod++;
+
+		if (texture->last_used_frame != frame)
+		{
+			texture->last_used_frame = frame;
+			texture->wanted_lod = lod;
+		}
+		else
+			texture->wanted_lod = std::min(texture->wanted_lod, lod);
+	}
+
+	void TextureStreamer::load(Texture* texture, int lod)
+	{
+		texture->streaming = true;
+		LoadTextureTask* task = new LoadTextureTask(texture->filename.c_str());
+		task->lod = lod;
+		TaskManager::background.addTask(task);
+		num_loads++;
+		total_loads++;
+	}
+
+	size_t TextureStreamer::evict(Texture* texture, int count)
+	{
+		static int can_copy = -1;
+		if (can_copy == -1)
+			can_copy = SDL_GL_ExtensionSupported("GL_ARB_copy_image") && SDL_GL_ExtensionSupported("GL_ARB_texture_storage");
+
+		size_t bytes = texture->getVRAMBytes();
+		size_t freed = bytes - getBytesWithLevels(bytes, -count);
+		if (can_copy && texture->dropLevels(count))
+			freed = bytes - texture->getVRAMBytes();
+		else //the memory is released once the smaller version arrives
+			load(texture, texture->lod + count);
+		total_evictions++;
+		evicted_bytes += freed;
+		return freed;
+	}
+
+	void TextureStreamer::update()
+	{
+		resident_bytes = 0;
+		streamed_bytes = 0;
+		num_streamed = 0;
+		num_loads = 0;
+
+		std::vector<Texture*> textures; //the ones we can touch now
+		for (auto& it : Texture::sTexturesLoaded)
+		{
+			Texture* texture = it.second;
+			size_t bytes = texture->getVRAMBytes();
+			resident_bytes += bytes;
+			if (!texture->source_width || texture->loading)
+				continue;
+			num_streamed++;
+			streamed_bytes += bytes;
+			if (texture->streaming)
+				num_loads++;
+			else
+				textures.push_back(texture);
+		}
+
+		if (!enabled)
+		{
+			frame++;
+			return;
+		}
+
+		//visible textures that need more levels, the ones that lack more first
+		std::vector<Texture*> upgrades;
+		for (Texture* texture : textures)
+			if (texture->last_used_frame >= frame - 1 && texture->wanted_lod < texture->lod)
+				upgrades.push_back(texture);
+		std::sort(upgrades.begin(), upgrades.end(), [](Texture* a, Texture* b) { return a->lod - a->wanted_lod > b->lod - b->wanted_lod; });
+		upgrades.resize(std::min(upgrades.size(), (size_t)std::max(0, max_loads - num_loads)));
+
+		size_t needed = streamed_bytes;
+		for (Texture* texture : upgrades)
+		{
+			size_t bytes = texture->getVRAMBytes();
+			needed += getBytesWithLevels(bytes, texture->lod - texture->wanted_lod) - bytes;
+		}
+
+		//evict the least recently used, the visible ones only lose the levels they are not using
+		if (needed > budget)
+		{
+			std::sort(textures.begin(), textures.end(), [](Texture* a, Texture* b) { return a->last_used_frame < b->last_used_frame; });
+			for (Texture* texture : textures)
+			{
+				if (needed <= budget)
+					break;
+				bool visible = texture->last_used_frame >= frame - 1;
+				int max_lod = visible ? texture->wanted_lod : getFirstLod(texture->source_width, texture->source_height);
+				int max_count = std::min(max_lod - texture->lod, texture->num_levels - 1);
+				if (max_count <= 0)
+					continue;
+
+				//only the levels needed to fit
+				size_t bytes = texture->getVRAMBytes();
+				int count = 1;
+				while (count < max_count && needed - (bytes - getBytesWithLevels(bytes, -count)) > budget)
+					count++;
+				size_t freed = evict(texture, count);
+				needed -= std::min(needed, freed);
+				streamed_bytes -= std::min(streamed_bytes, freed);
+			}
+		}
+
+		//start the reloads that fit in the budget
+		size_t used = streamed_bytes;
+		for (Texture* texture : upgrades)
+		{
+			size_t bytes = texture->getVRAMBytes();
+			size_t extra = getBytesWithLevels(bytes, texture->lod - texture->wanted_lod) - bytes;
+			if (used + extra > budget)
+				continue;
+			used += extra;
+			load(texture, texture->wanted_lod);
+		}
+
+		frame++;
+	}
+
+	std::string TextureStreamer::getStats()
+	{
+		char str[256];
+		double mb = 1.0 / (1024 * 1024);
+		snprintf(str, sizeof(str), "Streamed: %d textures, %.1f MB of %.1f MB budget (all textures %.1f MB). Loads: %d in flight, %d total. Evictions: %d, %.1f MB",
+			num_streamed, streamed_bytes * mb, budget * mb, resident_bytes * mb, num_loads, total_loads, total_evictions, evicted_bytes * mb);
+		return str;
+	}
+};
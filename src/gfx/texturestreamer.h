@@ -0,0 +1,46 @@
+#pragma once
+
+#include <string>
+
+//Keeps in VRAM only the mips the textures need.
+//Textures loaded with Texture::GetAsync arrive first with their small mips (first_load_size), the renderer
+//tells every frame how big on screen are the objects using them (request) and update() reloads with more
+//levels the ones that need them. When the budget is exceeded the least recently used textures lose their
+//biggest mips (copied in the GPU to a smaller texture, or reloaded from disk if GL_ARB_copy_image is missing)
+
+namespace GFX {
+
+	class Texture;
+
+	class TextureStreamer
+	{
+	public:
+		static bool enabled;
+		static size_t budget; //bytes of VRAM for the streamed textures
+		static int first_load_size; //first load uses the biggest mip not bigger than this
+		static int max_loads; //reloads in flight at the same time
+		static long frame;
+
+		//stats of the last update
+		static size_t resident_bytes; //all the textures of the manager
+		static size_t streamed_bytes; //only the ones that can be streamed
+		static int num_streamed;
+		static int num_loads; //in flight
+		static int total_loads;
+		static int total_evictions;
+		static size_t evicted_bytes;
+
+		//levels to skip the first time it is loaded (called from the background threads)
+		static int getFirstLod(int width, int height);
+		//the texture will be rendered covering these pixels on screen (its biggest side)
+		static void request(Texture* texture, float screen_pixels);
+		//once per frame from the main thread, starts the reloads and evicts mips
+		static void update();
+		static std::string getStats();
+
+	private:
+		static void load(Texture* texture, int lod);
+		static size_t evict(Texture* texture, int count); //returns bytes released
+	};
+
+};
@@ -10,6 +10,10 @@
 #include "litengine.h"
 
 #include "application.h"
+#include "utils/benchmark.h"
+#include "utils/gltf_loader.h"
+#include "core/task.h"
+#include "pipeline/animationsystem.h"
 
 
 #include <iostream> //to output
@@ -24,6 +28,22 @@ int main(int argc, char **argv)
 	std::cout << "Initiating app..." << std::endl;
 	CORE::init();
 
+	//benchmarks that do not need a window: main --benchmark name
+	if (argc > 2 && strcmp(argv[1], "--benchmark") == 0)
+	{
+		runBenchmark(argv[2], false);
+		TaskManager::background.stopThreads();
+		return 0;
+	}
+
+	//bakes the textures of a prefab to DDS: main --compress-textures data/prefabs/road/road.gltf
+	if (argc > 2 && strcmp(argv[1], "--compress-textures") == 0)
+	{
+		bool compressed = compressGLTFTextures(argv[2]);
+		TaskManager::background.stopThreads();
+		return compressed ? 0 : 1;
+	}
+
 	//define window size
 	bool fullscreen = false; 
 	Vector2f size(1024,600);
@@ -42,6 +62,7 @@ int main(int argc, char **argv)
 	CORE::mainLoop(window,app);
 
 	//save state and free memory
+	AnimationSystem::clear();
 	CORE::destroy();
 
 	return 0;
@@ -6,8 +6,10 @@
 #include "camera.h"
 #include "../gfx/shader.h"
 #include "../gfx/mesh.h"
+#include "blendtree.h"
 
 #include <sys/stat.h>
+#include <functional>
 
 Skeleton::Skeleton()
 {
@@ -40,7 +42,6 @@ void Skeleton::computeFinalBoneMatrices( std::vector<Matrix44>& bone_matrices, G
 	updateGlobalMatrices();
 
 	bone_matrices.resize(mesh->bones_info.size());
-	#pragma omp for  
 	for (int i = 0; i < mesh->bones_info.size(); ++i)
 	{
 		BoneInfo& bone_info = mesh->bones_info[i];
@@ -48,6 +49,39 @@ void Skeleton::computeFinalBoneMatrices( std::vector<Matrix44>& bone_matrices, G
 	}
 }
 
+void Skeleton::computeFinalBoneMatrices(Matrix44* bone_matrices, const SkinBinding& binding)
+{
+	int num = (int)binding.bones.size();
+	for (int i = 0; i < num; ++i)
+	{
+		int bone = binding.bones[i];
+		bone_matrices[i] = bone == -1 ? binding.bind_matrices[i] : binding.bind_matrices[i] * global_bone_matrices[bone];
+	}
+}
+
+void SkinBinding::create(GFX::Mesh* mesh, Skeleton* skeleton)
+{
+	this->mesh = mesh;
+	bones.resize(mesh->bones_info.size());
+	bind_matrices.resize(mesh->bones_info.size());
+	for (size_t i = 0; i < mesh->bones_info.size(); ++i)
+	{
+		BoneInfo& bone_info = mesh->bones_info[i];
+		auto it = skeleton->bones_by_name.find(bone_info.name);
+		bones[i] = it == skeleton->bones_by_name.end() ? -1 : it->second;
+		bind_matrices[i] = mesh->bind_matrix * bone_info.bind_pose;
+	}
+}
+
+static Quaternion nlerpQuat(const Quaternion& a, const Quaternion& b, float f)
+{
+	//shortest path, the tracks are already in the same hemisphere except when looping
+	float sign = DotProduct(a, b) < 0.0f ? -1.0f : 1.0f;
+	Quaternion q(a.x + (b.x * sign - a.x) * f, a.y + (b.y * sign - a.y) * f, a.z + (b.z * sign - a.z) * f, a.w + (b.w * sign - a.w) * f);
+	q.normalize();
+	return q;
+}
+
 void blendSkeleton(Skeleton* a, Skeleton* b, float w, Skeleton* result, uint8 layer)
 {
 	assert(a && b && result && "skeleton cannot be NULL");
@@ -79,7 +113,8 @@ void blendSkeleton(Skeleton* a, Skeleton* b, float w, Skeleton* result, uint8 la
 	}
 
 	//blend bones locally
-	#pragma omp for  
+	Quaternion ra, rb;
+	Vector3f ta, tb, sa, sb;
 	for (int i = 0; i < result->num_bones; ++i)
 	{
 		Skeleton::Bone& bone = result->bones[i];
@@ -87,10 +122,41 @@ void blendSkeleton(Skeleton* a, Skeleton* b, float w, Skeleton* result, uint8 la
 		Skeleton::Bone& boneB = b->bones[i];
 		if ( layer != 0xFF && !(bone.layer & layer) ) //not in the same layer
 			continue;
-		#pragma omp for  
-		for (int j = 0; j < 16; ++j)
-			bone.model.m[j] = lerp( boneA.model.m[j], boneB.model.m[j], w);
+		decomposeBoneMatrix(boneA.model, ra, ta, sa);
+		decomposeBoneMatrix(boneB.model, rb, tb, sb);
+		composeBoneMatrix(nlerpQuat(ra, rb, w), ta + (tb - ta) * w, sa + (sb - sa) * w, bone.model);
+	}
+}
+
+void composeBoneMatrix(const Quaternion& r, const Vector3f& t, const Vector3f& s, Matrix44& m)
+{
+	r.toMatrix(m);
+	for (int j = 0; j < 3; ++j)
+	{
+		m.m[j * 4] *= s.v[j];
+		m.m[j * 4 + 1] *= s.v[j];
+		m.m[j * 4 + 2] *= s.v[j];
+	}
+	m.m[12] = t.x;
+	m.m[13] = t.y;
+	m.m[14] = t.z;
+}
+
+void decomposeBoneMatrix(const Matrix44& m, Quaternion& r, Vector3f& t, Vector3f& s)
+{
+	Matrix44 rotation = m;
+	for (int j = 0; j < 3; ++j)
+	{
+		Vector3f axis(m.m[j * 4], m.m[j * 4 + 1], m.m[j * 4 + 2]);
+		float scale = axis.length();
+		s.v[j] = scale;
+		if (scale > 0.0f)
+			for (int c = 0; c < 3; ++c)
+				rotation.m[j * 4 + c] /= scale;
 	}
+	t.set(m.m[12], m.m[13], m.m[14]);
+	r.fromMatrix(rotation);
+	r.normalize();
 }
 
 void Skeleton::renderSkeleton(Camera* camera, Matrix44 model, Vector4f color, bool render_points)
@@ -100,6 +166,8 @@ void Skeleton::renderSkeleton(Camera* camera, Matrix44 model, Vector4f color, bo
 	for (int i = 1; i < num_bones; ++i)
 	{
 		Bone& bone = bones[i];
+		if (bone.parent == -1)
+			continue;
 		Vector3f v1;
 		Vector3f v2;
 		Matrix44 parent_global_matrix = global_bone_matrices[ bone.parent ];
@@ -138,11 +206,14 @@ void Skeleton::updateGlobalMatrices()
 {
 	//compute global matrices
 	global_bone_matrices[0] = bones[0].model;
-	//order dependant
+	//order dependant (imported skeletons can have several roots)
 	for (int i = 1; i < num_bones; ++i)
 	{
 		Skeleton::Bone& bone = bones[i];
-		global_bone_matrices[i] = bone.model * global_bone_matrices[ bone.parent ];
+		if (bone.parent == -1)
+			global_bone_matrices[i] = bone.model;
+		else
+			global_bone_matrices[i] = bone.model * global_bone_matrices[ bone.parent ];
 	}
 }
 
@@ -161,24 +232,211 @@ void Skeleton::assignLayer( Bone* bone, uint8 layer )
 	}
 }
 
+void Skeleton::assignBodyLayers()
+{
+	for (int i = 0; i < num_bones; ++i)
+		bones[i].layer = BODY;
+
+	//SKANIM files use mixamorig_, the glTF exports mixamorig:
+	const char* prefix = getBone("mixamorig_Hips") ? "mixamorig_" : "mixamorig:";
+	auto find = [&](const char* name) { return getBone((std::string(prefix) + name).c_str()); };
+	Skeleton::Bone* hips = find("Hips");
+	if (!hips)
+		return;
+	hips->layer |= HIPS;
+	assignLayer(hips, BODY);//force every bone to have a bit
+	assignLayer(find("Spine"), UPPER_BODY);
+	assignLayer(find("RightUpLeg"), LOWER_BODY | RIGHT_LEG);
+	assignLayer(find("LeftUpLeg"), LOWER_BODY | LEFT_LEG);
+	assignLayer(find("RightShoulder"), RIGHT_ARM);
+	assignLayer(find("LeftShoulder"), LEFT_ARM);
+}
+
+bool Animation::reduce_keyframes = true;
+float Animation::rotation_tolerance = 0.001f;
+float Animation::translation_tolerance = 0.001f;
+float Animation::scale_tolerance = 0.001f;
+
 Animation::Animation()
 {
 	duration = 0.0f;
-	keyframes = NULL;
 	num_keyframes = 0;
 	num_animated_bones = 0;
 }
 
-Animation::~Animation()
+static void quantizeQuat(const Quaternion& q, sQuantizedQuat& out)
 {
-	if (keyframes)
-		delete[] keyframes;
+	for (int i = 0; i < 4; ++i)
+		out.q[i] = (int16)round(clamp(q.q[i], -1.0f, 1.0f) * 32767.0f);
+}
+
+//key before sample v and factor to the next one, after the last key (always the last sample) it goes back to the first like the loop
+static int findKey(const uint16* keys, int num_keys, float v, int& next, float& f)
+{
+	if (num_keys == 1)
+	{
+		next = 0;
+		f = 0.0f;
+		return 0;
+	}
+	int i = (int)(std::upper_bound(keys, keys + num_keys, (uint16)v) - keys) - 1;
+	next = i + 1;
+	if (next == num_keys)
+	{
+		next = 0;
+		f = v - keys[i];
+	}
+	else
+		f = (v - keys[i]) / (keys[next] - keys[i]);
+	return i;
+}
+
+void Animation::sampleBone(int index, float v, Quaternion& r, Vector3f& t, Vector3f& s)
+{
+	int next;
+	float f;
+
+	//rotation
+	const sAnimTrack& rt = tracks[index * NUM_TRACKS + TRACK_ROTATION];
+	int i = findKey(&keys[rt.first_key], rt.num_keys, v, next, f);
+	const float n = 1.0f / 32767.0f;
+	const int16* q1 = rotations[rt.first_value + i].q;
+	const int16* q2 = rotations[rt.first_value + next].q;
+	r = nlerpQuat(Quaternion(q1[0] * n, q1[1] * n, q1[2] * n, q1[3] * n), Quaternion(q2[0] * n, q2[1] * n, q2[2] * n, q2[3] * n), f);
+
+	//scale
+	const sAnimTrack& st = tracks[index * NUM_TRACKS + TRACK_SCALE];
+	i = findKey(&keys[st.first_key], st.num_keys, v, next, f);
+	const Vector3f* sv = &scales[st.first_value];
+	s = sv[i] + (sv[next] - sv[i]) * f;
+
+	//translation
+	const sAnimTrack& tt = tracks[index * NUM_TRACKS + TRACK_TRANSLATION];
+	i = findKey(&keys[tt.first_key], tt.num_keys, v, next, f);
+	const Vector3f* tv = &translations[tt.first_value];
+	t = tv[i] + (tv[next] - tv[i]) * f;
+}
+
+//greedy reduction: every key reaches as far as the interpolation to it keeps the samples in between under the tolerance
+//error(a, b, f, k) returns the error of sample k when interpolating keys a and b with factor f
+static void reduceKeys(int num, float tolerance, const std::function<float(int, int, float, int)>& error, std::vector<uint16>& result)
+{
+	result.clear();
+	result.push_back(0);
+	if (num == 1)
+		return;
+
+	//constant track, one key is enough
+	bool constant = true;
+	for (int k = 1; k < num && constant; ++k)
+		constant = error(0, 0, 0.0f, k) <= tolerance;
+	if (constant)
+		return;
+
+	int start = 0;
+	while (start < num - 1)
+	{
+		int end = start + 1;
+		while (end + 1 < num)
+		{
+			bool valid = true;
+			for (int k = start + 1; k <= end && valid; ++k)
+				valid = error(start, end + 1, (k - start) / (float)(end + 1 - start), k) <= tolerance;
+			if (!valid)
+				break;
+			end++;
+		}
+		result.push_back((uint16)end);
+		start = end;
+	}
+}
+
+void Animation::compress(const Matrix44* keyframes)
+{
+	assert(num_keyframes <= 0xFFFF && "too many samples");
+	tracks.resize(num_animated_bones * NUM_TRACKS);
+	keys.clear();
+	rotations.clear();
+	translations.clear();
+	scales.clear();
+
+	std::vector<Quaternion> r(num_keyframes);
+	std::vector<Vector3f> t(num_keyframes);
+	std::vector<Vector3f> s(num_keyframes);
+	std::vector<uint16> kept;
+	bool reduce = reduce_keyframes;
+	auto reduceOrKeepAll = [&](float tolerance, const std::function<float(int, int, float, int)>& error) {
+		if (reduce)
+			return reduceKeys(num_keyframes, tolerance, error, kept);
+		kept.resize(num_keyframes);
+		for (int k = 0; k < num_keyframes; ++k)
+			kept[k] = k;
+	};
+
+	for (int i = 0; i < num_animated_bones; ++i)
+	{
+		for (int k = 0; k < num_keyframes; ++k)
+		{
+			decomposeBoneMatrix(keyframes[k * num_animated_bones + i], r[k], t[k], s[k]);
+			if (k > 0 && DotProduct(r[k], r[k - 1]) < 0.0f) //keep them in the same hemisphere to interpolate
+				r[k] = r[k] * -1.0f;
+		}
+
+		sAnimTrack* bone_tracks = &tracks[i * NUM_TRACKS];
+
+		reduceOrKeepAll(rotation_tolerance, [&](int a, int b, float f, int k) {
+			return 2.0f * acos(std::min(1.0f, fabs(DotProduct(nlerpQuat(r[a], r[b], f), r[k]))));
+		});
+		bone_tracks[TRACK_ROTATION].first_key = (uint32)keys.size();
+		bone_tracks[TRACK_ROTATION].first_value = (uint32)rotations.size();
+		bone_tracks[TRACK_ROTATION].num_keys = (uint32)kept.size();
+		for (uint16 k : kept)
+		{
+			keys.push_back(k);
+			sQuantizedQuat q;
+			quantizeQuat(r[k], q);
+			rotations.push_back(q);
+		}
+
+		reduceOrKeepAll(translation_tolerance, [&](int a, int b, float f, int k) {
+			return (t[a] + (t[b] - t[a]) * f - t[k]).length();
+		});
+		bone_tracks[TRACK_TRANSLATION].first_key = (uint32)keys.size();
+		bone_tracks[TRACK_TRANSLATION].first_value = (uint32)translations.size();
+		bone_tracks[TRACK_TRANSLATION].num_keys = (uint32)kept.size();
+		for (uint16 k : kept)
+		{
+			keys.push_back(k);
+			translations.push_back(t[k]);
+		}
+
+		reduceOrKeepAll(scale_tolerance, [&](int a, int b, float f, int k) {
+			return (s[a] + (s[b] - s[a]) * f - s[k]).length();
+		});
+		bone_tracks[TRACK_SCALE].first_key = (uint32)keys.size();
+		bone_tracks[TRACK_SCALE].first_value = (uint32)scales.size();
+		bone_tracks[TRACK_SCALE].num_keys = (uint32)kept.size();
+		for (uint16 k : kept)
+		{
+			keys.push_back(k);
+			scales.push_back(s[k]);
+		}
+	}
+}
+
+size_t Animation::getClipBytes()
+{
+	return tracks.size() * sizeof(sAnimTrack) + keys.size() * sizeof(uint16) + rotations.size() * sizeof(sQuantizedQuat) + translations.size() * sizeof(Vector3f) + scales.size() * sizeof(Vector3f);
 }
 
 void Animation::assignTime(float t, bool loop, bool interpolate, uint8 layers)
 {
-	assert(keyframes && skeleton.num_bones);
+	samplePose(t, skeleton, loop, layers);
+	skeleton.updateGlobalMatrices();
+}
 
+float Animation::getSample(float t, bool loop)
+{
 	if (loop)
 	{
 		t = fmod(t, duration);
@@ -187,36 +445,56 @@ void Animation::assignTime(float t, bool loop, bool interpolate, uint8 layers)
 	}
 	else
 		t = clamp( t, 0.0f, duration - (1.0/samples_per_second) );
-	float v = samples_per_second * t;
-	int index = clamp(floor(v), 0, num_keyframes - 1);
-	int index2 = index + 1;
-	if (index2 >= num_keyframes)
-		index2 = 0;
-	float f = v - floor(v);
+	return clamp(samples_per_second * t, 0.0f, (float)(num_keyframes - 1) + 0.999f);
+}
 
-	Matrix44* k = keyframes + index * num_animated_bones;
-	Matrix44* k2 = keyframes + index2 * num_animated_bones;
+void Animation::samplePose(float t, Skeleton& pose, bool loop, uint8 layers)
+{
+	assert(tracks.size() && pose.num_bones);
+	float v = getSample(t, loop);
 
 	//compute local bones
-	#pragma omp for  
+	Quaternion r;
+	Vector3f translation, scale;
 	for (int i = 0; i < num_animated_bones; ++i)
 	{
 		int bone_index = bones_map[i];
-		Skeleton::Bone& bone = skeleton.bones[bone_index];
+		Skeleton::Bone& bone = pose.bones[bone_index];
 		if (layers != 0xFF && !(bone.layer & layers))
 			continue;
-		for (int j = 0; j < 16; ++j)
-			bone.model.m[j] = lerp(k[i].m[j], k2[i].m[j], f);
+		sampleBone(i, v, r, translation, scale);
+		composeBoneMatrix(r, translation, scale, bone.model);
 	}
+}
 
-	skeleton.updateGlobalMatrices();
+void Animation::samplePose(float t, SoAPose& pose, bool loop)
+{
+	assert(tracks.size() && pose.num_bones);
+	float v = getSample(t, loop);
+
+	Quaternion r;
+	Vector3f translation, scale;
+	for (int i = 0; i < num_animated_bones; ++i)
+	{
+		sampleBone(i, v, r, translation, scale);
+		pose.setBone(bones_map[i], r, translation, scale);
+	}
 }
 
 
 void Animation::operator = (Animation* anim)
 {
-	memcpy(this, anim, sizeof(Animation));
-	this->keyframes = NULL;
+	skeleton = anim->skeleton;
+	duration = anim->duration;
+	samples_per_second = anim->samples_per_second;
+	num_animated_bones = anim->num_animated_bones;
+	num_keyframes = anim->num_keyframes;
+	memcpy(bones_map, anim->bones_map, sizeof(bones_map));
+	tracks = anim->tracks;
+	keys = anim->keys;
+	rotations = anim->rotations;
+	translations = anim->translations;
+	scales = anim->scales;
 }
 
 bool Animation::load(const char* filename)
@@ -251,7 +529,7 @@ bool Animation::load(const char* filename)
 		}
 	}
 
-	std::cout << "[OK] Num. Bones: " << skeleton.num_bones << " Time: " << (getTime() - time) * 0.001 << "sec" << std::endl;
+	std::cout << "[OK] Num. Bones: " << skeleton.num_bones << " Clip: " << getClipBytes() / 1024 << "KB (" << num_keyframes * num_animated_bones * sizeof(Matrix44) / 1024 << "KB uncompressed) Time: " << (getTime() - time) * 0.001 << "sec" << std::endl;
 	return true;
 }
 
@@ -264,6 +542,10 @@ struct sAnimHeader {
 	int num_keyframes;
 	int num_bones;
 	int8 bones_map[128];
+	int num_keys;
+	int num_rotations;
+	int num_translations;
+	int num_scales;
 	char extra[16];
 };
 
@@ -291,6 +573,11 @@ bool Animation::writeABIN(const char* filename)
 	header.num_keyframes = num_keyframes;
 	header.num_bones = skeleton.num_bones;
 	memcpy( header.bones_map, bones_map, sizeof(bones_map)  );
+	header.num_keys = (int)keys.size();
+	header.num_rotations = (int)rotations.size();
+	header.num_translations = (int)translations.size();
+	header.num_scales = (int)scales.size();
+	memset(header.extra, 0, sizeof(header.extra));
 
 	//write header
 	fwrite((void*)&header, sizeof(sAnimHeader), 1, f);
@@ -298,8 +585,17 @@ bool Animation::writeABIN(const char* filename)
 	//write skeleton
 	fwrite((void*)skeleton.bones, sizeof(skeleton.bones), 1, f);
 
-	//write keyframes
-	fwrite((void*)keyframes, sizeof(Matrix44) * num_keyframes * num_animated_bones, 1, f);
+	//write tracks, an animation without keys has empty vectors
+	if (tracks.size())
+		fwrite((void*)&tracks[0], sizeof(sAnimTrack) * tracks.size(), 1, f);
+	if (keys.size())
+		fwrite((void*)&keys[0], sizeof(uint16) * keys.size(), 1, f);
+	if (rotations.size())
+		fwrite((void*)&rotations[0], sizeof(sQuantizedQuat) * rotations.size(), 1, f);
+	if (translations.size())
+		fwrite((void*)&translations[0], sizeof(Vector3f) * translations.size(), 1, f);
+	if (scales.size())
+		fwrite((void*)&scales[0], sizeof(Vector3f) * scales.size(), 1, f);
 
 	fclose(f);
 	return true;
@@ -352,11 +648,27 @@ bool Animation::loadABIN(const char* filename)
 	memcpy( skeleton.bones, pos, sizeof(skeleton.bones) );
 	pos += sizeof(skeleton.bones);
 
-	//extract keyframes
-	assert(keyframes == NULL);
-	keyframes = new Matrix44[num_keyframes * num_animated_bones];
-	memcpy( keyframes, pos, sizeof(Matrix44)*num_keyframes * num_animated_bones );
-	pos += sizeof(Matrix44) * num_keyframes * num_animated_bones;
+	//extract tracks
+	tracks.resize(num_animated_bones * NUM_TRACKS);
+	if (tracks.size())
+		memcpy( &tracks[0], pos, sizeof(sAnimTrack) * tracks.size() );
+	pos += sizeof(sAnimTrack) * tracks.size();
+	keys.resize(header.num_keys);
+	if (keys.size())
+		memcpy( &keys[0], pos, sizeof(uint16) * keys.size() );
+	pos += sizeof(uint16) * keys.size();
+	rotations.resize(header.num_rotations);
+	if (rotations.size())
+		memcpy( &rotations[0], pos, sizeof(sQuantizedQuat) * rotations.size() );
+	pos += sizeof(sQuantizedQuat) * rotations.size();
+	translations.resize(header.num_translations);
+	if (translations.size())
+		memcpy( &translations[0], pos, sizeof(Vector3f) * translations.size() );
+	pos += sizeof(Vector3f) * translations.size();
+	scales.resize(header.num_scales);
+	if (scales.size())
+		memcpy( &scales[0], pos, sizeof(Vector3f) * scales.size() );
+	pos += sizeof(Vector3f) * scales.size();
 
 	//compute bone names map
 	for (int i = 0; i < skeleton.num_bones; ++i)
@@ -396,6 +708,7 @@ bool Animation::loadSKANIM(const char* filename)
 	num_animated_bones = 0;
 
 	int current_keyframe = 0;
+	Matrix44* keyframes = NULL; //only until compressed
 
 	while (*pos)
 	{
@@ -449,23 +762,15 @@ bool Animation::loadSKANIM(const char* filename)
 	}
 
 	for (int i = 0; i < skeleton.num_bones; ++i)
-	{
-		Skeleton::Bone& bone = skeleton.bones[i];
-		bone.layer = BODY;
-		skeleton.bones_by_name[bone.name] = i;
-	}
+		skeleton.bones_by_name[skeleton.bones[i].name] = i;
 
 	//assign layers
-	Skeleton::Bone* hips = skeleton.getBone("mixamorig_Hips");
-	if (hips)
+	skeleton.assignBodyLayers();
+
+	if (keyframes)
 	{
-		hips->layer |= HIPS;
-		skeleton.assignLayer(hips, BODY);//force every bone to have a bit
-		skeleton.assignLayer(skeleton.getBone("mixamorig_Spine"), UPPER_BODY);
-		skeleton.assignLayer(skeleton.getBone("mixamorig_RightUpLeg"), LOWER_BODY | RIGHT_LEG);
-		skeleton.assignLayer(skeleton.getBone("mixamorig_LeftUpLeg"), LOWER_BODY | LEFT_LEG);
-		skeleton.assignLayer(skeleton.getBone("mixamorig_RightShoulder"), RIGHT_ARM);
-		skeleton.assignLayer(skeleton.getBone("mixamorig_LeftShoulder"), LEFT_ARM);
+		compress(keyframes);
+		delete[] keyframes;
 	}
 
 	assignTime(0); //reset pose
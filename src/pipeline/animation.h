@@ -9,7 +9,7 @@
 
 class Camera;
 
-#define ANIM_BIN_VERSION 3
+#define ANIM_BIN_VERSION 4
 
 //defined layers for every body
 enum BODY_LAYERS {
@@ -23,6 +23,18 @@ enum BODY_LAYERS {
 	HIPS = 128,
 };
 
+class Skeleton;
+struct SoAPose;
+
+//precomputed link between the bones of a skinned mesh and the bones of a skeleton, so the final matrices need no name lookups
+struct SkinBinding {
+	GFX::Mesh* mesh;
+	std::vector<int> bones; //skeleton bone of every bone of the mesh, -1 if the skeleton does not have it
+	std::vector<Matrix44> bind_matrices; //bind_matrix * bind_pose of every bone of the mesh
+
+	void create(GFX::Mesh* mesh, Skeleton* skeleton);
+};
+
 //used to compare bone names in the map
 struct cmp_str { bool operator()(char const *a, char const *b) const { return std::strcmp(a, b) < 0; } };
 
@@ -54,13 +66,41 @@ public:
 
 	void renderSkeleton(Camera* camera, Matrix44 model, Vector4f color = Vector4f(0.5, 0, 0.5, 1), bool render_points = false); //renders the skeleton with lines
 	void computeFinalBoneMatrices(std::vector<Matrix44>& bones, GFX::Mesh* mesh); //fills the std::vector with the bones ready for the shader
+	void computeFinalBoneMatrices(Matrix44* bones, const SkinBinding& binding); //same without lookups, global matrices must be updated
 	void assignLayer(Bone* bone, uint8 layer); //assigns a layer to a node and all its children
+	void assignBodyLayers(); //BODY_LAYERS of a mixamo rig, every bone gets BODY if the rig is not recognized
 };
 
-//this function takes skeleton A and blends it with skeleton B and stores the result in result
+//this function takes skeleton A and blends it with skeleton B and stores the result in result (rotations are interpolated as quaternions)
 void blendSkeleton(Skeleton* a, Skeleton* b, float w, Skeleton* result, uint8 layer = 0xFF);
 
+//local matrix of a bone from its rotation, translation and scale and back (shear is lost)
+void composeBoneMatrix(const Quaternion& r, const Vector3f& t, const Vector3f& s, Matrix44& m);
+void decomposeBoneMatrix(const Matrix44& m, Quaternion& r, Vector3f& t, Vector3f& s);
+
+//every animated bone has one track of each type
+enum eAnimTrack {
+	TRACK_ROTATION,
+	TRACK_TRANSLATION,
+	TRACK_SCALE,
+	NUM_TRACKS
+};
+
+//keys of one track in the arrays of the clip
+struct sAnimTrack {
+	uint32 first_key; //in keys
+	uint32 first_value; //in the values array of its type
+	uint32 num_keys;
+};
+
+//quaternion with every component stored as a normalized int16
+struct sQuantizedQuat {
+	int16 q[4];
+};
+
 //This class contains one animation loaded from a file (it also uses a skeleton to store the current snapshot)
+//Keyframes are stored compressed: the local matrix of every animated bone is split in rotation (quantized quaternion),
+//translation and scale tracks, and every track only keeps the samples that cannot be interpolated from its neighbours
 class Animation {
 public:
 
@@ -72,13 +112,31 @@ public:
 	int num_keyframes;
 	int8 bones_map[128]; //maps from keyframe data index to bone
 
-	Matrix44* keyframes;
+	//compressed clip
+	std::vector<sAnimTrack> tracks; //num_animated_bones * NUM_TRACKS
+	std::vector<uint16> keys; //sample of every key
+	std::vector<sQuantizedQuat> rotations;
+	std::vector<Vector3f> translations;
+	std::vector<Vector3f> scales;
+
+	//keyframe reduction used when compressing
+	static bool reduce_keyframes;
+	static float rotation_tolerance; //radians
+	static float translation_tolerance; //units
+	static float scale_tolerance;
 
 	Animation();
-	~Animation();	//we need the dtor to remove the keyframes memory
 
-	//change the skeleton to the given pose according to time
+	//change the skeleton to the given pose according to time (only the bones in the layers are decompressed)
 	void assignTime(float time, bool loop = true, bool interpolate = true, uint8 layers = 0xFF);
+	//same but in the local matrices of another skeleton with the same bones (global matrices are not updated), safe from any thread
+	void samplePose(float time, Skeleton& pose, bool loop = true, uint8 layers = 0xFF);
+	//same but in the rotations, translations and scales of a pose used by the blend trees, the bones not animated keep their values
+	void samplePose(float time, SoAPose& pose, bool loop = true);
+
+	//builds the compressed tracks from the local matrices of every animated bone (num_keyframes * num_animated_bones)
+	void compress(const Matrix44* keyframes);
+	size_t getClipBytes();
 
 	//storage
 	bool load(const char* filename);
@@ -91,5 +149,9 @@ public:
 
 	//copy operator to copy the keyframes
 	void operator = (Animation* anim);
+
+private:
+	float getSample(float time, bool loop); //fractional sample of the time
+	void sampleBone(int index, float v, Quaternion& r, Vector3f& t, Vector3f& s);
 };
 
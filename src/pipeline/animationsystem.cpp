@@ -0,0 +1,92 @@
+#include "animationsystem.h"
+
+#include <cassert>
+
+#include "../core/task.h"
+
+int AnimationSystem::min_batch = 8;
+std::map<std::pair<GFX::Mesh*, Skeleton*>, SkinBinding*> AnimationSystem::bindings;
+
+AnimatedCharacter::AnimatedCharacter()
+{
+	animation = NULL;
+	time = 0.0f;
+	loop = true;
+	tree = NULL;
+}
+
+void AnimatedCharacter::setup(Skeleton* skeleton)
+{
+	assert(skeleton);
+	pose.num_bones = skeleton->num_bones;
+	memcpy(pose.bones, skeleton->bones, sizeof(pose.bones));
+	pose.bones_by_name.clear();
+	for (int i = 0; i < pose.num_bones; ++i)
+		pose.bones_by_name[pose.bones[i].name] = i;
+	bind_pose.fromSkeleton(*skeleton);
+	skins.clear();
+	palette_offsets.clear();
+	palette.clear();
+}
+
+void AnimatedCharacter::addSkin(SkinBinding* binding)
+{
+	palette_offsets.push_back((int)palette.size());
+	skins.push_back(binding);
+	palette.resize(palette.size() + binding->bones.size());
+}
+
+void AnimatedCharacter::evaluate(std::vector<SoAPose>& stack)
+{
+	if (tree)
+		tree->evaluate(bind_pose, pose, stack);
+	else if (animation)
+		animation->samplePose(time, pose, loop);
+
+	pose.updateGlobalMatrices();
+	for (size_t i = 0; i < skins.size(); ++i)
+		pose.computeFinalBoneMatrices(&palette[palette_offsets[i]], *skins[i]);
+}
+
+SkinBinding* AnimationSystem::getBinding(GFX::Mesh* mesh, Skeleton* skeleton)
+{
+	auto key = std::make_pair(mesh, skeleton);
+	auto it = bindings.find(key);
+	if (it != bindings.end())
+		return it->second;
+	SkinBinding* binding = new SkinBinding();
+	binding->create(mesh, skeleton);
+	bindings[key] = binding;
+	return binding;
+}
+
+//keys are pointers, a new mesh or skeleton could get the address of a destroyed one
+void AnimationSystem::removeBindings(GFX::Mesh* mesh, Skeleton* skeleton)
+{
+	for (auto it = bindings.begin(); it != bindings.end();)
+	{
+		if (it->first.first != mesh && it->first.second != skeleton)
+		{
+			++it;
+			continue;
+		}
+		delete it->second;
+		it = bindings.erase(it);
+	}
+}
+
+void AnimationSystem::clear()
+{
+	for (auto& it : bindings)
+		delete it.second;
+	bindings.clear();
+}
+
+void AnimationSystem::update(std::vector<AnimatedCharacter*>& characters)
+{
+	TaskManager::background.parallelFor(characters.size(), [&](size_t from, size_t to) {
+		std::vector<SoAPose> stack; //one per batch
+		for (size_t i = from; i < to; ++i)
+			characters[i]->evaluate(stack);
+	}, min_batch);
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <vector>
+#include <map>
+#include "animation.h"
+#include "blendtree.h"
+
+//Evaluates many animated characters at once. Every character samples its clip (or evaluates its blend tree),
+//updates the global matrices of its pose and fills the final bone matrices of its skinned meshes.
+//Characters are independent, they are split in batches executed by the background workers.
+
+//runtime state of one animated character, the clips are shared (they are only read)
+class AnimatedCharacter {
+public:
+	Animation* animation; //main clip, NULL keeps the bind pose
+	float time;
+	bool loop;
+
+	BlendTree* tree; //evaluated instead of the animation if set, the times are in its clip nodes
+
+	SoAPose bind_pose; //start of the blend trees
+	Skeleton pose; //pose of the last evaluation
+	std::vector<SkinBinding*> skins; //meshes deformed by the pose
+	std::vector<int> palette_offsets; //first matrix of every skin in the palette
+	std::vector<Matrix44> palette; //final bone matrices of all the skins
+
+	AnimatedCharacter();
+
+	void setup(Skeleton* skeleton); //the skeleton the clips and the bindings refer to
+	void addSkin(SkinBinding* binding);
+	void evaluate(std::vector<SoAPose>& stack); //stack is the memory for the blend tree, can be called from any thread
+};
+
+class AnimationSystem {
+public:
+	static int min_batch; //characters per job
+
+	//bindings are cached per mesh and skeleton, call it from the main thread
+	static SkinBinding* getBinding(GFX::Mesh* mesh, Skeleton* skeleton);
+	static void removeBindings(GFX::Mesh* mesh, Skeleton* skeleton); //the ones of the mesh or the skeleton, called when they are destroyed
+	static void clear(); //frees all the bindings
+	static void update(std::vector<AnimatedCharacter*>& characters); //returns once all have been evaluated
+
+private:
+	static std::map<std::pair<GFX::Mesh*, Skeleton*>, SkinBinding*> bindings;
+};
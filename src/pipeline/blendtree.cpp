@@ -0,0 +1,241 @@
+#include "blendtree.h"
+
+#include <cassert>
+#include <algorithm>
+
+#include "animation.h"
+#include "../core/simd.h"
+
+static int getPaddedBones(const SoAPose& pose) { return (pose.num_bones + 3) & ~3; }
+
+//quaternion product a * b of four bones
+static void mulQuat(simd4 ax, simd4 ay, simd4 az, simd4 aw, simd4 bx, simd4 by, simd4 bz, simd4 bw, simd4& x, simd4& y, simd4& z, simd4& w)
+{
+	x = ay * bz - az * by + aw * bx + ax * bw;
+	y = az * bx - ax * bz + aw * by + ay * bw;
+	z = ax * by - ay * bx + aw * bz + az * bw;
+	w = aw * bw - ax * bx - ay * by - az * bz;
+}
+
+//result = pose * weight or result += pose * weight, rotations are flipped to the hemisphere of the result
+static void accumulatePose(SoAPose& result, const SoAPose& pose, const float* weights, bool first)
+{
+	for (int i = 0; i < result.num_bones; i += 4)
+	{
+		simd4 w = simd4::load(weights + i);
+		simd4 rx = simd4::load(pose.rx + i), ry = simd4::load(pose.ry + i), rz = simd4::load(pose.rz + i), rw = simd4::load(pose.rw + i);
+		if (first)
+		{
+			(rx * w).store(result.rx + i); (ry * w).store(result.ry + i); (rz * w).store(result.rz + i); (rw * w).store(result.rw + i);
+			(simd4::load(pose.tx + i) * w).store(result.tx + i);
+			(simd4::load(pose.ty + i) * w).store(result.ty + i);
+			(simd4::load(pose.tz + i) * w).store(result.tz + i);
+			(simd4::load(pose.sx + i) * w).store(result.sx + i);
+			(simd4::load(pose.sy + i) * w).store(result.sy + i);
+			(simd4::load(pose.sz + i) * w).store(result.sz + i);
+			continue;
+		}
+		simd4 ax = simd4::load(result.rx + i), ay = simd4::load(result.ry + i), az = simd4::load(result.rz + i), aw = simd4::load(result.rw + i);
+		simd4 wr = flipSign(w, ax * rx + ay * ry + az * rz + aw * rw);
+		(ax + rx * wr).store(result.rx + i); (ay + ry * wr).store(result.ry + i); (az + rz * wr).store(result.rz + i); (aw + rw * wr).store(result.rw + i);
+		(simd4::load(result.tx + i) + simd4::load(pose.tx + i) * w).store(result.tx + i);
+		(simd4::load(result.ty + i) + simd4::load(pose.ty + i) * w).store(result.ty + i);
+		(simd4::load(result.tz + i) + simd4::load(pose.tz + i) * w).store(result.tz + i);
+		(simd4::load(result.sx + i) + simd4::load(pose.sx + i) * w).store(result.sx + i);
+		(simd4::load(result.sy + i) + simd4::load(pose.sy + i) * w).store(result.sy + i);
+		(simd4::load(result.sz + i) + simd4::load(pose.sz + i) * w).store(result.sz + i);
+	}
+}
+
+static void normalizeRotations(SoAPose& pose)
+{
+	for (int i = 0; i < pose.num_bones; i += 4)
+	{
+		simd4 x = simd4::load(pose.rx + i), y = simd4::load(pose.ry + i), z = simd4::load(pose.rz + i), w = simd4::load(pose.rw + i);
+		simd4 inv = simd4(1.0f) / sqrt(max(x * x + y * y + z * z + w * w, simd4(1e-12f)));
+		(x * inv).store(pose.rx + i); (y * inv).store(pose.ry + i); (z * inv).store(pose.rz + i); (w * inv).store(pose.rw + i);
+	}
+}
+
+//result += (additive - reference) * weight, the rotation difference is applied in the local space of the bone
+static void addPose(SoAPose& result, const SoAPose& additive, const SoAPose& reference, const float* weights)
+{
+	simd4 one(1.0f);
+	for (int i = 0; i < result.num_bones; i += 4)
+	{
+		simd4 w = simd4::load(weights + i);
+
+		//delta = conjugate(reference) * additive, scaled from the identity with nlerp
+		simd4 dx(0.0f), dy(0.0f), dz(0.0f), dw(0.0f);
+		mulQuat(simd4(0.0f) - simd4::load(reference.rx + i), simd4(0.0f) - simd4::load(reference.ry + i), simd4(0.0f) - simd4::load(reference.rz + i), simd4::load(reference.rw + i),
+			simd4::load(additive.rx + i), simd4::load(additive.ry + i), simd4::load(additive.rz + i), simd4::load(additive.rw + i), dx, dy, dz, dw);
+		simd4 wd = flipSign(w, dw);
+		dx = dx * wd; dy = dy * wd; dz = dz * wd;
+		dw = one - w + dw * wd;
+		simd4 inv = one / sqrt(max(dx * dx + dy * dy + dz * dz + dw * dw, simd4(1e-12f)));
+
+		simd4 x(0.0f), y(0.0f), z(0.0f), qw(0.0f);
+		mulQuat(simd4::load(result.rx + i), simd4::load(result.ry + i), simd4::load(result.rz + i), simd4::load(result.rw + i), dx * inv, dy * inv, dz * inv, dw * inv, x, y, z, qw);
+		x.store(result.rx + i); y.store(result.ry + i); z.store(result.rz + i); qw.store(result.rw + i);
+
+		(simd4::load(result.tx + i) + (simd4::load(additive.tx + i) - simd4::load(reference.tx + i)) * w).store(result.tx + i);
+		(simd4::load(result.ty + i) + (simd4::load(additive.ty + i) - simd4::load(reference.ty + i)) * w).store(result.ty + i);
+		(simd4::load(result.tz + i) + (simd4::load(additive.tz + i) - simd4::load(reference.tz + i)) * w).store(result.tz + i);
+		(simd4::load(result.sx + i) * (one + (simd4::load(additive.sx + i) / simd4::load(reference.sx + i) - one) * w)).store(result.sx + i);
+		(simd4::load(result.sy + i) * (one + (simd4::load(additive.sy + i) / simd4::load(reference.sy + i) - one) * w)).store(result.sy + i);
+		(simd4::load(result.sz + i) * (one + (simd4::load(additive.sz + i) / simd4::load(reference.sz + i) - one) * w)).store(result.sz + i);
+	}
+}
+
+//weight of every bone (and the padding of the last group), zero outside the layers
+static void fillMask(const SoAPose& pose, uint8 layers, float weight, float* weights)
+{
+	for (int i = 0; i < getPaddedBones(pose); ++i)
+		weights[i] = (layers == 0xFF || (pose.layers[i] & layers)) ? weight : 0.0f;
+}
+
+SoAPose::SoAPose()
+{
+	num_bones = 0;
+	//identity, also in the bones after num_bones that are processed in the last group of four
+	for (int i = 0; i < MAX_POSE_BONES; ++i)
+	{
+		rx[i] = ry[i] = rz[i] = 0.0f;
+		rw[i] = 1.0f;
+		tx[i] = ty[i] = tz[i] = 0.0f;
+		sx[i] = sy[i] = sz[i] = 1.0f;
+		layers[i] = 0xFF;
+	}
+}
+
+void SoAPose::fromSkeleton(const Skeleton& skeleton)
+{
+	num_bones = skeleton.num_bones;
+	Quaternion r;
+	Vector3f t, s;
+	for (int i = 0; i < num_bones; ++i)
+	{
+		decomposeBoneMatrix(skeleton.bones[i].model, r, t, s);
+		setBone(i, r, t, s);
+		layers[i] = skeleton.bones[i].layer;
+	}
+}
+
+void SoAPose::toSkeleton(Skeleton& skeleton) const
+{
+	assert(skeleton.num_bones == num_bones);
+	for (int i = 0; i < num_bones; ++i)
+		composeBoneMatrix(Quaternion(rx[i], ry[i], rz[i], rw[i]), Vector3f(tx[i], ty[i], tz[i]), Vector3f(sx[i], sy[i], sz[i]), skeleton.bones[i].model);
+}
+
+void SoAPose::setBone(int index, const Quaternion& r, const Vector3f& t, const Vector3f& s)
+{
+	rx[index] = r.x; ry[index] = r.y; rz[index] = r.z; rw[index] = r.w;
+	tx[index] = t.x; ty[index] = t.y; tz[index] = t.z;
+	sx[index] = s.x; sy[index] = s.y; sz[index] = s.z;
+}
+
+int BlendTree::addClip(Animation* animation, float time, bool loop)
+{
+	Node node;
+	node.type = CLIP;
+	node.animation = animation;
+	node.time = time;
+	node.loop = loop;
+	node.layers = 0xFF;
+	nodes.push_back(node);
+	return (int)nodes.size() - 1;
+}
+
+int BlendTree::addBlend(const std::vector<int>& inputs, const std::vector<float>& weights, uint8 layers)
+{
+	assert(inputs.size() && inputs.size() == weights.size());
+	Node node;
+	node.type = BLEND;
+	node.animation = NULL;
+	node.inputs = inputs;
+	node.weights = weights;
+	node.layers = layers;
+	nodes.push_back(node);
+	return (int)nodes.size() - 1;
+}
+
+int BlendTree::addAdditive(int base, int additive, int reference, float weight, uint8 layers)
+{
+	Node node;
+	node.type = ADDITIVE;
+	node.animation = NULL;
+	node.inputs = { base, additive, reference };
+	node.weights.push_back(weight);
+	node.layers = layers;
+	nodes.push_back(node);
+	return (int)nodes.size() - 1;
+}
+
+void BlendTree::evaluate(const SoAPose& bind_pose, Skeleton& pose, std::vector<SoAPose>& stack)
+{
+	assert(nodes.size());
+	//every level uses at most two slots for its inputs
+	if (stack.size() < nodes.size() * 2 + 1)
+		stack.resize(nodes.size() * 2 + 1);
+	evaluateNode((int)nodes.size() - 1, bind_pose, stack, 0);
+	stack[0].toSkeleton(pose);
+}
+
+void BlendTree::evaluateNode(int index, const SoAPose& bind_pose, std::vector<SoAPose>& stack, int slot)
+{
+	Node& node = nodes[index];
+	SoAPose& result = stack[slot];
+	float weights[MAX_POSE_BONES];
+
+	switch (node.type)
+	{
+	case CLIP:
+		result = bind_pose;
+		if (node.animation)
+			node.animation->samplePose(node.time, result, node.loop);
+		break;
+
+	case BLEND:
+	{
+		float total = 0.0f;
+		for (float w : node.weights)
+			total += w;
+		if (node.inputs.size() == 1 || total <= 0.0f)
+		{
+			evaluateNode(node.inputs[0], bind_pose, stack, slot);
+			break;
+		}
+
+		//the first input gets what the others leave, all of it outside the mask
+		float first[MAX_POSE_BONES];
+		fillMask(bind_pose, node.layers, 1.0f, first);
+		for (int i = 0; i < getPaddedBones(bind_pose); ++i)
+			first[i] = 1.0f - first[i] * (1.0f - node.weights[0] / total);
+		evaluateNode(node.inputs[0], bind_pose, stack, slot + 1);
+		result.num_bones = bind_pose.num_bones;
+		accumulatePose(result, stack[slot + 1], first, true);
+
+		for (size_t i = 1; i < node.inputs.size(); ++i)
+		{
+			if (node.weights[i] <= 0.0f)
+				continue;
+			evaluateNode(node.inputs[i], bind_pose, stack, slot + 1);
+			fillMask(bind_pose, node.layers, node.weights[i] / total, weights);
+			accumulatePose(result, stack[slot + 1], weights, false);
+		}
+		normalizeRotations(result);
+		break;
+	}
+
+	case ADDITIVE:
+		evaluateNode(node.inputs[0], bind_pose, stack, slot);
+		if (node.weights[0] <= 0.0f)
+			break;
+		evaluateNode(node.inputs[1], bind_pose, stack, slot + 1);
+		evaluateNode(node.inputs[2], bind_pose, stack, slot + 2);
+		fillMask(bind_pose, node.layers, node.weights[0], weights);
+		addPose(result, stack[slot + 1], stack[slot + 2], weights);
+		break;
+	}
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <vector>
+#include "../core/math.h"
+
+class Skeleton;
+class Animation;
+
+#define MAX_POSE_BONES 128 //same as the Skeleton
+
+//local transform of every bone of a skeleton as rotation, translation and scale, one array per component
+//so the blends process four bones at a time with SIMD
+struct SoAPose {
+	int num_bones;
+	float rx[MAX_POSE_BONES], ry[MAX_POSE_BONES], rz[MAX_POSE_BONES], rw[MAX_POSE_BONES]; //quaternions
+	float tx[MAX_POSE_BONES], ty[MAX_POSE_BONES], tz[MAX_POSE_BONES];
+	float sx[MAX_POSE_BONES], sy[MAX_POSE_BONES], sz[MAX_POSE_BONES];
+	uint8 layers[MAX_POSE_BONES]; //BODY_LAYERS of every bone, used by the masks
+
+	SoAPose();
+
+	void fromSkeleton(const Skeleton& skeleton); //from the local matrices
+	void toSkeleton(Skeleton& skeleton) const; //only the local matrices are changed
+	void setBone(int index, const Quaternion& r, const Vector3f& t, const Vector3f& s);
+};
+
+//Blends any number of clips evaluating the tree from the root in one pass, every node writes its pose in a slot
+//of a stack of SoAPose instead of a full Skeleton. Nodes are added children first, the last one is the root.
+// - CLIP: samples an animation at its time
+// - BLEND: weighted average of N inputs (weights are normalized), bones outside the layers keep the first input
+// - ADDITIVE: adds to the base the difference between an additive pose and its reference pose, scaled by the weight
+class BlendTree {
+public:
+	enum eNodeType { CLIP, BLEND, ADDITIVE };
+
+	struct Node {
+		eNodeType type;
+		Animation* animation;
+		float time;
+		bool loop;
+		std::vector<int> inputs; //BLEND: the poses, ADDITIVE: base, additive and reference
+		std::vector<float> weights; //one per input in BLEND, one in ADDITIVE
+		uint8 layers; //mask of BODY_LAYERS affected by the node
+	};
+	std::vector<Node> nodes;
+
+	int addClip(Animation* animation, float time = 0.0f, bool loop = true);
+	int addBlend(const std::vector<int>& inputs, const std::vector<float>& weights, uint8 layers = 0xFF);
+	int addAdditive(int base, int additive, int reference, float weight = 1.0f, uint8 layers = 0xFF);
+
+	//writes the local matrices of the root pose in the skeleton, bones not animated keep the bind pose
+	//stack is the temporary memory (one per thread), it grows as needed
+	void evaluate(const SoAPose& bind_pose, Skeleton& pose, std::vector<SoAPose>& stack);
+
+private:
+	void evaluateNode(int index, const SoAPose& bind_pose, std::vector<SoAPose>& stack, int slot);
+};
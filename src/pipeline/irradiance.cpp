@@ -0,0 +1,297 @@
+#include "irradiance.h"
+
+#include <iostream>
+#include <sys/stat.h>
+
+#include "light.h"
+#include "prefab.h"
+#include "material.h"
+#include "../gfx/texture.h"
+#include "../core/task.h"
+#include "../utils/utils.h"
+
+int SCN::IrradianceEntity::num_samples = 256;
+float SCN::IrradianceEntity::bias = 0.05f;
+
+//header of the binary file, after the watermark and followed by the probes
+struct sIrradianceInfo {
+	int version;
+	int header_bytes; //sizeof(sIrradianceInfo), to detect changes in the struct
+	int dims[3];
+	int num_probes;
+};
+
+SCN::IrradianceEntity::IrradianceEntity()
+{
+	size.set(100, 50, 100);
+	dims[0] = 8; dims[1] = 4; dims[2] = 8;
+	texture = nullptr;
+	texture_dirty = false;
+}
+
+SCN::IrradianceEntity::~IrradianceEntity()
+{
+	if (texture)
+		delete texture;
+}
+
+void SCN::IrradianceEntity::operator = (const IrradianceEntity& entity)
+{
+	BaseEntity::operator = (entity);
+	size = entity.size;
+	memcpy(dims, entity.dims, sizeof(dims));
+	filename = entity.filename;
+	probes = entity.probes;
+	texture = nullptr;
+	texture_dirty = probes.size() != 0;
+}
+
+void SCN::IrradianceEntity::configure(cJSON* json)
+{
+	size = readJSONVector3(json, "size", size);
+	Vector3f probes_dims = readJSONVector3(json, "dims", Vector3f((float)dims[0], (float)dims[1], (float)dims[2]));
+	for (int i = 0; i < 3; ++i)
+		dims[i] = std::max(1, (int)probes_dims.v[i]);
+	filename = readJSONString(json, "filename", filename.c_str());
+	if (filename.size())
+		load();
+}
+
+void SCN::IrradianceEntity::serialize(cJSON* json)
+{
+	writeJSONVector3(json, "size", size);
+	writeJSONVector3(json, "dims", Vector3f((float)dims[0], (float)dims[1], (float)dims[2]));
+	if (filename.size())
+		writeJSONString(json, "filename", filename.c_str());
+}
+
+Vector3f SCN::IrradianceEntity::getProbePosition(int x, int y, int z)
+{
+	int index[3] = { x, y, z };
+	Vector3f local;
+	for (int i = 0; i < 3; ++i)
+		local.v[i] = dims[i] > 1 ? size.v[i] * (index[i] / (float)(dims[i] - 1) - 0.5f) : 0.0f;
+	return root.model * local;
+}
+
+Matrix44 SCN::IrradianceEntity::getVolumeMatrix()
+{
+	Matrix44 inv = root.model;
+	inv.inverse();
+	Matrix44 scale;
+	scale.setScale(1.0f / size.x, 1.0f / size.y, 1.0f / size.z);
+	Matrix44 center;
+	center.setTranslation(0.5f, 0.5f, 0.5f);
+	return inv * scale * center;
+}
+
+GFX::Texture* SCN::IrradianceEntity::getTexture()
+{
+	if (!texture_dirty || (int)probes.size() != getNumProbes())
+		return (int)probes.size() == getNumProbes() ? texture : nullptr;
+
+	//RGB of every coefficient, one grid after the other in z
+	int num_probes = getNumProbes();
+	std::vector<Vector3f> data(num_probes * 9);
+	for (int k = 0; k < 9; ++k)
+		for (int i = 0; i < num_probes; ++i)
+			data[k * num_probes + i] = probes[i].coeffs[k];
+
+	if (!texture)
+		texture = new GFX::Texture();
+	texture->create3D(dims[0], dims[1], dims[2] * 9, GL_RGB, GL_FLOAT, false, (Uint8*)&data[0], GL_RGB16F);
+	texture_dirty = false;
+	return texture;
+}
+
+//radiance that leaves a surface towards the probe: the ambient light and the lights (if they are visible) over the color of its material
+struct sBounce {
+	Vector3f radiance;
+	Vector3f albedo;
+	Vector3f position;
+	Vector3f normal;
+};
+
+void SCN::IrradianceEntity::bake()
+{
+	assert(scene && "the volume must be in a scene");
+	double start = getHighResTime();
+	int samples = std::max(1, num_samples);
+	int num_probes = getNumProbes();
+
+	//spherical fibonacci, the same directions for all the probes
+	std::vector<Vector3f> directions(samples);
+	for (int i = 0; i < samples; ++i)
+	{
+		float z = 1.0f - (2.0f * i + 1.0f) / samples;
+		float r = sqrtf(std::max(0.0f, 1.0f - z * z));
+		float phi = i * 2.39996323f; //golden angle
+		directions[i].set(r * cosf(phi), r * sinf(phi), z);
+	}
+
+	std::vector<Ray> rays(num_probes * samples);
+	for (int z = 0; z < dims[2]; ++z)
+		for (int y = 0; y < dims[1]; ++y)
+			for (int x = 0; x < dims[0]; ++x)
+			{
+				Vector3f position = getProbePosition(x, y, z);
+				Ray* ray = &rays[((z * dims[1] + y) * dims[0] + x) * samples];
+				for (int i = 0; i < samples; ++i)
+				{
+					ray[i].origin = position;
+					ray[i].direction = directions[i];
+				}
+			}
+	std::vector<RayTestResult> hits;
+	scene->testRays(rays, hits);
+
+	std::vector<LightEntity*> lights;
+	for (auto ent : scene->entities)
+		if (ent->visible && ent->getType() == eEntityType::LIGHT)
+			lights.push_back((LightEntity*)ent);
+
+	//rays that escape see the ambient light, the rest the surface they hit
+	std::vector<sBounce> bounces(rays.size());
+	std::vector<Ray> shadow_rays;
+	std::vector<std::pair<int, Vector3f>> shadow_lights; //bounce and light that arrives if it is not occluded
+	for (size_t i = 0; i < rays.size(); ++i)
+	{
+		sBounce& bounce = bounces[i];
+		const RayTestResult& hit = hits[i];
+		if (!hit.collided)
+		{
+			bounce.radiance = scene->ambient_light;
+			continue;
+		}
+		Material* material = hit.node ? hit.node->material : nullptr;
+		bounce.normal = hit.normal;
+		if (bounce.normal.dot(rays[i].direction) > 0.0f)
+		{
+			if (!material || !material->two_sided)
+				continue; //the back of a surface, the probe is inside something
+			bounce.normal = bounce.normal * -1.0f;
+		}
+		bounce.albedo = material ? material->color.xyz() : Vector3f(1, 1, 1);
+		bounce.position = hit.collision + bounce.normal * bias;
+		bounce.radiance = bounce.albedo * scene->ambient_light;
+		if (material)
+			bounce.radiance += material->emissive_factor;
+
+		//the diffuse term of the lights, as in the shaders
+		for (auto light : lights)
+		{
+			Vector3f color = light->color * light->intensity;
+			Vector3f front = light->root.model.rotateVector(Vector3f(0, 0, 1));
+			Vector3f to_light;
+			float att = 1.0f;
+			if (light->light_type == eLightType::DIRECTIONAL)
+				to_light = front * 100000.0f;
+			else
+			{
+				to_light = light->root.model.getTranslation() - bounce.position;
+				float dist = to_light.length();
+				att = std::max((light->max_distance - dist) / light->max_distance, 0.0f);
+				if (light->light_type == eLightType::SPOT)
+				{
+					float cos_angle = front.dot(to_light) / dist;
+					float cos_min = cosf(light->cone_info.x * DEG2RAD), cos_max = cosf(light->cone_info.y * DEG2RAD);
+					if (cos_angle < cos_max)
+						att = 0.0f;
+					else if (cos_angle < cos_min)
+						att *= 1.0f - (cos_angle - cos_min) / (cos_max - cos_min);
+				}
+			}
+			float NdotL = bounce.normal.dot(to_light) / to_light.length();
+			if (NdotL <= 0.0f || att <= 0.0f)
+				continue;
+			Ray ray;
+			ray.origin = bounce.position;
+			ray.direction = to_light; //the light is at distance 1
+			shadow_rays.push_back(ray);
+			shadow_lights.push_back(std::make_pair((int)i, bounce.albedo * color * (NdotL * att)));
+		}
+	}
+
+	std::vector<RayTestResult> shadows;
+	scene->testRays(shadow_rays, shadows, 0xFF, 1.0f, true);
+	for (size_t i = 0; i < shadow_rays.size(); ++i)
+		if (!shadows[i].collided)
+			bounces[shadow_lights[i].first].radiance += shadow_lights[i].second;
+
+	//all the probes share the directions, so the weights are computed once
+	SHTable table;
+	table.create(&directions[0], (float)(4 * PI / samples), samples);
+	probes.resize(num_probes);
+	TaskManager::background.parallelFor(num_probes, [&](size_t start, size_t end) {
+		std::vector<Vector3f> radiance(samples);
+		for (size_t i = start; i < end; ++i)
+		{
+			for (int j = 0; j < samples; ++j)
+				radiance[j] = bounces[i * samples + j].radiance;
+			probes[i] = computeSH(table, &radiance[0]);
+		}
+	});
+	texture_dirty = true;
+
+	std::cout << " + Irradiance baked: " << name << " " << dims[0] << "x" << dims[1] << "x" << dims[2] << " probes, " << samples << " samples Time: " << (getHighResTime() - start) * 0.001 << "sec" << std::endl;
+}
+
+bool SCN::IrradianceEntity::save()
+{
+	if (!scene)
+		return false;
+	if (filename.empty())
+		filename = name + ".irr";
+	std::string fullpath = scene->base_folder + "/" + filename;
+	FILE* f = fopen(fullpath.c_str(), "wb");
+	if (f == NULL)
+	{
+		std::cout << "[ERROR] cannot write irradiance: " << fullpath << std::endl;
+		return false;
+	}
+
+	sIrradianceInfo info;
+	info.version = IRRADIANCE_BIN_VERSION;
+	info.header_bytes = sizeof(sIrradianceInfo);
+	memcpy(info.dims, dims, sizeof(dims));
+	info.num_probes = (int)probes.size();
+	fwrite("IRRV", 4, 1, f);
+	fwrite(&info, sizeof(info), 1, f);
+	if (probes.size())
+		fwrite(&probes[0], sizeof(SphericalHarmonics) * probes.size(), 1, f);
+	fclose(f);
+	return true;
+}
+
+bool SCN::IrradianceEntity::load()
+{
+	if (!scene)
+		return false;
+	std::string fullpath = scene->base_folder + "/" + filename;
+	std::vector<unsigned char> data;
+	if (!readFileBin(fullpath, data))
+		return false;
+
+	sIrradianceInfo info;
+	if (data.size() < 4 + sizeof(info) || memcmp(&data[0], "IRRV", 4) != 0)
+	{
+		std::cout << "[ERROR] loading irradiance: invalid content: " << fullpath << std::endl;
+		return false;
+	}
+	memcpy(&info, &data[4], sizeof(info));
+	if (info.version != IRRADIANCE_BIN_VERSION || info.header_bytes != sizeof(sIrradianceInfo) || data.size() != 4 + sizeof(info) + info.num_probes * sizeof(SphericalHarmonics))
+	{
+		std::cout << "[WARN] loading irradiance: old version: " << fullpath << std::endl;
+		return false;
+	}
+	if (memcmp(info.dims, dims, sizeof(dims)) != 0 || info.num_probes != getNumProbes())
+	{
+		std::cout << "[WARN] loading irradiance: the volume has changed, bake it again: " << fullpath << std::endl;
+		return false;
+	}
+
+	probes.resize(info.num_probes);
+	memcpy(&probes[0], &data[4 + sizeof(info)], info.num_probes * sizeof(SphericalHarmonics));
+	texture_dirty = true;
+	return true;
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include "scene.h"
+#include "../gfx/sphericalharmonics.h"
+
+#define IRRADIANCE_BIN_VERSION 1 //files with another version are ignored, the volume must be baked again
+
+namespace GFX {
+	class Texture;
+}
+
+namespace SCN {
+
+	//grid of probes with the light that reaches them in spherical harmonics (SH9), the renderer uses it instead of the constant ambient light.
+	//They are baked with the ray engine (the ambient light where the rays escape, one bounce of the lights where they hit),
+	//stored in a binary file next to the scene and sampled trilinearly from a 3D texture
+	class IrradianceEntity : public BaseEntity
+	{
+	public:
+		Vector3f size; //of the volume in the space of root, centered in it
+		int dims[3]; //probes per axis
+		std::string filename; //baked probes, relative to the scene folder
+		std::vector<SphericalHarmonics> probes; //x first, then y and z, empty till it is baked or loaded
+
+		static int num_samples; //rays per probe
+		static float bias; //the shadow rays start this far from the surfaces (world units)
+
+		ENTITY_METHODS(IrradianceEntity, IRRADIANCE_VOLUME, 13, 4);
+
+		IrradianceEntity();
+		~IrradianceEntity();
+		void operator = (const IrradianceEntity& entity); //the copy uploads its own texture
+
+		void configure(cJSON* json);
+		void serialize(cJSON* json);
+
+		int getNumProbes() const { return dims[0] * dims[1] * dims[2]; }
+		Vector3f getProbePosition(int x, int y, int z);
+		Matrix44 getVolumeMatrix(); //from world space to [0..1] in the volume (the first and last probes)
+		GFX::Texture* getTexture(); //uploads the probes after they change, every coefficient is a grid after the other in z
+
+		void bake(); //against the prefabs and lights of its scene
+		bool save();
+		bool load();
+
+	private:
+		GFX::Texture* texture;
+		bool texture_dirty;
+	};
+
+};
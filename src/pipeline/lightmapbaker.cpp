@@ -0,0 +1,255 @@
+#include "lightmapbaker.h"
+
+#include <iostream>
+
+#include "scene.h"
+#include "prefab.h"
+#include "../gfx/mesh.h"
+#include "../gfx/texture.h"
+#include "../utils/utils.h"
+
+using namespace SCN;
+
+int LightmapBaker::resolution = 256;
+int LightmapBaker::num_samples = 64;
+float LightmapBaker::max_distance = 100.0f;
+float LightmapBaker::bias = 0.05f;
+int LightmapBaker::dilation = 4;
+
+#define MAX_RAYS_PER_BATCH (1 << 20) //bounds the memory of the rays and results
+
+//surface under the center of a texel, in world space
+struct sTexel {
+	Vector3f position;
+	Vector3f normal;
+	int pixel;
+};
+
+//twice the signed area of the triangle abc
+static float edgeFunction(const Vector2f& a, const Vector2f& b, const Vector2f& c)
+{
+	return (b.x - a.x) * (c.y - a.y) - (b.y - a.y) * (c.x - a.x);
+}
+
+static float radicalInverse(uint32 bits)
+{
+	bits = (bits << 16u) | (bits >> 16u);
+	bits = ((bits & 0x55555555u) << 1u) | ((bits & 0xAAAAAAAAu) >> 1u);
+	bits = ((bits & 0x33333333u) << 2u) | ((bits & 0xCCCCCCCCu) >> 2u);
+	bits = ((bits & 0x0F0F0F0Fu) << 4u) | ((bits & 0xF0F0F0F0u) >> 4u);
+	bits = ((bits & 0x00FF00FFu) << 8u) | ((bits & 0xFF00FF00u) >> 8u);
+	return bits * 2.3283064365386963e-10f;
+}
+
+//finds the texels covered by the triangles of the mesh in its uvs1 (the first triangle wins where they overlap)
+static void rasterizeTexels(GFX::Mesh* mesh, const Matrix44& model, int size, std::vector<sTexel>& texels)
+{
+	std::vector<int> covered(size * size, 0);
+	bool interleaved = mesh->interleaved.size() != 0;
+	bool has_normals = interleaved || mesh->normals.size();
+	int num_triangles = (int)(mesh->m_indices.size() ? mesh->m_indices.size() : (interleaved ? mesh->interleaved.size() : mesh->vertices.size())) / 3;
+
+	for (int t = 0; t < num_triangles; ++t)
+	{
+		Vector3f v[3], n[3];
+		Vector2f uv[3];
+		for (int i = 0; i < 3; ++i)
+		{
+			unsigned int index = mesh->m_indices.size() ? mesh->m_indices[t * 3 + i] : t * 3 + i;
+			v[i] = model * (interleaved ? mesh->interleaved[index].vertex : mesh->vertices[index]);
+			if (has_normals)
+				n[i] = model.rotateVector(interleaved ? mesh->interleaved[index].normal : mesh->normals[index]);
+			uv[i] = mesh->m_uvs1[index] * (float)size;
+		}
+		Vector3f face_normal = (v[1] - v[0]).cross(v[2] - v[0]);
+		float area = edgeFunction(uv[0], uv[1], uv[2]);
+		if (fabsf(area) < 1e-8f || face_normal.length() == 0.0f)
+			continue;
+		face_normal.normalize();
+
+		//texel centers inside the triangle
+		int min_x = std::max(0, (int)floorf(std::min(uv[0].x, std::min(uv[1].x, uv[2].x)) - 0.5f));
+		int max_x = std::min(size - 1, (int)ceilf(std::max(uv[0].x, std::max(uv[1].x, uv[2].x)) - 0.5f));
+		int min_y = std::max(0, (int)floorf(std::min(uv[0].y, std::min(uv[1].y, uv[2].y)) - 0.5f));
+		int max_y = std::min(size - 1, (int)ceilf(std::max(uv[0].y, std::max(uv[1].y, uv[2].y)) - 0.5f));
+		for (int y = min_y; y <= max_y; ++y)
+			for (int x = min_x; x <= max_x; ++x)
+			{
+				int pixel = y * size + x;
+				if (covered[pixel])
+					continue;
+				Vector2f p(x + 0.5f, y + 0.5f);
+				float w0 = edgeFunction(uv[1], uv[2], p) / area;
+				float w1 = edgeFunction(uv[2], uv[0], p) / area;
+				float w2 = 1.0f - w0 - w1;
+				if (w0 < -1e-4f || w1 < -1e-4f || w2 < -1e-4f)
+					continue;
+				sTexel texel;
+				texel.position = v[0] * w0 + v[1] * w1 + v[2] * w2;
+				texel.normal = face_normal;
+				if (has_normals)
+				{
+					Vector3f normal = n[0] * w0 + n[1] * w1 + n[2] * w2;
+					if (normal.length() > 0.0f)
+						texel.normal = normal.normalize();
+				}
+				texel.pixel = pixel;
+				texels.push_back(texel);
+				covered[pixel] = 1;
+			}
+	}
+}
+
+//uncovered texels take the average of their covered neighbours, once per pass
+static void dilateTexels(std::vector<float>& values, std::vector<uint8>& covered, int size, int passes)
+{
+	std::vector<float> next_values;
+	std::vector<uint8> next_covered;
+	for (int pass = 0; pass < passes; ++pass)
+	{
+		next_values = values;
+		next_covered = covered;
+		for (int y = 0; y < size; ++y)
+			for (int x = 0; x < size; ++x)
+			{
+				if (covered[y * size + x])
+					continue;
+				float sum = 0.0f;
+				int count = 0;
+				for (int j = std::max(0, y - 1); j <= std::min(size - 1, y + 1); ++j)
+					for (int i = std::max(0, x - 1); i <= std::min(size - 1, x + 1); ++i)
+						if (covered[j * size + i])
+						{
+							sum += values[j * size + i];
+							count++;
+						}
+				if (!count)
+					continue;
+				next_values[y * size + x] = sum / count;
+				next_covered[y * size + x] = 1;
+			}
+		values.swap(next_values);
+		covered.swap(next_covered);
+	}
+}
+
+int LightmapBaker::bakeNode(Scene* scene, Node* node, Image& result)
+{
+	GFX::Mesh* mesh = node->mesh;
+	if (!mesh || !mesh->m_uvs1.size() || mesh->bones.size())
+		return 0;
+	int size = resolution;
+	int samples = std::max(1, num_samples);
+
+	std::vector<sTexel> texels;
+	rasterizeTexels(mesh, node->getGlobalMatrix(), size, texels);
+	if (!texels.size())
+		return 0;
+
+	//cosine weighted directions (z up), every texel rotates them a different angle around its normal to avoid banding
+	std::vector<Vector3f> directions(samples);
+	for (int i = 0; i < samples; ++i)
+	{
+		float u = (i + 0.5f) / samples;
+		float phi = 2.0f * PI * radicalInverse(i);
+		float r = sqrtf(u);
+		directions[i].set(r * cosf(phi), r * sinf(phi), sqrtf(1.0f - u));
+	}
+
+	std::vector<float> values(size * size, 1.0f);
+	std::vector<uint8> covered(size * size, 0);
+	std::vector<Ray> rays;
+	std::vector<RayTestResult> results;
+	size_t texels_per_batch = std::max(1, MAX_RAYS_PER_BATCH / samples);
+	for (size_t first = 0; first < texels.size(); first += texels_per_batch)
+	{
+		size_t last = std::min(texels.size(), first + texels_per_batch);
+		rays.resize((last - first) * samples);
+		for (size_t i = first; i < last; ++i)
+		{
+			const sTexel& texel = texels[i];
+			const Vector3f& N = texel.normal;
+			//orthonormal basis without branches (Duff et al. 2017)
+			float sign = N.z >= 0.0f ? 1.0f : -1.0f;
+			float a = -1.0f / (sign + N.z);
+			float b = N.x * N.y * a;
+			Vector3f T(1.0f + sign * N.x * N.x * a, sign * b, -sign * N.x);
+			Vector3f B(b, sign + N.y * N.y * a, -N.y);
+			float angle = 2.0f * PI * radicalInverse((uint32)texel.pixel * 2654435761u);
+			float c = cosf(angle), s = sinf(angle);
+
+			Ray* ray = &rays[(i - first) * samples];
+			for (int j = 0; j < samples; ++j)
+			{
+				const Vector3f& d = directions[j];
+				ray[j].origin = texel.position + N * bias;
+				ray[j].direction = T * (d.x * c - d.y * s) + B * (d.x * s + d.y * c) + N * d.z;
+			}
+		}
+
+		scene->testRays(rays, results, 0xFF, max_distance, true);
+
+		for (size_t i = first; i < last; ++i)
+		{
+			int hits = 0;
+			const RayTestResult* result = &results[(i - first) * samples];
+			for (int j = 0; j < samples; ++j)
+				hits += result[j].collided;
+			values[texels[i].pixel] = 1.0f - hits / (float)samples;
+			covered[texels[i].pixel] = 1;
+		}
+	}
+
+	dilateTexels(values, covered, size, dilation);
+
+	//rows in the order of v, like the rest of the textures
+	result.resize(size, size, 4);
+	for (int i = 0; i < size * size; ++i)
+	{
+		uint8 value = covered[i] ? (uint8)clamp(values[i] * 255.0f + 0.5f, 0.0f, 255.0f) : 255;
+		uint8* pixel = result.data + i * 4;
+		pixel[0] = pixel[1] = pixel[2] = value;
+		pixel[3] = 255;
+	}
+	return (int)texels.size();
+}
+
+int LightmapBaker::bake(Scene* scene, bool save)
+{
+	double start = getHighResTime();
+	int num_baked = 0;
+	for (size_t i = 0; i < scene->entities.size(); ++i)
+	{
+		BaseEntity* ent = scene->entities[i];
+		if (ent->getType() != eEntityType::PREFAB)
+			continue;
+		PrefabEntity* pent = (PrefabEntity*)ent;
+		pent->updatePrefab();
+		if (!pent->prefab || pent->pending_instance)
+			continue;
+
+		std::vector<Node*> nodes;
+		pent->getLightmapNodes(nodes);
+		if (!nodes.size())
+			continue;
+		//names can be repeated, the index makes it unique
+		if (save && pent->lightmap.empty())
+			pent->lightmap = getFolderName(pent->filename) + "/" + pent->name + "_" + std::to_string(i) + "_lightmap";
+
+		for (int j = 0; j < (int)nodes.size(); ++j)
+		{
+			Image image;
+			if (!bakeNode(scene, nodes[j], image))
+				continue;
+			num_baked++;
+			std::string filename = scene->base_folder + "/" + pent->getLightmapFilename(j);
+			if (save && !image.saveTGA(filename.c_str(), true))
+				std::cout << "[ERROR] cannot write lightmap: " << filename << std::endl;
+		}
+		if (save)
+			pent->loadLightmaps(true);
+	}
+
+	std::cout << " + Lightmaps baked: " << num_baked << " (" << resolution << "x" << resolution << ", " << num_samples << " samples) Time: " << (getHighResTime() - start) * 0.001 << "sec" << std::endl;
+	return num_baked;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include "../core/math.h"
+
+//Bakes the ambient occlusion of the prefab entities of a scene into lightmaps, in the second set of uvs of their meshes.
+//Every texel covered by a triangle fires rays over its hemisphere with Scene::testRays (in the worker threads),
+//the lightmaps are saved next to the prefab and the renderer multiplies the ambient light by them (see PrefabEntity::lightmap).
+//Nodes with meshes without uvs1 or skinned are skipped.
+
+class Image;
+
+namespace SCN {
+
+	class Scene;
+	class Node;
+
+	class LightmapBaker {
+	public:
+		static int resolution; //texels per side of every lightmap
+		static int num_samples; //rays per texel
+		static float max_distance; //occluders farther than this (world units) do not darken
+		static float bias; //the rays start this far from the surface (world units) to skip it
+		static int dilation; //texels the lightmaps are grown around the triangles to hide the seams
+
+		//bakes all the prefab entities with uvs1, save writes the lightmaps and assigns them to the entities. Returns how many were baked
+		static int bake(Scene* scene, bool save = true);
+		//occlusion of one node in result (RGBA, white where there are no triangles), returns the texels traced (0 if it cannot have a lightmap)
+		static int bakeNode(Scene* scene, Node* node, Image& result);
+	};
+
+};
@@ -2,23 +2,28 @@
 #include "../core/includes.h"
 #include "prefab.h"
 
+#include "../gfx/gfx.h"
 #include "../gfx/mesh.h"
+#include "../gfx/meshbvh.h"
 #include "../gfx/texture.h"
 #include "material.h"
 #include "camera.h"
+#include "animation.h"
+#include "animationsystem.h"
 
 #include "../utils/gltf_loader.h"
 #include "../utils/utils.h"
 #include "../core/math.h"
 
 #include <iostream>
+#include <sys/stat.h>
 
 using namespace SCN;
 
 int Node::s_NodeID = 0;
 Node* Node::s_selected = nullptr;
 
-Node::Node() : parent(nullptr), mesh(nullptr), material(nullptr), visible(true)
+Node::Node() : visible(true), mesh(nullptr), material(nullptr), lightmap(nullptr), parent(nullptr)
 {
 	m_Id = s_NodeID++;
 }
@@ -34,6 +39,7 @@ Node::~Node()
 
 	mesh = nullptr;
 	material = nullptr;
+	lightmap = nullptr;
 
 	if (s_selected == this)
 		s_selected = nullptr;
@@ -133,6 +139,7 @@ void Node::operator = (const Node& node)
 
 	mesh = node.mesh;
 	material = node.material;
+	lightmap = node.lightmap;
 	name = node.name;
 	visible = node.visible;
 	model = node.model;
@@ -150,10 +157,20 @@ void Node::operator = (const Node& node)
 
 Prefab::Prefab()
 {
+	loading = false;
+	skeleton = NULL;
 }
 
 Prefab::~Prefab()
 {
+	for (size_t i = 0; i < pending_textures.size(); ++i)
+		delete pending_textures[i].image;
+	if (skeleton)
+		AnimationSystem::removeBindings(NULL, skeleton);
+	delete skeleton;
+	for (size_t i = 0; i < animations.size(); ++i)
+		delete animations[i];
+
 	if (name.size())
 	{
 		auto it = sPrefabsLoaded.find(name);
@@ -168,6 +185,7 @@ void Prefab::updateBounding()
 }
 
 std::map<std::string, Prefab*> Prefab::sPrefabsLoaded;
+bool Prefab::use_binary = true;
 
 Prefab* Prefab::Get(const char* filename)
 {
@@ -177,9 +195,26 @@ Prefab* Prefab::Get(const char* filename)
 		return it->second;
 
 	Prefab* prefab = nullptr;
+	std::string binfilename = std::string(filename) + ".pbin";
 	{
+		//try the baked version first, it is discarded if the source changed
+		if (use_binary)
+		{
+			prefab = new Prefab();
+			if (!prefab->readBin(binfilename.c_str(), filename))
+			{
+				delete prefab;
+				prefab = nullptr;
+			}
+		}
+
 		if (!prefab)
+		{
 			prefab = loadGLTF(filename);
+			if (prefab && use_binary)
+				prefab->writeBin(binfilename.c_str(), filename);
+		}
+
 		if (!prefab) {
 			std::cout << "[ERROR]: Prefab not found: " << filename << std::endl;
 			return NULL;
@@ -192,6 +227,50 @@ Prefab* Prefab::Get(const char* filename)
 	return prefab;
 }
 
+Prefab* Prefab::GetAsync(const char* filename)
+{
+	assert(filename);
+	std::map<std::string, Prefab*>::iterator it = sPrefabsLoaded.find(filename);
+	if (it != sPrefabsLoaded.end())
+		return it->second;
+
+	//create an empty prefab that will be filled once loaded
+	Prefab* prefab = new Prefab();
+	prefab->registerPrefab(filename);
+	prefab->loading = true;
+
+	//add action to BG Thread
+	TaskManager::background.addTask(new LoadPrefabTask(filename, prefab));
+	return prefab;
+}
+
+Prefab* Prefab::LoadDeferred(const char* filename)
+{
+	Prefab* prefab = nullptr;
+	std::string binfilename = std::string(filename) + ".pbin";
+
+	if (use_binary)
+	{
+		prefab = new Prefab();
+		if (!prefab->readBin(binfilename.c_str(), filename, true))
+		{
+			delete prefab;
+			prefab = nullptr;
+		}
+	}
+
+	if (!prefab)
+	{
+		prefab = loadGLTF(filename, true);
+		if (prefab && use_binary)
+			prefab->writeBin(binfilename.c_str(), filename);
+	}
+
+	if (!prefab)
+		std::cout << "[ERROR]: Prefab not found: " << filename << std::endl;
+	return prefab;
+}
+
 void Prefab::registerPrefab(std::string name)
 {
 	this->name = name;
@@ -220,3 +299,792 @@ void Prefab::updateNodesByName()
 	nodes_by_name.clear();
 	updateInDepth(nodes_by_name, &root);
 }
+
+// BAKED PREFABS *****************************************
+//everything is stored in one single file so it can be read with one call:
+//header, string table, materials, meshes (header + streams) and nodes (parents always before children)
+
+typedef struct
+{
+	int version;
+	int header_bytes;
+	int64_t source_time; //modification time of the source file when baked
+	int64_t source_size;
+	int num_strings;
+	int strings_bytes;
+	int num_materials;
+	int num_meshes;
+	int num_nodes;
+	char extra[32]; //unused
+} sPrefabInfo;
+
+typedef struct
+{
+	int name;	//index in the string table, -1 if none
+	int alpha_mode;
+	float alpha_cutoff;
+	int two_sided;
+	Vector4f color;
+	float roughness_factor;
+	float metallic_factor;
+	Vector3f emissive_factor;
+	int textures[eTextureChannel::ALL]; //index in the string table of the texture filename
+	int uv_channels[eTextureChannel::ALL];
+} sPrefabMaterialInfo;
+
+typedef struct
+{
+	int name;
+	int num_vertices;
+	int num_indices;
+	Vector3f aabb_min;
+	Vector3f aabb_max;
+	Vector3f center;
+	Vector3f halfsize;
+	float radius;
+	char streams[8]; //Vertex|Normal|Uvs|Color|Indices|Uvs1|Weights|unused
+	int num_bvh_nodes; //the BVH goes after the streams
+	int num_bvh_packets;
+} sPrefabMeshInfo;
+
+typedef struct
+{
+	int name;
+	int parent; //index of the parent node, -1 for the root
+	int mesh;
+	int material;
+	int visible;
+	Matrix44 model;
+} sPrefabNodeInfo;
+
+static bool getSourceInfo(const char* filename, int64_t& time, int64_t& size)
+{
+	struct stat stbuffer;
+	if (stat(filename, &stbuffer) != 0)
+		return false;
+	time = (int64_t)stbuffer.st_mtime;
+	size = (int64_t)stbuffer.st_size;
+	return true;
+}
+
+//size of the streams that follow the mesh header, counts must be validated first
+static size_t getStreamsBytes(const sPrefabMeshInfo& meshinfo)
+{
+	size_t num = meshinfo.num_vertices;
+	size_t streams_bytes = sizeof(Vector3f) * num;
+	if (meshinfo.streams[1] == 'N') streams_bytes += sizeof(Vector3f) * num;
+	if (meshinfo.streams[2] == 'U') streams_bytes += sizeof(Vector2f) * num;
+	if (meshinfo.streams[3] == 'C') streams_bytes += sizeof(Vector4f) * num;
+	if (meshinfo.streams[4] == 'I') streams_bytes += sizeof(unsigned int) * (size_t)meshinfo.num_indices;
+	if (meshinfo.streams[5] == 'u') streams_bytes += sizeof(Vector2f) * num;
+	if (meshinfo.streams[6] == 'W') streams_bytes += sizeof(Vector4f) * num;
+	streams_bytes += sizeof(GFX::MeshBVH::sNode) * (size_t)meshinfo.num_bvh_nodes + sizeof(GFX::MeshBVH::sTrianglePacket) * (size_t)meshinfo.num_bvh_packets;
+	return streams_bytes;
+}
+
+//walks the whole file checking every count, index and offset against its size before anything is created,
+//so a truncated or corrupted file is rejected instead of read out of bounds
+static bool checkBin(const char* data, size_t size, const sPrefabInfo& info)
+{
+	const char* pos = data + 4 + sizeof(sPrefabInfo);
+	const char* end = data + size;
+	auto remaining = [&]() -> size_t { return (size_t)(end - pos); };
+	auto isString = [&](int index) { return index >= -1 && index < info.num_strings; };
+
+	if (info.num_strings < 0 || info.strings_bytes < 0 || info.num_materials < 0 || info.num_meshes < 0 || info.num_nodes < 1)
+		return false;
+
+	//strings
+	if ((size_t)info.strings_bytes > remaining())
+		return false;
+	const char* strings_end = pos + info.strings_bytes;
+	for (int i = 0; i < info.num_strings; ++i)
+	{
+		const char* zero = (const char*)memchr(pos, 0, strings_end - pos);
+		if (!zero)
+			return false;
+		pos = zero + 1;
+	}
+	if (pos != strings_end)
+		return false;
+
+	//materials
+	for (int i = 0; i < info.num_materials; ++i)
+	{
+		sPrefabMaterialInfo matinfo;
+		if (remaining() < sizeof(sPrefabMaterialInfo))
+			return false;
+		memcpy(&matinfo, pos, sizeof(sPrefabMaterialInfo));
+		pos += sizeof(sPrefabMaterialInfo);
+		if (!isString(matinfo.name))
+			return false;
+		for (int j = 0; j < eTextureChannel::ALL; ++j)
+			if (!isString(matinfo.textures[j]))
+				return false;
+	}
+
+	//meshes
+	for (int i = 0; i < info.num_meshes; ++i)
+	{
+		sPrefabMeshInfo meshinfo;
+		if (remaining() < sizeof(sPrefabMeshInfo))
+			return false;
+		memcpy(&meshinfo, pos, sizeof(sPrefabMeshInfo));
+		pos += sizeof(sPrefabMeshInfo);
+		if (!isString(meshinfo.name) || meshinfo.num_vertices <= 0 || meshinfo.num_indices < 0 ||
+			(meshinfo.streams[4] == 'I' && meshinfo.num_indices == 0) || meshinfo.num_bvh_nodes < 0 || meshinfo.num_bvh_packets < 0)
+			return false;
+		size_t streams_bytes = getStreamsBytes(meshinfo);
+		if (streams_bytes > remaining())
+			return false;
+		pos += streams_bytes;
+	}
+
+	//nodes, parents always before children
+	for (int i = 0; i < info.num_nodes; ++i)
+	{
+		sPrefabNodeInfo nodeinfo;
+		if (remaining() < sizeof(sPrefabNodeInfo))
+			return false;
+		memcpy(&nodeinfo, pos, sizeof(sPrefabNodeInfo));
+		pos += sizeof(sPrefabNodeInfo);
+		if (!isString(nodeinfo.name) ||
+			nodeinfo.mesh < -1 || nodeinfo.mesh >= info.num_meshes ||
+			nodeinfo.material < -1 || nodeinfo.material >= info.num_materials ||
+			(i == 0 ? nodeinfo.parent != -1 : (nodeinfo.parent < 0 || nodeinfo.parent >= i)))
+			return false;
+	}
+
+	return pos == end;
+}
+
+bool Prefab::readBin(const char* filename, const char* source_filename, bool defer_gpu)
+{
+	assert(filename);
+
+	//check it is still valid before reading it
+	int64_t source_time = 0, source_size = 0;
+	if (source_filename && !getSourceInfo(source_filename, source_time, source_size))
+		return false;
+
+	struct stat stbuffer;
+	if (stat(filename, &stbuffer) != 0)
+		return false;
+
+	FILE* f = fopen(filename, "rb");
+	if (f == NULL)
+		return false;
+
+	unsigned int size = (unsigned int)stbuffer.st_size;
+	char* data = new char[size];
+	size_t read = fread(data, size, 1, f);
+	fclose(f);
+
+	//watermark
+	if (read != 1 || size < 4 + sizeof(sPrefabInfo) || memcmp(data, "PBIN", 4) != 0)
+	{
+		std::cout << "[ERROR] loading PBIN: invalid content: " << filename << std::endl;
+		delete[] data;
+		return false;
+	}
+
+	char* pos = data + 4;
+	sPrefabInfo info;
+	memcpy(&info, pos, sizeof(sPrefabInfo));
+	pos += sizeof(sPrefabInfo);
+
+	if (info.version != PREFAB_BIN_VERSION || info.header_bytes != sizeof(sPrefabInfo))
+	{
+		std::cout << "[WARN] loading PBIN: old version: " << filename << std::endl;
+		delete[] data;
+		return false;
+	}
+
+	if (source_filename && (info.source_time != source_time || info.source_size != source_size))
+	{
+		std::cout << "[WARN] loading PBIN: source has changed: " << filename << std::endl;
+		delete[] data;
+		return false;
+	}
+
+	if (!checkBin(data, size, info))
+	{
+		std::cout << "[ERROR] loading PBIN: corrupted or truncated: " << filename << std::endl;
+		delete[] data;
+		return false;
+	}
+
+	double time = getTime();
+	std::cout << " + Prefab loading: " << TermColor::YELLOW << filename << TermColor::DEFAULT << " ... ";
+
+	//strings
+	std::vector<const char*> strings(info.num_strings);
+	for (int i = 0; i < info.num_strings; ++i)
+	{
+		strings[i] = pos;
+		pos += strlen(pos) + 1;
+	}
+	assert(pos == data + 4 + sizeof(sPrefabInfo) + info.strings_bytes);
+
+	//materials
+	std::vector<Material*> materials(info.num_materials);
+	for (int i = 0; i < info.num_materials; ++i)
+	{
+		sPrefabMaterialInfo matinfo;
+		memcpy(&matinfo, pos, sizeof(sPrefabMaterialInfo));
+		pos += sizeof(sPrefabMaterialInfo);
+
+		Material* material = (matinfo.name != -1 && !defer_gpu) ? Material::Get(strings[matinfo.name]) : NULL;
+		if (!material)
+		{
+			material = new Material();
+			if (matinfo.name != -1)
+			{
+				if (defer_gpu)
+					material->name = strings[matinfo.name]; //registered later from the main thread
+				else
+					material->registerMaterial(strings[matinfo.name]);
+			}
+			material->alpha_mode = (eAlphaMode)matinfo.alpha_mode;
+			material->alpha_cutoff = matinfo.alpha_cutoff;
+			material->two_sided = matinfo.two_sided != 0;
+			material->color = matinfo.color;
+			material->roughness_factor = matinfo.roughness_factor;
+			material->metallic_factor = matinfo.metallic_factor;
+			material->emissive_factor = matinfo.emissive_factor;
+			for (int j = 0; j < eTextureChannel::ALL; ++j)
+			{
+				material->textures[j].uv_channel = matinfo.uv_channels[j];
+				if (matinfo.textures[j] == -1)
+					continue;
+				sPendingTexture pending;
+				pending.material = material;
+				pending.channel = j;
+				pending.filename = strings[matinfo.textures[j]];
+				pending.image = NULL;
+				pending_textures.push_back(pending);
+			}
+		}
+		materials[i] = material;
+	}
+
+	//all the textures at once
+	if (!defer_gpu)
+		createPendingTextures();
+
+	//meshes
+	std::vector<GFX::Mesh*> meshes(info.num_meshes);
+	for (int i = 0; i < info.num_meshes; ++i)
+	{
+		sPrefabMeshInfo meshinfo;
+		memcpy(&meshinfo, pos, sizeof(sPrefabMeshInfo));
+		pos += sizeof(sPrefabMeshInfo);
+
+		//to be able to skip them
+		size_t num = meshinfo.num_vertices;
+		size_t streams_bytes = getStreamsBytes(meshinfo);
+
+		//already loaded by another prefab
+		GFX::Mesh* mesh = (meshinfo.name != -1 && !defer_gpu) ? GFX::Mesh::Get(strings[meshinfo.name], true) : NULL;
+		if (mesh)
+		{
+			meshes[i] = mesh;
+			pos += streams_bytes;
+			continue;
+		}
+
+		mesh = new GFX::Mesh();
+		mesh->vertices.resize(num);
+		memcpy((void*)&mesh->vertices[0], pos, sizeof(Vector3f) * num);
+		pos += sizeof(Vector3f) * num;
+		if (meshinfo.streams[1] == 'N')
+		{
+			mesh->normals.resize(num);
+			memcpy((void*)&mesh->normals[0], pos, sizeof(Vector3f) * num);
+			pos += sizeof(Vector3f) * num;
+		}
+		if (meshinfo.streams[2] == 'U')
+		{
+			mesh->uvs.resize(num);
+			memcpy((void*)&mesh->uvs[0], pos, sizeof(Vector2f) * num);
+			pos += sizeof(Vector2f) * num;
+		}
+		if (meshinfo.streams[3] == 'C')
+		{
+			mesh->colors.resize(num);
+			memcpy((void*)&mesh->colors[0], pos, sizeof(Vector4f) * num);
+			pos += sizeof(Vector4f) * num;
+		}
+		if (meshinfo.streams[4] == 'I')
+		{
+			mesh->m_indices.resize(meshinfo.num_indices);
+			memcpy((void*)&mesh->m_indices[0], pos, sizeof(unsigned int) * meshinfo.num_indices);
+			pos += sizeof(unsigned int) * meshinfo.num_indices;
+		}
+		if (meshinfo.streams[5] == 'u')
+		{
+			mesh->m_uvs1.resize(num);
+			memcpy((void*)&mesh->m_uvs1[0], pos, sizeof(Vector2f) * num);
+			pos += sizeof(Vector2f) * num;
+		}
+		if (meshinfo.streams[6] == 'W')
+		{
+			mesh->weights.resize(num);
+			memcpy((void*)&mesh->weights[0], pos, sizeof(Vector4f) * num);
+			pos += sizeof(Vector4f) * num;
+		}
+		if (meshinfo.num_bvh_nodes)
+		{
+			mesh->bvh = new GFX::MeshBVH();
+			pos = mesh->bvh->readBin(pos, meshinfo.num_bvh_nodes, meshinfo.num_bvh_packets);
+		}
+		else
+			mesh->createBVH();
+
+		mesh->aabb_min = meshinfo.aabb_min;
+		mesh->aabb_max = meshinfo.aabb_max;
+		mesh->box.center = meshinfo.center;
+		mesh->box.halfsize = meshinfo.halfsize;
+		mesh->radius = meshinfo.radius;
+		if (defer_gpu)
+		{
+			if (meshinfo.name != -1)
+				mesh->name = strings[meshinfo.name]; //registered later from the main thread
+		}
+		else
+		{
+			mesh->uploadToVRAM();
+			if (meshinfo.name != -1)
+				mesh->registerMesh(strings[meshinfo.name]);
+		}
+		meshes[i] = mesh;
+	}
+
+	//nodes, the first one is the root
+	std::vector<Node*> nodes(info.num_nodes);
+	for (int i = 0; i < info.num_nodes; ++i)
+	{
+		sPrefabNodeInfo nodeinfo;
+		memcpy(&nodeinfo, pos, sizeof(sPrefabNodeInfo));
+		pos += sizeof(sPrefabNodeInfo);
+
+		Node* node = i == 0 ? &root : new Node();
+		if (nodeinfo.name != -1)
+			node->name = strings[nodeinfo.name];
+		node->visible = nodeinfo.visible != 0;
+		node->model = nodeinfo.model;
+		node->mesh = nodeinfo.mesh != -1 ? meshes[nodeinfo.mesh] : NULL;
+		node->material = nodeinfo.material != -1 ? materials[nodeinfo.material] : NULL;
+		if (nodeinfo.parent != -1)
+		{
+			assert(nodeinfo.parent < i);
+			nodes[nodeinfo.parent]->addChild(node);
+		}
+		nodes[i] = node;
+	}
+
+	assert(pos == data + size);
+	delete[] data;
+
+	updateNodesByName();
+	updateBounding();
+
+	std::cout << "[OK BIN] Nodes: " << info.num_nodes << " Meshes: " << info.num_meshes << " Time: " << (getTime() - time) * 0.001 << "sec" << std::endl;
+	return true;
+}
+
+bool Prefab::writeBin(const char* filename, const char* source_filename)
+{
+	assert(filename && source_filename);
+
+	//the skin and the clips are always read from the glTF
+	if (skeleton || animations.size())
+		return false;
+
+	std::vector<std::string> strings;
+	std::map<std::string, int> strings_index;
+	auto addString = [&](const std::string& str) -> int {
+		if (!str.size())
+			return -1;
+		auto it = strings_index.find(str);
+		if (it != strings_index.end())
+			return it->second;
+		strings.push_back(str);
+		return strings_index[str] = (int)strings.size() - 1;
+	};
+
+	//flatten the tree, parents first
+	std::vector<Node*> nodes;
+	std::vector<int> parents;
+	std::vector<Material*> materials;
+	std::vector<GFX::Mesh*> meshes;
+	std::map<Material*, int> materials_index;
+	std::map<GFX::Mesh*, int> meshes_index;
+
+	nodes.push_back(&root);
+	parents.push_back(-1);
+	for (size_t i = 0; i < nodes.size(); ++i)
+	{
+		Node* node = nodes[i];
+		for (size_t j = 0; j < node->children.size(); ++j)
+		{
+			nodes.push_back(node->children[j]);
+			parents.push_back((int)i);
+		}
+		if (node->mesh && meshes_index.find(node->mesh) == meshes_index.end())
+		{
+			if (node->mesh->interleaved.size() || !node->mesh->vertices.size())
+			{
+				std::cout << "[WARN] cannot bake prefab, mesh without vertices stream: " << node->mesh->name << std::endl;
+				return false;
+			}
+			meshes_index[node->mesh] = (int)meshes.size();
+			meshes.push_back(node->mesh);
+		}
+		if (node->material && materials_index.find(node->material) == materials_index.end())
+		{
+			materials_index[node->material] = (int)materials.size();
+			materials.push_back(node->material);
+		}
+	}
+
+	//textures must be reloadable from disk, embedded ones cannot be baked
+	std::vector<sPrefabMaterialInfo> materials_info(materials.size());
+	for (size_t i = 0; i < materials.size(); ++i)
+	{
+		Material* material = materials[i];
+		sPrefabMaterialInfo& matinfo = materials_info[i];
+		matinfo = {};
+		matinfo.name = addString(material->name);
+		matinfo.alpha_mode = material->alpha_mode;
+		matinfo.alpha_cutoff = material->alpha_cutoff;
+		matinfo.two_sided = material->two_sided;
+		matinfo.color = material->color;
+		matinfo.roughness_factor = material->roughness_factor;
+		matinfo.metallic_factor = material->metallic_factor;
+		matinfo.emissive_factor = material->emissive_factor;
+		for (int j = 0; j < eTextureChannel::ALL; ++j)
+		{
+			GFX::Texture* texture = material->textures[j].texture;
+			matinfo.textures[j] = -1;
+			matinfo.uv_channels[j] = material->textures[j].uv_channel;
+
+			//if loaded in a background thread the texture is still pending
+			std::string texture_filename;
+			bool found = false;
+			if (texture)
+			{
+				texture_filename = texture->filename;
+				found = true;
+			}
+			else for (size_t k = 0; k < pending_textures.size(); ++k)
+				if (pending_textures[k].material == material && pending_textures[k].channel == j)
+				{
+					texture_filename = pending_textures[k].filename;
+					found = true;
+					break;
+				}
+			if (!found)
+				continue;
+
+			struct stat stbuffer;
+			if (!texture_filename.size() || stat(texture_filename.c_str(), &stbuffer) != 0)
+			{
+				std::cout << "[WARN] cannot bake prefab, texture not found in disk: " << texture_filename << std::endl;
+				return false;
+			}
+			matinfo.textures[j] = addString(texture_filename);
+		}
+	}
+
+	std::vector<sPrefabMeshInfo> meshes_info(meshes.size());
+	for (size_t i = 0; i < meshes.size(); ++i)
+	{
+		GFX::Mesh* mesh = meshes[i];
+		sPrefabMeshInfo& meshinfo = meshes_info[i];
+		meshinfo = {};
+		meshinfo.name = addString(mesh->name);
+		meshinfo.num_vertices = (int)mesh->vertices.size();
+		meshinfo.num_indices = (int)mesh->m_indices.size();
+		meshinfo.aabb_min = mesh->aabb_min;
+		meshinfo.aabb_max = mesh->aabb_max;
+		meshinfo.center = mesh->box.center;
+		meshinfo.halfsize = mesh->box.halfsize;
+		meshinfo.radius = mesh->radius;
+		meshinfo.streams[0] = 'V';
+		meshinfo.streams[1] = mesh->normals.size() ? 'N' : ' ';
+		meshinfo.streams[2] = mesh->uvs.size() ? 'U' : ' ';
+		meshinfo.streams[3] = mesh->colors.size() ? 'C' : ' ';
+		meshinfo.streams[4] = mesh->m_indices.size() ? 'I' : ' ';
+		meshinfo.streams[5] = mesh->m_uvs1.size() ? 'u' : ' ';
+		meshinfo.streams[6] = mesh->weights.size() ? 'W' : ' ';
+		meshinfo.streams[7] = ' ';
+		mesh->createBVH();
+		meshinfo.num_bvh_nodes = (int)mesh->bvh->nodes.size();
+		meshinfo.num_bvh_packets = (int)mesh->bvh->packets.size();
+	}
+
+	std::vector<sPrefabNodeInfo> nodes_info(nodes.size());
+	for (size_t i = 0; i < nodes.size(); ++i)
+	{
+		Node* node = nodes[i];
+		sPrefabNodeInfo& nodeinfo = nodes_info[i];
+		nodeinfo = {};
+		nodeinfo.name = addString(node->name);
+		nodeinfo.parent = parents[i];
+		nodeinfo.mesh = node->mesh ? meshes_index[node->mesh] : -1;
+		nodeinfo.material = node->material ? materials_index[node->material] : -1;
+		nodeinfo.visible = node->visible;
+		nodeinfo.model = node->model;
+	}
+
+	sPrefabInfo info;
+	memset(&info, 0, sizeof(info));
+	info.version = PREFAB_BIN_VERSION;
+	info.header_bytes = sizeof(sPrefabInfo);
+	if (!getSourceInfo(source_filename, info.source_time, info.source_size))
+		return false;
+	info.num_strings = (int)strings.size();
+	for (size_t i = 0; i < strings.size(); ++i)
+		info.strings_bytes += (int)strings[i].size() + 1;
+	info.num_materials = (int)materials.size();
+	info.num_meshes = (int)meshes.size();
+	info.num_nodes = (int)nodes.size();
+
+	//written with another name and renamed once complete, an interrupted bake never leaves a valid header
+	std::string tmp_filename = std::string(filename) + ".tmp";
+	FILE* f = fopen(tmp_filename.c_str(), "wb");
+	if (f == NULL)
+	{
+		std::cout << "[ERROR] cannot write prefab BIN: " << filename << std::endl;
+		return false;
+	}
+
+	//watermark
+	fwrite("PBIN", sizeof(char), 4, f);
+	fwrite((void*)&info, sizeof(sPrefabInfo), 1, f);
+
+	for (size_t i = 0; i < strings.size(); ++i)
+		fwrite(strings[i].c_str(), strings[i].size() + 1, 1, f);
+
+	if (materials_info.size())
+		fwrite((void*)&materials_info[0], sizeof(sPrefabMaterialInfo) * materials_info.size(), 1, f);
+
+	for (size_t i = 0; i < meshes.size(); ++i)
+	{
+		GFX::Mesh* mesh = meshes[i];
+		fwrite((void*)&meshes_info[i], sizeof(sPrefabMeshInfo), 1, f);
+		fwrite((void*)&mesh->vertices[0], mesh->vertices.size() * sizeof(Vector3f), 1, f);
+		if (mesh->normals.size())
+			fwrite((void*)&mesh->normals[0], mesh->normals.size() * sizeof(Vector3f), 1, f);
+		if (mesh->uvs.size())
+			fwrite((void*)&mesh->uvs[0], mesh->uvs.size() * sizeof(Vector2f), 1, f);
+		if (mesh->colors.size())
+			fwrite((void*)&mesh->colors[0], mesh->colors.size() * sizeof(Vector4f), 1, f);
+		if (mesh->m_indices.size())
+			fwrite((void*)&mesh->m_indices[0], mesh->m_indices.size() * sizeof(unsigned int), 1, f);
+		if (mesh->m_uvs1.size())
+			fwrite((void*)&mesh->m_uvs1[0], mesh->m_uvs1.size() * sizeof(Vector2f), 1, f);
+		if (mesh->weights.size())
+			fwrite((void*)&mesh->weights[0], mesh->weights.size() * sizeof(Vector4f), 1, f);
+		mesh->bvh->writeBin(f);
+	}
+
+	fwrite((void*)&nodes_info[0], sizeof(sPrefabNodeInfo) * nodes_info.size(), 1, f);
+	bool failed = ferror(f) != 0;
+	if (fclose(f) != 0)
+		failed = true;
+
+	remove(filename); //rename does not overwrite in windows
+	if (failed || rename(tmp_filename.c_str(), filename) != 0)
+	{
+		std::cout << "[ERROR] cannot write prefab BIN: " << filename << std::endl;
+		remove(tmp_filename.c_str());
+		return false;
+	}
+
+	std::cout << " + Prefab baked: " << TermColor::YELLOW << filename << TermColor::DEFAULT << std::endl;
+	return true;
+}
+
+// ASYNC LOADING *****************************************
+
+//meshes and materials created in a background thread are not registered, if another prefab
+//already registered them we use those, otherwise we register ours
+void Prefab::resolveDeferredResources()
+{
+	std::map<GFX::Mesh*, GFX::Mesh*> meshes;
+	std::map<Material*, Material*> materials;
+	std::vector<Node*> nodes;
+	nodes.push_back(&root);
+	pending_meshes.clear();
+
+	for (size_t i = 0; i < nodes.size(); ++i)
+	{
+		Node* node = nodes[i];
+		for (size_t j = 0; j < node->children.size(); ++j)
+			nodes.push_back(node->children[j]);
+
+		if (node->mesh)
+		{
+			auto it = meshes.find(node->mesh);
+			if (it == meshes.end())
+			{
+				GFX::Mesh* mesh = node->mesh;
+				GFX::Mesh* existing = mesh->name.size() ? GFX::Mesh::Get(mesh->name.c_str(), true) : NULL;
+				if (existing)
+					delete mesh;
+				else
+				{
+					if (mesh->name.size())
+						mesh->registerMesh(mesh->name);
+					pending_meshes.push_back(mesh);
+				}
+				it = meshes.insert(std::make_pair(mesh, existing ? existing : mesh)).first;
+			}
+			node->mesh = it->second;
+		}
+
+		if (node->material)
+		{
+			auto it = materials.find(node->material);
+			if (it == materials.end())
+			{
+				Material* material = node->material;
+				Material* existing = material->name.size() ? Material::Get(material->name.c_str()) : NULL;
+				if (existing)
+				{
+					//its pending textures are not needed anymore
+					for (size_t k = 0; k < pending_textures.size(); ++k)
+						if (pending_textures[k].material == material)
+						{
+							delete pending_textures[k].image;
+							pending_textures.erase(pending_textures.begin() + k--);
+						}
+					material->name.clear(); //otherwise the dtor unregisters the existing one
+					delete material;
+				}
+				else if (material->name.size())
+					material->registerMaterial(material->name.c_str());
+				it = materials.insert(std::make_pair(material, existing ? existing : material)).first;
+			}
+			node->material = it->second;
+		}
+	}
+}
+
+void Prefab::createPendingTextures()
+{
+	//the ones in files are requested together so they are decoded in parallel
+	std::vector<std::string> filenames;
+	for (size_t i = 0; i < pending_textures.size(); ++i)
+		if (!pending_textures[i].image)
+			filenames.push_back(pending_textures[i].filename);
+	std::vector<GFX::Texture*> textures = GFX::Texture::GetAsyncBatch(filenames);
+
+	int num_files = 0;
+	for (size_t i = 0; i < pending_textures.size(); ++i)
+	{
+		sPendingTexture& pending = pending_textures[i];
+		GFX::Texture* texture = NULL;
+		if (!pending.image)
+			texture = textures[num_files++];
+		else
+		{
+			//embedded image
+			texture = pending.filename.size() ? GFX::Texture::Find(pending.filename.c_str()) : NULL;
+			if (!texture)
+			{
+				texture = new GFX::Texture();
+				texture->loadFromImage(pending.image);
+				if (pending.filename.size())
+					texture->setName(pending.filename.c_str());
+			}
+			delete pending.image;
+		}
+		pending.material->textures[pending.channel].texture = texture;
+	}
+	pending_textures.clear();
+}
+
+//moves the tree from another prefab to this one
+void Prefab::takeNodesFrom(Prefab* prefab)
+{
+	root.clear();
+	root.name = prefab->root.name;
+	root.model = prefab->root.model;
+	root.mesh = prefab->root.mesh;
+	root.material = prefab->root.material;
+	root.visible = prefab->root.visible;
+	for (size_t i = 0; i < prefab->root.children.size(); ++i)
+	{
+		Node* child = prefab->root.children[i];
+		child->parent = NULL;
+		root.addChild(child);
+	}
+	prefab->root.children.clear();
+	skeleton = prefab->skeleton;
+	prefab->skeleton = NULL;
+	animations.swap(prefab->animations);
+	updateNodesByName();
+	updateBounding();
+}
+
+LoadPrefabTask::LoadPrefabTask(const char* filename, SCN::Prefab* target)
+{
+	this->filename = filename;
+	this->target = target;
+}
+
+void LoadPrefabTask::onExecute()
+{
+	//no OpenGL here, this runs in a background thread
+	SCN::Prefab* prefab = SCN::Prefab::LoadDeferred(filename.c_str());
+
+	//pass it to the main thread
+	TaskManager::foreground.addTask(new UploadPrefabTask(target, prefab));
+}
+
+UploadPrefabTask::UploadPrefabTask(SCN::Prefab* target, SCN::Prefab* loaded, bool resolved)
+{
+	priority = HIGH; //geometry before textures
+	this->target = target;
+	this->loaded = loaded;
+	this->resolved = resolved;
+}
+
+void UploadPrefabTask::onExecute()
+{
+	//failed to load, leave it empty
+	if (!loaded)
+	{
+		target->loading = false;
+		return;
+	}
+
+	if (!resolved)
+	{
+		loaded->resolveDeferredResources();
+		target->bounding = loaded->bounding; //so we can show something meanwhile
+		resolved = true;
+	}
+
+	//upload one mesh and continue in another task
+	if (loaded->pending_meshes.size())
+	{
+		GFX::Mesh* mesh = loaded->pending_meshes.back();
+		loaded->pending_meshes.pop_back();
+		mesh->uploadToVRAM();
+		size_t num = mesh->vertices.size();
+		GFX::addUploadedBytes(num * sizeof(Vector3f) + mesh->normals.size() * sizeof(Vector3f) + mesh->uvs.size() * sizeof(Vector2f) +
+			mesh->m_uvs1.size() * sizeof(Vector2f) + mesh->colors.size() * sizeof(Vector4f) + mesh->m_indices.size() * sizeof(unsigned int));
+		TaskManager::foreground.addTask(new UploadPrefabTask(target, loaded, true));
+		return;
+	}
+
+	//ready
+	loaded->createPendingTextures();
+	target->takeNodesFrom(loaded);
+	target->loading = false;
+	delete loaded;
+}
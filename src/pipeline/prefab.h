@@ -5,8 +5,11 @@
 #include <string>
 
 #include "../core/math.h"
+#include "../core/task.h"
 #include "material.h"
 
+#define PREFAB_BIN_VERSION 3 //this is used to regenerate baked prefabs if the format changes
+
 //forward declaration
 namespace GFX {
 	class Mesh;
@@ -14,6 +17,9 @@ namespace GFX {
 };
 
 class Camera;
+class Image;
+class Skeleton;
+class Animation;
 
 namespace SCN {
 
@@ -40,6 +46,7 @@ namespace SCN {
 
 		GFX::Mesh* mesh;
 		Material* material;
+		GFX::Texture* lightmap; //baked ambient occlusion in the uvs1 of the mesh (see LightmapBaker), NULL if it has none
 
 		Matrix44 model;	//the matrix that defines where is the object (in relation to its parent)
 		Matrix44 global_model;	//the matrix that defines where is the object (in relation to the world)
@@ -99,6 +106,23 @@ namespace SCN {
 		Node root;
 		BoundingBox bounding;
 
+		//skinned prefabs (glTF skin and animations), bones are in the space of the prefab root
+		Skeleton* skeleton; //bind pose, NULL if it has no skin
+		std::vector<Animation*> animations; //clips of the skeleton
+
+		//async loading: the prefab is registered empty and filled once it has been uploaded
+		bool loading;
+
+		//textures found while loading in a background thread, they are created later in the main thread
+		struct sPendingTexture {
+			Material* material;
+			int channel;
+			std::string filename;
+			Image* image; //decoded embedded image, NULL if it must be loaded from filename
+		};
+		std::vector<sPendingTexture> pending_textures;
+		std::vector<GFX::Mesh*> pending_meshes; //meshes waiting to be uploaded to VRAM
+
 		//ctor and dtor
 		Prefab();
 		~Prefab();
@@ -107,10 +131,45 @@ namespace SCN {
 		void updateNodesByName();
 		Node* getNodeByName(const char* name);
 
+		//baked version of the prefab (nodes, materials and mesh streams in one file), skinned prefabs are not baked
+		static bool use_binary; //stores a .pbin next to the source and loads it while it is up to date
+		bool readBin(const char* filename, const char* source_filename = NULL, bool defer_gpu = false);
+		bool writeBin(const char* filename, const char* source_filename);
+
 		//Manager to cache loaded prefabs
 		static std::map<std::string, Prefab*> sPrefabsLoaded;
 		static Prefab* Get(const char* filename);
+		static Prefab* GetAsync(const char* filename); //returns an empty prefab with loading set to true
+		static Prefab* LoadDeferred(const char* filename); //without OpenGL, meshes are not uploaded nor registered (see resolveDeferredResources)
 		void registerPrefab(std::string name);
+
+		//used by async loading, must be called from the main thread
+		void resolveDeferredResources();
+		void createPendingTextures();
+		void takeNodesFrom(Prefab* prefab);
 	};
 
 };
+
+//Prefabs loaded asynchronously are parsed in a background thread (glTF or baked version)
+//and afterwards the main thread uploads the meshes to the GPU one per task, so the
+//foreground manager can stop when the frame budget is spent
+
+class LoadPrefabTask : public Task {
+public:
+	std::string filename;
+	SCN::Prefab* target;
+
+	LoadPrefabTask(const char* filename, SCN::Prefab* target);
+	void onExecute();
+};
+
+class UploadPrefabTask : public Task {
+public:
+	SCN::Prefab* target;
+	SCN::Prefab* loaded;
+	bool resolved;
+
+	UploadPrefabTask(SCN::Prefab* target, SCN::Prefab* loaded, bool resolved = false);
+	void onExecute();
+};
@@ -0,0 +1,244 @@
+#include "reflectionprobe.h"
+
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+
+#include "prefab.h"
+#include "../gfx/texture.h"
+#include "../gfx/mesh.h"
+#include "../utils/utils.h"
+
+int SCN::ReflectionProbeEntity::num_prefilter_samples = 64;
+int SCN::ReflectionProbeEntity::stable_frames = 30;
+
+SCN::ReflectionProbeEntity::ReflectionProbeEntity()
+{
+	size.set(100, 100, 100);
+	resolution = 128;
+	signature = 0;
+	saved_signature = 0;
+	pending_signature = 0;
+	pending_frames = 0;
+	texture = nullptr;
+}
+
+SCN::ReflectionProbeEntity::~ReflectionProbeEntity()
+{
+	if (texture)
+		delete texture;
+}
+
+void SCN::ReflectionProbeEntity::operator = (const ReflectionProbeEntity& entity)
+{
+	BaseEntity::operator = (entity);
+	size = entity.size;
+	resolution = entity.resolution;
+	filename = entity.filename;
+	signature = 0;
+	saved_signature = 0;
+	pending_signature = 0;
+	pending_frames = 0;
+	texture = nullptr;
+}
+
+void SCN::ReflectionProbeEntity::configure(cJSON* json)
+{
+	size = readJSONVector3(json, "size", size);
+	//a power of two from 32 to 512 as in the editor, the mips are halved down to one texel
+	int requested = (int)readJSONNumber(json, "resolution", (float)resolution);
+	resolution = 32;
+	while (resolution < 512 && resolution < requested)
+		resolution *= 2;
+	filename = readJSONString(json, "filename", filename.c_str());
+	//as text, a JSON number would lose bits
+	signature = strtoull(readJSONString(json, "signature", "0").c_str(), NULL, 16);
+	if (filename.size() && !load())
+		signature = 0;
+	saved_signature = signature;
+}
+
+void SCN::ReflectionProbeEntity::serialize(cJSON* json)
+{
+	writeJSONVector3(json, "size", size);
+	writeJSONNumber(json, "resolution", (float)resolution);
+	if (filename.size())
+		writeJSONString(json, "filename", filename.c_str());
+	//of the file, the capture in memory is not stored till it is saved
+	if (saved_signature)
+	{
+		char str[32];
+		sprintf(str, "%llx", (unsigned long long)saved_signature);
+		writeJSONString(json, "signature", str);
+	}
+}
+
+BoundingBox SCN::ReflectionProbeEntity::getBoundingBox()
+{
+	return transformBoundingBox(root.model, BoundingBox(Vector3f(0, 0, 0), size * 0.5f));
+}
+
+bool SCN::ReflectionProbeEntity::contains(const Vector3f& point)
+{
+	BoundingBox box = getBoundingBox();
+	Vector3f d = point - box.center;
+	return fabsf(d.x) <= box.halfsize.x && fabsf(d.y) <= box.halfsize.y && fabsf(d.z) <= box.halfsize.z;
+}
+
+//FNV-1a
+static uint64 hashBytes(const void* data, size_t size, uint64 hash)
+{
+	const unsigned char* bytes = (const unsigned char*)data;
+	for (size_t i = 0; i < size; ++i)
+		hash = (hash ^ bytes[i]) * 1099511628211ULL;
+	return hash;
+}
+
+//the meshes of the node and its children that touch the box, with their transform
+static void hashNode(SCN::Node* node, const BoundingBox& box, uint64& hash)
+{
+	if (!node->visible)
+		return;
+	Matrix44 model = node->getGlobalMatrix(true);
+	if (node->mesh)
+	{
+		BoundingBox aabb = transformBoundingBox(model, node->mesh->box);
+		Vector3f d = aabb.center - box.center;
+		Vector3f h = aabb.halfsize + box.halfsize;
+		if (fabsf(d.x) <= h.x && fabsf(d.y) <= h.y && fabsf(d.z) <= h.z)
+		{
+			hash = hashBytes(node->mesh->name.c_str(), node->mesh->name.size(), hash);
+			hash = hashBytes(model.m, sizeof(model.m), hash);
+		}
+	}
+	for (auto child : node->children)
+		hashNode(child, box, hash);
+}
+
+uint64 SCN::ReflectionProbeEntity::computeSignature()
+{
+	assert(scene && "the probe must be in a scene");
+	BoundingBox box = getBoundingBox();
+
+	uint64 hash = 14695981039346656037ULL;
+	hash = hashBytes(&resolution, sizeof(resolution), hash);
+	hash = hashBytes(root.model.m, sizeof(root.model.m), hash);
+	hash = hashBytes(size.v, sizeof(size.v), hash);
+	for (auto ent : scene->entities)
+	{
+		if (!ent->visible || ent->getType() != eEntityType::PREFAB)
+			continue;
+		PrefabEntity* pent = (PrefabEntity*)ent;
+		if (pent->prefab && pent->pending_instance)
+			return 0; //it would be captured again once loaded
+		hashNode(&pent->root, box, hash);
+	}
+	return hash ? hash : 1;
+}
+
+bool SCN::ReflectionProbeEntity::needsCapture()
+{
+	uint64 current = computeSignature();
+	if (!current)
+		return false;
+	if (!texture)
+		return true;
+	if (current == signature)
+	{
+		pending_frames = 0;
+		return false;
+	}
+	//while something moves the signature changes every frame, wait till it stops
+	if (current != pending_signature)
+	{
+		pending_signature = current;
+		pending_frames = 0;
+	}
+	return ++pending_frames >= stable_frames;
+}
+
+GFX::Texture* SCN::ReflectionProbeEntity::beginCapture()
+{
+	if (!texture || texture->width != resolution)
+		upload(NULL);
+	return texture;
+}
+
+void SCN::ReflectionProbeEntity::endCapture()
+{
+	signature = computeSignature();
+	pending_signature = 0;
+	pending_frames = 0;
+}
+
+void SCN::ReflectionProbeEntity::upload(float* faces[N_LEVELS][N_FACES])
+{
+	if (!texture)
+		texture = new GFX::Texture();
+	//RGBA, the renderer prefilters the captures into the mips and RGB16F is not always renderable
+	texture->createCubemap(resolution, resolution, faces ? (Uint8**)faces[0] : NULL, GL_RGB, GL_FLOAT, true, GL_RGBA16F);
+	for (int i = 1; i < N_LEVELS; ++i)
+		texture->uploadCubemap(GL_RGB, GL_FLOAT, false, faces ? (Uint8**)faces[i] : NULL, GL_RGBA16F, i);
+
+	//the smaller mips are not stored, the texture would be incomplete
+	texture->num_levels = N_LEVELS;
+	glBindTexture(GL_TEXTURE_CUBE_MAP, texture->texture_id);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAX_LEVEL, N_LEVELS - 1);
+	glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
+}
+
+bool SCN::ReflectionProbeEntity::save()
+{
+	if (!scene || !texture)
+		return false;
+	if (filename.empty())
+		filename = name + ".hdre";
+	std::string fullpath = scene->base_folder + "/" + filename;
+
+	//read back from the GPU, the captures only live there
+	std::vector<float> levels[N_LEVELS][N_FACES];
+	float* faces[N_LEVELS][N_FACES];
+	glBindTexture(GL_TEXTURE_CUBE_MAP, texture->texture_id);
+	for (int i = 0; i < N_LEVELS; ++i)
+	{
+		int w = resolution >> i;
+		for (int j = 0; j < N_FACES; ++j)
+		{
+			levels[i][j].resize(w * w * 3);
+			faces[i][j] = &levels[i][j][0];
+			glGetTexImage(GL_TEXTURE_CUBE_MAP_POSITIVE_X + j, i, GL_RGB, GL_FLOAT, faces[i][j]);
+		}
+	}
+	glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
+
+	if (!HDRE::Save(fullpath.c_str(), resolution, 3, faces))
+	{
+		std::cout << "[ERROR] cannot write reflection probe: " << fullpath << std::endl;
+		return false;
+	}
+	saved_signature = signature;
+	std::cout << " + Reflection probe saved: " << fullpath << std::endl;
+	return true;
+}
+
+bool SCN::ReflectionProbeEntity::load()
+{
+	if (!scene)
+		return false;
+	std::string fullpath = scene->base_folder + "/" + filename;
+	HDRE hdre; //not HDRE::Get, it would keep an old version in memory after a capture
+	if (!hdre.load(fullpath.c_str()))
+		return false;
+	if (hdre.width != resolution || hdre.header.numChannels != 3 || hdre.header.version <= 2.0f)
+	{
+		std::cout << "[WARN] loading reflection probe: the probe has changed, it will be captured again: " << fullpath << std::endl;
+		return false;
+	}
+
+	float* faces[N_LEVELS][N_FACES];
+	for (int i = 0; i < N_LEVELS; ++i)
+		for (int j = 0; j < N_FACES; ++j)
+			faces[i][j] = hdre.getFacef(i, j);
+	upload(faces);
+	return true;
+}
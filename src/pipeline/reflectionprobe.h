@@ -0,0 +1,57 @@
+#pragma once
+
+#include "scene.h"
+#include "../extra/hdre.h"
+
+namespace GFX {
+	class Texture;
+}
+
+namespace SCN {
+
+	//cubemap of the scene seen from a point, prefiltered in N_LEVELS mips (roughness 0 in the first, 1 in the last).
+	//The renderer captures it with the FBO cubemap faces and prefilters it in the GPU, it is captured again once the geometry
+	//inside its box changes and stays still. The captures live in memory, save stores them next to the scene as HDRE.
+	//The objects inside the box use it for their reflections
+	class ReflectionProbeEntity : public BaseEntity
+	{
+	public:
+		Vector3f size; //of the box in the space of root, centered in it
+		int resolution; //of the faces, a power of two of at least 32 (one texel in the last mip)
+		std::string filename; //prefiltered cubemap, relative to the scene folder
+		uint64 signature; //of the geometry in the box when it was captured, 0 if it never was
+
+		static int num_prefilter_samples; //GGX samples per texel of the rough mips
+		static int stable_frames; //the signature must stay the same for these frames before capturing again
+
+		ENTITY_METHODS(ReflectionProbeEntity, REFLECTION_PROBE, 12, 4);
+
+		ReflectionProbeEntity();
+		~ReflectionProbeEntity();
+		void operator = (const ReflectionProbeEntity& entity); //the copy captures its own texture
+
+		void configure(cJSON* json);
+		void serialize(cJSON* json);
+
+		BoundingBox getBoundingBox(); //in world space
+		bool contains(const Vector3f& point);
+		uint64 computeSignature(); //of the visible prefab nodes that touch the box, 0 while a prefab is still loading
+		bool needsCapture(); //no cubemap yet, or the geometry changed since it was captured and is still now
+		GFX::Texture* getTexture() { return texture; } //NULL till it is captured or loaded
+		bool isSaved() { return texture && saved_signature == signature; } //the file has the current capture
+
+		GFX::Texture* beginCapture(); //with empty mips if the resolution changed, the renderer prefilters into them
+		void endCapture(); //the texture has the scene as it is now
+		bool save(); //reads the mips back from the GPU, only when asked (the editor)
+		bool load();
+
+	private:
+		GFX::Texture* texture;
+		uint64 saved_signature; //of the capture in the file
+		uint64 pending_signature; //changed signature that is waiting to be still
+		int pending_frames;
+
+		void upload(float* faces[N_LEVELS][N_FACES]); //NULL only allocates the mips
+	};
+
+};
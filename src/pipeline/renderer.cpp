@@ -1,16 +1,21 @@
 #include "renderer.h"
 
 #include <algorithm> //sort
+#include <unordered_map>
 
 #include "camera.h"
 #include "../gfx/gfx.h"
 //#include "../gfx/shader.h"
 #include "../gfx/mesh.h"
 #include "../gfx/texture.h"
+#include "../gfx/texturestreamer.h"
+#include "../gfx/mesharena.h"
 #include "../gfx/fbo.h"
 #include "../pipeline/prefab.h"
 #include "../pipeline/material.h"
 #include "../pipeline/animation.h"
+#include "../pipeline/irradiance.h"
+#include "../pipeline/reflectionprobe.h"
 #include "../utils/utils.h"
 #include "../extra/hdre.h"
 #include "../core/ui.h"
@@ -22,6 +27,7 @@ using namespace SCN;
 
 //some globals
 GFX::Mesh sphere;
+GFX::Mesh wire_box;
 
 bool SCN::RenderCall::CompareAlphaAndDistance(RenderCall rc1, RenderCall rc2)
 {
@@ -33,25 +39,139 @@ bool SCN::RenderCall::CompareAlphaAndDistance(RenderCall rc1, RenderCall rc2)
 }
 
 
+//textures still loading are uploaded first if they cover more of the screen,
+//the streamed ones get the mip level they need for the size on screen
+static void updateTexturesImportance(SCN::Material* material, const BoundingBox& world_bounding, Camera* camera)
+{
+	float distance = std::max(camera->eye.distance(world_bounding.center), 0.01f);
+	float importance = world_bounding.halfsize.length() / distance;
+	//diameter in pixels, assuming the uvs cover the texture once
+	float pixels = importance * CORE::getWindowSize().y / tan(camera->fov * 0.5f * DEG2RAD);
+	for (int i = 0; i < eTextureChannel::ALL; ++i)
+	{
+		GFX::Texture* texture = material->textures[i].texture;
+		if (!texture)
+			continue;
+		if (texture->loading)
+			texture->screen_importance = std::max(texture->screen_importance, importance);
+		else
+			GFX::TextureStreamer::request(texture, pixels);
+	}
+}
+
+//a material as it is in the materials buffer (std430)
+struct sMaterialGPU {
+	Vector4f color;
+	Vector4f emissive_factor; //w is the alpha cutoff
+	uint64_t textures[4]; //bindless handles: albedo, emissive, metallic_roughness, normalmap
+};
+
+//uniform blocks as they are in the shaders (std140), see shader_atlas.glsl
+struct sFrameBlock {
+	Vector3f camera_position;
+	int show_specular;
+	Vector3f ambient_light;
+	float padding;
+	Matrix44 irradiance_matrix;
+	Vector4f irradiance_dims; //w is 0 without volume
+};
+
+//one light of the multi pass
+struct sLightBlock {
+	Vector4f info;
+	Vector3f position; float padding0;
+	Vector3f front; float padding1;
+	Vector3f color; float padding2;
+	Vector2f cone; Vector2f padding3;
+	Matrix44 shadow_viewproj;
+	Vector2f shadow_params; Vector2f padding4;
+};
+
+//all the lights of the single pass, vec3 and vec2 arrays have a stride of 16 bytes
+struct sLightsBlock {
+	Vector4f info[MAX_LIGHTS];
+	Vector4f position[MAX_LIGHTS];
+	Vector4f front[MAX_LIGHTS];
+	Vector4f color[MAX_LIGHTS];
+	Vector4f cone[MAX_LIGHTS];
+	int num_lights;
+	int padding[3];
+};
+
+struct sMaterialBlock {
+	Vector4f color;
+	Vector3f emissive_factor;
+	float alpha_cutoff;
+};
+
+//version of the shader that reads the material from the materials buffer
+static GFX::Shader* getBatchedShader(const char* name)
+{
+	GFX::Shader::UberShader* ubershader = GFX::Shader::GetUberShader(name);
+	return ubershader ? ubershader->get(1) : NULL; //BINDLESS
+}
+
+//version of the shader that deforms the mesh with the bones (reading the material from the buffer if batched)
+static GFX::Shader* getSkinnedShader(const char* name, bool batched)
+{
+	GFX::Shader::UberShader* ubershader = GFX::Shader::GetUberShader(name);
+	if (!ubershader || ubershader->getMacroIndex("SKINNING") == -1)
+		return NULL;
+	uint64 macros = (uint64)1 << ubershader->getMacroIndex("SKINNING");
+	if (batched)
+		macros |= (uint64)1 << ubershader->getMacroIndex("BINDLESS");
+	return ubershader->get(macros);
+}
+
 Renderer::Renderer(const char* shader_atlas_filename)
 {
 	render_wireframe = false;
 	render_boundaries = false;
 	show_shadowmaps = false;
 	show_specular = false;
+	use_material_batching = true;
+	material_batching_supported = true;
+	use_multidraw = true;
+	materials_buffer.type = GL_SHADER_STORAGE_BUFFER;
+	draws_buffer.type = GL_SHADER_STORAGE_BUFFER;
+	indirect_buffer_id = 0;
+	num_multidraw_calls = num_multidraw_submissions = 0;
+	frame_ubo.name = "FrameBlock";
+	light_ubo.name = "LightBlock";
+	lights_ubo.name = "LightsBlock";
+	material_ubo.name = "MaterialBlock";
+	bones_ubo.name = "BonesBlock";
+	frame = 0;
+
+	//ranges of a buffer bound to a block must start aligned
+	GLint alignment = 256;
+	glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+	light_block_stride = ((int)sizeof(sLightBlock) + alignment - 1) / alignment * alignment;
+	material_block_stride = ((int)sizeof(sMaterialBlock) + alignment - 1) / alignment * alignment;
 	render_mode = eRenderMode::MULTIPASS;
 	scene = nullptr;
 	skybox_cubemap = nullptr;
+	irradiance = nullptr;
+	irradiance_texture = nullptr;
+	capturing_probe = false;
+	probe_fbo = nullptr;
+	probe_capture = nullptr;
 
 	if (!GFX::Shader::LoadAtlas(shader_atlas_filename))
 		exit(1);
+
+	//the permutations used by the batched paths, so the first frame does not have to compile them
+	if (GFX::Texture::isBindlessSupported())
+		GFX::Shader::WarmUp({ { "@multi_pass", 1 }, { "@single_pass", 1 }, { "@single_pass", 3 } }); //BINDLESS, BINDLESS|MULTIDRAW
 	GFX::checkGLErrors();
 
 	sphere.createSphere(1.0f);
 	sphere.uploadToVRAM();
+	wire_box.createWireBox();
+	wire_box.uploadToVRAM();
 }
 
-void Renderer::setupScene(Camera* camera)
+void Renderer::setupScene(Camera* camera, bool frustum_culling)
 {
 	if (scene->skybox_filename.size())
 		skybox_cubemap = GFX::Texture::Get(std::string(scene->base_folder + "/" + scene->skybox_filename).c_str());
@@ -60,6 +180,8 @@ void Renderer::setupScene(Camera* camera)
 
 	render_calls.clear();
 	lights.clear();
+	irradiance = nullptr;
+	updateSkinning();
 	//process entities
 	for (int i = 0; i < scene->entities.size(); ++i)
 	{
@@ -71,19 +193,36 @@ void Renderer::setupScene(Camera* camera)
 		if (ent->getType() == eEntityType::PREFAB)
 		{
 			PrefabEntity* pent = (SCN::PrefabEntity*)ent;
-			if (pent->prefab)
-				storeNode(&pent->root, camera);
+			pent->updatePrefab();
+			if (pent->prefab && !pent->pending_instance)
+				storeNode(&pent->root, camera, frustum_culling);
 		}
 		else if (ent->getType() == eEntityType::LIGHT)
 		{
 			LightEntity* light = (SCN::LightEntity*)ent;
 			lights.push_back(light);
 		}
+		else if (ent->getType() == eEntityType::IRRADIANCE_VOLUME && !irradiance)
+		{
+			IrradianceEntity* volume = (SCN::IrradianceEntity*)ent;
+			if (volume->probes.size())
+				irradiance = volume;
+		}
 	}
 
 	std::sort(render_calls.begin(), render_calls.end(), SCN::RenderCall::CompareAlphaAndDistance);
 
-
+	//materials could have been destroyed and their address reused, the slots are rebuilt every frame
+	material_slots.clear();
+	if (isMaterialBatching() && !uploadMaterialsBuffer())
+		material_batching_supported = false;
+	if (!isMaterialBatching())
+		for (RenderCall& rc : render_calls)
+			rc.material_index = updateMaterialBlock(rc.material);
+
+	//the shadowmap passes use the blocks too, they are uploaded again after with the new shadow matrices
+	uploadFrameBlocks(camera);
+	uploadSkinning();
 	generateShadowmaps();
 
 }
@@ -92,8 +231,12 @@ void Renderer::setupScene(Camera* camera)
 void Renderer::renderScene(SCN::Scene* scene, Camera* camera)
 {
 	this->scene = scene;
+	updateReflectionProbes(); //before the setup, the captures render the scene too
 	setupScene(camera);
 
+	if (render_mode == eRenderMode::MULTIPASS || render_mode == eRenderMode::SINGLEPASS)
+		uploadFrameBlocks(camera);
+
 	renderFrameCall(scene, camera);
 
 	//debug
@@ -132,10 +275,52 @@ void Renderer::renderFrame(SCN::Scene* scene, Camera* camera)
 		if (ent->getType() == eEntityType::PREFAB)
 		{
 			PrefabEntity* pent = (SCN::PrefabEntity*)ent;
-			if (pent->prefab)
+			pent->updatePrefab();
+			if (pent->prefab && !pent->pending_instance)
 				renderNode(&pent->root, camera);
 		}
 	}
+
+	renderLoadingPrefabs(camera);
+}
+
+void Renderer::renderLoadingPrefabs(Camera* camera)
+{
+	GFX::Shader* shader = NULL;
+
+	for (int i = 0; i < scene->entities.size(); ++i)
+	{
+		BaseEntity* ent = scene->entities[i];
+		if (!ent->visible || ent->getType() != eEntityType::PREFAB)
+			continue;
+		PrefabEntity* pent = (SCN::PrefabEntity*)ent;
+		if (!pent->prefab || !pent->pending_instance)
+			continue;
+
+		//bounding is only known once it has been parsed
+		BoundingBox box = transformBoundingBox(pent->root.getGlobalMatrix(), pent->prefab->bounding);
+		if (box.halfsize.length() == 0.0f || !camera->testBoxInFrustum(box.center, box.halfsize))
+			continue;
+
+		if (!shader)
+		{
+			shader = GFX::Shader::Get("flat");
+			if (!shader)
+				return;
+			shader->enable();
+			cameraToShader(camera, shader);
+			shader->setUniform(GFX::U_COLOR, Vector4f(0.5f, 0.5f, 0.5f, 1.0f));
+		}
+
+		Matrix44 m;
+		m.translate(box.center.x, box.center.y, box.center.z);
+		m.scale(box.halfsize.x, box.halfsize.y, box.halfsize.z);
+		shader->setUniform(GFX::U_MODEL, m);
+		wire_box.render(GL_LINES);
+	}
+
+	if (shader)
+		shader->disable();
 }
 
 
@@ -158,15 +343,27 @@ void Renderer::renderFrameCall(SCN::Scene* scene, Camera* camera) {
 	if (skybox_cubemap && render_mode != eRenderMode::FLAT)
 		renderSkybox(skybox_cubemap);
 	
+	if (isMaterialBatching() && materials_buffer.size)
+		materials_buffer.bind(NULL, 0);
+
+	num_multidraw_calls = num_multidraw_submissions = 0;
+	if (render_mode == eRenderMode::SINGLEPASS && isMaterialBatching() && use_multidraw)
+		renderMultiDraw(camera);
+
 	for (int i = 0; i < render_calls.size(); i++) {
+		RenderCall& rc = render_calls[i];
+		if (rc.in_multidraw)
+			continue;
 		switch (render_mode)
 		{
-		case eRenderMode::FLAT: renderMeshWithMaterialFlat(render_calls[i].model, render_calls[i].mesh, render_calls[i].material); break;
-		case eRenderMode::TEXTURED: renderMeshWithMaterial(render_calls[i].model, render_calls[i].mesh, render_calls[i].material); break;
-		case eRenderMode::MULTIPASS: renderMeshWithMaterialMultiPass(render_calls[i].model, render_calls[i].mesh, render_calls[i].material); break;
-		case eRenderMode::SINGLEPASS:renderMeshWithMaterialSinglePass(render_calls[i].model, render_calls[i].mesh, render_calls[i].material); break;
+		case eRenderMode::FLAT: renderMeshWithMaterialFlat(rc.model, rc.mesh, rc.material, rc.bones_slot); break;
+		case eRenderMode::TEXTURED: renderMeshWithMaterial(rc.model, rc.mesh, rc.material, rc.bones_slot); break;
+		case eRenderMode::MULTIPASS: renderMeshWithMaterialMultiPass(rc.model, rc.mesh, rc.material, rc.material_index, rc.bones_slot, rc.lightmap, rc.reflection); break;
+		case eRenderMode::SINGLEPASS:renderMeshWithMaterialSinglePass(rc.model, rc.mesh, rc.material, rc.material_index, rc.bones_slot, rc.lightmap, rc.reflection); break;
 		}
 	}
+
+	renderLoadingPrefabs(camera);
 }
 
 
@@ -189,9 +386,9 @@ void Renderer::renderSkybox(GFX::Texture* cubemap)
 	Matrix44 m;
 	m.setTranslation(camera->eye.x, camera->eye.y, camera->eye.z);
 	m.scale(10, 10, 10);
-	shader->setUniform("u_model", m);
+	shader->setUniform(GFX::U_MODEL, m);
 	cameraToShader(camera, shader);
-	shader->setUniform("u_texture", cubemap, 0);
+	shader->setUniform(GFX::U_TEXTURE, cubemap, 0);
 	sphere.render(GL_TRIANGLES);
 	shader->disable();
 	glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
@@ -210,6 +407,14 @@ void Renderer::renderNode(SCN::Node* node, Camera* camera)
 	//does this node have a mesh? then we must render it
 	if (node->mesh && node->material)
 	{
+		int bones_slot = -1;
+		auto skinned = skinned_nodes.find(node);
+		if (skinned != skinned_nodes.end())
+		{
+			node_model = skinned->second.model;
+			bones_slot = skinned->second.slot;
+		}
+
 		//compute the bounding box of the object in world space (by using the mesh bounding box transformed to world space)
 		BoundingBox world_bounding = transformBoundingBox(node_model, node->mesh->box);
 
@@ -218,14 +423,15 @@ void Renderer::renderNode(SCN::Node* node, Camera* camera)
 		{
 			if (render_boundaries)
 				node->mesh->renderBounding(node_model, true);
+			updateTexturesImportance(node->material, world_bounding, camera);
 			//renderMeshWithMaterialFlat(node_model, node->mesh, node->material);
 
 			switch (render_mode)
 			{
-			case eRenderMode::FLAT: renderMeshWithMaterialFlat(node_model, node->mesh, node->material); break;
-			case eRenderMode::TEXTURED: renderMeshWithMaterial(node_model, node->mesh, node->material); break;
-			case eRenderMode::MULTIPASS: renderMeshWithMaterialMultiPass(node_model, node->mesh, node->material); break;
-			case eRenderMode::SINGLEPASS:renderMeshWithMaterialSinglePass(node_model, node->mesh, node->material); break;
+			case eRenderMode::FLAT: renderMeshWithMaterialFlat(node_model, node->mesh, node->material, bones_slot); break;
+			case eRenderMode::TEXTURED: renderMeshWithMaterial(node_model, node->mesh, node->material, bones_slot); break;
+			case eRenderMode::MULTIPASS: renderMeshWithMaterialMultiPass(node_model, node->mesh, node->material, -1, bones_slot, node->lightmap, findReflection(world_bounding.center)); break;
+			case eRenderMode::SINGLEPASS:renderMeshWithMaterialSinglePass(node_model, node->mesh, node->material, -1, bones_slot, node->lightmap, findReflection(world_bounding.center)); break;
 			}
 		}
 	}
@@ -235,7 +441,7 @@ void Renderer::renderNode(SCN::Node* node, Camera* camera)
 		renderNode(node->children[i], camera);
 }
 //store a node of the prefab and its children
-void Renderer::storeNode(SCN::Node* node, Camera* camera)
+void Renderer::storeNode(SCN::Node* node, Camera* camera, bool frustum_culling)
 {
 	if (!node->visible)
 		return;
@@ -246,14 +452,23 @@ void Renderer::storeNode(SCN::Node* node, Camera* camera)
 	//does this node have a mesh? then we must render it
 	if (node->mesh && node->material)
 	{
+		int bones_slot = -1;
+		auto skinned = skinned_nodes.find(node);
+		if (skinned != skinned_nodes.end())
+		{
+			node_model = skinned->second.model;
+			bones_slot = skinned->second.slot;
+		}
+
 		//compute the bounding box of the object in world space (by using the mesh bounding box transformed to world space)
 		BoundingBox world_bounding = transformBoundingBox(node_model, node->mesh->box);
 
 		//if bounding box is inside the camera frustum then the object is probably visible
-		if (camera->testBoxInFrustum(world_bounding.center, world_bounding.halfsize))
+		if (!frustum_culling || camera->testBoxInFrustum(world_bounding.center, world_bounding.halfsize))
 		{
 			if (render_boundaries)
 				node->mesh->renderBounding(node_model, true);
+			updateTexturesImportance(node->material, world_bounding, camera);
 
 			//instead of render, we store it
 			//renderMeshWithMaterial(node_model, node->mesh, node->material);
@@ -262,6 +477,11 @@ void Renderer::storeNode(SCN::Node* node, Camera* camera)
 			rc.mesh = node->mesh;
 			rc.material = node->material;
 			rc.model = node_model;
+			rc.material_index = -1;
+			rc.in_multidraw = false;
+			rc.bones_slot = bones_slot;
+			rc.lightmap = node->lightmap;
+			rc.reflection = findReflection(world_bounding.center);
 			rc.distance_to_camera = camera->eye.distance(nodepos);
 			render_calls.push_back(rc);
 		}
@@ -269,10 +489,10 @@ void Renderer::storeNode(SCN::Node* node, Camera* camera)
 
 	//iterate recursively with children
 	for (int i = 0; i < node->children.size(); ++i)
-		storeNode(node->children[i], camera);
+		storeNode(node->children[i], camera, frustum_culling);
 }
 
-void Renderer::renderMeshWithMaterialFlat(const Matrix44 model, GFX::Mesh* mesh, SCN::Material* material)
+void Renderer::renderMeshWithMaterialFlat(const Matrix44 model, GFX::Mesh* mesh, SCN::Material* material, int bones_slot)
 {
 	//in case there is nothing to do
 	if (!mesh || !mesh->getNumVertices() || !material)
@@ -299,7 +519,7 @@ void Renderer::renderMeshWithMaterialFlat(const Matrix44 model, GFX::Mesh* mesh,
 	glEnable(GL_DEPTH_TEST);
 
 	//chose a shader
-	shader = GFX::Shader::Get("flat");
+	shader = bones_slot >= 0 ? getSkinnedShader("@flat", false) : GFX::Shader::Get("flat");
 
 	assert(glGetError() == GL_NO_ERROR);
 
@@ -307,9 +527,11 @@ void Renderer::renderMeshWithMaterialFlat(const Matrix44 model, GFX::Mesh* mesh,
 	if (!shader)
 		return;
 	shader->enable();
+	if (bones_slot >= 0)
+		bindBones(bones_slot);
 
 	//upload uniforms
-	shader->setUniform("u_model", model);
+	shader->setUniform(GFX::U_MODEL, model);
 	cameraToShader(camera, shader);
 	
 	//this is used to say which is the alpha threshold to what we should not paint a pixel on the screen (to cut polygons according to texture alpha)
@@ -323,7 +545,7 @@ void Renderer::renderMeshWithMaterialFlat(const Matrix44 model, GFX::Mesh* mesh,
 
 }
 //renders a mesh given its transform and material
-void Renderer::renderMeshWithMaterial(const Matrix44 model, GFX::Mesh* mesh, SCN::Material* material)
+void Renderer::renderMeshWithMaterial(const Matrix44 model, GFX::Mesh* mesh, SCN::Material* material, int bones_slot)
 {
 	//in case there is nothing to do
 	if (!mesh || !mesh->getNumVertices() || !material )
@@ -362,7 +584,7 @@ void Renderer::renderMeshWithMaterial(const Matrix44 model, GFX::Mesh* mesh, SCN
 	glEnable(GL_DEPTH_TEST);
 
 	//chose a shader
-	shader = GFX::Shader::Get("texture");
+	shader = bones_slot >= 0 ? getSkinnedShader("@texture", false) : GFX::Shader::Get("texture");
 
     assert(glGetError() == GL_NO_ERROR);
 
@@ -370,19 +592,21 @@ void Renderer::renderMeshWithMaterial(const Matrix44 model, GFX::Mesh* mesh, SCN
 	if (!shader)
 		return;
 	shader->enable();
+	if (bones_slot >= 0)
+		bindBones(bones_slot);
 
 	//upload uniforms
-	shader->setUniform("u_model", model);
+	shader->setUniform(GFX::U_MODEL, model);
 	cameraToShader(camera, shader);
 	float t = getTime();
-	shader->setUniform("u_time", t );
+	shader->setUniform(GFX::U_TIME, t );
 
-	shader->setUniform("u_color", material->color);
+	shader->setUniform(GFX::U_COLOR, material->color);
 	if(texture)
-		shader->setUniform("u_texture", texture, 0);
+		shader->setUniform(GFX::U_TEXTURE, texture, 0);
 
 	//this is used to say which is the alpha threshold to what we should not paint a pixel on the screen (to cut polygons according to texture alpha)
-	shader->setUniform("u_alpha_cutoff", material->alpha_mode == SCN::eAlphaMode::MASK ? material->alpha_cutoff : 0.001f);
+	shader->setUniform(GFX::U_ALPHA_CUTOFF, material->alpha_mode == SCN::eAlphaMode::MASK ? material->alpha_cutoff : 0.001f);
 
 	if (render_wireframe)
 		glPolygonMode( GL_FRONT_AND_BACK, GL_LINE );
@@ -398,7 +622,7 @@ void Renderer::renderMeshWithMaterial(const Matrix44 model, GFX::Mesh* mesh, SCN
 	glPolygonMode( GL_FRONT_AND_BACK, GL_FILL );
 }
 
-void SCN::Renderer::renderMeshWithMaterialMultiPass(const Matrix44 model, GFX::Mesh* mesh, SCN::Material* material)
+void SCN::Renderer::renderMeshWithMaterialMultiPass(const Matrix44 model, GFX::Mesh* mesh, SCN::Material* material, int material_index, int bones_slot, GFX::Texture* lightmap, GFX::Texture* reflection)
 {
 
 	//in case there is nothing to do
@@ -429,8 +653,12 @@ void SCN::Renderer::renderMeshWithMaterialMultiPass(const Matrix44 model, GFX::M
 
 	glEnable(GL_DEPTH_TEST);
 
-	//chose a shader
-	shader = GFX::Shader::Get("multi_pass");
+	//chose a shader, the batched one reads the material from the materials buffer
+	bool batched = isMaterialBatching() && material_index >= 0;
+	if (bones_slot >= 0)
+		shader = getSkinnedShader("@multi_pass", batched);
+	else
+		shader = batched ? getBatchedShader("@multi_pass") : GFX::Shader::Get("multi_pass");
 
 	assert(glGetError() == GL_NO_ERROR);
 
@@ -438,15 +666,22 @@ void SCN::Renderer::renderMeshWithMaterialMultiPass(const Matrix44 model, GFX::M
 	if (!shader)
 		return;
 	shader->enable();
+	if (bones_slot >= 0)
+		bindBones(bones_slot);
 
-	//upload uniforms
-	shader->setUniform("u_model", model);
+	//upload uniforms (frame and lights data are in the uniform buffers, see uploadFrameBlocks)
+	shader->setUniform(GFX::U_MODEL, model);
 	cameraToShader(camera, shader);
 	float t = getTime();
-	shader->setUniform("u_time", t);
+	shader->setUniform(GFX::U_TIME, t);
 
-
-	uplodadMaterialUniforms(shader, material);
+	if (batched)
+		shader->setUniform(GFX::U_MATERIAL_INDEX, material_index);
+	else
+		uplodadMaterialUniforms(shader, material, material_index);
+	shader->setUniform(GFX::U_LIGHTMAP, lightmap ? lightmap : GFX::Texture::getWhiteTexture(), 4);
+	bindIrradiance(shader);
+	bindReflection(shader, reflection);
 	
 	
 	if (render_wireframe)
@@ -456,56 +691,31 @@ void SCN::Renderer::renderMeshWithMaterialMultiPass(const Matrix44 model, GFX::M
 	glDepthFunc(GL_LEQUAL);  //Render if the z is less or equal than the current one
 
 	// lights
-	shader->setUniform("u_ambient_light", scene->ambient_light);
-	shader->setUniform("u_show_specular", show_specular);
-
-	visibleLights.clear();
-
+	visible_lights.clear();
+	BoundingBox world_bounding = transformBoundingBox(model, mesh->box);
 	for (int i = 0; i < lights.size(); i++)
 	{
 		LightEntity* light = lights[i];
-
-		if(light->light_type == eLightType::DIRECTIONAL)
-			visibleLights.push_back(light);
-		else
-		{
-			vec3 center = light->root.model.getTranslation();
-			float radius = light->max_distance;
-
-			BoundingBox world_bounding = transformBoundingBox(model, mesh->box);
-
-			if (BoundingBoxSphereOverlap(world_bounding, center, radius) )
-				visibleLights.push_back(light);
-		}
+		if (light->light_type == eLightType::DIRECTIONAL || BoundingBoxSphereOverlap(world_bounding, light->root.model.getTranslation(), light->max_distance))
+			visible_lights.push_back(i);
 	}
 
-
-	if (visibleLights.size() == 0)
+	//first pass with ambient and emissive, the next ones are additive
+	shader->setUniform(GFX::U_BASE_PASS, 1.0f);
+	if (visible_lights.size() == 0)
 	{
-		shader->setUniform("u_light_info", vec4((int) eLightType::NO_LIGHT, 0, 0, 0));
+		light_ubo.bind(NULL, GFX::B_LIGHT, (int)lights.size() * light_block_stride, sizeof(sLightBlock)); //the block without light
 		mesh->render(GL_TRIANGLES);
 
 	}
 	else
 	{
-		for (int i = 0; i < visibleLights.size(); i++)
+		for (size_t i = 0; i < visible_lights.size(); i++)
 		{
-			LightEntity* light = visibleLights[i];
-			shader->setUniform("u_light_position", light->root.model.getTranslation());
-			shader->setUniform("u_light_front", light->root.model.rotateVector(vec3(0,0,1)) ); //we pass the forward vector  
-			shader->setUniform("u_light_color", light->color * light->intensity);
-			shader->setUniform("u_light_info",vec4((int)light->light_type, light->near_distance, light->max_distance, 0));
-
-			shader->setUniform("u_shadow_params", vec2((light->shadowmap && light->cast_shadows) ? 1:0, light->shadow_bias));
+			LightEntity* light = lights[visible_lights[i]];
+			light_ubo.bind(NULL, GFX::B_LIGHT, visible_lights[i] * light_block_stride, sizeof(sLightBlock));
 			if (light->shadowmap && light->cast_shadows)
-			{
-				shader->setTexture("u_shadowmap", light->shadowmap, 8);
-				shader->setUniform("u_shadow_viewproj", light->shadow_viewproj);
-
-			}
-
-			if (light->light_type == eLightType::SPOT )
-				shader->setUniform("u_light_cone", vec2( cos( light->cone_info.x * DEG2RAD ), cos(light->cone_info.y * DEG2RAD)));
+				shader->setUniform(GFX::U_SHADOWMAP, light->shadowmap, 8);
 
 			//do the draw call that renders the mesh into the screen
 			mesh->render(GL_TRIANGLES);
@@ -513,9 +723,7 @@ void SCN::Renderer::renderMeshWithMaterialMultiPass(const Matrix44 model, GFX::M
 			glEnable(GL_BLEND); //additive (the blending property)
 			glBlendFunc(GL_SRC_ALPHA, GL_ONE);
 
-			shader->setUniform("u_ambient_light", vec3(0.0));
-			shader->setUniform("u_emissive_factor", vec3(0.0));
-
+			shader->setUniform(GFX::U_BASE_PASS, 0.0f);
 		}
 	}
 	
@@ -530,7 +738,7 @@ void SCN::Renderer::renderMeshWithMaterialMultiPass(const Matrix44 model, GFX::M
 }
 
 
-void SCN::Renderer::renderMeshWithMaterialSinglePass(const Matrix44 model, GFX::Mesh* mesh, SCN::Material* material)
+void SCN::Renderer::renderMeshWithMaterialSinglePass(const Matrix44 model, GFX::Mesh* mesh, SCN::Material* material, int material_index, int bones_slot, GFX::Texture* lightmap, GFX::Texture* reflection)
 {
 
 	//in case there is nothing to do
@@ -563,8 +771,12 @@ void SCN::Renderer::renderMeshWithMaterialSinglePass(const Matrix44 model, GFX::
 
 	glEnable(GL_DEPTH_TEST);
 
-	//chose a shader
-	shader = GFX::Shader::Get("single_pass");
+	//chose a shader, the batched one reads the material from the materials buffer
+	bool batched = isMaterialBatching() && material_index >= 0;
+	if (bones_slot >= 0)
+		shader = getSkinnedShader("@single_pass", batched);
+	else
+		shader = batched ? getBatchedShader("@single_pass") : GFX::Shader::Get("single_pass");
 
 	assert(glGetError() == GL_NO_ERROR);
 
@@ -572,46 +784,22 @@ void SCN::Renderer::renderMeshWithMaterialSinglePass(const Matrix44 model, GFX::
 	if (!shader)
 		return;
 	shader->enable();
+	if (bones_slot >= 0)
+		bindBones(bones_slot);
 
-	//upload uniforms
-	shader->setUniform("u_model", model);
+	//upload uniforms (frame and lights data are in the uniform buffers, see uploadFrameBlocks)
+	shader->setUniform(GFX::U_MODEL, model);
 	cameraToShader(camera, shader);
 	float t = getTime();
-	shader->setUniform("u_time", t);
-
-	uplodadMaterialUniforms(shader, material);
-
+	shader->setUniform(GFX::U_TIME, t);
 
-	//Lights
-	shader->setUniform("u_ambient_light", scene->ambient_light);
-	shader->setUniform("u_show_specular", show_specular);
-
-	Vector3f light_position[MAX_LIGHTS];
-	Vector3f light_color[MAX_LIGHTS];
-	Vector3f light_front[MAX_LIGHTS];
-	Vector3f light_info[MAX_LIGHTS];
-	Vector2f light_cone[MAX_LIGHTS];
-
-
-	for (int i = 0; i < lights.size(); i++) {
-		LightEntity* light = lights[i];
-		light_position[i] = light->root.model.getTranslation();
-		light_color[i] = light->color * light->intensity;
-		light_front[i] = light->root.model.rotateVector(vec3(0, 0, 1));
-		light_info[i] = vec3((int)light->light_type, light->near_distance, light->max_distance);
-		if (light->light_type == eLightType::SPOT)
-			light_cone[i] = vec2(cos(light->cone_info.x * DEG2RAD), cos(light->cone_info.y * DEG2RAD));
-
-
-	}
-
-	shader->setUniform3Array("u_light_position", (float*)&light_position, MAX_LIGHTS);
-	shader->setUniform3Array("u_light_color", (float*)&light_color, MAX_LIGHTS);
-	shader->setUniform3Array("u_light_front", (float*)&light_front, MAX_LIGHTS);
-	shader->setUniform3Array("u_light_info", (float*)&light_info, MAX_LIGHTS);
-	shader->setUniform2Array("u_light_cone", (float*)&light_cone, MAX_LIGHTS);
-
-	shader->setUniform1("u_num_lights", (int) lights.size());
+	if (batched)
+		shader->setUniform(GFX::U_MATERIAL_INDEX, material_index);
+	else
+		uplodadMaterialUniforms(shader, material, material_index);
+	shader->setUniform(GFX::U_LIGHTMAP, lightmap ? lightmap : GFX::Texture::getWhiteTexture(), 4);
+	bindIrradiance(shader);
+	bindReflection(shader, reflection);
 
 	if (render_wireframe)
 		glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
@@ -628,7 +816,7 @@ void SCN::Renderer::renderMeshWithMaterialSinglePass(const Matrix44 model, GFX::
 
 }
 
-void SCN::Renderer::uplodadMaterialUniforms(GFX::Shader* shader, Material* material)
+void SCN::Renderer::uplodadMaterialUniforms(GFX::Shader* shader, Material* material, int slot)
 {
 	GFX::Texture* white = GFX::Texture::getWhiteTexture(); //a 1x1 white texture that we can use when other textures are null;
 
@@ -637,20 +825,517 @@ void SCN::Renderer::uplodadMaterialUniforms(GFX::Shader* shader, Material* mater
 	GFX::Texture* metalic_roughness_texture = material->textures[SCN::eTextureChannel::METALLIC_ROUGHNESS].texture;
 	GFX::Texture* normalmap_texture = material->textures[SCN::eTextureChannel::NORMALMAP].texture;
 
-	shader->setUniform("u_color", material->color);
-	shader->setUniform("u_emissive_factor", material->emissive_factor);  //is a vector 3 (not a factor)
-	shader->setUniform("u_albedo_texture", albedo_texture ? albedo_texture : white, 0);
-	shader->setUniform("u_emissive_texture", emissive_texture ? emissive_texture : white, 1);
-	shader->setUniform("u_metalic_roughness_texture", metalic_roughness_texture ? metalic_roughness_texture : white, 2);  //TODO check white texture
-	shader->setUniform("u_normalmap", normalmap_texture ? normalmap_texture : white, 3);
+	shader->setUniform(GFX::U_ALBEDO_TEXTURE, albedo_texture ? albedo_texture : white, 0);
+	shader->setUniform(GFX::U_EMISSIVE_TEXTURE, emissive_texture ? emissive_texture : white, 1);
+	shader->setUniform(GFX::U_METALIC_ROUGHNESS_TEXTURE, metalic_roughness_texture ? metalic_roughness_texture : white, 2);  //TODO check white texture
+	shader->setUniform(GFX::U_NORMALMAP, normalmap_texture ? normalmap_texture : white, 3);
 
+	//color, emissive and alpha cutoff are in the material block, uploaded only when they change
+	if (slot < 0)
+		slot = updateMaterialBlock(material);
+	material_ubo.bind(NULL, GFX::B_MATERIAL, slot * material_block_stride, sizeof(sMaterialBlock));
+}
 
+int SCN::Renderer::updateMaterialBlock(Material* material)
+{
+	sMaterialBlock block;
+	block.color = material->color;
+	block.emissive_factor = material->emissive_factor;
 	//this is used to say which is the alpha threshold to what we should not paint a pixel on the screen (to cut polygons according to texture alpha)
-	shader->setUniform("u_alpha_cutoff", material->alpha_mode == SCN::eAlphaMode::MASK ? material->alpha_cutoff : 0.001f);
+	block.alpha_cutoff = material->alpha_mode == SCN::eAlphaMode::MASK ? material->alpha_cutoff : 0.001f;
+
+	//slots are given again every frame (see setupScene), a material keeps its slot while the scene does not change
+	int slot = 0;
+	auto it = material_slots.find(material);
+	if (it != material_slots.end())
+		slot = it->second;
+	else
+	{
+		slot = (int)material_slots.size();
+		material_slots[material] = slot;
+		if ((slot + 1) * material_block_stride > (int)material_blocks.size())
+		{
+			//grow, the buffer is reallocated with all the blocks
+			material_blocks.resize(std::max((size_t)64 * material_block_stride, material_blocks.size() * 2));
+			material_ubo.updateFromPointer(&material_blocks[0], (int)material_blocks.size());
+		}
+	}
+	assert(slot * material_block_stride + sizeof(block) <= material_blocks.size());
+
+	if (memcmp(&material_blocks[slot * material_block_stride], &block, sizeof(block)) == 0)
+		return slot; //nothing changed
+
+	memcpy(&material_blocks[slot * material_block_stride], &block, sizeof(block));
+	material_ubo.updateRange(slot * material_block_stride, &block, sizeof(block));
+	return slot;
+}
+
+void SCN::Renderer::uploadFrameBlocks(Camera* camera)
+{
+	sFrameBlock frame = {};
+	frame.camera_position = camera->eye;
+	frame.show_specular = show_specular;
+	frame.ambient_light = scene->ambient_light;
+	irradiance_texture = irradiance ? irradiance->getTexture() : nullptr;
+	if (irradiance_texture)
+	{
+		frame.irradiance_matrix = irradiance->getVolumeMatrix();
+		frame.irradiance_dims.set((float)irradiance->dims[0], (float)irradiance->dims[1], (float)irradiance->dims[2], 1.0f);
+	}
+	frame_ubo.update(frame);
+	frame_ubo.bind(NULL, GFX::B_FRAME);
+
+	//multi pass: one block per light and a last one without light, passes bind their range
+	std::vector<uint8> blocks((lights.size() + 1) * light_block_stride, 0);
+	for (size_t i = 0; i <= lights.size(); ++i)
+	{
+		sLightBlock& block = *(sLightBlock*)&blocks[i * light_block_stride];
+		if (i == lights.size())
+		{
+			block.info = vec4((int)eLightType::NO_LIGHT, 0, 0, 0);
+			break;
+		}
+		LightEntity* light = lights[i];
+		bool shadows = light->shadowmap && light->cast_shadows;
+		block.info = vec4((int)light->light_type, light->near_distance, light->max_distance, 0);
+		block.position = light->root.model.getTranslation();
+		block.front = light->root.model.rotateVector(vec3(0, 0, 1)); //we pass the forward vector
+		block.color = light->color * light->intensity;
+		if (light->light_type == eLightType::SPOT)
+			block.cone = vec2(cos(light->cone_info.x * DEG2RAD), cos(light->cone_info.y * DEG2RAD));
+		if (shadows)
+			block.shadow_viewproj = light->shadow_viewproj;
+		block.shadow_params = vec2(shadows ? 1 : 0, light->shadow_bias);
+	}
+	light_ubo.updateFromPointer(&blocks[0], (int)blocks.size());
+
+	//single pass: all in one block
+	sLightsBlock all = {};
+	all.num_lights = std::min((int)lights.size(), MAX_LIGHTS);
+	for (int i = 0; i < all.num_lights; ++i)
+	{
+		LightEntity* light = lights[i];
+		vec3 position = light->root.model.getTranslation();
+		vec3 front = light->root.model.rotateVector(vec3(0, 0, 1));
+		vec3 color = light->color * light->intensity;
+		all.info[i] = vec4((int)light->light_type, light->near_distance, light->max_distance, 0);
+		all.position[i] = vec4(position.x, position.y, position.z, 0);
+		all.front[i] = vec4(front.x, front.y, front.z, 0);
+		all.color[i] = vec4(color.x, color.y, color.z, 0);
+		if (light->light_type == eLightType::SPOT)
+			all.cone[i] = vec4(cos(light->cone_info.x * DEG2RAD), cos(light->cone_info.y * DEG2RAD), 0, 0);
+	}
+	lights_ubo.update(all);
+	lights_ubo.bind(NULL, GFX::B_LIGHTS);
+}
+
+void SCN::Renderer::bindIrradiance(GFX::Shader* shader)
+{
+	//the sampler is set even without volume, by default it would share the unit 0 with a 2D texture
+	if (irradiance_texture)
+		shader->setUniform(GFX::U_IRRADIANCE_TEXTURE, irradiance_texture, 5);
+	else
+		shader->setUniform(GFX::U_IRRADIANCE_TEXTURE, 5);
+}
+
+void SCN::Renderer::bindReflection(GFX::Shader* shader, GFX::Texture* reflection)
+{
+	//the probes and the HDRE skyboxes store N_LEVELS prefiltered mips, the sampler is set even without cubemap (as the irradiance)
+	if (reflection)
+	{
+		shader->setUniform(GFX::U_REFLECTION_TEXTURE, reflection, 6);
+		shader->setUniform(GFX::U_REFLECTION_MAX_LOD, (float)(N_LEVELS - 1));
+	}
+	else
+	{
+		shader->setUniform(GFX::U_REFLECTION_TEXTURE, 6);
+		shader->setUniform(GFX::U_REFLECTION_MAX_LOD, -1.0f);
+	}
+}
+
+GFX::Texture* SCN::Renderer::findReflection(const Vector3f& position)
+{
+	GFX::Texture* best = skybox_cubemap;
+	if (capturing_probe)
+		return best;
+	float best_distance = 1e10f;
+	for (auto probe : reflection_probes)
+	{
+		float distance = probe->root.model.getTranslation().distance(position);
+		if (distance < best_distance && probe->contains(position))
+		{
+			best = probe->getTexture();
+			best_distance = distance;
+		}
+	}
+	return best;
+}
+
+void SCN::Renderer::updateReflectionProbes()
+{
+	if (capturing_probe)
+		return;
+
+	//one capture per frame at most, the rest wait for the next ones
+	bool captured = false;
+	reflection_probes.clear();
+	for (auto ent : scene->entities)
+	{
+		if (!ent->visible || ent->getType() != eEntityType::REFLECTION_PROBE)
+			continue;
+		ReflectionProbeEntity* probe = (SCN::ReflectionProbeEntity*)ent;
+		if (!captured && probe->needsCapture())
+		{
+			captureReflectionProbe(probe);
+			captured = true;
+		}
+		if (probe->getTexture())
+			reflection_probes.push_back(probe);
+	}
+}
+
+void SCN::Renderer::captureReflectionProbe(ReflectionProbeEntity* probe)
+{
+	//as the faces of a GL cubemap (see cubemapFaceNormals)
+	static const Vector3f fronts[6] = { Vector3f(1, 0, 0), Vector3f(-1, 0, 0), Vector3f(0, 1, 0), Vector3f(0, -1, 0), Vector3f(0, 0, 1), Vector3f(0, 0, -1) };
+	static const Vector3f ups[6] = { Vector3f(0, -1, 0), Vector3f(0, -1, 0), Vector3f(0, 0, 1), Vector3f(0, 0, -1), Vector3f(0, -1, 0), Vector3f(0, -1, 0) };
+
+	int size = probe->resolution;
+	if (probe_capture && probe_capture->width != size)
+	{
+		delete probe_capture;
+		probe_capture = nullptr;
+	}
+	if (!probe_capture)
+	{
+		probe_capture = new GFX::Texture();
+		probe_capture->createCubemap(size, size, NULL, GL_RGBA, GL_FLOAT, true, GL_RGBA16F);
+	}
+	if (!probe_fbo)
+		probe_fbo = new GFX::FBO();
+
+	GFX::startGPULabel("Reflection probe");
+	Camera* current = Camera::current;
+	Camera camera;
+	camera.setPerspective(90.0f, 1.0f, 1.0f, 10000.0f);
+	Vector3f position = probe->root.model.getTranslation();
+	capturing_probe = true;
+
+	//skinning, shadowmaps and render calls (all of them, not culled) are shared by the six faces
+	camera.lookAt(position, position + fronts[0], ups[0]);
+	setupScene(&camera, false); //the shadowmaps use their own FBO, it must be bound after
+	for (int i = 0; i < 6; ++i)
+	{
+		camera.lookAt(position, position + fronts[i], ups[i]);
+		if (render_mode == eRenderMode::MULTIPASS || render_mode == eRenderMode::SINGLEPASS)
+			uploadFrameBlocks(&camera);
+		probe_fbo->setTexture(probe_capture, i);
+		probe_fbo->bind();
+		renderFrameCall(scene, &camera);
+		probe_fbo->unbind();
+	}
+
+	capturing_probe = false;
+	if (current)
+		current->enable();
+
+	prefilterReflectionProbe(probe_capture, probe->beginCapture());
+	probe->endCapture();
+	GFX::endGPULabel();
+}
+
+//GGX prefilter of the capture into the mips of the probe (see probe_prefilter.fs), all in the GPU:
+//the capture is not read back, the probe only reaches the disk when it is saved
+void SCN::Renderer::prefilterReflectionProbe(GFX::Texture* capture, GFX::Texture* target)
+{
+	GFX::Shader* shader = GFX::Shader::Get("probe_prefilter");
+	if (!shader)
+		return;
+
+	//the rough mips read the plain mipmaps of the capture, one texel per sample solid angle
+	glBindTexture(GL_TEXTURE_CUBE_MAP, capture->texture_id);
+	glGenerateMipmap(GL_TEXTURE_CUBE_MAP);
+	glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
+
+	GFX::Mesh* quad = GFX::Mesh::getQuad();
+	int size = (int)capture->width;
+	shader->enable();
+	shader->setUniform("u_texture", capture, 0);
+	shader->setUniform("u_texel_solid_angle", (float)(4.0 * PI / (6.0 * size * size)));
+	shader->setUniform("u_max_lod", (float)(capture->num_levels - 1));
+	shader->setUniform("u_num_samples", ReflectionProbeEntity::num_prefilter_samples);
+	glDisable(GL_DEPTH_TEST);
+	glDisable(GL_CULL_FACE);
+	glDisable(GL_BLEND);
+
+	probe_fbo->bind();
+	for (int i = 0; i < N_LEVELS; ++i)
+	{
+		//the first level is the capture, the rest go from roughness 0.2 to 1
+		shader->setUniform("u_roughness", i / (float)(N_LEVELS - 1));
+		glViewport(0, 0, size >> i, size >> i);
+		for (int j = 0; j < N_FACES; ++j)
+		{
+			//FBO::setTexture only attaches the first mip
+			glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_CUBE_MAP_POSITIVE_X + j, target->texture_id, i);
+			shader->setUniform("u_face", j);
+			quad->render(GL_TRIANGLES);
+		}
+	}
+	probe_fbo->unbind();
+	shader->disable();
+	glEnable(GL_DEPTH_TEST);
+}
+
+
+
+void SCN::Renderer::updateSkinning()
+{
+	bone_matrices.clear();
+	skinned_nodes.clear();
+	frame++;
+
+	std::vector<PrefabEntity*> entities;
+	std::vector<AnimatedCharacter*> characters;
+	float time = getTime() * 0.001f;
+	for (BaseEntity* ent : scene->entities)
+	{
+		if (!ent->visible || ent->getType() != eEntityType::PREFAB)
+			continue;
+		PrefabEntity* pent = (SCN::PrefabEntity*)ent;
+		pent->updatePrefab();
+		Prefab* prefab = pent->prefab;
+		if (!prefab || pent->pending_instance || !prefab->skeleton)
+			continue;
+
+		sAnimatedEntity*& animated = animated_entities[pent];
+		if (!animated || animated->prefab != prefab)
+		{
+			//find the skinned nodes once, the bones of every mesh are mapped to the skeleton here
+			delete animated;
+			animated = new sAnimatedEntity();
+			animated->prefab = prefab;
+			animated->character.setup(prefab->skeleton);
+			std::vector<Node*> nodes(1, &pent->root);
+			for (size_t i = 0; i < nodes.size(); ++i)
+			{
+				Node* node = nodes[i];
+				nodes.insert(nodes.end(), node->children.begin(), node->children.end());
+				if (!node->mesh || node->mesh->bones_info.empty() || node->mesh->bones_info.size() > MAX_BONES)
+					continue;
+				animated->character.addSkin(AnimationSystem::getBinding(node->mesh, prefab->skeleton));
+				animated->nodes.push_back(node);
+			}
+		}
+		animated->frame = frame;
+
+		AnimatedCharacter& character = animated->character;
+		bool has_animation = pent->animation >= 0 && pent->animation < (int)prefab->animations.size();
+		character.animation = has_animation ? prefab->animations[pent->animation] : NULL;
+		character.time = time;
+		entities.push_back(pent);
+		characters.push_back(&character);
+	}
+
+	//entities removed or hidden
+	for (auto it = animated_entities.begin(); it != animated_entities.end();)
+		if (it->second->frame != frame)
+		{
+			delete it->second;
+			it = animated_entities.erase(it);
+		}
+		else
+			++it;
+
+	AnimationSystem::update(characters);
+
+	for (size_t i = 0; i < entities.size(); ++i)
+	{
+		sAnimatedEntity* animated = animated_entities[entities[i]];
+		AnimatedCharacter& character = animated->character;
+		Matrix44 model = entities[i]->root.getGlobalMatrix();
+		for (size_t j = 0; j < animated->nodes.size(); ++j)
+		{
+			sSkinnedNode& skinned = skinned_nodes[animated->nodes[j]];
+			skinned.slot = (int)(bone_matrices.size() / MAX_BONES);
+			skinned.model = model;
+			Matrix44* palette = &character.palette[character.palette_offsets[j]];
+			bone_matrices.insert(bone_matrices.end(), palette, palette + character.skins[j]->bones.size());
+			bone_matrices.resize((skinned.slot + 1) * MAX_BONES);
+		}
+	}
+}
+
+void SCN::Renderer::uploadSkinning()
+{
+	if (bone_matrices.size())
+		bones_ubo.updateFromPointer(&bone_matrices[0], (int)(bone_matrices.size() * sizeof(Matrix44)));
+}
+
+void SCN::Renderer::bindBones(int bones_slot)
+{
+	//the size of a slot (8KB) is a multiple of the offset alignment
+	const int stride = MAX_BONES * sizeof(Matrix44);
+	bones_ubo.bind(NULL, GFX::B_BONES, bones_slot * stride, stride);
+}
+
+bool SCN::Renderer::uploadMaterialsBuffer()
+{
+	static int supported = -1;
+	if (supported == -1)
+	{
+		supported = GFX::Texture::isBindlessSupported() && getBatchedShader("@multi_pass") && getBatchedShader("@single_pass");
+		if (!supported)
+			std::cout << " * Material batching not supported (needs GL_ARB_bindless_texture and SSBOs), using texture binds" << std::endl;
+	}
+	if (!supported)
+		return false;
+
+	GFX::Texture* white = GFX::Texture::getWhiteTexture();
+	static const eTextureChannel channels[] = { eTextureChannel::ALBEDO, eTextureChannel::EMISSIVE, eTextureChannel::METALLIC_ROUGHNESS, eTextureChannel::NORMALMAP };
+
+	//one entry per material used this frame, handles can change when textures finish loading or are streamed
+	std::vector<sMaterialGPU> materials;
+	std::unordered_map<Material*, int> indices;
+	for (RenderCall& rc : render_calls)
+	{
+		auto it = indices.find(rc.material);
+		if (it != indices.end())
+		{
+			rc.material_index = it->second;
+			continue;
+		}
+		Material* material = rc.material;
+		rc.material_index = indices[material] = (int)materials.size();
+
+		sMaterialGPU gpu;
+		gpu.color = material->color;
+		gpu.emissive_factor = Vector4f(material->emissive_factor.x, material->emissive_factor.y, material->emissive_factor.z,
+			material->alpha_mode == SCN::eAlphaMode::MASK ? material->alpha_cutoff : 0.001f);
+		for (int i = 0; i < 4; ++i)
+		{
+			GFX::Texture* texture = material->textures[channels[i]].texture;
+			gpu.textures[i] = (texture ? texture : white)->getBindlessHandle();
+		}
+		materials.push_back(gpu);
+	}
 
+	if (materials.size())
+		materials_buffer.updateFromPointer(&materials[0], (int)(materials.size() * sizeof(sMaterialGPU)));
+	return true;
 }
 
+//as glMultiDrawElementsIndirect reads them
+struct sDrawCommand {
+	uint32 count;
+	uint32 instance_count;
+	uint32 first_index;
+	int base_vertex;
+	uint32 base_instance; //the draw id (a_draw_id is an instanced attribute)
+};
+
+//as sDraw in basic.vs (std430)
+struct sDrawGPU {
+	Matrix44 model;
+	int material_index;
+	int padding[3];
+};
+
+void SCN::Renderer::renderMultiDraw(Camera* camera)
+{
+	static int supported = -1;
+	if (supported == -1)
+	{
+		//the draw id comes from the base instance of every command
+		supported = SDL_GL_ExtensionSupported("GL_ARB_multi_draw_indirect") && SDL_GL_ExtensionSupported("GL_ARB_base_instance") &&
+			GFX::MeshArena::init() && GFX::Shader::GetUberShader("@single_pass");
+		if (!supported)
+			std::cout << " * Multi draw indirect not supported (GL_ARB_multi_draw_indirect and GL_ARB_base_instance), using a draw per mesh" << std::endl;
+	}
+	if (!supported)
+		return;
+	GFX::MeshArena* arena = GFX::MeshArena::instance;
+	GFX::Shader* shader = GFX::Shader::GetUberShader("@single_pass")->get(3); //BINDLESS and MULTIDRAW
+	if (!shader)
+		return;
+
+	//the indirect draws share the cubemap of the camera position, the calls with another one are drawn one by one
+	GFX::Texture* reflection = findReflection(camera->eye);
+
+	//opaque calls of meshes in the arena, one group per cull mode (the rest keeps the order of render_calls)
+	std::vector<sDrawCommand> commands[2];
+	std::vector<sDrawGPU> draws[2];
+	for (RenderCall& rc : render_calls)
+	{
+		if (!rc.mesh->in_arena || rc.material->alpha_mode == eAlphaMode::BLEND || rc.material_index < 0 || rc.lightmap || rc.reflection != reflection)
+			continue;
+		int group = rc.material->two_sided ? 1 : 0;
+		if (draws[0].size() + draws[1].size() >= MAX_ARENA_DRAW_IDS)
+			break;
+		sDrawCommand command;
+		command.count = (uint32)rc.mesh->arena_range.num_indices;
+		command.instance_count = 1;
+		command.first_index = (uint32)rc.mesh->arena_range.first_index;
+		command.base_vertex = (int)rc.mesh->arena_range.first_vertex;
+		commands[group].push_back(command);
+		sDrawGPU draw;
+		draw.model = rc.model;
+		draw.material_index = rc.material_index;
+		draws[group].push_back(draw);
+		rc.in_multidraw = true;
+		GFX::Mesh::num_triangles_rendered += command.count / 3;
+		GFX::Mesh::num_meshes_rendered++;
+	}
+	size_t num_first = commands[0].size();
+	if (!num_first && !commands[1].size())
+		return;
+
+	//both groups in the same buffers, the base instance is the index in draws_buffer
+	commands[0].insert(commands[0].end(), commands[1].begin(), commands[1].end());
+	draws[0].insert(draws[0].end(), draws[1].begin(), draws[1].end());
+	for (size_t i = 0; i < commands[0].size(); ++i)
+		commands[0][i].base_instance = (uint32)i;
+	draws_buffer.updateFromPointer(&draws[0][0], (int)(draws[0].size() * sizeof(sDrawGPU)));
+	if (!indirect_buffer_id)
+		glGenBuffers(1, &indirect_buffer_id);
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, indirect_buffer_id);
+	glBufferData(GL_DRAW_INDIRECT_BUFFER, commands[0].size() * sizeof(sDrawCommand), &commands[0][0], GL_STREAM_DRAW);
 
+	glDisable(GL_BLEND);
+	glEnable(GL_DEPTH_TEST);
+	if (render_wireframe)
+		glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
+
+	shader->enable();
+	cameraToShader(camera, shader);
+	shader->setUniform(GFX::U_TIME, (float)getTime());
+	bindIrradiance(shader);
+	bindReflection(shader, reflection);
+	draws_buffer.bind(NULL, 1);
+
+	glBindVertexArray(arena->vao_id);
+	size_t counts[2] = { num_first, commands[0].size() - num_first };
+	size_t offset = 0;
+	for (int group = 0; group < 2; ++group)
+	{
+		if (!counts[group])
+			continue;
+		if (group == 0)
+			glEnable(GL_CULL_FACE);
+		else
+			glDisable(GL_CULL_FACE);
+		glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, (void*)(offset * sizeof(sDrawCommand)), (GLsizei)counts[group], 0);
+		offset += counts[group];
+		num_multidraw_submissions++;
+	}
+	num_multidraw_calls = (int)commands[0].size();
+	glBindVertexArray(0);
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+
+	shader->disable();
+	glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+	GFX::checkGLErrors();
+}
 
 void SCN::Renderer::generateShadowmaps()
 {
@@ -728,7 +1413,7 @@ void SCN::Renderer::debugShadowmaps()
 
 		GFX::Shader* shader = GFX::Shader::getDefaultShader("linear_depth");
 		shader->enable();
-		shader->setUniform("u_camera_nearfar", vec2(light->near_distance, light->max_distance));
+		shader->setUniform(GFX::U_CAMERA_NEARFAR, vec2(light->near_distance, light->max_distance));
 		glViewport(x, 100, 256, 256);
 		light->shadowmap->toViewport(shader);
 		x += 260;
@@ -741,8 +1426,8 @@ void SCN::Renderer::debugShadowmaps()
 
 void SCN::Renderer::cameraToShader(Camera* camera, GFX::Shader* shader)
 {
-	shader->setUniform("u_viewprojection", camera->viewprojection_matrix );
-	shader->setUniform("u_camera_position", camera->eye);
+	shader->setUniform(GFX::U_VIEWPROJECTION, camera->viewprojection_matrix );
+	shader->setUniform(GFX::U_CAMERA_POSITION, camera->eye);
 }
 
 #ifndef SKIP_IMGUI
@@ -757,6 +1442,12 @@ void Renderer::showUI()
 	//add here your stuff
 	ImGui::Checkbox("Show Shadowmaps", &show_shadowmaps);
 	ImGui::Checkbox("Show Specular", &show_specular);
+	ImGui::Checkbox("Material batching (bindless)", &use_material_batching);
+	if (use_material_batching && !material_batching_supported)
+		ImGui::Text("Not supported, using texture binds");
+	ImGui::Checkbox("Multi draw indirect", &use_multidraw);
+	if (use_multidraw && num_multidraw_calls)
+		ImGui::Text("%d draws in %d submissions", num_multidraw_calls, num_multidraw_submissions);
 
 	ImGui::Combo("Render Mode", (int*)&render_mode, "FLAT\0TEXTURED\0MULTIPASS\0SINGLEPASS", 4);
 
@@ -3,9 +3,13 @@
 #include "prefab.h"
 #include "../gfx/shader.h"
 
+#include <unordered_map>
+
 #include "light.h"
+#include "animationsystem.h"
 
 #define MAX_LIGHTS 4
+#define MAX_BONES 128 //as in the BonesBlock of the shaders
 //forward declarations
 class Camera;
 class Skeleton;
@@ -19,12 +23,19 @@ namespace SCN {
 
 	class Prefab;
 	class Material;
+	class IrradianceEntity;
+	class ReflectionProbeEntity;
 
 	class RenderCall {
 	public:
 		GFX::Mesh* mesh;
 		SCN::Material* material;
 		Matrix44 model;
+		int material_index; //in the materials buffer of the renderer, -1 if not batched
+		bool in_multidraw; //already submitted with the indirect draws
+		int bones_slot; //in bones_ubo, -1 if it is not skinned
+		GFX::Texture* lightmap; //of the node, NULL if it has none
+		GFX::Texture* reflection; //prefiltered cubemap of its probe or the skybox, NULL if there is none
 
 		float distance_to_camera;
 		static bool CompareAlphaAndDistance(RenderCall rc1, RenderCall rc2);
@@ -47,22 +58,66 @@ namespace SCN {
 		bool render_boundaries;
 		bool show_shadowmaps;
 		bool show_specular;
+		bool use_material_batching; //materials in a SSBO with bindless textures, draws only set the index
+		bool material_batching_supported; //false if the GPU cannot do it, use_material_batching is kept as the user set it
+		bool use_multidraw; //opaque meshes in the arena are submitted with glMultiDrawElementsIndirect (single pass and material batching)
 		eRenderMode render_mode;
 
 		GFX::Texture* skybox_cubemap;
+		IrradianceEntity* irradiance; //the first visible volume with probes, replaces the ambient light
+		GFX::Texture* irradiance_texture;
+		std::vector<ReflectionProbeEntity*> reflection_probes; //visible and captured
+		bool capturing_probe; //the faces of a probe are being rendered, only the skybox is reflected
+		GFX::FBO* probe_fbo;
+		GFX::Texture* probe_capture; //the faces before they are prefiltered, with mipmaps
 
 		SCN::Scene* scene;
 
 		std::vector<RenderCall> render_calls; //to store the nodes by sort them by distance
 
 		std::vector<LightEntity*> lights;
-		std::vector<LightEntity*> visibleLights;
+		std::vector<int> visible_lights; //indices in lights (and in light_ubo)
+
+		GFX::BufferObject materials_buffer; //materials of the render calls of this frame
+		GFX::BufferObject draws_buffer; //model and material of every indirect draw
+		GLuint indirect_buffer_id; //the draw commands
+		int num_multidraw_calls; //stats of the last frame
+		int num_multidraw_submissions;
+
+		//std140 uniform buffers, draws only bind ranges of them
+		GFX::BufferObject frame_ubo; //camera and ambient, once per frame
+		GFX::BufferObject light_ubo; //one block per light for the multi pass (plus one without light at the end)
+		GFX::BufferObject lights_ubo; //all the lights for the single pass
+		GFX::BufferObject material_ubo; //one block per material, uploaded only when the material changes
+		std::vector<uint8> material_blocks; //copy of material_ubo to know what changed
+		std::unordered_map<Material*, int> material_slots;
+		int light_block_stride;
+		int material_block_stride;
+
+		//skinning: the final bone matrices of every skinned node of this frame, MAX_BONES per node
+		struct sSkinnedNode {
+			int slot; //in bones_ubo
+			Matrix44 model; //the node transform is ignored, bones are in the space of the prefab
+		};
+		GFX::BufferObject bones_ubo;
+		std::vector<Matrix44> bone_matrices;
+		std::unordered_map<SCN::Node*, sSkinnedNode> skinned_nodes;
+		//animation state of every skinned prefab entity, rebuilt when its prefab changes
+		struct sAnimatedEntity {
+			Prefab* prefab;
+			AnimatedCharacter character;
+			std::vector<SCN::Node*> nodes; //one per skin of the character
+			long frame; //last frame it was visible
+		};
+		std::unordered_map<PrefabEntity*, sAnimatedEntity*> animated_entities;
+		long frame;
 
 		//updated every frame
 		Renderer(const char* shaders_atlas_filename );
 
 		//just to be sure we have everything ready for the rendering
-		void setupScene(Camera* camera);
+		//(without frustum culling the render calls can be reused by any camera in the same position)
+		void setupScene(Camera* camera, bool frustum_culling = true);
 
 		//add here your functions
 		//...
@@ -78,15 +133,33 @@ namespace SCN {
 	
 		//to render one node from the prefab and its children
 		void renderNode(SCN::Node* node, Camera* camera);
-		void storeNode(SCN::Node* node, Camera* camera);
-
-		//to render one mesh given its material and transformation matrix
-		void renderMeshWithMaterial(const Matrix44 model, GFX::Mesh* mesh, SCN::Material* material);
-		void renderMeshWithMaterialFlat(const Matrix44 model, GFX::Mesh* mesh, SCN::Material* material);
-		void renderMeshWithMaterialMultiPass(const Matrix44 model, GFX::Mesh* mesh, SCN::Material* material);
-		void renderMeshWithMaterialSinglePass(const Matrix44 model, GFX::Mesh* mesh, SCN::Material* material);
 
-		void uplodadMaterialUniforms(GFX::Shader* shader, Material* material);
+		//shows the bounding of the prefabs that are still loading
+		void renderLoadingPrefabs(Camera* camera);
+		void storeNode(SCN::Node* node, Camera* camera, bool frustum_culling = true);
+
+		//to render one mesh given its material and transformation matrix (bones_slot for skinned meshes)
+		void renderMeshWithMaterial(const Matrix44 model, GFX::Mesh* mesh, SCN::Material* material, int bones_slot = -1);
+		void renderMeshWithMaterialFlat(const Matrix44 model, GFX::Mesh* mesh, SCN::Material* material, int bones_slot = -1);
+		void renderMeshWithMaterialMultiPass(const Matrix44 model, GFX::Mesh* mesh, SCN::Material* material, int material_index = -1, int bones_slot = -1, GFX::Texture* lightmap = NULL, GFX::Texture* reflection = NULL);
+		void renderMeshWithMaterialSinglePass(const Matrix44 model, GFX::Mesh* mesh, SCN::Material* material, int material_index = -1, int bones_slot = -1, GFX::Texture* lightmap = NULL, GFX::Texture* reflection = NULL);
+
+		void uplodadMaterialUniforms(GFX::Shader* shader, Material* material, int slot = -1);
+		int updateMaterialBlock(Material* material); //returns the slot in material_ubo
+		void uploadFrameBlocks(Camera* camera);
+		bool uploadMaterialsBuffer(); //fills material_index of the render calls, false if batching is not supported
+		bool isMaterialBatching() const { return use_material_batching && material_batching_supported; }
+		void renderMultiDraw(Camera* camera); //marks in_multidraw the render calls submitted
+		void updateSkinning(); //evaluates all the animated prefabs at once and stores the bones of their skinned nodes
+		void uploadSkinning();
+		void bindBones(int bones_slot); //range of bones_ubo of a skinned node
+		void bindIrradiance(GFX::Shader* shader); //the texture of the volume in slot 5
+		void bindReflection(GFX::Shader* shader, GFX::Texture* reflection); //in slot 6
+
+		void updateReflectionProbes(); //captures (at most) one probe whose geometry changed and is still, lists the visible ones
+		void captureReflectionProbe(ReflectionProbeEntity* probe);
+		void prefilterReflectionProbe(GFX::Texture* capture, GFX::Texture* target);
+		GFX::Texture* findReflection(const Vector3f& position); //the closest probe that contains it, or the skybox
 
 		void generateShadowmaps();
 		void debugShadowmaps(); 
@@ -4,6 +4,11 @@
 #include "../utils/utils.h"
 
 #include "prefab.h"
+#include "material.h"
+#include "../core/task.h"
+#include "../core/simd.h"
+#include "../gfx/mesh.h"
+#include "../gfx/meshbvh.h"
 #include "../extra/cJSON.h"
 #include "../core/ui.h"
 #include "../gfx/texture.h"
@@ -267,34 +272,86 @@ SCN::BaseEntity* SCN::BaseEntity::createEntity(const char* type)
 SCN::PrefabEntity::PrefabEntity()
 {
 	prefab = NULL;
+	pending_instance = false;
+	animation = 0;
 }
 
 void SCN::PrefabEntity::configure(cJSON* json)
 {
+	lightmap = readJSONString(json, "lightmap", lightmap.c_str()); //before the prefab, it may be instanced already
 	if (cJSON_GetObjectItem(json, "filename"))
 	{
 		filename = cJSON_GetObjectItem(json, "filename")->valuestring;
 		loadPrefab( filename.c_str() );
 	}
+	animation = (int)readJSONNumber(json, "animation", animation);
 }
 
 void SCN::PrefabEntity::serialize(cJSON* json)
 {
 	cJSON_AddStringToObject(json, "filename", filename.c_str());
+	if (animation != 0)
+		cJSON_AddNumberToObject(json, "animation", animation);
+	if (lightmap.size())
+		cJSON_AddStringToObject(json, "lightmap", lightmap.c_str());
 }
 
 void SCN::PrefabEntity::loadPrefab(const char* filename)
 {
 	assert(scene && "Cannot assign filename without scene (to extract base folder)");
 	std::string fullpath = scene->base_folder + "/" + filename;
-	prefab = SCN::Prefab::Get(fullpath.c_str());
-	if (!prefab)
+	prefab = SCN::Prefab::GetAsync(fullpath.c_str());
+	root.clear();
+	pending_instance = true;
+	updatePrefab();
+}
+
+void SCN::PrefabEntity::updatePrefab()
+{
+	if (!pending_instance || !prefab || prefab->loading)
 		return;
-	
+
 	SCN::Node* child = new SCN::Node();
 	*child = prefab->root;
-	root.clear();
 	root.addChild(child);
+	pending_instance = false;
+	loadLightmaps();
+}
+
+static void addLightmapNodes(SCN::Node* node, std::vector<SCN::Node*>& nodes)
+{
+	if (node->mesh && node->material && node->mesh->m_uvs1.size() && !node->mesh->bones.size())
+		nodes.push_back(node);
+	for (auto child : node->children)
+		addLightmapNodes(child, nodes);
+}
+
+void SCN::PrefabEntity::getLightmapNodes(std::vector<Node*>& nodes)
+{
+	addLightmapNodes(&root, nodes);
+}
+
+std::string SCN::PrefabEntity::getLightmapFilename(int index)
+{
+	return lightmap + "_" + std::to_string(index) + ".tga";
+}
+
+void SCN::PrefabEntity::loadLightmaps(bool reload)
+{
+	if (lightmap.empty() || pending_instance)
+		return;
+	std::vector<Node*> nodes;
+	getLightmapNodes(nodes);
+	for (int i = 0; i < (int)nodes.size(); ++i)
+	{
+		std::string fullpath = scene->base_folder + "/" + getLightmapFilename(i);
+		GFX::Texture* texture = GFX::Texture::Find(fullpath.c_str());
+		if (texture && reload)
+			texture->load(fullpath.c_str());
+		else if (!texture && fileExists(fullpath))
+			texture = GFX::Texture::Get(fullpath.c_str());
+		nodes[i]->lightmap = texture;
+	}
 }
 
 bool SCN::PrefabEntity::testRay(const Ray& ray, Vector3f& coll, float max_dist)
@@ -345,6 +402,7 @@ SCN::RayTestResult SCN::Scene::testRay(Ray& ray, uint8 layers)
 	result.t = 1000000.0f;
 	result.collided = false;
 	result.entity = nullptr;
+	result.node = nullptr;
 	Vector3f collision;
 
 	//TODO: optimal way:
@@ -376,4 +434,120 @@ SCN::RayTestResult SCN::Scene::testRay(Ray& ray, uint8 layers)
 	return result;
 }
 
+int SCN::Scene::rays_min_batch = 64;
+
+//the meshes of the scene flattened for the batched ray tests, with their inverse matrices and their world
+//boxes one array per component (padded with empty boxes to a multiple of four) to test four of them at once
+struct sRayInstance {
+	GFX::MeshBVH* bvh;
+	Matrix44 model;
+	Matrix44 inv_model;
+	SCN::BaseEntity* entity;
+	SCN::Node* node;
+};
+
+struct sRayScene {
+	std::vector<sRayInstance> instances;
+	std::vector<float> box[6]; //min x,y,z and max x,y,z, the padding is skipped
+
+	void addNode(SCN::Node* node, SCN::BaseEntity* entity)
+	{
+		//same nodes as Node::testRay
+		Matrix44 model = node->getGlobalMatrix(true);
+		if (node->mesh && node->material && node->material->alpha_mode != SCN::eAlphaMode::BLEND && node->mesh->createBVH() && !node->mesh->bvh->isEmpty())
+		{
+			sRayInstance instance;
+			instance.bvh = node->mesh->bvh;
+			instance.model = model;
+			instance.inv_model = model;
+			instance.inv_model.inverse();
+			instance.entity = entity;
+			instance.node = node;
+			instances.push_back(instance);
+
+			BoundingBox aabb = transformBoundingBox(model, node->mesh->box);
+			Vector3f min = aabb.center - aabb.halfsize, max = aabb.center + aabb.halfsize;
+			for (int i = 0; i < 3; ++i)
+			{
+				box[i].push_back(min.v[i]);
+				box[i + 3].push_back(max.v[i]);
+			}
+		}
+		for (size_t i = 0; i < node->children.size(); ++i)
+			addNode(node->children[i], entity);
+	}
+
+	void pad()
+	{
+		while (box[0].size() % 4)
+			for (int i = 0; i < 6; ++i)
+				box[i].push_back(0.0f);
+	}
+
+	//candidates is temporary memory of the thread
+	void testRay(const Ray& ray, float max_dist, bool any_hit, SCN::RayTestResult& result, std::vector<std::pair<float, int>>& candidates) const
+	{
+		result.collided = false;
+		result.t = max_dist;
+		result.entity = nullptr;
+		result.node = nullptr;
+
+		//boxes crossed by the ray, four per test
+		candidates.clear();
+		simd4 ox(ray.origin.x), oy(ray.origin.y), oz(ray.origin.z);
+		simd4 ix(1.0f / ray.direction.x), iy(1.0f / ray.direction.y), iz(1.0f / ray.direction.z);
+		simd4 zero(0.0f), t_max(max_dist);
+		for (size_t i = 0; i < box[0].size(); i += 4)
+		{
+			simd4 t0x = (simd4::load(&box[0][i]) - ox) * ix, t1x = (simd4::load(&box[3][i]) - ox) * ix;
+			simd4 t0y = (simd4::load(&box[1][i]) - oy) * iy, t1y = (simd4::load(&box[4][i]) - oy) * iy;
+			simd4 t0z = (simd4::load(&box[2][i]) - oz) * iz, t1z = (simd4::load(&box[5][i]) - oz) * iz;
+			simd4 t_near = max(max(min(t0x, t1x), min(t0y, t1y)), max(min(t0z, t1z), zero));
+			simd4 t_far = min(min(max(t0x, t1x), max(t0y, t1y)), min(max(t0z, t1z), t_max));
+			int mask = (t_near <= t_far).getMask();
+			for (int lane = 0; mask && i + lane < instances.size(); ++lane, mask >>= 1)
+				if (mask & 1)
+					candidates.push_back(std::make_pair(t_near[lane], (int)i + lane));
+		}
+
+		//closest boxes first, stop when the next one starts after the collision
+		std::sort(candidates.begin(), candidates.end());
+		GFX::sMeshHit hit;
+		for (auto& candidate : candidates)
+		{
+			if (candidate.first > result.t)
+				break;
+			const sRayInstance& instance = instances[candidate.second];
+			if (!instance.bvh->testRay(instance.model, instance.inv_model, ray.origin, ray.direction, result.t, hit, any_hit))
+				continue;
+			result.collided = true;
+			result.t = hit.distance;
+			result.collision = hit.position;
+			result.normal = hit.normal;
+			result.entity = instance.entity;
+			result.node = instance.node;
+			if (any_hit)
+				break;
+		}
+	}
+};
+
+void SCN::Scene::testRays(const std::vector<Ray>& rays, std::vector<RayTestResult>& results, uint8 layers, float max_dist, bool any_hit)
+{
+	results.resize(rays.size());
+
+	//gathered in the main thread, the meshes may build their BVH here
+	sRayScene ray_scene;
+	for (auto& ent : entities)
+		if (ent->layers & layers && ent->getType() == eEntityType::PREFAB)
+			ray_scene.addNode(&ent->root, ent);
+	ray_scene.pad();
+
+	TaskManager::background.parallelFor(rays.size(), [&](size_t start, size_t end) {
+		std::vector<std::pair<float, int>> candidates;
+		for (size_t i = start; i < end; ++i)
+			ray_scene.testRay(rays[i], max_dist, any_hit, results[i], candidates);
+	}, rays_min_batch);
+}
+
 
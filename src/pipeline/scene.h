@@ -46,10 +46,11 @@ namespace SCN {
 	//used for ray picking against the scene
 	struct RayTestResult {
 		bool collided;
-		float t;
+		float t; //testRays: in units of the ray direction (the distance if it is normalized)
 		Vector3f collision;
 		Vector3f normal;
 		BaseEntity* entity;
+		Node* node; //testRays: the node of the mesh, NULL in testRay
 	};
 
 	#define ENTITY_METHODS(_A,_B,_ICONX,_ICONY) \
@@ -96,6 +97,9 @@ namespace SCN {
 	public:
 		std::string filename;
 		Prefab* prefab;
+		bool pending_instance; //prefab still loading, nodes will be created once ready
+		int animation; //clip of the prefab that is played (skinned prefabs), -1 for the bind pose
+		std::string lightmap; //base filename of its baked lightmaps (see LightmapBaker), empty if it has none
 		
 		PrefabEntity();
 
@@ -104,6 +108,11 @@ namespace SCN {
 		virtual void configure(cJSON* json);
 		virtual void serialize(cJSON* json);
 		void loadPrefab(const char* filename);
+		void updatePrefab(); //creates the nodes if the prefab finished loading
+
+		void getLightmapNodes(std::vector<Node*>& nodes); //nodes that can have a lightmap, in the order of the files
+		std::string getLightmapFilename(int index); //relative to the scene folder
+		void loadLightmaps(bool reload = false); //reload uploads again the ones already loaded
 
 		bool testRay(const Ray& ray, Vector3f& coll, float max_dist = 100000.0f);
 	};
@@ -152,6 +161,10 @@ namespace SCN {
 		BaseEntity* getEntity(std::string name);
 
 		RayTestResult testRay( Ray& ray, uint8 layers = 0xFF );
+		//many rays at once in the worker threads, one result per ray. Only meshes of prefabs are tested.
+		//any_hit stops at the first collision found (visibility), max_dist is in units of the ray direction
+		void testRays(const std::vector<Ray>& rays, std::vector<RayTestResult>& results, uint8 layers = 0xFF, float max_dist = 1000000.0f, bool any_hit = false);
+		static int rays_min_batch; //rays per job
 	};
 
 };
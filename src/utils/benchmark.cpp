@@ -0,0 +1,751 @@
+#include "benchmark.h"
+
+#include <iostream>
+#include <list>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+
+#include "utils.h"
+#include "../core/task.h"
+#include "../gfx/texture.h"
+#include "../gfx/shader.h"
+#include "../gfx/mesh.h"
+#include "../gfx/sphericalharmonics.h"
+#include "../pipeline/animation.h"
+#include "../pipeline/animationsystem.h"
+#include "../pipeline/scene.h"
+#include "../pipeline/lightmapbaker.h"
+#include "../pipeline/irradiance.h"
+#include "../pipeline/light.h"
+#include "../extra/cJSON.h"
+#include "../extra/picopng.h"
+#include "../extra/stb_image.h"
+
+// TASKS **************************************************
+
+//the task manager we had before the thread pool: one thread, a locked list and polling every 10ms
+//kept here only to compare against it
+class LegacyTaskManager {
+public:
+	std::list<Task*> pending_tasks;
+	std::mutex tasks_mutex;
+	std::atomic<bool> must_loop;
+	std::thread* _thread;
+
+	LegacyTaskManager() { must_loop = true; _thread = new std::thread([this] { loop(); }); }
+	~LegacyTaskManager() { must_loop = false; _thread->join(); delete _thread; }
+
+	void addTask(Task* task)
+	{
+		const std::lock_guard<std::mutex> lock(tasks_mutex);
+		pending_tasks.push_back(task);
+	}
+
+	void loop()
+	{
+		while (must_loop)
+		{
+			Task* task = NULL;
+			{
+				const std::lock_guard<std::mutex> lock(tasks_mutex);
+				if (!pending_tasks.empty())
+				{
+					task = pending_tasks.front();
+					pending_tasks.pop_front();
+				}
+			}
+			if (!task)
+			{
+				std::this_thread::sleep_for(std::chrono::milliseconds(10));
+				continue;
+			}
+			task->onExecute();
+			delete task;
+		}
+	}
+};
+
+//some work so tasks are not empty
+static float busyWork(int iterations)
+{
+	float v = 0.0f;
+	for (int i = 0; i < iterations; ++i)
+		v += sqrtf((float)i) * 0.5f;
+	return v;
+}
+
+template<typename MANAGER>
+static void benchmarkTaskManager(const char* name, MANAGER& manager)
+{
+	//latency: time since a task is added till it starts, one task at a time (like a GetAsync)
+	const int num_latency = 50;
+	double total_latency = 0;
+	for (int i = 0; i < num_latency; ++i)
+	{
+		std::atomic<bool> done(false);
+		double start = getHighResTime();
+		double started = 0;
+		manager.addTask(new Task([&] { started = getHighResTime(); done = true; }));
+		while (!done)
+			std::this_thread::yield();
+		total_latency += started - start;
+		std::this_thread::sleep_for(std::chrono::milliseconds(1)); //let it go to sleep again
+	}
+
+	//throughput: lots of small tasks
+	const int num_tasks = 100000;
+	std::atomic<int> count(0);
+	std::atomic<float> sink(0.0f);
+	double start = getHighResTime();
+	for (int i = 0; i < num_tasks; ++i)
+		manager.addTask(new Task([&] { sink = busyWork(200); count++; }));
+	while (count < num_tasks)
+		std::this_thread::yield();
+	double elapsed = getHighResTime() - start;
+
+	std::cout << "  " << name << ": latency " << (total_latency / num_latency) << " ms, throughput "
+		<< (num_tasks / elapsed) << " tasks/ms (" << elapsed << " ms for " << num_tasks << " tasks)" << std::endl;
+}
+
+static void benchmarkTasks()
+{
+	{
+		LegacyTaskManager legacy;
+		benchmarkTaskManager("legacy (1 thread, polling)", legacy);
+	}
+
+	std::string name = "pool (" + std::to_string(TaskManager::background.getNumThreads()) + " threads)";
+	benchmarkTaskManager(name.c_str(), TaskManager::background);
+
+	//parallel for
+	const int num_items = 100000;
+	std::vector<float> results(num_items);
+	double start = getHighResTime();
+	for (int i = 0; i < num_items; ++i)
+		results[i] = busyWork(200);
+	double serial = getHighResTime() - start;
+	start = getHighResTime();
+	TaskManager::background.parallelFor(num_items, [&](size_t from, size_t to) {
+		for (size_t i = from; i < to; ++i)
+			results[i] = busyWork(200);
+	});
+	double parallel = getHighResTime() - start;
+	std::cout << "  parallelFor: serial " << serial << " ms, parallel " << parallel << " ms (x" << (serial / parallel) << ")" << std::endl;
+}
+
+// IMAGE DECODING *****************************************
+
+//how images were decoded before: picopng for PNG (always RGBA) and stb_image forcing RGB for JPG, copied afterwards
+static bool legacyDecodeImage(std::vector<unsigned char>& buffer, bool png, bool flip_y, Image& image)
+{
+	image.clear();
+	if (png)
+	{
+		std::vector<unsigned char> out_image;
+		if (decodePNG(out_image, image.width, image.height, &buffer[0], buffer.size(), true) != 0)
+			return false;
+		image.num_channels = 4;
+		image.data = new uint8[out_image.size()];
+		memcpy(image.data, &out_image[0], out_image.size());
+	}
+	else
+	{
+		int width, height, channels;
+		unsigned char* pixels = stbi_load_from_memory(&buffer[0], (int)buffer.size(), &width, &height, &channels, STBI_rgb);
+		if (!pixels)
+			return false;
+		image.width = width;
+		image.height = height;
+		image.num_channels = 3;
+		image.data = new uint8[width * height * 3];
+		memcpy(image.data, pixels, width * height * 3);
+		stbi_image_free(pixels);
+	}
+	if (flip_y)
+		image.flipY();
+	return true;
+}
+
+static void benchmarkImageDecode()
+{
+	const char* filenames[] = {
+		"data/prefabs/road/asphalt_02_diff_2k.jpg",
+		"data/prefabs/road/dirty_concrete_diff_2k.jpg",
+		"data/prefabs/road/dirty_concrete_nor_2k.jpg",
+		"data/prefabs/road/dirty_concrete_rough_2k.png",
+		"data/prefabs/trash_can/textures/lambert1_metallicRoughness.png",
+		"data/prefabs/trash_can/textures/lambert1_normal.png",
+	};
+
+	double total_legacy = 0, total_new = 0;
+	for (const char* filename : filenames)
+	{
+		std::vector<unsigned char> buffer;
+		if (!readFileBin(filename, buffer))
+			continue;
+		bool png = toLowerCase(getExtension(filename)) == "png";
+
+		Image image;
+		double times[4]; //legacy, new, legacy flipped, new flipped
+		for (int i = 0; i < 4; ++i)
+		{
+			bool flip_y = i >= 2;
+			double start = getHighResTime();
+			if (i % 2 == 0)
+				legacyDecodeImage(buffer, png, flip_y, image);
+			else
+				image.loadSTB(buffer, flip_y);
+			times[i] = getHighResTime() - start;
+		}
+		total_legacy += times[0];
+		total_new += times[1];
+
+		std::cout << "  " << filename << " " << image.width << "x" << image.height << "x" << image.num_channels << ": legacy " << (int)times[0]
+			<< " ms, stb " << (int)times[1] << " ms (x" << (times[0] / times[1]) << "), flipping Y: legacy " << (int)times[2] << " ms, stb " << (int)times[3] << " ms" << std::endl;
+	}
+	std::cout << "  total: legacy " << (int)total_legacy << " ms, stb " << (int)total_new << " ms" << std::endl;
+}
+
+// UNIFORMS ***********************************************
+
+//cost of setting the uniforms of a draw by name (std::map lookup with strcmp) or by precomputed location
+static void benchmarkUniforms()
+{
+	GFX::Shader* shader = GFX::Shader::Get("multi_pass");
+	if (!shader)
+	{
+		std::cout << "[ERROR] multi_pass shader not found" << std::endl;
+		return;
+	}
+	shader->enable();
+
+	const char* names[8] = { "u_model", "u_viewprojection", "u_time", "u_base_pass", "u_albedo_texture", "u_emissive_texture", "u_metalic_roughness_texture", "u_normalmap" };
+	Matrix44 model;
+	Matrix44 viewprojection;
+	const int num_draws = 100000;
+	double times[3]; //by name, by location, only the lookup by name
+	for (int mode = 0; mode < 3; ++mode)
+	{
+		double start = getHighResTime();
+		GLint sink = 0;
+		for (int i = 0; i < num_draws; ++i)
+		{
+			if (mode == 0)
+			{
+				shader->setUniform("u_model", model);
+				shader->setUniform("u_viewprojection", viewprojection);
+				shader->setUniform("u_time", (float)i);
+				shader->setUniform("u_base_pass", 1.0f);
+				shader->setUniform("u_albedo_texture", 0);
+				shader->setUniform("u_emissive_texture", 1);
+				shader->setUniform("u_metalic_roughness_texture", 2);
+				shader->setUniform("u_normalmap", 3);
+			}
+			else if (mode == 1)
+			{
+				shader->setUniform(GFX::U_MODEL, model);
+				shader->setUniform(GFX::U_VIEWPROJECTION, viewprojection);
+				shader->setUniform(GFX::U_TIME, (float)i);
+				shader->setUniform(GFX::U_BASE_PASS, 1.0f);
+				shader->setUniform(GFX::U_ALBEDO_TEXTURE, 0);
+				shader->setUniform(GFX::U_EMISSIVE_TEXTURE, 1);
+				shader->setUniform(GFX::U_METALIC_ROUGHNESS_TEXTURE, 2);
+				shader->setUniform(GFX::U_NORMALMAP, 3);
+			}
+			else
+				for (int j = 0; j < 8; ++j)
+					sink += shader->getLocation(names[j]);
+		}
+		glFinish();
+		times[mode] = getHighResTime() - start;
+		if (sink == 42) //so the lookups are not removed
+			std::cout << sink;
+	}
+	shader->disable();
+
+	double calls = num_draws * 8.0;
+	std::cout << "  " << num_draws << " draws of 8 uniforms: by name " << times[0] << " ms (" << (times[0] * 1000000.0 / calls) << " ns per uniform), by location "
+		<< times[1] << " ms (" << (times[1] * 1000000.0 / calls) << " ns per uniform), x" << (times[0] / times[1]) << std::endl;
+	std::cout << "  only the lookup by name: " << (times[2] * 1000000.0 / calls) << " ns per uniform" << std::endl;
+}
+
+// ANIMATION **********************************************
+
+static void createTestClip(Skeleton& skeleton, Animation& animation, float speed);
+
+//skeleton like a humanoid rig (a tree of 65 bones) and a clip of 2 seconds moving all of them
+static void createTestCharacter(Skeleton& skeleton, Animation& animation, GFX::Mesh& mesh)
+{
+	skeleton.num_bones = 65;
+	for (int i = 0; i < skeleton.num_bones; ++i)
+	{
+		Skeleton::Bone& bone = skeleton.bones[i];
+		snprintf(bone.name, sizeof(bone.name), "bone%d", i);
+		bone.parent = i ? (i - 1) / 2 : -1;
+		bone.num_children = 0;
+		bone.layer = BODY | (i % 2 ? UPPER_BODY : LOWER_BODY);
+		bone.model.setIdentity();
+		bone.model.setTranslation(0.0f, 0.1f, 0.0f);
+		if (i)
+		{
+			Skeleton::Bone& parent = skeleton.bones[(int)bone.parent];
+			parent.children[parent.num_children++] = i;
+		}
+		skeleton.bones_by_name[bone.name] = i;
+	}
+
+	createTestClip(skeleton, animation, 1.0f);
+
+	//only the bones are needed to compute the palette
+	mesh.bones_info.resize(skeleton.num_bones);
+	for (int i = 0; i < skeleton.num_bones; ++i)
+	{
+		strcpy(mesh.bones_info[i].name, skeleton.bones[i].name);
+		mesh.bones_info[i].bind_pose.setIdentity();
+	}
+}
+
+static void createTestClip(Skeleton& skeleton, Animation& animation, float speed)
+{
+	animation.skeleton = skeleton;
+	animation.samples_per_second = 30.0f;
+	animation.num_keyframes = 60;
+	animation.duration = animation.num_keyframes / animation.samples_per_second;
+	animation.num_animated_bones = skeleton.num_bones;
+	std::vector<Matrix44> keyframes(animation.num_keyframes * animation.num_animated_bones);
+	for (int i = 0; i < animation.num_animated_bones; ++i)
+	{
+		animation.bones_map[i] = i;
+		for (int k = 0; k < animation.num_keyframes; ++k)
+		{
+			Matrix44& m = keyframes[k * animation.num_animated_bones + i];
+			m.setRotation(sinf(k * 0.2f * speed + i) * 0.5f, Vector3f(speed - 1.0f, 0.0f, 1.0f).normalize());
+			m.m[13] = 0.1f * speed; //setTranslation would reset the rotation
+		}
+	}
+	animation.compress(&keyframes[0]);
+}
+
+//posing many characters: one by one as the renderer did (assignTime and bones by name), or with the AnimationSystem
+static void benchmarkAnimation()
+{
+	const int num_characters = 500;
+	Skeleton skeleton;
+	Animation animation;
+	GFX::Mesh mesh;
+	createTestCharacter(skeleton, animation, mesh);
+
+	std::vector<AnimatedCharacter> characters(num_characters);
+	std::vector<AnimatedCharacter*> pointers;
+	for (auto& character : characters)
+	{
+		character.setup(&skeleton);
+		character.animation = &animation;
+		character.addSkin(AnimationSystem::getBinding(&mesh, &skeleton));
+		pointers.push_back(&character);
+	}
+
+	const int num_frames = 20;
+	std::vector<Matrix44> palette;
+	double start = getHighResTime();
+	for (int frame = 0; frame < num_frames; ++frame)
+		for (int i = 0; i < num_characters; ++i)
+		{
+			animation.assignTime(frame * 0.033f + i * 0.01f);
+			animation.skeleton.computeFinalBoneMatrices(palette, &mesh);
+		}
+	double serial = (getHighResTime() - start) / num_frames;
+
+	start = getHighResTime();
+	for (int frame = 0; frame < num_frames; ++frame)
+	{
+		for (int i = 0; i < num_characters; ++i)
+			characters[i].time = frame * 0.033f + i * 0.01f;
+		AnimationSystem::update(pointers);
+	}
+	double batched = (getHighResTime() - start) / num_frames;
+
+	//both must produce the same palette
+	float max_error = 0.0f;
+	for (int i = 0; i < 16; ++i)
+		max_error = std::max(max_error, fabsf(palette.back().m[i] - characters.back().palette.back().m[i]));
+
+	std::cout << "  " << num_characters << " characters of " << skeleton.num_bones << " bones: serial " << serial << " ms, system " << batched
+		<< " ms per frame (x" << (serial / batched) << ", " << TaskManager::background.getNumThreads() << " threads), max difference " << max_error << std::endl;
+}
+
+//three clips blended in two levels (the last one only in the upper body) with blendSkeleton (matrices) or with a BlendTree
+static void benchmarkBlendTree()
+{
+	const int num_characters = 500;
+	Skeleton skeleton;
+	Animation clips[3];
+	GFX::Mesh mesh;
+	createTestCharacter(skeleton, clips[0], mesh);
+	createTestClip(skeleton, clips[1], 1.5f);
+	createTestClip(skeleton, clips[2], 2.0f);
+
+	BlendTree tree;
+	int walk = tree.addClip(&clips[0]);
+	int run = tree.addClip(&clips[1]);
+	int locomotion = tree.addBlend({ walk, run }, { 0.5f, 0.5f });
+	int wave = tree.addClip(&clips[2]);
+	tree.addBlend({ locomotion, wave }, { 0.5f, 0.5f }, UPPER_BODY);
+
+	SoAPose bind_pose;
+	bind_pose.fromSkeleton(skeleton);
+	Skeleton a = skeleton, b = skeleton;
+	std::vector<SoAPose> stack;
+	double times[2];
+	for (int mode = 0; mode < 2; ++mode)
+	{
+		double start = getHighResTime();
+		for (int i = 0; i < num_characters; ++i)
+		{
+			float time = i * 0.01f;
+			if (mode == 0)
+			{
+				clips[0].samplePose(time, a);
+				clips[1].samplePose(time, b);
+				blendSkeleton(&a, &b, 0.5f, &a);
+				clips[2].samplePose(time, b);
+				blendSkeleton(&a, &b, 0.5f, &a, UPPER_BODY);
+			}
+			else
+			{
+				for (int j : { walk, run, wave })
+					tree.nodes[j].time = time;
+				tree.evaluate(bind_pose, b, stack);
+			}
+		}
+		times[mode] = getHighResTime() - start;
+	}
+
+	//both must give the same pose
+	float max_error = 0.0f;
+	for (int i = 0; i < skeleton.num_bones; ++i)
+		for (int j = 0; j < 16; ++j)
+			max_error = std::max(max_error, fabsf(a.bones[i].model.m[j] - b.bones[i].model.m[j]));
+
+	std::cout << "  " << num_characters << " characters, 3 clips: blendSkeleton " << times[0] << " ms, blend tree " << times[1]
+		<< " ms (x" << (times[0] / times[1]) << "), max difference " << max_error << std::endl;
+}
+
+// RAYS ***************************************************
+
+//the sample scene without the GPU, the prefabs it loads are added to loaded (see freeTestScene)
+static SCN::Scene* loadTestScene(std::vector<SCN::Prefab*>& loaded)
+{
+	const char* filename = "data/scene.json";
+	std::string content;
+	cJSON* json = readFile(filename, content) ? cJSON_Parse(content.c_str()) : NULL;
+	if (!json)
+	{
+		std::cout << "  [ERROR] scene not found: " << filename << std::endl;
+		return NULL;
+	}
+
+	if (!SCN::BaseEntity::s_factory.count("PREFAB"))
+		REGISTER_ENTITY_TYPE(SCN::PrefabEntity);
+	if (!SCN::BaseEntity::s_factory.count("LIGHT"))
+		REGISTER_ENTITY_TYPE(SCN::LightEntity);
+
+	//the prefabs are loaded without the GPU before the scene asks for them (unless the editor has them already)
+	std::string base_folder = getFolderName(filename);
+	cJSON* entity_json;
+	cJSON_ArrayForEach(entity_json, cJSON_GetObjectItem(json, "entities"))
+	{
+		std::string fullpath = base_folder + "/" + readJSONString(entity_json, "filename", "");
+		if (fullpath.size() == base_folder.size() + 1 || SCN::Prefab::sPrefabsLoaded.count(fullpath))
+			continue;
+		SCN::Prefab* prefab = SCN::Prefab::LoadDeferred(fullpath.c_str());
+		if (!prefab)
+			continue;
+		prefab->registerPrefab(fullpath);
+		loaded.push_back(prefab);
+	}
+	cJSON_Delete(json);
+
+	SCN::Scene* current = SCN::Scene::instance;
+	SCN::Scene* scene = new SCN::Scene();
+	scene->load(filename);
+	SCN::Scene::instance = current;
+	return scene;
+}
+
+static void freeTestScene(SCN::Scene* scene, std::vector<SCN::Prefab*>& loaded)
+{
+	scene->clear();
+	delete scene;
+	for (auto prefab : loaded)
+		delete prefab;
+}
+
+//random rays in the sample scene tested one by one with Scene::testRay or in batches with Scene::testRays
+static void benchmarkRays()
+{
+	std::vector<SCN::Prefab*> loaded;
+	SCN::Scene* scene = loadTestScene(loaded);
+	if (!scene)
+		return;
+
+	//from everywhere in the scene to everywhere
+	const int num_rays = 200000;
+	const int num_serial = 20000;
+	std::vector<Ray> rays(num_rays);
+	srand(0);
+	for (auto& ray : rays)
+	{
+		ray.origin.set(random(800.0f, -400.0f), random(150.0f, 1.0f), random(800.0f, -400.0f));
+		ray.direction.set(random(2.0f, -1.0f), random(2.0f, -1.0f), random(2.0f, -1.0f));
+		ray.direction.normalize();
+	}
+
+	std::vector<SCN::RayTestResult> serial(num_serial);
+	double start = getHighResTime();
+	for (int i = 0; i < num_serial; ++i)
+		serial[i] = scene->testRay(rays[i]);
+	double serial_time = getHighResTime() - start;
+
+	std::vector<SCN::RayTestResult> results;
+	scene->testRays(rays, results); //the first call may build the BVHs
+	start = getHighResTime();
+	scene->testRays(rays, results);
+	double batch_time = getHighResTime() - start;
+	start = getHighResTime();
+	std::vector<SCN::RayTestResult> any_results;
+	scene->testRays(rays, any_results, 0xFF, 1000000.0f, true);
+	double any_time = getHighResTime() - start;
+
+	//both must find the same collisions
+	int hits = 0, mismatches = 0;
+	for (int i = 0; i < num_serial; ++i)
+	{
+		hits += results[i].collided;
+		if (serial[i].collided != results[i].collided || (serial[i].collided && fabsf(serial[i].t - results[i].t) > 0.01f))
+			mismatches++;
+	}
+
+	std::cout << "  " << scene->entities.size() << " entities, " << num_rays << " rays (" << (hits * 100 / num_serial) << "% hit): testRay " << (num_serial / serial_time / 1000.0)
+		<< " Mrays/s, testRays " << (num_rays / batch_time / 1000.0) << " Mrays/s, any hit " << (num_rays / any_time / 1000.0) << " Mrays/s ("
+		<< TaskManager::background.getNumThreads() << " threads), mismatches " << mismatches << std::endl;
+
+	freeTestScene(scene, loaded);
+}
+
+// LIGHTMAPS **********************************************
+
+//ambient occlusion of the house of the sample scene, the assets have no uvs1 so it is baked in its first uvs (not saved)
+static void benchmarkLightmap()
+{
+	std::vector<SCN::Prefab*> loaded;
+	SCN::Scene* scene = loadTestScene(loaded);
+	if (!scene)
+		return;
+	SCN::PrefabEntity* house = (SCN::PrefabEntity*)scene->getEntity("house");
+	if (!house || house->getType() != SCN::eEntityType::PREFAB || !house->prefab)
+	{
+		std::cout << "  [ERROR] house not found in the scene" << std::endl;
+		freeTestScene(scene, loaded);
+		return;
+	}
+
+	std::vector<SCN::Node*> nodes;
+	std::vector<GFX::Mesh*> meshes;
+	std::function<void(SCN::Node*)> addNodes = [&](SCN::Node* node) {
+		if (node->mesh && node->material && !node->mesh->m_uvs1.size() && node->mesh->uvs.size())
+		{
+			node->mesh->m_uvs1 = node->mesh->uvs;
+			meshes.push_back(node->mesh);
+		}
+		if (node->mesh && node->material && node->mesh->m_uvs1.size())
+			nodes.push_back(node);
+		for (auto child : node->children)
+			addNodes(child);
+	};
+	addNodes(&house->root);
+
+	int resolution = SCN::LightmapBaker::resolution;
+	SCN::LightmapBaker::resolution = 128;
+	int texels = 0;
+	double start = getHighResTime();
+	for (auto node : nodes)
+	{
+		Image image;
+		texels += SCN::LightmapBaker::bakeNode(scene, node, image);
+	}
+	double time = getHighResTime() - start;
+	double rays = (double)texels * SCN::LightmapBaker::num_samples;
+
+	std::cout << "  " << nodes.size() << " lightmaps of " << SCN::LightmapBaker::resolution << "x" << SCN::LightmapBaker::resolution << ", " << texels << " texels, "
+		<< SCN::LightmapBaker::num_samples << " samples: " << time << " ms, " << (rays / time / 1000.0) << " Mrays/s (" << TaskManager::background.getNumThreads() << " threads)" << std::endl;
+
+	SCN::LightmapBaker::resolution = resolution;
+	for (auto mesh : meshes)
+		mesh->m_uvs1.clear();
+	freeTestScene(scene, loaded);
+}
+
+// IRRADIANCE *********************************************
+
+//a volume over the sample scene baked with its lights (not saved), the probes at the corners must map to the corners of the texture
+static void benchmarkIrradiance()
+{
+	std::vector<SCN::Prefab*> loaded;
+	SCN::Scene* scene = loadTestScene(loaded);
+	if (!scene)
+		return;
+
+	SCN::IrradianceEntity* volume = new SCN::IrradianceEntity();
+	volume->name = "benchmark_irradiance";
+	volume->root.model.setTranslation(0, 75, 0);
+	volume->size.set(800, 140, 800);
+	volume->dims[0] = 10; volume->dims[1] = 3; volume->dims[2] = 10;
+	scene->addEntity(volume);
+
+	double start = getHighResTime();
+	volume->bake();
+	double time = getHighResTime() - start;
+	double rays = (double)volume->getNumProbes() * SCN::IrradianceEntity::num_samples;
+
+	Matrix44 to_volume = volume->getVolumeMatrix();
+	Vector3f first = to_volume * volume->getProbePosition(0, 0, 0);
+	Vector3f last = to_volume * volume->getProbePosition(volume->dims[0] - 1, volume->dims[1] - 1, volume->dims[2] - 1);
+	float error = first.length() + (last - Vector3f(1, 1, 1)).length();
+
+	std::cout << "  " << volume->getNumProbes() << " probes, " << SCN::IrradianceEntity::num_samples << " samples: " << time << " ms, " << (volume->getNumProbes() / time * 1000.0)
+		<< " probes/s, " << (rays / time / 1000.0) << " Mrays/s (" << TaskManager::background.getNumThreads() << " threads), volume matrix error " << error << std::endl;
+
+	freeTestScene(scene, loaded);
+}
+
+// SPHERICAL HARMONICS ************************************
+
+float texelSolidAngle(float aU, float aV, float width, float height);
+
+//computeSH before the precomputed tables: serial, directions rebuilt per size and weights per texel
+//kept here only to compare against it
+static SphericalHarmonics legacyComputeSH(FloatImage images[])
+{
+	int size = images[0].width;
+	std::vector< std::vector<Vector3f> > cubeMapVecs;
+	for (int index = 0; index < 6; ++index)
+	{
+		std::vector<Vector3f> faceVecs;
+		for (int v = 0; v < size; v++)
+			for (int u = 0; u < size; u++)
+			{
+				float fU = (2.0f * u / (size - 1.0f)) - 1.0f;
+				float fV = (2.0f * v / (size - 1.0f)) - 1.0f;
+				faceVecs.push_back(normalize(cubemapFaceNormals[index][0] * fU + cubemapFaceNormals[index][1] * fV + cubemapFaceNormals[index][2]));
+			}
+		cubeMapVecs.push_back(faceVecs);
+	}
+
+	SphericalHarmonics sh;
+	float weightAccum = 0;
+	for (int index = 0; index < 6; ++index)
+		for (int y = 0; y < size; y++)
+			for (int x = 0; x < size; x++)
+			{
+				Vector3f d = cubeMapVecs[index][y * size + x];
+				float weight = texelSolidAngle(x, y, size, size);
+				Vector3f value = images[index].getPixel(x, y).xyz();
+				sh.coeffs[0] += value * (weight * 4 / 17);
+				sh.coeffs[1] += value * (weight * 8 / 17) * d.y;
+				sh.coeffs[2] += value * (weight * 8 / 17) * d.z;
+				sh.coeffs[3] += value * (weight * 8 / 17) * d.x;
+				sh.coeffs[4] += value * (weight * 15 / 17) * d.x * d.y;
+				sh.coeffs[5] += value * (weight * 15 / 17) * d.y * d.z;
+				sh.coeffs[6] += value * (weight * 5 / 68) * (3.0f * d.z * d.z - 1.0f);
+				sh.coeffs[7] += value * (weight * 15 / 17) * d.x * d.z;
+				sh.coeffs[8] += value * (weight * 15 / 68) * (d.x * d.x - d.y * d.y);
+				weightAccum += weight * 3.0f;
+			}
+
+	for (int i = 0; i < 9; i++)
+		sh.coeffs[i] = sh.coeffs[i] * (float)(4 * PI / weightAccum);
+	return sh;
+}
+
+//a procedural cubemap (a bright sun over a gradient) projected again and again, like a probe capture would
+static void benchmarkSH()
+{
+	const int size = 128;
+	const int iterations = 20;
+	FloatImage faces[6];
+	for (int index = 0; index < 6; ++index)
+	{
+		faces[index].resize(size, size, 4);
+		for (int y = 0; y < size; ++y)
+			for (int x = 0; x < size; ++x)
+			{
+				float fU = (2.0f * x / (size - 1.0f)) - 1.0f;
+				float fV = (2.0f * y / (size - 1.0f)) - 1.0f;
+				Vector3f d = normalize(cubemapFaceNormals[index][0] * fU + cubemapFaceNormals[index][1] * fV + cubemapFaceNormals[index][2]);
+				float sun = std::max(0.0f, d.dot(normalize(Vector3f(1, 2, 1)))) * 4.0f;
+				faces[index].setPixel(x, y, Vector4f(sun + 0.2f + d.y * 0.1f, sun + 0.3f, 0.5f + d.x * 0.2f, 1.0f));
+			}
+	}
+
+	SphericalHarmonics results[2];
+	double times[2];
+	for (int mode = 0; mode < 2; ++mode)
+	{
+		double start = getHighResTime();
+		for (int i = 0; i < iterations; ++i)
+			results[mode] = mode == 0 ? legacyComputeSH(faces) : computeSH(faces);
+		times[mode] = (getHighResTime() - start) / iterations;
+	}
+
+	//both must give the same coefficients (save rounding)
+	float max_error = 0.0f;
+	for (int i = 0; i < 9; ++i)
+		max_error = std::max(max_error, (results[0].coeffs[i] - results[1].coeffs[i]).length());
+
+	std::cout << "  cubemap " << size << "x" << size << ": serial " << times[0] << " ms, tables " << times[1]
+		<< " ms (x" << (times[0] / times[1]) << ", " << TaskManager::background.getNumThreads() << " threads), max difference " << max_error << std::endl;
+}
+
+// REGISTRY ***********************************************
+
+std::vector<sBenchmark>& getBenchmarks()
+{
+	static std::vector<sBenchmark> benchmarks = {
+		{ "tasks", false, benchmarkTasks },
+		{ "imagedecode", false, benchmarkImageDecode },
+		{ "uniforms", true, benchmarkUniforms },
+		{ "animation", false, benchmarkAnimation },
+		{ "blendtree", false, benchmarkBlendTree },
+		{ "rays", false, benchmarkRays },
+		{ "lightmap", false, benchmarkLightmap },
+		{ "irradiance", false, benchmarkIrradiance },
+		{ "sh", false, benchmarkSH },
+	};
+	return benchmarks;
+}
+
+bool runBenchmark(const char* name, bool has_gpu)
+{
+	bool found = false;
+	for (auto& benchmark : getBenchmarks())
+	{
+		if (strcmp(name, "all") != 0 && strcmp(name, benchmark.name) != 0)
+			continue;
+		found = true;
+		if (benchmark.needs_gpu && !has_gpu)
+		{
+			std::cout << " * Benchmark " << benchmark.name << " skipped, it needs a GPU context" << std::endl;
+			continue;
+		}
+		std::cout << " * Benchmark " << TermColor::YELLOW << benchmark.name << TermColor::DEFAULT << std::endl;
+		benchmark.func();
+	}
+
+	if (!found)
+		std::cout << "[ERROR] Benchmark not found: " << name << std::endl;
+	return found;
+}
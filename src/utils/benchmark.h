@@ -0,0 +1,17 @@
+#pragma once
+
+#include <vector>
+#include <functional>
+
+//Benchmarks to measure the performance of some of the systems.
+//They can be launched from the editor (Stats tab) or from the command line: main --benchmark name
+//(from the command line only the ones that do not need a GPU context)
+
+struct sBenchmark {
+	const char* name;
+	bool needs_gpu;
+	std::function<void()> func;
+};
+
+std::vector<sBenchmark>& getBenchmarks();
+bool runBenchmark(const char* name, bool has_gpu = true); //"all" runs all of them
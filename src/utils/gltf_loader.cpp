@@ -7,14 +7,27 @@
 
 #include "../gfx/mesh.h"
 #include "../gfx/texture.h"
+#include "../gfx/texturecompression.h"
 #include "../pipeline/material.h"
 #include "../pipeline/prefab.h"
+#include "../pipeline/animation.h"
 #include "../utils/utils.h"
 
 #include <iostream>
+#include <atomic>
+#include <set>
+#include <functional>
+
+#define GLTF_ANIMATION_FPS 30 //clips are resampled at this rate before compressing them
 
 //** PARSING GLTF IS UGLY
-std::string base_folder;
+thread_local std::string base_folder; //prefabs can be loaded from several threads
+
+//when loading from a background thread nothing can touch OpenGL or the managers,
+//meshes and materials are stored here and the textures are left pending in the prefab
+thread_local SCN::Prefab* deferred_prefab = NULL;
+thread_local std::map<std::string, GFX::Mesh*> deferred_meshes;
+thread_local std::map<std::string, SCN::Material*> deferred_materials;
 
 #ifdef _DEBUG2
 	bool load_textures = false; //must textures be loadead?
@@ -73,7 +86,7 @@ void parseGLTFBufferVector4(std::vector<Vector4f>& container, cgltf_accessor* ac
 				for (size_t j = 0; j < 4; ++j)
 				{
 					values[i * 4 + j] = *(current + j);
-					if (acc->normalized) values[i * 4 + j] /= (float)0xFFFF;
+					if (acc->normalized) values[i * 4 + j] /= (float)0xFF;
 				}
 				current += stride;
 			}
@@ -258,6 +271,30 @@ void parseGLTFBufferIndices(std::vector<unsigned int>& container, cgltf_accessor
 	}
 }
 
+//joints are 8u or 16u indices to the joints of the skin
+void parseGLTFBufferJoints(std::vector<Vector4ub>& container, cgltf_accessor* acc)
+{
+	container.resize(acc->count);
+	cgltf_uint joints[4];
+	for (size_t i = 0; i < acc->count; ++i)
+	{
+		memset(joints, 0, sizeof(joints));
+		cgltf_accessor_read_uint(acc, i, joints, 4);
+		container[i].set(joints[0], joints[1], joints[2], joints[3]);
+	}
+}
+
+//bone names must fit in Skeleton::Bone and BoneInfo
+void getGLTFJointName(cgltf_skin* skin, size_t joint, char* name)
+{
+	cgltf_node* node = skin->joints[joint];
+	if (node->name)
+		strncpy(name, node->name, 31);
+	else
+		snprintf(name, 32, "joint%d", (int)joint);
+	name[31] = 0;
+}
+
 std::vector<GFX::Mesh*> parseGLTFMesh(cgltf_mesh* meshdata, const char* basename)
 {
 	std::vector<GFX::Mesh*> result;
@@ -275,7 +312,13 @@ std::vector<GFX::Mesh*> parseGLTFMesh(cgltf_mesh* meshdata, const char* basename
 		if (meshdata->name)
 		{
 			submesh_name = std::string(basename) + std::string("::") + std::string(meshdata->name) + std::string("::") + std::to_string(i);
-			mesh = GFX::Mesh::Get(submesh_name.c_str(), true);
+			if (deferred_prefab)
+			{
+				auto it = deferred_meshes.find(submesh_name);
+				mesh = it != deferred_meshes.end() ? it->second : NULL;
+			}
+			else
+				mesh = GFX::Mesh::Get(submesh_name.c_str(), true);
 			if (mesh)
 			{
 				result.push_back(mesh);
@@ -328,15 +371,26 @@ std::vector<GFX::Mesh*> parseGLTFMesh(cgltf_mesh* meshdata, const char* basename
 			else
 			if (attr->type == cgltf_attribute_type_joints)
 			{
-				//parseGLTFBufferVector4(mesh->bones, attr->data);
+				parseGLTFBufferJoints(mesh->bones, attr->data);
 			}
 
 			if (primitive->indices && primitive->indices->count)
 				parseGLTFBufferIndices(mesh->m_indices, primitive->indices);
 		}
-		mesh->uploadToVRAM();
-		if (meshdata->name)
-			mesh->registerMesh(submesh_name);
+		mesh->createBVH(); //also in the loading thread when deferred
+		if (deferred_prefab)
+		{
+			//uploaded and registered later from the main thread
+			mesh->name = submesh_name;
+			if (meshdata->name)
+				deferred_meshes[submesh_name] = mesh;
+		}
+		else
+		{
+			mesh->uploadToVRAM();
+			if (meshdata->name)
+				mesh->registerMesh(submesh_name);
+		}
 		result.push_back(mesh);
 	}
 
@@ -345,6 +399,30 @@ std::vector<GFX::Mesh*> parseGLTFMesh(cgltf_mesh* meshdata, const char* basename
 
 int GLTF_TEXTURE_LAST_ID = 1;
 
+//decodes an image embedded in the binary buffer (only CPU work)
+bool decodeGLTFImage(cgltf_image* image, Image& img)
+{
+	std::vector<unsigned char> buffer;
+	buffer.resize(image->buffer_view->size);
+	memcpy(&buffer[0], (char*)image->buffer_view->buffer->data + image->buffer_view->offset, image->buffer_view->size);
+
+	if (!strcmp(image->mime_type, "image/png"))
+		img.loadPNG(buffer);
+	else if (!strcmp(image->mime_type, "image/jpeg"))
+		img.loadJPG(buffer);
+	else
+	{
+		stdlog(std::string("image format not supported: ") + image->mime_type);
+		return false;
+	}
+	if (!img.width)
+	{
+		stdlog(std::string("image encoding has error: ") + image->mime_type);
+		return false;
+	}
+	return true;
+}
+
 GFX::Texture* parseGLTFTexture(cgltf_image* image, const char* filename)
 {
 	if (!load_textures || !image )
@@ -372,24 +450,8 @@ GFX::Texture* parseGLTFTexture(cgltf_image* image, const char* filename)
 	if (image->buffer_view)
 	{
 		Image img;
-		std::vector<unsigned char> buffer;
-		buffer.resize(image->buffer_view->size);
-		memcpy(&buffer[0], (char*)image->buffer_view->buffer->data + image->buffer_view->offset, image->buffer_view->size);
-
-		if (!strcmp(image->mime_type, "image/png"))
-			img.loadPNG(buffer);
-		else if (!strcmp(image->mime_type, "image/jpeg"))
-			img.loadJPG(buffer);
-		else
-		{
-			stdlog(std::string("image format not supported: ") + image->mime_type);
+		if (!decodeGLTFImage(image, img))
 			return NULL;
-		}
-		if (!img.width)
-		{
-			stdlog(std::string("image encoding has error: ") + image->mime_type);
-			return NULL;
-		}
 		GFX::Texture* tex = new GFX::Texture();
 		tex->loadFromImage(&img);
 		if (filename)
@@ -407,6 +469,47 @@ GFX::Texture* parseGLTFTexture(cgltf_image* image, const char* filename)
 	return NULL;
 }
 
+//assigns the texture to the material channel, or leaves it pending if we are not in the main thread
+void parseGLTFSampler(cgltf_texture_view& view, SCN::Material* material, SCN::eTextureChannel channel)
+{
+	if (!view.texture || !load_textures)
+		return;
+
+	SCN::Sampler& sampler = material->textures[channel];
+	sampler.uv_channel = view.texcoord;
+
+	if (!deferred_prefab)
+	{
+		sampler.texture = parseGLTFTexture(view.texture->image, view.texture->name);
+		return;
+	}
+
+	cgltf_image* image = view.texture->image;
+	if (!image)
+		return;
+
+	SCN::Prefab::sPendingTexture pending;
+	pending.material = material;
+	pending.channel = channel;
+	pending.image = NULL;
+	if (image->uri)
+		pending.filename = std::string(base_folder) + "/" + image->uri;
+	else if (image->buffer_view)
+	{
+		if (view.texture->name)
+			pending.filename = std::string(base_folder) + "/" + view.texture->name;
+		pending.image = new Image();
+		if (!decodeGLTFImage(image, *pending.image))
+		{
+			delete pending.image;
+			return;
+		}
+	}
+	else
+		return;
+	deferred_prefab->pending_textures.push_back(pending);
+}
+
 SCN::Material* parseGLTFMaterial(cgltf_material* matdata, const char* basename)
 {
 	SCN::Material* material = NULL;
@@ -414,7 +517,13 @@ SCN::Material* parseGLTFMaterial(cgltf_material* matdata, const char* basename)
 	if (matdata->name)
 	{
 		name = std::string(basename) + std::string("::") + std::string(matdata->name);
-		material = SCN::Material::Get(name.c_str());
+		if (deferred_prefab)
+		{
+			auto it = deferred_materials.find(name);
+			material = it != deferred_materials.end() ? it->second : NULL;
+		}
+		else
+			material = SCN::Material::Get(name.c_str());
 	}
 	
 	if (material)
@@ -422,60 +531,41 @@ SCN::Material* parseGLTFMaterial(cgltf_material* matdata, const char* basename)
 
 	material = new SCN::Material();
 	if (matdata->name)
-		material->registerMaterial(name.c_str());
+	{
+		if (deferred_prefab)
+		{
+			//registered later from the main thread
+			material->name = name;
+			deferred_materials[name] = material;
+		}
+		else
+			material->registerMaterial(name.c_str());
+	}
 
 	material->alpha_mode = (SCN::eAlphaMode)matdata->alpha_mode;
 	material->alpha_cutoff = matdata->alpha_cutoff;
 	material->two_sided = matdata->double_sided;
 
 	//normalmap
-	if (matdata->normal_texture.texture)
-	{
-		material->textures[SCN::eTextureChannel::NORMALMAP].texture = parseGLTFTexture( matdata->normal_texture.texture->image, matdata->normal_texture.texture->name);
-		material->textures[SCN::eTextureChannel::NORMALMAP].uv_channel = matdata->normal_texture.texcoord;
-	}
+	parseGLTFSampler(matdata->normal_texture, material, SCN::eTextureChannel::NORMALMAP);
 
 	//emissive
 	material->emissive_factor = matdata->emissive_factor;
-	if (matdata->emissive_texture.texture)
-	{
-		material->textures[SCN::eTextureChannel::EMISSIVE].texture = parseGLTFTexture(matdata->emissive_texture.texture->image, matdata->emissive_texture.texture->name);
-		material->textures[SCN::eTextureChannel::EMISSIVE].uv_channel = matdata->emissive_texture.texcoord;
-	}
-
+	parseGLTFSampler(matdata->emissive_texture, material, SCN::eTextureChannel::EMISSIVE);
 
 	//pbr
 	if (matdata->has_pbr_specular_glossiness)
-	{
-		if (matdata->pbr_specular_glossiness.diffuse_texture.texture)
-			material->textures[SCN::eTextureChannel::ALBEDO].texture = parseGLTFTexture(matdata->pbr_specular_glossiness.diffuse_texture.texture->image, matdata->pbr_specular_glossiness.diffuse_texture.texture->name);
-	}
+		parseGLTFSampler(matdata->pbr_specular_glossiness.diffuse_texture, material, SCN::eTextureChannel::ALBEDO);
 	if (matdata->has_pbr_metallic_roughness)
 	{
 		material->color = matdata->pbr_metallic_roughness.base_color_factor;
 		material->metallic_factor = matdata->pbr_metallic_roughness.metallic_factor;
 		material->roughness_factor = matdata->pbr_metallic_roughness.roughness_factor;
-
-		if (load_textures)
-		{
-			if (matdata->pbr_metallic_roughness.base_color_texture.texture)
-			{
-				material->textures[SCN::eTextureChannel::ALBEDO].texture = parseGLTFTexture(matdata->pbr_metallic_roughness.base_color_texture.texture->image, matdata->pbr_metallic_roughness.base_color_texture.texture->name);
-				material->textures[SCN::eTextureChannel::ALBEDO].uv_channel = matdata->pbr_metallic_roughness.base_color_texture.texcoord;
-			}
-			if (matdata->pbr_metallic_roughness.metallic_roughness_texture.texture)
-			{
-				material->textures[SCN::eTextureChannel::METALLIC_ROUGHNESS].texture = parseGLTFTexture(matdata->pbr_metallic_roughness.metallic_roughness_texture.texture->image, matdata->pbr_metallic_roughness.metallic_roughness_texture.texture->name);
-				material->textures[SCN::eTextureChannel::METALLIC_ROUGHNESS].uv_channel = matdata->pbr_metallic_roughness.metallic_roughness_texture.texcoord;
-			}
-		}
+		parseGLTFSampler(matdata->pbr_metallic_roughness.base_color_texture, material, SCN::eTextureChannel::ALBEDO);
+		parseGLTFSampler(matdata->pbr_metallic_roughness.metallic_roughness_texture, material, SCN::eTextureChannel::METALLIC_ROUGHNESS);
 	}
 
-	if (matdata->occlusion_texture.texture)
-	{
-		material->textures[SCN::eTextureChannel::OCCLUSION].texture = parseGLTFTexture(matdata->occlusion_texture.texture->image, matdata->occlusion_texture.texture->name);
-		material->textures[SCN::eTextureChannel::OCCLUSION].uv_channel = matdata->occlusion_texture.texcoord;
-	}
+	parseGLTFSampler(matdata->occlusion_texture, material, SCN::eTextureChannel::OCCLUSION);
 
 	return material;
 }
@@ -500,6 +590,22 @@ void parseGLTFTransform(cgltf_node* node, Matrix44 &model)
 	}
 }
 
+//the joints of the skin with their inverse bind matrices, in the order of the JOINTS stream
+void parseGLTFBonesInfo(cgltf_skin* skin, GFX::Mesh* mesh)
+{
+	if (!mesh || mesh->bones_info.size() || !mesh->bones.size() || skin->joints_count > 128)
+		return;
+	mesh->bones_info.resize(skin->joints_count);
+	for (size_t i = 0; i < skin->joints_count; ++i)
+	{
+		BoneInfo& info = mesh->bones_info[i];
+		getGLTFJointName(skin, i, info.name);
+		if (skin->inverse_bind_matrices)
+			cgltf_accessor_read_float(skin->inverse_bind_matrices, i, info.bind_pose.m, 16);
+	}
+	mesh->bind_matrix.setIdentity(); //the transform of the node is ignored, joints are in the space of the prefab root
+}
+
 //GLTF PARSING: you can pass the node or it will create it
 SCN::Node* parseGLTFNode(cgltf_node* node, SCN::Node* scenenode = NULL, const char* basename = NULL)
 {
@@ -526,6 +632,8 @@ SCN::Node* parseGLTFNode(cgltf_node* node, SCN::Node* scenenode = NULL, const ch
 			{
 				SCN::Node* subnode = new SCN::Node();
 				subnode->mesh = meshes[i];
+				if (node->skin)
+					parseGLTFBonesInfo(node->skin, meshes[i]);
 				if (node->mesh->primitives[i].material)
 					subnode->material = parseGLTFMaterial(node->mesh->primitives[i].material, basename );
 				scenenode->addChild(subnode);
@@ -533,7 +641,7 @@ SCN::Node* parseGLTFNode(cgltf_node* node, SCN::Node* scenenode = NULL, const ch
 		}
 		else //single primitive
 		{
-			if (node->mesh->name)
+			if (node->mesh->name && !deferred_prefab)
 				scenenode->mesh = GFX::Mesh::Get(node->mesh->name, true);
 
 			if (!scenenode->mesh)
@@ -546,6 +654,9 @@ SCN::Node* parseGLTFNode(cgltf_node* node, SCN::Node* scenenode = NULL, const ch
 					scenenode->mesh = meshes[0];
 			}
 
+			if (node->skin)
+				parseGLTFBonesInfo(node->skin, scenenode->mesh);
+
 			if (node->mesh->primitives->material)
 				scenenode->material = parseGLTFMaterial(node->mesh->primitives->material, basename );
 		}
@@ -557,6 +668,202 @@ SCN::Node* parseGLTFNode(cgltf_node* node, SCN::Node* scenenode = NULL, const ch
 	return scenenode;
 }
 
+//the bones of the skin in hierarchy order (parents first), the roots have the transform of their ancestors
+//so the whole skeleton is in the space of the prefab root. joint_bones maps every joint to its bone
+bool parseGLTFSkin(cgltf_skin* skin, Skeleton& skeleton, std::vector<int>& joint_bones)
+{
+	if (skin->joints_count > 128)
+	{
+		std::cout << "[WARN] skin with more than 128 joints, skipped" << std::endl;
+		return false;
+	}
+
+	std::map<cgltf_node*, int> joints;
+	for (size_t i = 0; i < skin->joints_count; ++i)
+		joints[skin->joints[i]] = (int)i;
+	joint_bones.assign(skin->joints_count, -1);
+	memset(&skeleton.bones, 0, sizeof(skeleton.bones));
+	skeleton.num_bones = 0;
+	skeleton.bones_by_name.clear();
+
+	//depth first from every root, nodes that are not joints are skipped
+	std::function<void(cgltf_node*, int)> addBones = [&](cgltf_node* node, int parent) {
+		auto it = joints.find(node);
+		if (it != joints.end())
+		{
+			int index = skeleton.num_bones++;
+			Skeleton::Bone& bone = skeleton.bones[index];
+			getGLTFJointName(skin, it->second, bone.name);
+			bone.parent = parent;
+			if (parent == -1)
+				cgltf_node_transform_world(node, bone.model.m);
+			else
+			{
+				cgltf_node_transform_local(node, bone.model.m);
+				Skeleton::Bone& parent_bone = skeleton.bones[parent];
+				if (parent_bone.num_children < 16)
+					parent_bone.children[parent_bone.num_children++] = index;
+			}
+			joint_bones[it->second] = index;
+			parent = index;
+		}
+		for (size_t i = 0; i < node->children_count; ++i)
+			addBones(node->children[i], parent);
+	};
+
+	for (size_t i = 0; i < skin->joints_count; ++i)
+	{
+		cgltf_node* root = skin->joints[i];
+		bool is_root = true;
+		for (cgltf_node* node = root->parent; node && is_root; node = node->parent)
+			is_root = joints.find(node) == joints.end();
+		if (is_root)
+			addBones(root, -1);
+	}
+
+	for (int i = 0; i < skeleton.num_bones; ++i)
+		skeleton.bones_by_name[skeleton.bones[i].name] = i;
+	skeleton.assignBodyLayers();
+	skeleton.updateGlobalMatrices();
+	return true;
+}
+
+//keys of one channel, cubic splines keep only the values (in tangent, value, out tangent)
+struct sGLTFChannel {
+	int bone;
+	cgltf_animation_path_type path;
+	cgltf_interpolation_type interpolation;
+	int num_components;
+	std::vector<float> times;
+	std::vector<float> values;
+};
+
+static void sampleGLTFChannel(const sGLTFChannel& channel, float t, float* out)
+{
+	int n = channel.num_components;
+	int stride = channel.interpolation == cgltf_interpolation_type_cubic_spline ? n * 3 : n;
+	int offset = channel.interpolation == cgltf_interpolation_type_cubic_spline ? n : 0;
+	const std::vector<float>& times = channel.times;
+	int i = (int)(std::upper_bound(times.begin(), times.end(), t) - times.begin()) - 1;
+	if (i < 0 || i >= (int)times.size() - 1) //before the first key or after the last
+	{
+		i = clamp(i, 0, (int)times.size() - 1);
+		memcpy(out, &channel.values[i * stride + offset], sizeof(float) * n);
+		return;
+	}
+	const float* a = &channel.values[i * stride + offset];
+	const float* b = &channel.values[(i + 1) * stride + offset];
+	float f = channel.interpolation == cgltf_interpolation_type_step ? 0.0f : (t - times[i]) / (times[i + 1] - times[i]);
+	if (channel.path == cgltf_animation_path_type_rotation)
+	{
+		Quaternion q = Qslerp(Quaternion(a), Quaternion(b), f);
+		memcpy(out, q.q, sizeof(float) * 4);
+	}
+	else
+		for (int j = 0; j < n; ++j)
+			out[j] = a[j] + (b[j] - a[j]) * f;
+}
+
+//resamples the channels that target the skeleton to local matrices of every bone and compresses them
+Animation* parseGLTFAnimation(cgltf_animation* animdata, cgltf_skin* skin, const Skeleton& skeleton, const std::vector<int>& joint_bones)
+{
+	std::map<cgltf_node*, int> bones;
+	for (size_t i = 0; i < skin->joints_count; ++i)
+		bones[skin->joints[i]] = joint_bones[i];
+
+	std::vector<sGLTFChannel> channels;
+	float duration = 0.0f;
+	for (size_t i = 0; i < animdata->channels_count; ++i)
+	{
+		cgltf_animation_channel& c = animdata->channels[i];
+		auto it = bones.find(c.target_node);
+		if (it == bones.end() || c.target_path == cgltf_animation_path_type_weights || c.target_path == cgltf_animation_path_type_invalid)
+			continue;
+		sGLTFChannel channel;
+		channel.bone = it->second;
+		channel.path = c.target_path;
+		channel.interpolation = c.sampler->interpolation;
+		channel.num_components = c.target_path == cgltf_animation_path_type_rotation ? 4 : 3;
+		cgltf_accessor* input = c.sampler->input;
+		cgltf_accessor* output = c.sampler->output;
+		channel.times.resize(input->count);
+		for (size_t j = 0; j < input->count; ++j)
+			cgltf_accessor_read_float(input, j, &channel.times[j], 1);
+		channel.values.resize(output->count * channel.num_components);
+		for (size_t j = 0; j < output->count; ++j)
+			cgltf_accessor_read_float(output, j, &channel.values[j * channel.num_components], channel.num_components);
+		if (channel.times.empty() || channel.values.empty())
+			continue;
+		duration = std::max(duration, channel.times.back());
+		channels.push_back(channel);
+	}
+	if (channels.empty())
+		return NULL;
+
+	Animation* anim = new Animation();
+	anim->skeleton = skeleton;
+	anim->skeleton.bones_by_name.clear(); //the keys point to the names of the other skeleton
+	for (int i = 0; i < skeleton.num_bones; ++i)
+		anim->skeleton.bones_by_name[anim->skeleton.bones[i].name] = i;
+	anim->samples_per_second = GLTF_ANIMATION_FPS;
+	anim->num_keyframes = std::max(1, (int)round(duration * GLTF_ANIMATION_FPS));
+	anim->duration = anim->num_keyframes / anim->samples_per_second;
+	anim->num_animated_bones = skeleton.num_bones;
+	for (int i = 0; i < skeleton.num_bones; ++i)
+		anim->bones_map[i] = i;
+
+	//rest pose of every bone, the channels overwrite it
+	struct sTRS { float t[3]; float r[4]; float s[3]; };
+	std::vector<sTRS> rest(skeleton.num_bones);
+	std::vector<Matrix44> ancestors(skeleton.num_bones); //only for the roots
+	for (auto& it : bones)
+	{
+		cgltf_node* node = it.first;
+		sTRS& trs = rest[it.second];
+		float identity[10] = { 0,0,0, 0,0,0,1, 1,1,1 };
+		memcpy(&trs, identity, sizeof(trs));
+		if (node->has_translation) memcpy(trs.t, node->translation, sizeof(trs.t));
+		if (node->has_rotation) memcpy(trs.r, node->rotation, sizeof(trs.r));
+		if (node->has_scale) memcpy(trs.s, node->scale, sizeof(trs.s));
+		if (skeleton.bones[it.second].parent == -1 && node->parent)
+			cgltf_node_transform_world(node->parent, ancestors[it.second].m);
+	}
+
+	std::vector<Matrix44> keyframes(anim->num_keyframes * anim->num_animated_bones);
+	std::vector<sTRS> pose(skeleton.num_bones);
+	for (int k = 0; k < anim->num_keyframes; ++k)
+	{
+		float t = k / anim->samples_per_second;
+		pose = rest;
+		for (const sGLTFChannel& channel : channels)
+		{
+			sTRS& trs = pose[channel.bone];
+			float* out = channel.path == cgltf_animation_path_type_translation ? trs.t : (channel.path == cgltf_animation_path_type_rotation ? trs.r : trs.s);
+			sampleGLTFChannel(channel, t, out);
+		}
+		for (int i = 0; i < skeleton.num_bones; ++i)
+		{
+			sTRS& trs = pose[i];
+			Matrix44& m = keyframes[k * anim->num_animated_bones + i];
+			Quaternion q(trs.r);
+			q.normalize();
+			q.toMatrix(m);
+			for (int j = 0; j < 3; ++j)
+				for (int c = 0; c < 3; ++c)
+					m.m[j * 4 + c] *= trs.s[j];
+			m.m[12] = trs.t[0];
+			m.m[13] = trs.t[1];
+			m.m[14] = trs.t[2];
+			if (skeleton.bones[i].parent == -1)
+				m = m * ancestors[i];
+		}
+	}
+
+	anim->compress(&keyframes[0]);
+	anim->assignTime(0);
+	return anim;
+}
+
 cgltf_result internalOpenFile(const struct cgltf_memory_options* memory_options, const struct cgltf_file_options* file_options, const char* path, cgltf_size* size, void** data)
 {
 	//stdlog(std::string(" <- ") + path);
@@ -585,7 +892,7 @@ cgltf_result internalOpenMemory(const struct cgltf_memory_options* memory_option
 	return cgltf_result_success;
 }
 
-SCN::Prefab* loadGLTF(const char *filename, cgltf_data *data, cgltf_options& options)
+SCN::Prefab* loadGLTF(const char *filename, cgltf_data *data, cgltf_options& options, bool defer_gpu = false)
 {
 	cgltf_result result;
 
@@ -613,6 +920,8 @@ SCN::Prefab* loadGLTF(const char *filename, cgltf_data *data, cgltf_options& opt
 	}
 
 	SCN::Prefab* prefab = new SCN::Prefab();
+	if (defer_gpu)
+		deferred_prefab = prefab;
 
 	{
 		if (scene->nodes_count > 1)
@@ -649,12 +958,37 @@ SCN::Prefab* loadGLTF(const char *filename, cgltf_data *data, cgltf_options& opt
 	*/
 	//prefab->root.model = model;
 
+	//only one skeleton per prefab, the first skin
+	std::vector<int> joint_bones;
+	if (data->skins_count)
+	{
+		if (data->skins_count > 1)
+			std::cout << "[WARN] more than one skin, only the first one is used" << std::endl;
+		prefab->skeleton = new Skeleton();
+		if (!parseGLTFSkin(&data->skins[0], *prefab->skeleton, joint_bones))
+		{
+			delete prefab->skeleton;
+			prefab->skeleton = NULL;
+		}
+	}
+	if (prefab->skeleton)
+		for (size_t i = 0; i < data->animations_count; ++i)
+		{
+			Animation* anim = parseGLTFAnimation(&data->animations[i], &data->skins[0], *prefab->skeleton, joint_bones);
+			if (anim)
+				prefab->animations.push_back(anim);
+		}
+
 	prefab->updateNodesByName();
 	prefab->updateBounding();
 
 	//frees all data, including bin
 	cgltf_free(data);
 
+	deferred_prefab = NULL;
+	deferred_meshes.clear();
+	deferred_materials.clear();
+
     stdlog( std::string(" - Loaded ") + filename );
 
     return prefab;
@@ -677,7 +1011,7 @@ SCN::Prefab* loadGLTF(const std::vector<unsigned char>& dat, const std::string&
 	return loadGLTF(path.c_str(), data, options);
 }
 
-SCN::Prefab* loadGLTF(const char* filename)
+SCN::Prefab* loadGLTF(const char* filename, bool defer_gpu)
 {
 	std::cout << "loading gltf " << TermColor::YELLOW << filename << TermColor::DEFAULT << " ..." << std::endl;
 	cgltf_options options;
@@ -694,6 +1028,85 @@ SCN::Prefab* loadGLTF(const char* filename)
 		}
 	}
 
-	return loadGLTF(filename, data, options);
+	return loadGLTF(filename, data, options, defer_gpu);
+}
+
+//how every image is used by the materials, normalmaps need both channels with precision and albedos may have alpha
+static void addImageUsage(std::map<cgltf_image*, GFX::eBCFormat>& images, cgltf_texture_view& view, GFX::eBCFormat format)
+{
+	if (!view.texture || !view.texture->image || !view.texture->image->uri)
+		return;
+	auto it = images.find(view.texture->image);
+	if (it == images.end() || format == GFX::BC5)
+		images[view.texture->image] = format;
+}
+
+bool compressGLTFTextures(const char* filename)
+{
+	std::cout << "compressing textures of " << TermColor::YELLOW << filename << TermColor::DEFAULT << " ..." << std::endl;
+	cgltf_options options;
+	memset(&options, 0, sizeof(cgltf_options));
+	options.file.read = internalOpenFile;
+	cgltf_data* data = NULL;
+	if (cgltf_parse_file(&options, filename, &data) != cgltf_result_success)
+	{
+		std::cout << "[NOT FOUND]" << std::endl;
+		return false;
+	}
+
+	std::map<cgltf_image*, GFX::eBCFormat> usage;
+	for (size_t i = 0; i < data->materials_count; ++i)
+	{
+		cgltf_material* material = &data->materials[i];
+		GFX::eBCFormat albedo_format = material->alpha_mode != cgltf_alpha_mode_opaque ? GFX::BC3 : GFX::BC1;
+		addImageUsage(usage, material->normal_texture, GFX::BC5);
+		addImageUsage(usage, material->emissive_texture, GFX::BC1);
+		addImageUsage(usage, material->occlusion_texture, GFX::BC1);
+		addImageUsage(usage, material->pbr_metallic_roughness.base_color_texture, albedo_format);
+		addImageUsage(usage, material->pbr_metallic_roughness.metallic_roughness_texture, GFX::BC1);
+		addImageUsage(usage, material->pbr_specular_glossiness.diffuse_texture, albedo_format);
+	}
+
+	std::string folder = getFolderName(filename);
+	if (folder.size())
+		folder += "/";
+	std::vector<std::pair<std::string, GFX::eBCFormat>> images;
+	for (auto& it : usage)
+		images.push_back(std::make_pair(folder + it.first->uri, it.second));
+	cgltf_free(data);
+
+	//every image is independent, one per task
+	std::atomic<int> num_converted(0);
+	std::atomic<size_t> source_bytes(0), compressed_bytes(0);
+	double start = getHighResTime();
+	TaskManager::background.parallelFor(images.size(), [&](size_t from, size_t to) {
+		for (size_t i = from; i < to; ++i)
+		{
+			const std::string& image_filename = images[i].first;
+			std::string ext = getExtension(image_filename);
+			if (ext.empty() || toLowerCase(ext) == "dds" || toLowerCase(ext) == "ktx")
+				continue;
+			Image image;
+			if (!image.load(image_filename.c_str()))
+			{
+				std::cout << "[ERROR] image not found: " << image_filename << std::endl;
+				continue;
+			}
+			std::string output = image_filename.substr(0, image_filename.size() - ext.size()) + "dds";
+			if (!GFX::saveDDS(output.c_str(), &image, images[i].second))
+				continue;
+			std::vector<unsigned char> buffer;
+			readFileBin(output, buffer);
+			source_bytes += image.width * image.height * 4; //what it took in VRAM as RGBA8
+			compressed_bytes += buffer.size();
+			num_converted++;
+			const char* names[] = { "BC1", "BC3", "BC5" };
+			std::cout << " + " << output << " " << names[images[i].second] << std::endl;
+		}
+	});
+
+	std::cout << "Textures compressed: " << num_converted << "/" << images.size() << " in " << (int)(getHighResTime() - start) << "ms, VRAM "
+		<< (source_bytes / (1024 * 1024)) << "MB -> " << (compressed_bytes / (1024 * 1024)) << "MB" << std::endl;
+	return num_converted == (int)images.size();
 }
 
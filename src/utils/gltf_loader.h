@@ -2,6 +2,11 @@
 
 #include "../pipeline/prefab.h"
 
-SCN::Prefab* loadGLTF(const char* filename);
+//defer_gpu allows to call it from a background thread, meshes are not uploaded and textures are left pending
+SCN::Prefab* loadGLTF(const char* filename, bool defer_gpu = false);
 //GTR::Prefab* loadGLTF(const char* filename, cgltf_data* data, cgltf_options& options);
 SCN::Prefab* loadGLTF(const std::vector<unsigned char>& data, const std::string& path);
+
+//offline: saves a block compressed DDS next to every image of the glTF (BC5 normalmaps, BC3 albedos with alpha, BC1 the rest)
+//Texture::Get and GetAsync use them instead of the images once they exist
+bool compressGLTFTextures(const char* filename);
@@ -3,6 +3,8 @@
 #include <cassert>
 #include <iostream>
 #include <algorithm>
+#include <chrono>
+#include <sys/stat.h>
 
 #include "../core/includes.h"
 #include "../core/core.h"
@@ -12,6 +14,12 @@
 #endif
 
 
+double getHighResTime()
+{
+	using namespace std::chrono;
+	return duration<double, std::milli>(high_resolution_clock::now().time_since_epoch()).count();
+}
+
 long getTime()
 {
 	#ifdef WIN32
@@ -118,6 +126,12 @@ bool readFileBin(const std::string& filename, std::vector<unsigned char>& buffer
 	return true;
 }
 
+bool fileExists(const std::string& filename)
+{
+	struct stat stbuffer;
+	return stat(filename.c_str(), &stbuffer) == 0;
+}
+
 bool writeFile(const std::string& filename, std::string& content)
 {
 	FILE* f = fopen(filename.c_str(), "w");
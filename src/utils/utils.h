@@ -15,9 +15,11 @@
 
 //General functions **************
 long getTime(); //there is also CORE::getTime
+double getHighResTime(); //in ms but with sub-ms precision, to measure small things
 bool readFile(const std::string& filename, std::string& content);
 bool readFileBin(const std::string& filename, std::vector<unsigned char>& buffer);
 bool writeFile(const std::string& filename, std::string& content);
+bool fileExists(const std::string& filename);
 
 //work with file paths
 std::string getFolderName(std::string path);